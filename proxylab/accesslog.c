@@ -0,0 +1,199 @@
+#include <time.h>
+
+#include "csapp.h"
+#include "accesslog.h"
+
+#define LOG_BUFSIZE (1 << 16)
+
+/*
+ * The head is only written by the worker owning the ring and the tail only
+ * by the logger thread. They live on different cache lines so the two
+ * sides do not bounce a line on every record.
+ */
+
+typedef struct _logRing {
+    unsigned long head __attribute__((aligned(64)));
+    unsigned long tail __attribute__((aligned(64)));
+    int inUse;
+    struct _logRing *next;
+    LogRecord rec[LOG_RING_SIZE];
+} LogRing;
+
+static int logfd = -1;
+static LogRing *ringList = NULL;
+static __thread LogRing *myRing = NULL;
+static pthread_key_t ringKey;
+static pthread_once_t ringOnce = PTHREAD_ONCE_INIT;
+
+static void releaseRing(void *ring) {
+    __atomic_store_n(&((LogRing *)ring)->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void makeRingKey() {
+    pthread_key_create(&ringKey, releaseRing);
+}
+
+/*
+ * getRing - return the ring of the calling thread, same scheme as the
+ *     StatBlocks: reuse a released ring or push a new one, lock free.
+ */
+
+static LogRing *getRing() {
+    LogRing *ptr;
+    int expected;
+
+    if (myRing != NULL)
+        return myRing;
+
+    pthread_once(&ringOnce, makeRingKey);
+
+    for (ptr = __atomic_load_n(&ringList, __ATOMIC_ACQUIRE); ptr;
+            ptr = ptr->next) {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&ptr->inUse, &expected, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (ptr == NULL) {
+        ptr = (LogRing *)Calloc(1, sizeof(LogRing));
+        ptr->inUse = 1;
+        ptr->next = __atomic_load_n(&ringList, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&ringList, &ptr->next, ptr,
+                0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(ringKey, ptr);
+    myRing = ptr;
+    return ptr;
+}
+
+/*
+ * copyField - bounded copy which always terminates the destination.
+ */
+
+static void copyField(char *dst, const char *src, size_t size) {
+    size_t len = strlen(src);
+
+    if (len >= size)
+        len = size - 1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+}
+
+/*
+ * logRequest - append the record of a finished request to the ring of the
+ *     calling thread. Does nothing when no access log was configured.
+ */
+
+void logRequest(ReqStat *rs) {
+    LogRing *ring;
+    LogRecord *rec;
+    unsigned long head;
+    struct timespec ts;
+
+    if (logfd < 0)
+        return;
+
+    ring = getRing();
+    head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+            >= LOG_RING_SIZE) {
+        statsInc(STAT_LOG_DROPS);
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    rec = &ring->rec[head & (LOG_RING_SIZE - 1)];
+    rec->wallSec = ts.tv_sec;
+    rec->firstByteUs = rs->firstByteUs ? rs->firstByteUs - rs->acceptUs : 0;
+    rec->connectUs = rs->connectUs;
+    rec->ttfbUs = rs->ttfbUs;
+    rec->totalUs = rs->endUs - rs->acceptUs;
+    rec->bytes = rs->bytes;
+    rec->status = rs->status;
+    rec->hit = rs->hit;
+    copyField(rec->method, rs->method, sizeof(rec->method));
+    copyField(rec->host, rs->host, sizeof(rec->host));
+    copyField(rec->port, rs->port, sizeof(rec->port));
+    copyField(rec->path, rs->path, sizeof(rec->path));
+
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * formatRecord - print one record as a logfmt line, return its length.
+ */
+
+static int formatRecord(char *buf, size_t size, LogRecord *rec) {
+    struct tm tm;
+    char when[32];
+
+    gmtime_r(&rec->wallSec, &tm);
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%SZ", &tm);
+
+    return snprintf(buf, size, "time=%s method=%s host=%s port=%s path=%s "
+        "status=%d bytes=%ld cache=%s first_byte_us=%lu connect_us=%lu "
+        "ttfb_us=%lu total_us=%lu\n", when, rec->method[0] ? rec->method : "-",
+        rec->host[0] ? rec->host : "-", rec->port[0] ? rec->port : "-",
+        rec->path[0] ? rec->path : "-", rec->status, rec->bytes,
+        rec->hit ? "HIT" : "MISS", rec->firstByteUs, rec->connectUs,
+        rec->ttfbUs, rec->totalUs);
+}
+
+/*
+ * loggerThread - drain every ring in batches. The buffer is written out
+ *     whenever it can not hold another line, and once per wakeup.
+ */
+
+static void *loggerThread(void *vargp) {
+    static char buf[LOG_BUFSIZE];
+    struct timespec interval = { 0, LOG_FLUSH_MS * 1000000L };
+    LogRing *ring;
+    unsigned long head, tail;
+    size_t len;
+    int n;
+
+    pthread_detach(pthread_self());
+
+    for (; ;) {
+        len = 0;
+        for (ring = __atomic_load_n(&ringList, __ATOMIC_ACQUIRE); ring;
+                ring = ring->next) {
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            for (tail = ring->tail; tail != head; tail++) {
+                n = formatRecord(buf + len, LOG_BUFSIZE - len,
+                    &ring->rec[tail & (LOG_RING_SIZE - 1)]);
+                if (n >= (int)(LOG_BUFSIZE - len)) {
+                    rio_writen(logfd, buf, len);
+                    len = 0;
+                    n = formatRecord(buf, LOG_BUFSIZE,
+                        &ring->rec[tail & (LOG_RING_SIZE - 1)]);
+                }
+                len += n;
+            }
+            __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+        }
+        if (len > 0)
+            rio_writen(logfd, buf, len);
+
+        nanosleep(&interval, NULL);
+    }
+    return NULL;
+}
+
+/*
+ * startAccessLog - open (append) the log file and start the logger.
+ */
+
+void startAccessLog(char *path) {
+    pthread_t tid;
+
+    if ((logfd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644)) < 0) {
+        fprintf(stderr, "Can not open access log %s\n", path);
+        exit(1);
+    }
+
+    Pthread_create(&tid, NULL, loggerThread, NULL);
+}
@@ -0,0 +1,39 @@
+#ifndef __ACCESSLOG_H__
+#define __ACCESSLOG_H__
+
+#include "stats.h"
+
+/*
+ * Access log is defined as followed:
+ *     Every worker thread appends one fixed size record per request into
+ *     its own single producer / single consumer ring. Appending is a
+ *     memcpy and a release store, no lock and no syscall.
+ *
+ *     A dedicated logger thread drains all rings periodically, formats
+ *     the records in one buffer and writes them with as few write(2)
+ *     calls as possible. When a ring is full the record is dropped and
+ *     counted in proxy_log_drops_total instead of stalling the worker.
+ */
+
+#define LOG_RING_SIZE 512               /* records per thread, power of 2 */
+#define LOG_FLUSH_MS 20                 /* logger wakeup interval */
+
+typedef struct _logRecord {
+    long wallSec;                       /* wall clock time of the request */
+    unsigned long firstByteUs;
+    unsigned long connectUs;
+    unsigned long ttfbUs;
+    unsigned long totalUs;
+    long bytes;
+    int status;
+    int hit;
+    char method[16];
+    char host[64];
+    char port[8];
+    char path[128];
+} LogRecord;
+
+void startAccessLog(char*);
+void logRequest(ReqStat*);
+
+#endif /* __ACCESSLOG_H__ */
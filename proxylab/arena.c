@@ -0,0 +1,247 @@
+#include "csapp.h"
+#include "stats.h"
+#include "arena.h"
+
+#define ARENA_ALIGN 16
+#define alignUp(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+/*
+ * ArenaHdr: precedes every allocation. Inside the block prev is the
+ * offset of the header of the previous allocation (-1 for none), for a
+ * heap allocation it links the list of those. The union keeps the
+ * payload 16 byte aligned.
+ */
+typedef union _arenaHdr {
+    struct {
+        long prev;
+        size_t size;
+        union _arenaHdr *next;
+    } h;
+    char pad[32];
+} ArenaHdr;
+
+/* a call arenaDefer left for the next reset, it lives in the arena */
+typedef struct _arenaDeferred {
+    void (*fn)(void *);
+    void *arg;
+    struct _arenaDeferred *next;
+} ArenaDeferred;
+
+typedef struct _arena {
+    char *base;
+    size_t size;
+    size_t step;            /* the block grows in multiples of this */
+    size_t used;
+    long last;              /* offset of the most recent header, -1 none */
+    size_t heapLive;        /* bytes in heap allocations right now */
+    size_t peak;            /* peak of used + heapLive since the reset */
+    ArenaHdr *heap;         /* allocations which did not fit */
+    ArenaDeferred *deferred;
+} Arena;
+
+static __thread Arena *myArena = NULL;
+static pthread_key_t arenaKey;
+static pthread_once_t arenaOnce = PTHREAD_ONCE_INIT;
+
+/*
+ * arenaNew - an arena of size bytes which no thread uses yet, see
+ *     arenaSwap. Coroutines have one each.
+ */
+
+void *arenaNew(size_t size) {
+    Arena *a = (Arena *)Calloc(1, sizeof(Arena));
+
+    a->size = a->step = size;
+    a->base = (char *)Malloc(a->size);
+    a->last = -1;
+    return a;
+}
+
+/*
+ * runDeferred - make the calls arenaDefer left, the newest first.
+ */
+
+static void runDeferred(Arena *a) {
+    ArenaDeferred *d;
+
+    while ((d = a->deferred) != NULL) {
+        a->deferred = d->next;
+        d->fn(d->arg);
+    }
+}
+
+/*
+ * arenaDelete - free an arena. Threads which exit (the warm-up fetchers)
+ *     give theirs back through the key.
+ */
+
+void arenaDelete(void *arena) {
+    Arena *a = (Arena *)arena;
+    ArenaHdr *hdr;
+
+    runDeferred(a);
+    while ((hdr = a->heap) != NULL) {
+        a->heap = hdr->h.next;
+        Free(hdr);
+    }
+    Free(a->base);
+    Free(a);
+}
+
+static void makeArenaKey() {
+    pthread_key_create(&arenaKey, arenaDelete);
+}
+
+/*
+ * getArena - the arena of the calling thread, created on first use so it
+ *     is first touched by (and local to) that thread.
+ */
+
+static Arena *getArena() {
+    Arena *a;
+
+    if ((a = myArena) == NULL) {
+        pthread_once(&arenaOnce, makeArenaKey);
+        a = (Arena *)arenaNew(ARENA_INITIAL_SIZE);
+        myArena = a;
+        pthread_setspecific(arenaKey, a);
+    }
+    return a;
+}
+
+/*
+ * arenaSwap - make arena the one the calling thread allocates from and
+ *     return the one it had. The arena a thread was created with stays
+ *     its own, whatever was swapped in when it exits.
+ */
+
+void *arenaSwap(void *arena) {
+    Arena *a = myArena;
+
+    myArena = (Arena *)arena;
+    return a;
+}
+
+static int inBlock(Arena *a, void *p) {
+    return (char *)p >= a->base && (char *)p < a->base + a->size;
+}
+
+void *arenaAlloc(size_t n) {
+    Arena *a = getArena();
+    size_t need = sizeof(ArenaHdr) + alignUp(n, ARENA_ALIGN);
+    ArenaHdr *hdr;
+
+    if (a->used + need <= a->size) {
+        hdr = (ArenaHdr *)(a->base + a->used);
+        hdr->h.prev = a->last;
+        hdr->h.size = n;
+        a->last = a->used;
+        a->used += need;
+    }
+    else {
+        statsInc(STAT_ARENA_HEAP_ALLOCS);
+        hdr = (ArenaHdr *)Malloc(need);
+        hdr->h.size = n;
+        hdr->h.next = a->heap;
+        a->heap = hdr;
+        a->heapLive += need;
+    }
+    if (a->used + a->heapLive > a->peak)
+        a->peak = a->used + a->heapLive;
+    return hdr + 1;
+}
+
+/*
+ * arenaGrow - like realloc. The most recent allocation is extended in
+ *     place when the block has room, anything else is copied.
+ */
+
+void *arenaGrow(void *p, size_t n) {
+    Arena *a = getArena();
+    ArenaHdr *hdr = (ArenaHdr *)p - 1;
+    size_t off = (char *)hdr - a->base;
+    void *q;
+
+    if (inBlock(a, p) && (long)off == a->last
+            && off + sizeof(ArenaHdr) + alignUp(n, ARENA_ALIGN) <= a->size) {
+        hdr->h.size = n;
+        a->used = off + sizeof(ArenaHdr) + alignUp(n, ARENA_ALIGN);
+        if (a->used + a->heapLive > a->peak)
+            a->peak = a->used + a->heapLive;
+        return p;
+    }
+
+    q = arenaAlloc(n);
+    memcpy(q, p, hdr->h.size < n ? hdr->h.size : n);
+    arenaFree(p);
+    return q;
+}
+
+void arenaFree(void *p) {
+    Arena *a = getArena();
+    ArenaHdr *hdr = (ArenaHdr *)p - 1, **pp;
+
+    if (inBlock(a, p)) {
+        if ((char *)hdr - a->base == a->last) {
+            a->used = a->last;
+            a->last = hdr->h.prev;
+        }
+        return;
+    }
+
+    for (pp = &a->heap; *pp; pp = &(*pp)->h.next) {
+        if (*pp == hdr) {
+            *pp = hdr->h.next;
+            a->heapLive -= sizeof(ArenaHdr) + alignUp(hdr->h.size,
+                ARENA_ALIGN);
+            Free(hdr);
+            return;
+        }
+    }
+}
+
+/*
+ * arenaDefer - call fn(arg) at the next reset, before the memory of the
+ *     request is released.
+ */
+
+void arenaDefer(void (*fn)(void *), void *arg) {
+    ArenaDeferred *d = (ArenaDeferred *)arenaAlloc(sizeof(ArenaDeferred));
+
+    d->fn = fn;
+    d->arg = arg;
+    d->next = getArena()->deferred;
+    getArena()->deferred = d;
+}
+
+/*
+ * arenaReset - release everything allocated since the last reset and grow
+ *     the block if this request needed more than it had.
+ */
+
+void arenaReset() {
+    Arena *a = getArena();
+    ArenaHdr *hdr;
+    size_t size;
+
+    runDeferred(a);
+    while ((hdr = a->heap) != NULL) {
+        a->heap = hdr->h.next;
+        Free(hdr);
+    }
+
+    if (a->peak > a->size && a->size < ARENA_MAX_SIZE) {
+        size = alignUp(a->peak, a->step);
+        if (size > ARENA_MAX_SIZE)
+            size = ARENA_MAX_SIZE;
+        statsInc(STAT_ARENA_HEAP_ALLOCS);
+        Free(a->base);
+        a->base = (char *)Malloc(size);
+        a->size = size;
+    }
+
+    a->used = 0;
+    a->last = -1;
+    a->heapLive = 0;
+    a->peak = 0;
+}
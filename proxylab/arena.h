@@ -0,0 +1,42 @@
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+/*
+ * Arena is defined as followed:
+ *     Every thread serving requests owns one arena, a single block from
+ *     which the buffers of a request (the assembled header, objects copied
+ *     out of the cache, bodies read from origin) are bump allocated. The
+ *     whole arena is released at once by arenaReset when the request is
+ *     done, so the steady state path does not touch the heap at all.
+ *
+ *     Each allocation is preceded by a small header linking it to the
+ *     one before, so freeing the most recent allocation gives its space
+ *     back right away. That keeps loops which allocate and free one
+ *     buffer per round (segments of a range) from growing the arena.
+ *     Freeing anything else is a no-op until the reset.
+ *
+ *     A request which does not fit is served from the heap, and the next
+ *     reset grows the block to the peak usage (up to ARENA_MAX_SIZE), so
+ *     such a request costs heap allocations only once per worker.
+ *
+ *     A coroutine (coro.h) serves its request from an arena of its own,
+ *     smaller to begin with, which is swapped in whenever it runs.
+ *
+ *     Whatever else must live exactly as long as the request, like an
+ *     object the cache lends out instead of copying it (cache.h), is
+ *     given back by a function arenaDefer runs at the next reset.
+ */
+
+#define ARENA_INITIAL_SIZE (256 * 1024)
+#define ARENA_MAX_SIZE (4 * 1024 * 1024)
+
+void *arenaAlloc(size_t);
+void *arenaGrow(void *, size_t);
+void arenaFree(void *);
+void arenaReset();
+void *arenaNew(size_t);
+void arenaDelete(void *);
+void *arenaSwap(void *);
+void arenaDefer(void (*)(void *), void *);
+
+#endif /* __ARENA_H__ */
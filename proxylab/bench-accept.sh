@@ -0,0 +1,16 @@
+#!/bin/sh
+#
+# bench-accept.sh - new connections per second with 1 and N listeners.
+#     Every loadgen request is a new connection and the single small
+#     object is a cache hit after the first request, so the request rate
+#     is the connection rate of the proxy.
+#
+#     usage: [LISTENERS=N] ./bench-accept.sh [loadgen options]
+#
+
+LISTENERS=${LISTENERS:-$(nproc)}
+
+for n in 1 $LISTENERS; do
+    echo "== $n listener(s)"
+    PROXY_OPTS="-L $n $PROXY_OPTS" ./bench.sh -t 10 -c 64 -u 1 -s 64 "$@"
+done
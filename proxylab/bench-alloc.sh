@@ -0,0 +1,45 @@
+#!/bin/sh
+#
+# bench-alloc.sh - check that a cache hit does not touch the heap. The
+#     proxy runs with allocount.so preloaded. A first loadgen pass fills
+#     the cache and grows the arena of every worker, then the heap
+#     allocations of a second pass, which only hits, are counted. Both
+#     passes send plain and Range requests. Fails unless the count is 0.
+#
+#     usage: [HITS=n] ./bench-alloc.sh [loadgen options]
+#
+
+PROXY_PORT=${PROXY_PORT:-15555}
+ORIGIN_PORT=${ORIGIN_PORT:-15556}
+HITS=${HITS:-20000}
+LOG=$(mktemp)
+
+LD_PRELOAD=./allocount.so ./proxy $PROXY_OPTS $PROXY_PORT 2>$LOG &
+PROXY_PID=$!
+trap 'kill $PROXY_PID 2>/dev/null; wait $PROXY_PID 2>/dev/null; rm -f $LOG' \
+    EXIT
+sleep 1
+
+# pass <requests> [loadgen options] - plain requests, then ranges
+pass() {
+    n=$1
+    shift
+    ./loadgen -o $ORIGIN_PORT -n $n -c 8 -u 64 -s 1024:8192 "$@" \
+        localhost $PROXY_PORT >/dev/null &&
+    ./loadgen -o $ORIGIN_PORT -n $n -c 8 -u 64 -s 1024:8192 -R 512 "$@" \
+        localhost $PROXY_PORT >/dev/null
+}
+
+count() {
+    kill -USR1 $PROXY_PID
+    sleep 1
+    awk '$1 == "allocount" { n = $2 } END { print n }' $LOG
+}
+
+pass 2000 "$@" || { echo "warm-up pass failed"; exit 1; }
+before=$(count)
+pass $HITS "$@" || { echo "hit pass failed"; exit 1; }
+after=$(count)
+
+echo "heap allocations in $((2 * HITS)) requests: $((after - before))"
+[ "$after" -eq "$before" ]
@@ -0,0 +1,15 @@
+#!/bin/sh
+#
+# bench-cache.sh - run the same Zipf workload against 1MB, 1GB and 16GB
+#     caches. The default working set is 32768 objects of 4KB to 124KB
+#     (about 2GB), so it fits in the largest cache only. Objects are sent
+#     as application/octet-stream so compression does not blur the sizes.
+#
+#     usage: ./bench-cache.sh [loadgen options]
+#
+
+for size in 1M 1G 16G; do
+    echo "== cache size $size"
+    PROXY_OPTS="-c $size -o 128K $PROXY_OPTS" ./bench.sh -n 200000 -c 32 \
+        -u 32768 -z 0.8 -s 4096:126976 -l 5 -T application/octet-stream "$@"
+done
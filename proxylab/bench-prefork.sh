@@ -0,0 +1,21 @@
+#!/bin/sh
+#
+# bench-prefork.sh - hit throughput with 1 to N serving processes (-F),
+#     first each with a heap cache of its own, then all sharing one -S
+#     segment. The Zipf workload of 3000 16KB objects fits either cache,
+#     so the origin requests show how much of the cache is shared.
+#
+#     usage: [PROCESSES="1 2 4"] ./bench-prefork.sh [loadgen options]
+#
+
+PROCESSES=${PROCESSES:-"1 2 4"}
+
+for cache in "-c 64M" "-S 64M"; do
+    for n in $PROCESSES; do
+        echo "== $cache, $n process(es)"
+        PROXY_OPTS="$cache -F $n $PROXY_OPTS" ./bench.sh -t 8 -c 32 \
+            -u 3000 -s 16384 "$@"
+        # the forked processes exit after the parent, let the port go
+        sleep 1
+    done
+done
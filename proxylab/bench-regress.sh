@@ -0,0 +1,101 @@
+#!/bin/sh
+#
+# bench-regress.sh - run the scenarios below through bench.sh and compare
+#     them with bench-baseline.txt. Each runs RUNS times and its median
+#     throughput and p99 count. The run fails if a throughput fell more
+#     than TOLERANCE percent under its baseline, a p99 rose more than
+#     P99_TOLERANCE percent over it, or a scenario saw errors.
+#
+#     The baseline holds the numbers of one machine. After a change which
+#     is meant to move them, or on another machine, record it again with
+#     UPDATE=1 and commit it along.
+#
+#     usage: [RUNS=n] [TOLERANCE=pct] [P99_TOLERANCE=pct] [UPDATE=1]
+#            ./bench-regress.sh [scenario...]
+#
+
+RUNS=${RUNS:-3}
+TOLERANCE=${TOLERANCE:-15}
+P99_TOLERANCE=${P99_TOLERANCE:-50}
+BASELINE=${BASELINE:-bench-baseline.txt}
+OUT=/tmp/bench-regress.$$
+ONLY=" $* "
+trap 'rm -f $OUT $OUT.*' EXIT
+
+# name, proxy options and loadgen options of every scenario
+SCENARIOS="
+workers||-n 20000 -c 16 -s 1024:65536
+coro|-E|-n 20000 -c 16 -s 1024:65536
+uring|-E -I uring|-n 20000 -c 16 -s 1024:65536
+shared|-S 64M|-n 20000 -c 16 -u 3000 -s 16384
+tunnel||-C -n 5000 -c 8 -s 16384
+"
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }'
+}
+
+echo "$SCENARIOS" | while IFS='|' read name proxyOpts loadOpts; do
+    [ -z "$name" ] && continue
+    if [ "$ONLY" != "  " ] && ! echo "$ONLY" | grep -q " $name "; then
+        continue
+    fi
+
+    : > $OUT.tput
+    : > $OUT.p99
+    errors=0
+    i=0
+    while [ $i -lt $RUNS ]; do
+        PROXY_OPTS="$proxyOpts" ./bench.sh $loadOpts > $OUT 2>&1
+        awk '$1 == "throughput" { print $2 }' $OUT >> $OUT.tput
+        awk '$1 == "latency" { print $8 }' $OUT >> $OUT.p99
+        # no errors line, the proxy or loadgen died
+        e=$(awk '$1 == "errors" { print $2 }' $OUT)
+        errors=$((errors + ${e:-1}))
+        i=$((i + 1))
+        # let the port go before the next proxy binds it
+        sleep 1
+    done
+    tput=$(median < $OUT.tput)
+    p99=$(median < $OUT.p99)
+
+    if [ -n "$UPDATE" ]; then
+        echo "$name $tput $p99" >> $OUT.new
+        printf "%-8s %10s req/s  p99 %8s us  recorded\n" $name $tput $p99
+        continue
+    fi
+
+    set -- $(awk -v name=$name '$1 == name { print $2, $3 }' $BASELINE)
+    if [ $# -ne 2 ]; then
+        printf "%-8s %10s req/s  p99 %8s us  no baseline\n" $name $tput $p99
+        echo fail >> $OUT.fail
+        continue
+    fi
+    verdict=$(awk -v t=$tput -v p=$p99 -v bt=$1 -v bp=$2 -v e=$errors \
+            -v tol=$TOLERANCE -v ptol=$P99_TOLERANCE 'BEGIN {
+        if (e > 0) print "FAIL errors " e
+        else if (t < bt * (100 - tol) / 100) print "FAIL throughput"
+        else if (p > bp * (100 + ptol) / 100) print "FAIL p99"
+        else print "ok"
+    }')
+    printf "%-8s %10s req/s  p99 %8s us  baseline %s req/s  p99 %s us  %s\n" \
+        $name $tput $p99 $1 $2 "$verdict"
+    case $verdict in
+    ok) ;;
+    *) echo fail >> $OUT.fail ;;
+    esac
+done
+
+# scenarios which were not run keep their line
+if [ -n "$UPDATE" ]; then
+    {
+        echo "# bench-regress.sh baseline, written by UPDATE=1"
+        echo "# scenario  median req/s  median p99 us"
+        [ -f $BASELINE ] && awk 'NR == FNR { run[$1] = 1; next }
+            !/^#/ && !($1 in run)' $OUT.new $BASELINE
+        cat $OUT.new
+    } > $OUT.base
+    mv $OUT.base $BASELINE
+    exit 0
+fi
+[ ! -s $OUT.fail ]
@@ -0,0 +1,49 @@
+#!/bin/sh
+#
+# bench-restart.sh - replace the proxy in the middle of a loadgen run,
+#     once by killing it and starting a new one, once by a -R handover.
+#     loadgen's errors are the requests refused or cut off by the restart,
+#     its p99 and max latency the spike. The 20ms origin keeps requests
+#     in flight when the restart comes.
+#
+#     usage: [RESTART_AT=sec] ./bench-restart.sh [loadgen options]
+#
+
+PROXY_PORT=${PROXY_PORT:-15555}
+ORIGIN_PORT=${ORIGIN_PORT:-15556}
+CONTROL=${CONTROL:-/tmp/bench-restart.$$}
+DURATION=${DURATION:-8}
+RESTART_AT=${RESTART_AT:-3}
+
+OLD_PID=
+NEW_PID=
+trap 'kill $OLD_PID $NEW_PID 2>/dev/null; wait 2>/dev/null; rm -f $CONTROL' \
+    EXIT
+
+for mode in kill handover; do
+    echo "== $mode"
+    opts=$PROXY_OPTS
+    [ $mode = handover ] && opts="-R $CONTROL $opts"
+
+    ./proxy $opts $PROXY_PORT &
+    OLD_PID=$!
+    sleep 1
+
+    ./loadgen -o $ORIGIN_PORT -t $DURATION -c 16 -l 20 "$@" \
+        localhost $PROXY_PORT &
+    LOADGEN_PID=$!
+    sleep $RESTART_AT
+
+    # a handed over proxy drains and exits by itself
+    if [ $mode = kill ]; then
+        kill $OLD_PID
+        wait $OLD_PID 2>/dev/null
+    fi
+    ./proxy $opts $PROXY_PORT &
+    NEW_PID=$!
+
+    wait $LOADGEN_PID
+    kill $OLD_PID $NEW_PID 2>/dev/null
+    wait 2>/dev/null
+    rm -f $CONTROL
+done
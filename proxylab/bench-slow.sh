@@ -0,0 +1,58 @@
+#!/bin/sh
+#
+# bench-slow.sh - fast clients on small objects next to slow readers of
+#     large ones, which the proxy misses. The body budget and the memory
+#     governor must keep the proxy's memory bounded: the run fails unless
+#     bodies were relayed, the governor made misses wait or shed them, and
+#     the peak RSS of the proxy stayed under MAX_RSS_KB.
+#
+#     Then CONNECT tunnels stay idle for 3s, past a client write timeout
+#     of 1s, before the origin answers through them. The write deadline
+#     of the 200 must not cut them off: the run fails if one was.
+#
+#     usage: [READERS=n] [MAX_RSS_KB=n] ./bench-slow.sh [loadgen options]
+#
+
+PROXY_PORT=${PROXY_PORT:-15555}
+ORIGIN_PORT=${ORIGIN_PORT:-15556}
+ADMIN_PORT=${ADMIN_PORT:-15557}
+READERS=${READERS:-40}
+MAX_RSS_KB=${MAX_RSS_KB:-65536}
+
+./proxy -c 8M -o 8M -b 256K -M 1M -a $ADMIN_PORT $PROXY_OPTS $PROXY_PORT &
+PROXY_PID=$!
+trap 'kill $PROXY_PID 2>/dev/null; wait $PROXY_PID 2>/dev/null' EXIT
+sleep 1
+
+./loadgen -o $ORIGIN_PORT -t 20 -c 8 -s 16384 -D $READERS -B 4194304 \
+    -r 163840 "$@" localhost $PROXY_PORT
+
+metric() {
+    curl -s http://localhost:$ADMIN_PORT/metrics \
+        | awk -v name=$1 '$1 == name { print $2 }'
+}
+
+relays=$(metric proxy_budget_relays_total)
+waits=$(metric proxy_governor_waits_total)
+shed=$(metric proxy_governor_shed_total)
+peak=$(metric proxy_inflight_peak_bytes)
+rss=$(awk '$1 == "VmHWM:" { print $2 }' /proc/$PROXY_PID/status)
+
+kill $PROXY_PID
+wait $PROXY_PID 2>/dev/null
+sleep 1
+./proxy -t ::::1 $PROXY_OPTS $PROXY_PORT &
+PROXY_PID=$!
+sleep 1
+cut=$(./loadgen -o $ORIGIN_PORT -C -l 3000 -n 8 -c 4 localhost $PROXY_PORT \
+    | awk '$1 == "errors" { print $2 }')
+
+echo "budget relays  $relays"
+echo "governor       $waits waited  $shed shed"
+echo "in flight      $peak bytes at peak"
+echo "peak RSS       $rss kB (max $MAX_RSS_KB)"
+echo "idle tunnels   ${cut:-all} of 8 cut off"
+
+[ "${relays:-0}" -gt 0 ] && [ $((${waits:-0} + ${shed:-0})) -gt 0 ] \
+    && [ "${rss:-0}" -gt 0 ] && [ "$rss" -le "$MAX_RSS_KB" ] \
+    && [ "${cut:-1}" -eq 0 ]
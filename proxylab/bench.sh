@@ -0,0 +1,18 @@
+#!/bin/sh
+#
+# bench.sh - start the proxy on a scratch port and drive it with loadgen.
+#
+#     usage: [PROXY_OPTS="..."] ./bench.sh [loadgen options]
+#
+#     Example: PROXY_OPTS="-a 15557" ./bench.sh -n 50000 -c 32 -s 1024:65536
+#
+
+PROXY_PORT=${PROXY_PORT:-15555}
+ORIGIN_PORT=${ORIGIN_PORT:-15556}
+
+./proxy $PROXY_OPTS $PROXY_PORT &
+PROXY_PID=$!
+trap 'kill $PROXY_PID 2>/dev/null; wait $PROXY_PID 2>/dev/null' EXIT
+sleep 1
+
+./loadgen -o $ORIGIN_PORT "$@" localhost $PROXY_PORT
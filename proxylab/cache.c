@@ -1,155 +1,1405 @@
 #include "cache.h"
+#include "stats.h"
+#include "topology.h"
+#include "arena.h"
+#include "sketch.h"
+#include "lz4.h"
+#include "shmcache.h"
+
+ProxyCache proxyCache;
+
+static const char* tierNames[CACHE_TIERS] = { "hot", "warm" };
+
+/* 
+ * isCompressible - true for the Content-Type of text like objects which
+ *     are not encoded by origin already. type is the header lines as
+ *     stored in the cache item.
+ */
+
+static int isCompressible(char* type) {
+    char lower[MAXLINE];
+    int i;
+
+    for (i = 0; type[i] && i < MAXLINE - 1; i++)
+        lower[i] = tolower(type[i]);
+    lower[i] = '\0';
+
+    if (strstr(lower, "content-encoding:"))
+        return 0;
+    return strstr(lower, "text/") || strstr(lower, "javascript")
+        || strstr(lower, "json") || strstr(lower, "xml");
+}
 
 /*
- * findItemInCache - find cache using port, host and filename
- *    if these three indices match, the stored object is returned 
- *    and size/type are set. Otherwise, NULL is returned. 
+ * gzipObject - gzip compress content. Returns a malloc'd buffer and sets
+ *     outSize, or NULL when the result would not be smaller.
  */
 
-char* findItemInCache(char* port, char* host, 
-    char* filename, int* intPtr, char* type) {
-    
-    CacheItem* ptr = NULL;
-    char* content = NULL;
+static char* gzipObject(char* content, long size, long* outSize) {
+    z_stream zs;
+    char* out;
+    long bound;
+
+    memset(&zs, 0, sizeof(zs));
+    /* 15 window bits plus 16 selects the gzip wrapper */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+            Z_DEFAULT_STRATEGY) != Z_OK)
+        return NULL;
+
+    bound = deflateBound(&zs, size);
+    if ((out = (char*)malloc(bound)) == NULL) {
+        deflateEnd(&zs);
+        return NULL;
+    }
+    zs.next_in = (Bytef*)content;
+    zs.avail_in = size;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = bound;
+
+    if (deflate(&zs, Z_FINISH) != Z_STREAM_END || (long)zs.total_out >= size) {
+        deflateEnd(&zs);
+        free(out);
+        return NULL;
+    }
+    *outSize = zs.total_out;
+    deflateEnd(&zs);
+    return out;
+}
+
+/* zlib state of the lookup path comes from the request arena as well */
+static voidpf zArenaAlloc(voidpf opaque, uInt items, uInt size) {
+    return arenaAlloc((size_t)items * size);
+}
+
+static void zArenaFree(voidpf opaque, voidpf p) {
+    arenaFree(p);
+}
+
+/*
+ * gunzipObject - inflate a gzipped object of total original bytes into
+ *     an arena buffer. Returns NULL if the data is corrupt.
+ */
+
+static char* gunzipObject(char* content, long size, long total) {
+    z_stream zs;
+    char* out;
+
+    out = (char*)arenaAlloc(total > 0 ? total : 1);
+
+    memset(&zs, 0, sizeof(zs));
+    zs.zalloc = zArenaAlloc;
+    zs.zfree = zArenaFree;
+    if (inflateInit2(&zs, 15 + 16) != Z_OK)
+        return NULL;
+
+    zs.next_in = (Bytef*)content;
+    zs.avail_in = size;
+    zs.next_out = (Bytef*)out;
+    zs.avail_out = total;
+
+    if (inflate(&zs, Z_FINISH) != Z_STREAM_END
+            || (long)zs.total_out != total) {
+        inflateEnd(&zs);
+        arenaFree(out);
+        return NULL;
+    }
+    inflateEnd(&zs);
+    return out;
+}
+
+static int unreserved(int c) {
+    return isalnum(c) || c == '-' || c == '.' || c == '_' || c == '~';
+}
+
+/*
+ * normalizeEscapes - copy len bytes of src to dst, decoding percent
+ *     escapes of unreserved characters and upper casing the others.
+ *     Returns the length written, which is at most len.
+ */
+
+static int normalizeEscapes(char* src, int len, char* dst) {
+    int i, o = 0, c;
+
+    for (i = 0; i < len; i++) {
+        if (src[i] == '%' && i + 2 < len && isxdigit(src[i + 1])
+                && isxdigit(src[i + 2])) {
+            sscanf(src + i + 1, "%2x", &c);
+            if (unreserved(c))
+                dst[o++] = c;
+            else {
+                dst[o++] = '%';
+                dst[o++] = toupper(src[i + 1]);
+                dst[o++] = toupper(src[i + 2]);
+            }
+            i += 2;
+        }
+        else
+            dst[o++] = src[i];
+    }
+    return o;
+}
+
+/*
+ * removeDots - copy the absolute path of len bytes to out without its
+ *     "." and ".." segments, see RFC 3986 5.2.4. Returns the length
+ *     written, which is at most len.
+ */
+
+static int removeDots(char* path, int len, char* out) {
+    char *p = path + 1, *end = path + len, *slash;
+    int o = 0, n, last;
+
+    for (; ;) {
+        if ((slash = memchr(p, '/', end - p)) == NULL)
+            slash = end;
+        n = slash - p;
+        last = slash == end;
+        if (n == 1 && p[0] == '.') {
+            if (last)
+                out[o++] = '/';
+        }
+        else if (n == 2 && p[0] == '.' && p[1] == '.') {
+            while (o > 0 && out[--o] != '/')
+                ;
+            if (last)
+                out[o++] = '/';
+        }
+        else {
+            out[o++] = '/';
+            memcpy(out + o, p, n);
+            o += n;
+        }
+        if (last)
+            break;
+        p = slash + 1;
+    }
+    if (o == 0)
+        out[o++] = '/';
+    return o;
+}
+
+static int cmpParam(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+/*
+ * canonicalPath - write the normalized filename to out: escapes as in
+ *     normalizeEscapes, no dot segments and the query parameters sorted.
+ *     The path is case sensitive. Anything from a '#' or a space on is
+ *     kept as it is. A request target never holds a space, the proxy
+ *     names the segments of large objects "filename k" (SEGMENT_SEP), so
+ *     no URL a client asks for has the key of a segment.
+ *     Returns the length written, at most strlen(filename) + 1.
+ */
+
+static int canonicalPath(char* filename, char* out) {
+    char tmp[MAXLINE], *params[MAX_QUERY_PARAMS], *query, *pos, *save;
+    int pathLen, queryLen, len, o, n = 0, i;
+
+    pathLen = strcspn(filename, "?#" SEGMENT_SEP);
+    if (pathLen >= MAXLINE)
+        pathLen = MAXLINE - 1;
+    len = normalizeEscapes(filename, pathLen, tmp);
+    if (len > 0 && tmp[0] == '/')
+        o = removeDots(tmp, len, out);
+    else {
+        memcpy(out, tmp, len);
+        o = len;
+    }
+
+    /* an empty query or empty parameters do not change the resource */
+    if (filename[pathLen] == '?') {
+        query = filename + pathLen + 1;
+        queryLen = strcspn(query, "#" SEGMENT_SEP);
+        if (queryLen >= MAXLINE)
+            queryLen = MAXLINE - 1;
+        len = normalizeEscapes(query, queryLen, tmp);
+        tmp[len] = '\0';
+        for (i = 0; i < len; i++)
+            n += tmp[i] == '&';
+
+        /* with too many parameters the order is kept */
+        if (n >= MAX_QUERY_PARAMS) {
+            out[o++] = '?';
+            memcpy(out + o, tmp, len);
+            o += len;
+            n = 0;
+        }
+        else {
+            n = 0;
+            for (pos = strtok_r(tmp, "&", &save); pos;
+                    pos = strtok_r(NULL, "&", &save))
+                params[n++] = pos;
+            qsort(params, n, sizeof(char*), cmpParam);
+        }
+        for (i = 0; i < n; i++) {
+            out[o++] = i ? '&' : '?';
+            len = strlen(params[i]);
+            memcpy(out + o, params[i], len);
+            o += len;
+        }
+    }
+    strcpy(out + o, filename + strcspn(filename, "#" SEGMENT_SEP));
+    return o + strlen(out + o);
+}
+
+/* FNV-1a */
+static unsigned int hashKey(char* key) {
+    unsigned int hash = 2166136261u;
+
+    for (; *key; key++)
+        hash = (hash ^ (unsigned char)*key) * 16777619u;
+    return hash;
+}
+
+/*
+ * makeKey - build the index key "host:port/filename" in canonical form,
+ *     so that equivalent URLs share one item: the host is lower cased,
+ *     the port is a plain number and the filename goes through
+ *     canonicalPath. Returns the hash of the key.
+ */
+
+static unsigned int makeKey(char* port, char* host, char* filename,
+    char* key, int size) {
+
+    int i, n;
+
+    n = snprintf(key, size, "%s", host);
+    for (i = 0; i < n; i++)
+        key[i] = tolower(key[i]);
+    /* "example.com." is the same host */
+    if (n > 0 && key[n - 1] == '.')
+        n--;
+    n += snprintf(key + n, size - n, ":%d", atoi(port));
+    if ((int)strlen(filename) + 2 <= size - n)
+        canonicalPath(filename, key + n);
+    return hashKey(key);
+}
+
+/*
+ * cacheKey - the canonical key of a URL and its hash, which is what the
+ *     members of a peer group (peer.h) agree on owners by.
+ */
+
+unsigned int cacheKey(char* port, char* host, char* filename, char* key,
+    int size) {
+
+    return makeKey(port, host, filename, key, size);
+}
+
+/*
+ * headerValue - copy the value of header name in the request headers to
+ *     out, with runs of white space folded. Repeated headers are joined
+ *     by commas. out is empty if the header is missing.
+ */
+
+static void headerValue(char* headers, char* name, char* out, int size) {
+    int len = strlen(name), o = 0, space;
+    char *line, *end, *p;
+
+    out[0] = '\0';
+    for (line = headers; line && *line; line = end) {
+        end = line + strcspn(line, "\n");
+        if (*end)
+            end++;
+        if (strncasecmp(line, name, len) || line[len] != ':')
+            continue;
+        if (o > 0 && o < size - 1)
+            out[o++] = ',';
+        space = 0;
+        for (p = line + len + 1; p < end && *p != '\r' && *p != '\n'; p++) {
+            if (*p == ' ' || *p == '\t') {
+                space = o > 0 && out[o - 1] != ',';
+                continue;
+            }
+            if (space && o < size - 1)
+                out[o++] = ' ';
+            space = 0;
+            if (o < size - 1)
+                out[o++] = *p;
+        }
+    }
+    out[o] = '\0';
+}
+
+/*
+ * varyNames - collect the header names of the Vary lines in type into
+ *     names, lower cased and separated by commas. Returns -1 for
+ *     "Vary: *", which can never be matched, or if the names do not
+ *     fit, else the number of names.
+ */
+
+static int varyNames(char* type, char* names, int size) {
+    char value[MAXLINE], *pos, *save;
+    int n = 0, o = 0, i;
+
+    names[0] = '\0';
+    headerValue(type, "Vary", value, sizeof(value));
+    for (pos = strtok_r(value, ", ", &save); pos;
+            pos = strtok_r(NULL, ", ", &save)) {
+        if (!strcmp(pos, "*"))
+            return -1;
+        if (o + (int)strlen(pos) + 2 > size)
+            return -1;
+        if (n++)
+            names[o++] = ',';
+        for (i = 0; pos[i]; i++)
+            names[o++] = tolower(pos[i]);
+        names[o] = '\0';
+    }
+    return n;
+}
+
+/*
+ * variantKey - extend key by the values of the Vary names in the request
+ *     headers. Returns the hash of the new key, or 0 with the key left
+ *     alone if it would not fit.
+ */
+
+static unsigned int variantKey(char* key, int size, char* names,
+    char* headers) {
+
+    char list[MAXLINE], value[MAXLINE], *name, *save;
+    int len = strlen(key), n;
+
+    strcpy(list, names);
+    for (name = strtok_r(list, ",", &save); name;
+            name = strtok_r(NULL, ",", &save)) {
+        headerValue(headers, name, value, sizeof(value));
+        n = snprintf(key + len, size - len, "\n%s: %s", name, value);
+        if (n >= size - len) {
+            key[strcspn(key, "\n")] = '\0';
+            return 0;
+        }
+        len += n;
+    }
+    return hashKey(key);
+}
+
+static CacheShard* shardOf(unsigned int hash) {
+    return &proxyCache.shards[hash % proxyCache.nshards];
+}
+
+static unsigned long bucketOf(CacheShard* shard, unsigned int hash) {
+    /* the low bits already picked the shard, use the high ones */
+    return ((hash >> 16) | (hash << 16)) & (shard->nbuckets - 1);
+}
+
+/* the bytes the object of an item takes in memory */
+static long storedSize(CacheItem* item) {
+    return item->packed > 0 ? item->packed : item->size;
+}
+
+/* and uncompressed */
+static long logicalSize(CacheItem* item) {
+    return item->gzipped ? item->total : item->size;
+}
+
+static int ageBucket(unsigned long ms) {
+    static const unsigned long bound[AGE_BUCKETS - 1] = {
+        1000, 10000, 60000, 600000, 3600000
+    };
+    int i;
+
+    for (i = 0; i < AGE_BUCKETS - 1 && ms >= bound[i]; i++)
+        ;
+    return i;
+}
+
+/*
+ * addFootprint - account an object of key to its "host:port" in the
+ *     snapshot table.
+ */
+
+static void addFootprint(HostFootprint** table, CacheSnapshot* snap,
+    char* key, long bytes) {
+
+    HostFootprint* h;
+    int len = strcspn(key, "/\n");
+    unsigned int b = 2166136261u;
+    int i;
+
+    for (i = 0; i < len; i++)
+        b = (b ^ (unsigned char)key[i]) * 16777619u;
+    b %= SNAPSHOT_BUCKETS;
+
+    for (h = table[b]; h; h = h->next)
+        if (!strncmp(h->host, key, len) && h->host[len] == '\0')
+            break;
+    if (h == NULL) {
+        h = (HostFootprint*)Calloc(1, sizeof(HostFootprint));
+        h->host = (char*)Malloc(len + 1);
+        memcpy(h->host, key, len);
+        h->host[len] = '\0';
+        h->next = table[b];
+        table[b] = h;
+        snap->nhosts++;
+    }
+    h->entries++;
+    h->bytes += bytes;
+}
+
+static int cmpFootprint(const void* a, const void* b) {
+    const HostFootprint *x = *(HostFootprint* const*)a;
+    const HostFootprint *y = *(HostFootprint* const*)b;
+
+    return (x->bytes < y->bytes) - (x->bytes > y->bytes);
+}
+
+/*
+ * cacheSnapshot - fill snap from the items of every shard, see cache.h.
+ *     The hosts must be released with freeCacheSnapshot.
+ */
+
+void cacheSnapshot(CacheSnapshot* snap) {
+    HostFootprint **table, *h;
+    CacheShard* shard;
+    CacheTier* tier;
+    CacheItem* ptr;
+    unsigned long now;
+    long n = 0;
+    int i, t;
+
+    memset(snap, 0, sizeof(CacheSnapshot));
+    table = (HostFootprint**)Calloc(SNAPSHOT_BUCKETS, sizeof(HostFootprint*));
+
+    for (i = 0; i < proxyCache.nshards; i++) {
+        shard = &proxyCache.shards[i];
+        pthread_rwlock_rdlock(&shard->rwMutex);
+        now = getTime();
+        for (t = 0; t < CACHE_TIERS; t++) {
+            tier = &shard->tiers[t];
+            snap->capacity += tier->capacity;
+            snap->charge += tier->capacity - tier->remainSpace;
+            snap->logical += tier->logical;
+            snap->tierEntries[t] += tier->count;
+            snap->tierCharge[t] += tier->capacity - tier->remainSpace;
+            snap->tierCapacity[t] += tier->capacity;
+            for (ptr = tier->head; ptr; ptr = ptr->next) {
+                if (ptr->varyRecord) {
+                    snap->varyRecords++;
+                    continue;
+                }
+                snap->entries++;
+                snap->bytes += storedSize(ptr);
+                snap->gzipped += ptr->gzipped;
+                snap->packed += ptr->packed > 0;
+                snap->age[ageBucket(now - ptr->inserted)]++;
+                snap->idle[ageBucket(now - __atomic_load_n(&ptr->atime,
+                    __ATOMIC_RELAXED))]++;
+                addFootprint(table, snap, ptr->key, storedSize(ptr));
+            }
+        }
+        pthread_rwlock_unlock(&shard->rwMutex);
+    }
+
+    snap->hosts = (HostFootprint**)Calloc(snap->nhosts + 1,
+        sizeof(HostFootprint*));
+    for (i = 0; i < SNAPSHOT_BUCKETS; i++)
+        for (h = table[i]; h; h = h->next)
+            snap->hosts[n++] = h;
+    qsort(snap->hosts, snap->nhosts, sizeof(HostFootprint*), cmpFootprint);
+    Free(table);
+}
+
+void freeCacheSnapshot(CacheSnapshot* snap) {
+    long i;
+
+    for (i = 0; i < snap->nhosts; i++) {
+        Free(snap->hosts[i]->host);
+        Free(snap->hosts[i]);
+    }
+    Free(snap->hosts);
+}
+
+/*
+ * effectiveCapacity - how many bytes of objects, as they are sent, the
+ *     cache would hold if all of it were filled like it is now.
+ */
+
+static long effectiveCapacity(CacheSnapshot* snap) {
+    if (snap->charge == 0)
+        return snap->capacity;
+    return (long)((double)snap->capacity * snap->logical / snap->charge);
+}
+
+/*
+ * dumpTiers - the tier gauges on /metrics. They come from the counts the
+ *     tiers keep, no item is looked at.
+ */
+
+static void dumpTiers(FILE* fp) {
+    long charge[CACHE_TIERS] = { 0 }, logical[CACHE_TIERS] = { 0 };
+    long entries[CACHE_TIERS] = { 0 }, capacity = 0, total = 0, sum = 0;
+    CacheShard* shard;
+    int i, t;
+
+    for (i = 0; i < proxyCache.nshards; i++) {
+        shard = &proxyCache.shards[i];
+        pthread_rwlock_rdlock(&shard->rwMutex);
+        for (t = 0; t < CACHE_TIERS; t++) {
+            entries[t] += shard->tiers[t].count;
+            charge[t] += shard->tiers[t].capacity
+                - shard->tiers[t].remainSpace;
+            logical[t] += shard->tiers[t].logical;
+            capacity += shard->tiers[t].capacity;
+        }
+        pthread_rwlock_unlock(&shard->rwMutex);
+    }
+
+    fprintf(fp, "# TYPE proxy_cache_tier_entries gauge\n");
+    for (t = 0; t < CACHE_TIERS; t++)
+        fprintf(fp, "proxy_cache_tier_entries{tier=\"%s\"} %ld\n",
+            tierNames[t], entries[t]);
+    fprintf(fp, "# TYPE proxy_cache_tier_bytes gauge\n");
+    for (t = 0; t < CACHE_TIERS; t++)
+        fprintf(fp, "proxy_cache_tier_bytes{tier=\"%s\"} %ld\n",
+            tierNames[t], charge[t]);
+    fprintf(fp, "# TYPE proxy_cache_tier_logical_bytes gauge\n");
+    for (t = 0; t < CACHE_TIERS; t++) {
+        fprintf(fp, "proxy_cache_tier_logical_bytes{tier=\"%s\"} %ld\n",
+            tierNames[t], logical[t]);
+        total += charge[t];
+        sum += logical[t];
+    }
+    fprintf(fp, "# TYPE proxy_cache_effective_capacity_bytes gauge\n");
+    fprintf(fp, "proxy_cache_effective_capacity_bytes %ld\n",
+        total ? (long)((double)capacity * sum / total) : capacity);
+}
+
+/*
+ * dumpCache - the /cache admin page: the snapshot and the hottest keys of
+ *     the sketch. "?top=n" sets the number of hosts and keys listed.
+ */
+
+static void dumpCache(FILE* fp, char* query) {
+    static const char* ageNames[AGE_BUCKETS] = {
+        "<1s", "<10s", "<1m", "<10m", "<1h", ">=1h"
+    };
+    SketchEntry top[SKETCH_SIZE];
+    CacheSnapshot snap;
+    int i, n = DEFAULT_TOP;
+
+    if (!strncmp(query, "top=", 4) && atoi(query + 4) > 0)
+        n = atoi(query + 4);
+    cacheSnapshot(&snap);
+
+    fprintf(fp, "entries %ld\n", snap.entries);
+    fprintf(fp, "vary_records %ld\n", snap.varyRecords);
+    fprintf(fp, "gzipped %ld\n", snap.gzipped);
+    fprintf(fp, "lz4 %ld\n", snap.packed);
+    fprintf(fp, "bytes %ld\n", snap.bytes);
+    fprintf(fp, "logical_bytes %ld\n", snap.logical);
+    fprintf(fp, "charge %ld\n", snap.charge);
+    fprintf(fp, "capacity %ld\n", snap.capacity);
+    fprintf(fp, "effective_capacity %ld\n", effectiveCapacity(&snap));
+    fprintf(fp, "shards %d\n", proxyCache.nshards);
+
+    fprintf(fp, "\n%-10s %10s %12s %12s\n", "tier", "entries", "charge",
+        "capacity");
+    for (i = 0; i < CACHE_TIERS; i++)
+        fprintf(fp, "%-10s %10ld %12ld %12ld\n", tierNames[i],
+            snap.tierEntries[i], snap.tierCharge[i], snap.tierCapacity[i]);
+
+    fprintf(fp, "\n%-10s %10s %10s\n", "age", "inserted", "last_hit");
+    for (i = 0; i < AGE_BUCKETS; i++)
+        fprintf(fp, "%-10s %10ld %10ld\n", ageNames[i], snap.age[i],
+            snap.idle[i]);
+
+    fprintf(fp, "\n%12s %8s  host (%ld)\n", "bytes", "entries", snap.nhosts);
+    for (i = 0; i < n && i < snap.nhosts; i++)
+        fprintf(fp, "%12ld %8ld  %s\n", snap.hosts[i]->bytes,
+            snap.hosts[i]->entries, snap.hosts[i]->host);
+    freeCacheSnapshot(&snap);
+
+    n = sketchTop(top, n);
+    fprintf(fp, "\n%12s %12s  key (1 in %d hits sampled)\n", "est_hits",
+        "max_error", SKETCH_SAMPLE);
+    for (i = 0; i < n; i++)
+        fprintf(fp, "%12lu %12lu  %s\n", top[i].count * SKETCH_SAMPLE,
+            top[i].error * SKETCH_SAMPLE, top[i].key);
+}
+
+/*
+ * initCache - size the cache. shards <= 0 picks a shard count so that
+ *     every shard can hold a good number of the largest objects. The hot
+ *     tier of every shard takes hotShare percent of it.
+ */
+
+void initCache(long cacheSize, long maxObjectSize, int shards, int hotShare) {
+    CacheShard* shard;
+    long capacity, hot;
+    int i;
+
+    if (shards <= 0) {
+        shards = cacheSize / (16 * maxObjectSize);
+        if (shards > 64)
+            shards = 64;
+    }
+    if (shards < 1)
+        shards = 1;
+    if (shards > MAX_SHARDS)
+        shards = MAX_SHARDS;
+
+    proxyCache.maxObjectSize = maxObjectSize;
+    proxyCache.nshards = shards;
+    proxyCache.shards = (CacheShard*)Calloc(shards, sizeof(CacheShard));
+
+    capacity = cacheSize / shards;
+    hot = capacity / 100 * hotShare + capacity % 100 * hotShare / 100;
+    for (i = 0; i < shards; i++) {
+        shard = &proxyCache.shards[i];
+        pthread_rwlock_init(&shard->rwMutex, NULL);
+        shard->tiers[TIER_HOT].capacity = hot;
+        shard->tiers[TIER_WARM].capacity = capacity - hot;
+        shard->tiers[TIER_HOT].remainSpace = hot;
+        shard->tiers[TIER_WARM].remainSpace = capacity - hot;
+        shard->nbuckets = MIN_BUCKETS;
+        shard->buckets = (CacheItem**)Calloc(MIN_BUCKETS, sizeof(CacheItem*));
+    }
+    statsRegisterPage("/cache", dumpCache);
+    statsRegisterDump(dumpTiers);
+}
+
+static void freeItem(CacheItem* item) {
+    Free(item->object);
+    Free(item);
+}
+
+/*
+ * releaseItem - drop a reference to an item, the last one frees it. The
+ *     arena calls it for the objects lent to a request.
+ */
+
+static void releaseItem(void* p) {
+    CacheItem* item = (CacheItem*)p;
+
+    if (__atomic_sub_fetch(&item->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        freeItem(item);
+}
+
+/*
+ * lookupItem - find the item stored under key, take a reference to it
+ *     and copy its type into the request arena. tier is set to the tier
+ *     it is on. If key holds the Vary record of a URL, NULL is returned
+ *     and the Vary names are copied to names.
+ */
+
+static CacheItem* lookupItem(char* key, unsigned int hash, char** type,
+    int* tier, char* names) {
+
+    CacheItem *ptr = NULL, *item = NULL;
+    CacheShard* shard = shardOf(hash);
+
+    names[0] = '\0';
 
     /* 
      * When accessing the cache, we must lock it using read lock 
      * to avoid race condition 
      */
-    pthread_rwlock_rdlock(&rwMutex);
+    pthread_rwlock_rdlock(&shard->rwMutex);
     
     /* 
-     * When cache hit, the atime of that cache item should be updated. We 
-     * acquire the second mutex to ensure that atime will hold the lastest
-     * time.
+     * When cache hit, the referenced bit and atime of that item are
+     * updated. Concurrent readers may write the same values, so plain
+     * atomic stores are enough.
      *
-     * Since we need to access the content when sending object back, instead
-     * of directly returning the object pointer back, we malloc a new memory
-     * area, copy the object into this area and return it.
-     * 
-     * This char array will be freed after serving content.
+     * The object is not copied under the lock. The reference keeps the
+     * item, and with it the object, alive after it is dropped from the
+     * cache, until the caller is done with it.
      */
-    for (ptr = proxyCache.head; ptr; ptr = ptr->next) {
-        if ((!strcasecmp(port, ptr->port)) && (!strcasecmp(host, ptr->host))
-            && (!strcasecmp(filename, ptr->filename))) {
+    for (ptr = shard->buckets[bucketOf(shard, hash)]; ptr; ptr = ptr->hnext) {
+        if (ptr->hash == hash && !strcmp(key, ptr->key)) {
             
-            P(&acMutex);
-                ptr->atime = getTime();
-            V(&acMutex);
+            __atomic_store_n(&ptr->referenced, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(&ptr->atime, getTime(), __ATOMIC_RELAXED);
+
+            if (ptr->varyRecord) {
+                strcpy(names, ptr->type);
+                break;
+            }
         
-            content = (char*)Malloc(ptr->size);
-            type = (char*)Malloc(strlen(ptr->type) + 1);
-            memcpy(content, ptr->object, ptr->size);
-            strcpy(type, ptr->type);
-            type[strlen(ptr->type)] = '\0';
-            *intPtr = ptr->size;
+            __atomic_add_fetch(&ptr->refs, 1, __ATOMIC_RELAXED);
+            *type = (char*)arenaAlloc(strlen(ptr->type) + 64);
+            strcpy(*type, ptr->type);
+            *tier = ptr->tier;
+            item = ptr;
             break;
         }
     }
 
-    pthread_rwlock_unlock(&rwMutex);
+    pthread_rwlock_unlock(&shard->rwMutex);
+    return item;
+}
+
+/*
+ * unpackItem - inflate the LZ4 object of a warm item into the request
+ *     arena. Returns NULL if it is corrupt.
+ */
+
+static char* unpackItem(CacheItem* item) {
+    unsigned long start = statsNow();
+    char* content;
+
+    content = (char*)arenaAlloc(item->size > 0 ? item->size : 1);
+    if (lz4Decompress(item->object, item->packed, content, item->size) < 0) {
+        arenaFree(content);
+        return NULL;
+    }
+    statsRecord(HIST_WARM_DECOMPRESS, 1, statsNow() - start);
+    return content;
+}
+
+static void promoteItem(CacheItem*, char*);
+
+/*
+ * findLocal - look key up in the cache of this process, see
+ *     findItemInCache. Sets gzipped if the object is gzip compressed.
+ */
+
+static char* findLocal(char* key, int keySize, unsigned int hash,
+    char* headers, long* size, char** type, long* total, int* gzipped) {
+
+    char names[MAXLINE], *content;
+    int tier = TIER_HOT;
+    CacheItem* item;
+
+    item = lookupItem(key, hash, type, &tier, names);
+    if (item == NULL && names[0] != '\0'
+            && (hash = variantKey(key, keySize, names, headers)) != 0)
+        item = lookupItem(key, hash, type, &tier, names);
+    if (item == NULL)
+        return NULL;
+
+    /* all variants of a URL count as the URL */
+    statsInc(item->node == numaCurrentNode() ? STAT_LOCAL_NODE_HITS
+        : STAT_REMOTE_NODE_HITS);
+    if (tier == TIER_WARM)
+        statsInc(STAT_WARM_HITS);
+
+    *size = item->size;
+    *total = item->total;
+    *gzipped = item->gzipped;
+    if (item->packed > 0) {
+        if ((content = unpackItem(item)) != NULL)
+            promoteItem(item, content);
+        releaseItem(item);
+        if (content == NULL)
+            arenaFree(*type);
+    }
+    else {
+        if (tier == TIER_WARM)
+            promoteItem(item, NULL);
+        content = item->object;
+        arenaDefer(releaseItem, item);
+    }
+    return content;
+}
+
+/*
+ * findShared - look key up in the shared cache, see shmcache.h. The
+ *     object is copied into the request arena.
+ */
+
+static char* findShared(char* key, int keySize, unsigned int hash,
+    char* headers, long* size, char** type, long* total, int* gzipped) {
+
+    char names[MAXLINE], *content;
+    int flags;
+
+    content = shmCacheFind(key, hash, size, total, type, &flags);
+    if (content == NULL && (flags & SHM_VARY)) {
+        snprintf(names, sizeof(names), "%s", *type);
+        arenaFree(*type);
+        if ((hash = variantKey(key, keySize, names, headers)) == 0)
+            return NULL;
+        content = shmCacheFind(key, hash, size, total, type, &flags);
+    }
+    if (content == NULL)
+        return NULL;
+    *gzipped = flags & SHM_GZIPPED;
+    return content;
+}
+
+/*
+ * findItemInCache - find cache using port, host and filename
+ *    if these three indices match, the stored object is returned 
+ *    and size/type/total are set. Otherwise, NULL is returned. 
+ *
+ *    If origin answered with Vary, the URL holds a Vary record and the
+ *    variant which matches headers, the request headers sent to origin,
+ *    is looked up in a second step.
+ *
+ *    type is a copy allocated from the request arena, returned as the
+ *    header lines to send along with the object. An object of the hot
+ *    tier is the item's own, lent until the arena is reset, one of the
+ *    warm tier is inflated into the arena, and the item is promoted.
+ *    One of the shared cache is copied into the arena.
+ *    A gzipped object is returned as is, with Content-Encoding, when
+ *    the client accepts gzip, and inflated otherwise.
+ */
+
+char* findItemInCache(char* port, char* host, char* filename,
+    char* headers, long* size, char** type, long* total, int acceptGzip) {
+    
+    char key[3 * MAXLINE], *content;
+    unsigned int hash;
+    int gzipped, urlLen;
+
+    hash = makeKey(port, host, filename, key, sizeof(key));
+    urlLen = strlen(key);
+    if (shmCacheEnabled())
+        content = findShared(key, sizeof(key), hash, headers, size, type,
+            total, &gzipped);
+    else
+        content = findLocal(key, sizeof(key), hash, headers, size, type,
+            total, &gzipped);
+    if (content == NULL)
+        return NULL;
+    sketchHit(key, urlLen, hash);
+
+    /* decompression happens outside of the lock */
+    if (gzipped) {
+        if (acceptGzip) {
+            strcat(*type, "Content-Encoding: gzip\r\n"
+                "Vary: Accept-Encoding\r\n");
+        }
+        else {
+            if ((content = gunzipObject(content, *size, *total)) == NULL) {
+                arenaFree(*type);
+                return NULL;
+            }
+            *size = *total;
+            strcat(*type, "Vary: Accept-Encoding\r\n");
+        }
+    }
 
 	return content;
 }
 
+static void indexAdd(CacheShard* shard, CacheItem* item) {
+    unsigned long b = bucketOf(shard, item->hash);
+
+    item->hnext = shard->buckets[b];
+    shard->buckets[b] = item;
+}
+
+static void indexRemove(CacheShard* shard, CacheItem* item) {
+    CacheItem** pp;
+
+    for (pp = &shard->buckets[bucketOf(shard, item->hash)]; *pp;
+            pp = &(*pp)->hnext) {
+        if (*pp == item) {
+            *pp = item->hnext;
+            break;
+        }
+    }
+}
+
+/* isIndexed - true if item itself is still in the index of its shard */
+static int isIndexed(CacheShard* shard, CacheItem* item) {
+    CacheItem* ptr;
+
+    for (ptr = shard->buckets[bucketOf(shard, item->hash)]; ptr;
+            ptr = ptr->hnext)
+        if (ptr == item)
+            return 1;
+    return 0;
+}
+
+/*
+ * listPush - put an item at the head of tier t, listRemove takes it off
+ *     the list of its tier. Both account its space. Must hold the write
+ *     lock.
+ */
+
+static void listPush(CacheShard* shard, int t, CacheItem* item) {
+    CacheTier* tier = &shard->tiers[t];
+
+    item->tier = t;
+    item->prev = NULL;
+    item->next = tier->head;
+    if (tier->head != NULL)
+        tier->head->prev = item;
+    tier->head = item;
+    if (tier->tail == NULL)
+        tier->tail = item;
+
+    tier->remainSpace -= item->charge;
+    tier->logical += logicalSize(item);
+    tier->count++;
+}
+
+static void listRemove(CacheShard* shard, CacheItem* item) {
+    CacheTier* tier = &shard->tiers[item->tier];
+
+    if (item->prev)
+        item->prev->next = item->next;
+    else
+        tier->head = item->next;
+    if (item->next)
+        item->next->prev = item->prev;
+    else
+        tier->tail = item->prev;
+
+    tier->remainSpace += item->charge;
+    tier->logical -= logicalSize(item);
+    tier->count--;
+}
+
+/*
+ * unlinkItem - remove an item from the list and the hash index of its
+ *     shard. The reference of the cache is the caller's then. Must hold
+ *     the write lock.
+ */
+
+static void unlinkItem(CacheShard* shard, CacheItem* item) {
+    indexRemove(shard, item);
+    if (item->tier != TIER_PENDING)
+        listRemove(shard, item);
+    shard->count--;
+}
+
 /* 
- * evictFromCache - traverse the list and evict the item with the least
- *        access time from the cache list. Evicted item will be freed.
+ * clockVictim - the item to push out of a tier next, giving referenced
+ *        items a second chance. Must hold the write lock.
+ */
+
+static CacheItem* clockVictim(CacheTier* tier) {
+
+    CacheItem* ptr;
+
+    while ((ptr = tier->tail) != NULL) {
+        if (!ptr->referenced || ptr == tier->head)
+            break;
+
+        /* second chance: clear the bit and move to the head */
+        ptr->referenced = 0;
+        tier->tail = ptr->prev;
+        tier->tail->next = NULL;
+        ptr->prev = NULL;
+        ptr->next = tier->head;
+        tier->head->prev = ptr;
+        tier->head = ptr;
+    }
+    return ptr;
+}
+
+/*
+ * newItem - allocate an item with no object yet. Key and type live in
+ *     the same allocation right after the item.
  */
 
-void evictFromCache() {
+static CacheItem* newItem(char* key, unsigned int hash, char* type) {
+    CacheItem* item;
+    int keyLen = strlen(key) + 1, typeLen = strlen(type) + 1;
 
-    CacheItem* evicted = NULL,*ptr = NULL;
-    int size = 0;
-    unsigned long minAtime = ~0L;
+    if ((item = (CacheItem *)malloc(sizeof(CacheItem) + keyLen + typeLen))
+            == NULL)
+        return NULL;
+
+    item->key = (char *)(item + 1);
+    item->type = item->key + keyLen;
+    memcpy(item->key, key, keyLen);
+    memcpy(item->type, type, typeLen);
+    item->hash = hash;
+    item->size = 0;
+    item->total = 0;
+    item->gzipped = 0;
+    item->varyRecord = 0;
+    item->referenced = 0;
+    item->node = numaCurrentNode();
+    item->tier = TIER_HOT;
+    item->refs = 1;
+    item->packed = 0;
+    item->object = NULL;
+    item->prev = NULL;
+    item->charge = sizeof(CacheItem) + keyLen + typeLen;
+    return item;
+}
+
+/*
+ * copyItem - a new item for the object of item in another form, the
+ *     caller sets object and adds its size to charge.
+ */
+
+static CacheItem* copyItem(CacheItem* item) {
+    CacheItem* copy;
+
+    if ((copy = newItem(item->key, item->hash, item->type)) == NULL)
+        return NULL;
+    copy->size = item->size;
+    copy->total = item->total;
+    copy->gzipped = item->gzipped;
+    copy->node = item->node;
+    copy->atime = item->atime;
+    copy->inserted = item->inserted;
+    return copy;
+}
+
+/*
+ * pushWarm - put an item, which is in the index but on no list, at the
+ *     head of the warm tier, or evict it if it can never fit. Must hold
+ *     the write lock.
+ */
 
-    printf("Cache evicted\n");
-    if (proxyCache.tail == NULL)
+static void pushWarm(CacheShard* shard, CacheItem* item) {
+    CacheItem* victim;
+
+    item->referenced = 0;
+    if (item->charge > shard->tiers[TIER_WARM].capacity) {
+        statsInc(STAT_EVICTIONS);
+        indexRemove(shard, item);
+        shard->count--;
+        releaseItem(item);
         return;
+    }
+    while (shard->tiers[TIER_WARM].remainSpace < item->charge
+            && (victim = clockVictim(&shard->tiers[TIER_WARM])) != NULL) {
+        statsInc(STAT_EVICTIONS);
+        unlinkItem(shard, victim);
+        releaseItem(victim);
+    }
+    listPush(shard, TIER_WARM, item);
+}
 
-    /* find the item with the lease atime */
-    for (ptr = proxyCache.head; ptr; ptr = ptr->next) {
-        if (ptr->atime < minAtime){
-            minAtime = ptr->atime;
-            evicted = ptr;
-        }
+/*
+ * demoteItem - move an item, which is in the index but on no list, to
+ *     the warm tier. An object which is worth LZ4 compressing is not
+ *     compressed here, under the write lock, but left in the index on no
+ *     list and put on pending, with a reference, for packDemoted. Must
+ *     hold the write lock.
+ */
+
+static void demoteItem(CacheShard* shard, CacheItem* item,
+    CacheItem** pending) {
+
+    /* with no warm tier a demotion is an eviction */
+    if (shard->tiers[TIER_WARM].capacity == 0) {
+        statsInc(STAT_EVICTIONS);
+        indexRemove(shard, item);
+        shard->count--;
+        releaseItem(item);
+        return;
     }
 
-    if (evicted == NULL)
+    statsInc(STAT_DEMOTIONS);
+    if (!item->varyRecord && !item->gzipped
+            && item->size >= MIN_COMPRESS_SIZE) {
+        __atomic_add_fetch(&item->refs, 1, __ATOMIC_RELAXED);
+        item->tier = TIER_PENDING;
+        item->next = *pending;
+        *pending = item;
         return;
+    }
+    pushWarm(shard, item);
+}
+
+/*
+ * packDemoted - LZ4 compress the items demoteItem left pending, with no
+ *     lock held, and put them on the warm tier. An object is replaced by
+ *     its LZ4 block if that is smaller. Lookups go on lending the plain
+ *     object meanwhile. An item replaced or dropped in between is let go.
+ */
+
+static void packDemoted(CacheShard* shard, CacheItem* pending) {
+    CacheItem *item, *next, *warm;
+    char *packed, *tmp;
+    long n = 0;
+
+    for (item = pending; item != NULL; item = next) {
+        next = item->next;
+        warm = NULL;
+        if ((packed = (char*)malloc(item->size)) != NULL) {
+            /* no room for a block which would not be smaller */
+            if ((n = lz4Compress(item->object, item->size, packed,
+                    item->size - 1)) > 0 && (warm = copyItem(item)) != NULL) {
+                tmp = (char*)realloc(packed, n);
+                warm->object = tmp ? tmp : packed;
+                warm->packed = n;
+                warm->charge += n;
+            }
+            else
+                free(packed);
+        }
+
+        pthread_rwlock_wrlock(&shard->rwMutex);
+        if (item->tier == TIER_PENDING && isIndexed(shard, item)) {
+            if (warm != NULL) {
+                statsAdd(STAT_LZ4_SAVED_BYTES, item->size - n);
+                indexRemove(shard, item);
+                indexAdd(shard, warm);
+                releaseItem(item);
+                pushWarm(shard, warm);
+                warm = NULL;
+            }
+            else
+                pushWarm(shard, item);
+        }
+        pthread_rwlock_unlock(&shard->rwMutex);
+
+        if (warm != NULL)
+            freeItem(warm);
+        releaseItem(item);
+    }
+}
+
+/*
+ * makeRoom - push items out of tier t until need bytes are free. Items
+ *     of the hot tier are demoted, see demoteItem for pending, those of
+ *     the warm tier evicted. Must hold the write lock.
+ */
+
+static void makeRoom(CacheShard* shard, int t, long need,
+    CacheItem** pending) {
+
+    CacheItem* victim;
+
+    while (shard->tiers[t].remainSpace < need
+            && (victim = clockVictim(&shard->tiers[t])) != NULL) {
+        listRemove(shard, victim);
+        if (t == TIER_HOT)
+            demoteItem(shard, victim, pending);
+        else {
+            statsInc(STAT_EVICTIONS);
+            indexRemove(shard, victim);
+            shard->count--;
+            releaseItem(victim);
+        }
+    }
+}
+
+/*
+ * promoteItem - move an item which was hit in the warm tier back to the
+ *     hot one. A packed item is replaced by a copy holding plain, the
+ *     object it was just inflated to. The caller holds a reference.
+ *     Nothing happens if the item was dropped or promoted meanwhile.
+ */
 
-    size = evicted->size;
-    proxyCache.remainSpace += size;
+static void promoteItem(CacheItem* item, char* plain) {
+    CacheShard* shard = shardOf(item->hash);
+    CacheItem *hot = NULL, *pending = NULL;
 
-    /* remove this item from cache list */
-    if (proxyCache.head == proxyCache.tail) {
-        proxyCache.head = proxyCache.tail = NULL;
+    /* the copy is made before taking the lock */
+    if (plain != NULL) {
+        if (item->size > shard->tiers[TIER_HOT].capacity
+                || (hot = copyItem(item)) == NULL)
+            return;
+        if ((hot->object = (char*)malloc(item->size > 0 ? item->size : 1))
+                == NULL) {
+            freeItem(hot);
+            return;
+        }
+        memcpy(hot->object, plain, item->size);
+        hot->charge += item->size;
     }
-    else if (proxyCache.tail == evicted){
-        proxyCache.tail = evicted->prev;
-        proxyCache.tail->next = NULL;
+    if ((hot ? hot : item)->charge > shard->tiers[TIER_HOT].capacity) {
+        if (hot)
+            freeItem(hot);
+        return;
     }
-    else if (proxyCache.head == evicted){
-        proxyCache.head = evicted->next;
-        proxyCache.head->prev = NULL;
+
+    pthread_rwlock_wrlock(&shard->rwMutex);
+    if (item->tier != TIER_WARM || !isIndexed(shard, item)) {
+        pthread_rwlock_unlock(&shard->rwMutex);
+        if (hot)
+            freeItem(hot);
+        return;
     }
-    else {
-        evicted->prev->next = evicted->next;
-        evicted->next->prev = evicted->prev;
+
+    listRemove(shard, item);
+    if (hot) {
+        indexRemove(shard, item);
+        indexAdd(shard, hot);
+        releaseItem(item);
+        item = hot;
     }
-    Free(evicted->object);
-    Free(evicted);    
+    makeRoom(shard, TIER_HOT, item->charge, &pending);
+    listPush(shard, TIER_HOT, item);
+    statsInc(STAT_PROMOTIONS);
+    pthread_rwlock_unlock(&shard->rwMutex);
+    packDemoted(shard, pending);
 }
 
-/* 
- * addToCache - Add an new item to the cache item list.
+/*
+ * growIndex - double the hash buckets of a shard. Must hold the write lock.
  */
 
-void addToCache(char* port, char* host, 
-    char* filename, int size, char *content, char* type) {
-    
-    CacheItem *item;
+static void growIndex(CacheShard* shard) {
+    CacheItem **old = shard->buckets, *ptr, *next;
+    unsigned long oldCount = shard->nbuckets, i;
+    CacheItem **buckets;
 
-    /* We create a new item before accessing and locking the cache list */
-    if ((item = (CacheItem *)malloc(sizeof(CacheItem))) == NULL)
+    if ((buckets = (CacheItem**)calloc(oldCount * 2, sizeof(CacheItem*)))
+            == NULL)
         return;
-    
-    strcpy(item->port, port);
-    strcpy(item->host, host);
-    strcpy(item->filename, filename);
-    strcpy(item->type, type);
-    item->size = size;
-    if ((item->object = (char*)malloc(size)) == NULL)
+
+    shard->buckets = buckets;
+    shard->nbuckets = oldCount * 2;
+    for (i = 0; i < oldCount; i++) {
+        for (ptr = old[i]; ptr; ptr = next) {
+            next = ptr->hnext;
+            indexAdd(shard, ptr);
+        }
+    }
+    Free(old);
+}
+
+/*
+ * insertItem - link item into the hot tier of its shard, replacing an
+ *     item with the same key and demoting until it fits. An item larger
+ *     than the hot tier goes to the warm one right away.
+ */
+
+static void insertItem(CacheItem* item) {
+    CacheShard* shard = shardOf(item->hash);
+    CacheItem *ptr, *pending = NULL;
+    unsigned int hash = item->hash;
+
+    if (item->charge > shard->tiers[TIER_HOT].capacity
+            + shard->tiers[TIER_WARM].capacity) {
+        freeItem(item);
         return;
-    item->prev = NULL;
-    
-    memcpy(item->object, content, size);
+    }
     
     /* 
      * Since we need to make change on the whole list, we acquire the 
      * write lock.
      */
-    pthread_rwlock_wrlock(&rwMutex);
+    pthread_rwlock_wrlock(&shard->rwMutex);
 
-        /* Evict item from cache until we get enough space */
-        while (proxyCache.remainSpace < size) {
-            evictFromCache();
+        /* Replace an older copy, two threads may miss at the same time */
+        for (ptr = shard->buckets[bucketOf(shard, hash)]; ptr;
+                ptr = ptr->hnext) {
+            if (ptr->hash == hash && !strcmp(item->key, ptr->key)) {
+                unlinkItem(shard, ptr);
+                releaseItem(ptr);
+                break;
+            }
         }
 
-        item->atime = getTime();
+        if (shard->count >= 2 * (long)shard->nbuckets)
+            growIndex(shard);
 
-        /* Insert the new cache item to the head of the list */
-        proxyCache.remainSpace -= size;
-        item->next = proxyCache.head;
+        item->atime = item->inserted = getTime();
 
-        if (proxyCache.head != NULL)
-            proxyCache.head->prev = item;
-        
-        proxyCache.head = item;
-        if (proxyCache.tail == NULL)
-            proxyCache.tail = item;
+        /* Insert the new cache item to the head of the list and index */
+        indexAdd(shard, item);
+        shard->count++;
+        if (item->charge <= shard->tiers[TIER_HOT].capacity) {
+            makeRoom(shard, TIER_HOT, item->charge, &pending);
+            listPush(shard, TIER_HOT, item);
+        }
+        else
+            demoteItem(shard, item, &pending);
         
-    pthread_rwlock_unlock(&rwMutex);
+    pthread_rwlock_unlock(&shard->rwMutex);
+
+    /* compressing the demoted objects does not hold up the shard */
+    packDemoted(shard, pending);
+}
+
+/*
+ * addShared - addToCache for the shared cache, names are the Vary names
+ *     if there are any.
+ */
+
+static void addShared(char* key, int keySize, unsigned int hash,
+    char* headers, char* names, long size, char* content, char* type,
+    long total) {
+
+    char* packed = NULL;
+    long packedSize;
+    int flags = 0;
+
+    if (names != NULL) {
+        shmCacheAdd(key, hash, names, NULL, 0, 0, SHM_VARY);
+        if ((hash = variantKey(key, keySize, names, headers)) == 0)
+            return;
+        statsInc(STAT_VARIANT_INSERTS);
+    }
+    if (size == total && size >= MIN_COMPRESS_SIZE && isCompressible(type)
+            && (packed = gzipObject(content, size, &packedSize)) != NULL) {
+        statsInc(STAT_COMPRESSED_INSERTS);
+        statsAdd(STAT_COMPRESS_SAVED_BYTES, size - packedSize);
+        content = packed;
+        size = packedSize;
+        flags = SHM_GZIPPED;
+    }
+    shmCacheAdd(key, hash, type, content, size, total, flags);
+    free(packed);
+    statsInc(STAT_CACHE_INSERTS);
+}
+
+/* 
+ * addToCache - Add an new item to the cache item list.
+ *     A whole text object which is not already encoded by origin is
+ *     stored gzip compressed, if that makes it smaller. An existing item
+ *     with the same key is replaced.
+ *
+ *     If type carries a Vary header, a Vary record naming the headers
+ *     goes under the URL and the object under the variant of headers,
+ *     the request headers sent to origin. "Vary: *" is not cached.
+ */
+
+void addToCache(char* port, char* host, char* filename, char* headers,
+    long size, char *content, char* type, long total) {
+    
+    CacheItem *item, *record;
+    char key[3 * MAXLINE], names[MAXLINE], *packed = NULL;
+    long packedSize;
+    unsigned int hash;
+    int vary;
+
+    if (size > proxyCache.maxObjectSize
+            || (vary = varyNames(type, names, sizeof(names))) < 0)
+        return;
+
+    hash = makeKey(port, host, filename, key, sizeof(key));
+    if (shmCacheEnabled()) {
+        addShared(key, sizeof(key), hash, headers, vary ? names : NULL, size,
+            content, type, total);
+        return;
+    }
+    if (vary > 0) {
+        if ((record = newItem(key, hash, names)) == NULL)
+            return;
+        record->varyRecord = 1;
+        if ((hash = variantKey(key, sizeof(key), names, headers)) == 0) {
+            freeItem(record);
+            return;
+        }
+        insertItem(record);
+        statsInc(STAT_VARIANT_INSERTS);
+    }
+
+    /* 
+     * We create a new item before accessing and locking the cache list.
+     */
+    if ((item = newItem(key, hash, type)) == NULL)
+        return;
+    item->size = size;
+    item->total = total;
+
+    if (size == total && size >= MIN_COMPRESS_SIZE && isCompressible(type)
+            && (packed = gzipObject(content, size, &packedSize)) != NULL) {
+        statsInc(STAT_COMPRESSED_INSERTS);
+        statsAdd(STAT_COMPRESS_SAVED_BYTES, size - packedSize);
+        item->object = packed;
+        item->size = size = packedSize;
+        item->gzipped = 1;
+    }
+    else {
+        if ((item->object = (char*)malloc(size > 0 ? size : 1)) == NULL) {
+            free(item);
+            return;
+        }
+        memcpy(item->object, content, size);
+    }
+    item->charge += size;
+
+    insertItem(item);
+    statsInc(STAT_CACHE_INSERTS);
 }
 
 /* 
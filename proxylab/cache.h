@@ -10,64 +10,200 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <zlib.h>
 
 #include "csapp.h"
 /* Constant defined here */
 
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/* defaults, both can be changed on the command line */
+#define DEFAULT_CACHE_SIZE 1049000
+#define DEFAULT_OBJECT_SIZE 102400
+
+/* text objects smaller than this are not worth compressing */
+#define MIN_COMPRESS_SIZE 256
+
+/* percent of the cache which holds the hot tier, see below */
+#define DEFAULT_HOT_SHARE 25
+enum {
+    TIER_HOT,
+    TIER_WARM,
+    CACHE_TIERS
+};
+/* an item demoted from the hot tier while it is compressed, on no list */
+#define TIER_PENDING CACHE_TIERS
+
+#define MAX_SHARDS 1024
+/* initial hash buckets of a shard, doubled whenever it gets crowded */
+#define MIN_BUCKETS 64
+/* query parameters are sorted for the key only up to this many */
+#define MAX_QUERY_PARAMS 64
+/*
+ * parts a large object is cached in are named "filename k", a request
+ * target cannot hold a space
+ */
+#define SEGMENT_SEP " "
+
+/* snapshot age buckets, up to 1s, 10s, 1m, 10m, 1h and older */
+#define AGE_BUCKETS 6
+#define SNAPSHOT_BUCKETS 1024
+/* rows of /cache unless ?top=n */
+#define DEFAULT_TOP 20
 
 /*
  * Cache is defined as followed:
  *     Cache header:
- *           [size]: the current available space 
- *           [head, tail]: point to the head and tail and the 
+ *           [maxObjectSize]: larger objects are never cached
+ *           [shards]: the cache is split into independent shards by the
+ *            hash of the key, each with its own lock, list and space.
+ *     Cache shard:
+ *           [buckets]: hash index over the items of both tiers, it
+ *            doubles when there are more than two items per bucket on
+ *            average.
+ *           [tiers]: the hot and the warm tier, each a list of its own
+ *            with its own space.
+ *     Cache tier:
+ *           [remainSpace, capacity]: the available and total space
+ *           [logical]: what its objects take uncompressed
+ *           [head, tail]: point to the head and tail and the
  *            linked list.
+ *        Tiers:
+ *         new items go to the hot tier, which holds objects as they
+ *         are sent and lends them to the request instead of copying
+ *         them. An item pushed out of the hot tier is demoted to the
+ *         warm tier, LZ4 compressed unless it is gzipped already or does
+ *         not shrink. The compression runs after the shard lock is
+ *         dropped, the item stays in the index on no list until then
+ *         (TIER_PENDING). A hit in the warm tier is decompressed into the
+ *         request arena and the item is promoted back. Items pushed out
+ *         of the warm tier are gone. The warm tier is the larger one, so
+ *         the cache keeps more objects than its size, and the hot one
+ *         keeps the hits on the most popular objects free of any copy.
  *        Cache item:
- *            double linked list, the recently accessed cache
- *         item will be placed into the head of the list.
- *         The tail of the list will be evicted if the space
- *         is not enough.
- *         [host, port, filename]: used as the index.
+ *            double linked list, new items are placed into the head of
+ *         the list of their tier. Eviction works like CLOCK: the tail is
+ *         evicted if it was not referenced since it was last looked at,
+ *         otherwise its referenced bit is cleared and it is moved to the
+ *         head. A hit only sets the bit, so lookups need nothing but the
+ *         read lock.
+ *         [key]: "host:port" followed by the filename, used as the index.
+ *         It is canonical (see makeKey), so equivalent URLs share it. A
+ *         variant adds a line per Vary header with the request value.
  *         [size, type]: used when cache hits. These two parameters
  *         will be sent in response headers.
- *         [object]: store the real web object.
- *         [atime]: access time, used as LRU flag
- *         [prev, next]: used to construct double linked list. 
+ *         [total]: size of the whole object. It differs from size
+ *         only for a segment of a large object, see serveRange.
+ *         [gzipped]: text objects are gzip compressed once when they are
+ *         added, then object holds the compressed bytes and size is the
+ *         compressed size.
+ *         [charge]: size plus the item bookkeeping, which is what counts
+ *         against the space of the shard.
+ *         [atime]: last access time.
+ *         [inserted]: time the item was added.
+ *         [tier]: the tier whose list the item is on.
+ *         [packed]: object holds an LZ4 block of packed bytes, which
+ *         inflates to size bytes.
+ *         [refs]: one for the cache while the item is linked and one for
+ *         every request its object is lent to, the last one frees it.
+ *         [varyRecord]: the item has no object, type holds the names of
+ *         the Vary of the response, whose variants are stored under
+ *         their own key.
+ *         [node]: NUMA node of the thread which inserted the item, the
+ *         object memory was first touched there.
+ *         [prev, next]: used to construct double linked list.
+ *         [hnext]: next item in the same hash bucket.
+ *
+ *     With -S objects are stored in the shared cache instead, which has
+ *     its own layout and no tiers, see shmcache.h.
  */
 
 typedef struct _cacheItem {
-    int size;
+    long size;
+    long total;
+    long charge;
+    int gzipped;
+    int referenced;
+    int varyRecord;
+    int node;
+    int tier;
+    int refs;
+    long packed;
+    unsigned int hash;
     unsigned long atime;
-    char host[MAXLINE];
-    char port[MAXLINE];
-    char filename[MAXLINE];
-    char type[MAXLINE];
+    unsigned long inserted;
+    char* key;
+    char* type;
     char* object;
     struct _cacheItem* prev;
     struct _cacheItem* next;
+    struct _cacheItem* hnext;
 } CacheItem;
 
-typedef struct _proxyCache {
-    int remainSpace;
+/*
+ * RW_lock: this lock allows multiple parallel readers and only one writer.
+ * Each shard has its own, so writers of different shards never contend.
+ */
+
+typedef struct _cacheTier {
+    long remainSpace;
+    long capacity;
+    long count;
+    long logical;
     CacheItem *head;
     CacheItem *tail;
+} CacheTier;
+
+typedef struct _cacheShard {
+    pthread_rwlock_t rwMutex;
+    long count;
+    unsigned long nbuckets;
+    CacheItem **buckets;
+    CacheTier tiers[CACHE_TIERS];
+} __attribute__((aligned(64))) CacheShard;
+
+typedef struct _proxyCache {
+    long maxObjectSize;
+    int nshards;
+    CacheShard *shards;
 } ProxyCache;
 
-/* Two lock:
- *     RW_lock: this lock allows multiple parallel readers and only one writer.
- *     
- *     acMutex: When there is a cache hit, we must change the atime of the 
- *     item. In order to make this change without race condition, we acquire
- *     the second mutex.
+/*
+ * Cache snapshot: totals, age histograms and the footprint per origin,
+ * gathered by walking one shard at a time under its read lock. Lookups
+ * go on meanwhile, inserts into a shard wait for its walk only, so the
+ * snapshot is not taken at one instant across shards.
  */
 
-pthread_rwlock_t rwMutex;
-sem_t acMutex;
-ProxyCache proxyCache;
+typedef struct _hostFootprint {
+    char *host;                 /* "host:port" */
+    long entries;
+    long bytes;
+    struct _hostFootprint *next;
+} HostFootprint;
 
-void addToCache(char*, char*, char*, int, char*, char*);
-char* findItemInCache(char*, char*, char*, int*, char*);
-void evictFromCache();
-unsigned long getTime();
+typedef struct _cacheSnapshot {
+    long entries;               /* objects, Vary records not included */
+    long varyRecords;
+    long gzipped;
+    long packed;                /* LZ4 compressed in the warm tier */
+    long bytes;                 /* stored object bytes */
+    long logical;               /* the same uncompressed */
+    long charge;                /* bytes counted against the capacity */
+    long capacity;
+    long tierEntries[CACHE_TIERS];
+    long tierCharge[CACHE_TIERS];
+    long tierCapacity[CACHE_TIERS];
+    long age[AGE_BUCKETS];      /* since the object was added */
+    long idle[AGE_BUCKETS];     /* since its last hit */
+    long nhosts;
+    HostFootprint **hosts;      /* largest first */
+} CacheSnapshot;
 
+extern ProxyCache proxyCache;
+
+void initCache(long, long, int, int);
+void addToCache(char*, char*, char*, char*, long, char*, char*, long);
+char* findItemInCache(char*, char*, char*, char*, long*, char**, long*, int);
+unsigned int cacheKey(char*, char*, char*, char*, int);
+unsigned long getTime();
+void cacheSnapshot(CacheSnapshot*);
+void freeCacheSnapshot(CacheSnapshot*);
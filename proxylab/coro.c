@@ -0,0 +1,719 @@
+#include <ucontext.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "csapp.h"
+#include "stats.h"
+#include "arena.h"
+#include "coro.h"
+#include "uring.h"
+
+/* written at the lowest address of every stack, see checkStack */
+#define CORO_CANARY 0x5a5aa5a55a5aa5a5UL
+
+/* user_data of the loop's own operations on the ring, coroutines use theirs */
+#define RING_ACCEPT 1
+#define RING_WAKE 2
+#define RING_STOP 3
+#define RING_CANCEL 4
+
+typedef struct _loop Loop;
+
+/*
+ * A coroutine is entered through its ucontext the first time only. Every
+ * other switch is a _setjmp/_longjmp pair, which unlike swapcontext does
+ * not save and restore the signal mask with a system call each time.
+ */
+struct _coro {
+    Loop *loop;
+    jmp_buf ctx;
+    ucontext_t start;
+    int started;
+    int done;
+    char *stack;
+    void *arena;
+    void *local;
+    void (*fn)(void *);     /* what it runs, for a connection serveConn */
+    void *arg;
+    int watched[2];         /* fds last added to the epoll instance */
+    int res;                /* result of its operation on the ring */
+    struct _coro *next;     /* in the ready queue or the pool */
+};
+
+struct _loop {
+    int epfd;
+    Uring *ring;            /* NULL unless the loop runs on io_uring */
+    int listenfd;
+    int wakefd;
+    void (*serve)(int);
+    jmp_buf ctx;
+    void *arena;            /* of the loop thread itself */
+    Coro *readyHead;
+    Coro *readyTail;
+    Coro *pool;
+    int pooled;
+    pthread_mutex_t mutex;  /* guards remote */
+    Coro *remote;           /* unparked from other threads */
+};
+
+static __thread Loop *myLoop = NULL;
+static __thread Coro *current = NULL;
+static long active = 0;
+static long stacks = 0;
+static pthread_once_t dumpOnce = PTHREAD_ONCE_INIT;
+
+static void dumpCoro(FILE *fp) {
+    fprintf(fp, "# TYPE proxy_coroutines_active gauge\n");
+    fprintf(fp, "proxy_coroutines_active %ld\n",
+        __atomic_load_n(&active, __ATOMIC_RELAXED));
+    fprintf(fp, "# TYPE proxy_coroutine_stacks gauge\n");
+    fprintf(fp, "proxy_coroutine_stacks %ld\n",
+        __atomic_load_n(&stacks, __ATOMIC_RELAXED));
+}
+
+static void registerDump() {
+    statsRegisterDump(dumpCoro);
+}
+
+static void makeReady(Loop *l, Coro *co) {
+    co->next = NULL;
+    if (l->readyTail)
+        l->readyTail->next = co;
+    else
+        l->readyHead = co;
+    l->readyTail = co;
+}
+
+/*
+ * checkStack - stacks have no guard page, they would each cost a mapping
+ *     of their own, so an overflow is caught when the coroutine yields.
+ */
+
+static void checkStack(Coro *co) {
+    if (*(unsigned long *)co->stack != CORO_CANARY) {
+        fprintf(stderr, "coroutine stack overflow\n");
+        abort();
+    }
+}
+
+/* yield - back to the loop, which resumes us later */
+static void yield() {
+    Coro *co = current;
+
+    checkStack(co);
+    if (!_setjmp(co->ctx))
+        _longjmp(co->loop->ctx, 1);
+}
+
+static void coroMain() {
+    Coro *co;
+
+    /* a pooled coroutine comes back here for its next run */
+    for (; ;) {
+        co = current;
+        co->fn(co->arg);
+        co->done = 1;
+        yield();
+    }
+}
+
+static void serveConn(void *arg) {
+    current->loop->serve((int)(long)arg);
+}
+
+static void freeCoro(Coro *co) {
+    munmap(co->stack, CORO_STACK_SIZE);
+    arenaDelete(co->arena);
+    Free(co);
+    __atomic_fetch_sub(&stacks, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * spawn - run fn(arg) in a coroutine, from the pool if it has one.
+ *     Returns -1 if there is no stack for it.
+ */
+
+static int spawn(Loop *l, void (*fn)(void *), void *arg) {
+    Coro *co;
+
+    if ((co = l->pool) != NULL) {
+        l->pool = co->next;
+        l->pooled--;
+    }
+    else {
+        co = (Coro *)Calloc(1, sizeof(Coro));
+        co->loop = l;
+        co->stack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+        if (co->stack == MAP_FAILED) {
+            Free(co);
+            return -1;
+        }
+        *(unsigned long *)co->stack = CORO_CANARY;
+        co->arena = arenaNew(CORO_ARENA_SIZE);
+        getcontext(&co->start);
+        co->start.uc_stack.ss_sp = co->stack;
+        co->start.uc_stack.ss_size = CORO_STACK_SIZE;
+        co->start.uc_link = NULL;
+        makecontext(&co->start, coroMain, 0);
+        __atomic_fetch_add(&stacks, 1, __ATOMIC_RELAXED);
+    }
+
+    co->fn = fn;
+    co->arg = arg;
+    co->done = 0;
+    co->local = NULL;
+    co->watched[0] = co->watched[1] = -1;
+    __atomic_fetch_add(&active, 1, __ATOMIC_RELAXED);
+    makeReady(l, co);
+    return 0;
+}
+
+/*
+ * resume - run co until it yields or finishes.
+ */
+
+static void resume(Loop *l, Coro *co) {
+    current = co;
+    l->arena = arenaSwap(co->arena);
+    if (!_setjmp(l->ctx)) {
+        if (co->started)
+            _longjmp(co->ctx, 1);
+        co->started = 1;
+        setcontext(&co->start);
+    }
+    arenaSwap(l->arena);
+    current = NULL;
+
+    if (!co->done)
+        return;
+    __atomic_fetch_sub(&active, 1, __ATOMIC_RELAXED);
+    if (l->pooled < CORO_POOL) {
+        co->next = l->pool;
+        l->pool = co;
+        l->pooled++;
+    }
+    else
+        freeCoro(co);
+}
+
+/*
+ * acceptAll - accept every pending connection of the listener. The
+ *     sockets are made non-blocking here, accept4 would need _GNU_SOURCE
+ *     which csapp.h does not build with.
+ */
+
+static void acceptAll(Loop *l) {
+    int fd;
+
+    while ((fd = accept(l->listenfd, NULL, NULL)) >= 0) {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        if (spawn(l, serveConn, (void *)(long)fd) < 0)
+            close(fd);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+            && errno != ECONNABORTED)
+        perror("accept");
+}
+
+static void takeRemote(Loop *l) {
+    unsigned long count;
+    Coro *co, *next;
+
+    if (read(l->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("eventfd read");
+
+    pthread_mutex_lock(&l->mutex);
+    co = l->remote;
+    l->remote = NULL;
+    pthread_mutex_unlock(&l->mutex);
+
+    for (; co; co = next) {
+        next = co->next;
+        makeReady(l, co);
+    }
+}
+
+/*
+ * stopAccepting - take the listener out of the loop for good, the
+ *     coroutines it has go on.
+ */
+
+static void stopAccepting(Loop *l, int stopfd) {
+    epoll_ctl(l->epfd, EPOLL_CTL_DEL, l->listenfd, NULL);
+    epoll_ctl(l->epfd, EPOLL_CTL_DEL, stopfd, NULL);
+    l->listenfd = -1;
+}
+
+/*
+ * epollLoop - wait for the listener and the coroutines' sockets with
+ *     epoll. Never returns.
+ */
+
+static void epollLoop(Loop *l, int stopfd) {
+    struct epoll_event ev, events[CORO_EVENTS];
+    Coro *co;
+    int i, n;
+
+    if ((l->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+        unix_error("coroLoop error");
+
+    /* the listener is level triggered, it has no coroutine */
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->listenfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.data.ptr = l;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, l->wakefd, &ev) < 0)
+        unix_error("epoll_ctl error");
+    ev.data.ptr = &l->listenfd;
+    if (stopfd >= 0 && epoll_ctl(l->epfd, EPOLL_CTL_ADD, stopfd, &ev) < 0)
+        unix_error("epoll_ctl error");
+
+    for (; ;) {
+        while ((co = l->readyHead) != NULL) {
+            if ((l->readyHead = co->next) == NULL)
+                l->readyTail = NULL;
+            resume(l, co);
+        }
+
+        if ((n = epoll_wait(l->epfd, events, CORO_EVENTS, -1)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                if (l->listenfd >= 0)
+                    acceptAll(l);
+            }
+            else if (events[i].data.ptr == l)
+                takeRemote(l);
+            else if (events[i].data.ptr == &l->listenfd)
+                stopAccepting(l, stopfd);
+            else
+                makeReady(l, (Coro *)events[i].data.ptr);
+        }
+    }
+}
+
+static void ringAccept(Loop *l, int multishot) {
+    struct io_uring_sqe *sqe = uringSqe(l->ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->listenfd;
+    sqe->ioprio = multishot ? IORING_ACCEPT_MULTISHOT : 0;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = RING_ACCEPT;
+}
+
+static void ringPoll(Loop *l, int fd, unsigned long data) {
+    struct io_uring_sqe *sqe = uringSqe(l->ring);
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = data;
+}
+
+/*
+ * ringLoop - run the loop on an io_uring instead: the listener has a
+ *     multishot accept, and every operation of a coroutine is queued on
+ *     the ring with the coroutine as its user_data, so one io_uring_enter
+ *     submits a whole round of them and waits for the next completions.
+ *     Returns only if the ring can not be set up.
+ */
+
+static void ringLoop(Loop *l, int stopfd) {
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned long data;
+    int res, more, multishot = 1;
+    Coro *co;
+
+    l->ring = (Uring *)Malloc(sizeof(Uring));
+    if (uringInit(l->ring, CORO_RING_ENTRIES) < 0) {
+        Free(l->ring);
+        l->ring = NULL;
+        return;
+    }
+
+    ringAccept(l, multishot);
+    ringPoll(l, l->wakefd, RING_WAKE);
+    if (stopfd >= 0)
+        ringPoll(l, stopfd, RING_STOP);
+
+    for (; ;) {
+        while ((co = l->readyHead) != NULL) {
+            if ((l->readyHead = co->next) == NULL)
+                l->readyTail = NULL;
+            resume(l, co);
+        }
+
+        /* EBUSY: the completion queue overflowed, it is drained below */
+        if (uringSubmit(l->ring, 1) < 0 && errno != EINTR && errno != EBUSY)
+            unix_error("io_uring_enter error");
+
+        while ((cqe = uringCqe(l->ring)) != NULL) {
+            data = cqe->user_data;
+            res = cqe->res;
+            more = cqe->flags & IORING_CQE_F_MORE;
+            uringCqeSeen(l->ring);
+
+            switch (data) {
+            case RING_ACCEPT:
+                /* what was accepted before a stop is served all the same */
+                if (res >= 0 && spawn(l, serveConn, (void *)(long)res) < 0)
+                    close(res);
+                if (res == -EINVAL && multishot) {
+                    /* no multishot accept in this kernel, one at a time */
+                    multishot = 0;
+                    res = 0;
+                }
+                else if (res < 0 && res != -EAGAIN && res != -EINTR
+                        && res != -ECONNABORTED && res != -ECANCELED)
+                    fprintf(stderr, "accept: %s\n", strerror(-res));
+                if (!more && l->listenfd >= 0)
+                    ringAccept(l, multishot);
+                break;
+            case RING_WAKE:
+                takeRemote(l);
+                ringPoll(l, l->wakefd, RING_WAKE);
+                break;
+            case RING_STOP:
+                l->listenfd = -1;
+                sqe = uringSqe(l->ring);
+                sqe->opcode = IORING_OP_ASYNC_CANCEL;
+                sqe->addr = RING_ACCEPT;
+                sqe->user_data = RING_CANCEL;
+                break;
+            case RING_CANCEL:
+                break;
+            default:
+                co = (Coro *)data;
+                co->res = res;
+                makeReady(l, co);
+            }
+        }
+    }
+}
+
+/*
+ * coroLoop - serve the connections of listenfd in coroutines, each runs
+ *     serve(fd) which must close fd. Once stopfd (if not -1) turns
+ *     readable no more connections are accepted. io is IO_URING to run
+ *     the loop and the socket I/O of its coroutines on io_uring, where
+ *     the kernel has it, or IO_EPOLL. Never returns.
+ */
+
+void coroLoop(int listenfd, int stopfd, int io, void (*serve)(int)) {
+    Loop *l;
+
+    pthread_once(&dumpOnce, registerDump);
+
+    l = (Loop *)Calloc(1, sizeof(Loop));
+    l->listenfd = listenfd;
+    l->serve = serve;
+    pthread_mutex_init(&l->mutex, NULL);
+    if ((l->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        unix_error("coroLoop error");
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    myLoop = l;
+
+    if (io == IO_URING)
+        ringLoop(l, stopfd);
+    epollLoop(l, stopfd);
+}
+
+/*
+ * coroSpawn - run fn(arg) in a new coroutine on the loop of the running
+ *     one, once that yields. Returns -1 if it can not be started.
+ */
+
+int coroSpawn(void (*fn)(void *), void *arg) {
+    return spawn(current->loop, fn, arg);
+}
+
+/*
+ * coroSelf - the coroutine running in this thread, NULL in a worker.
+ */
+
+Coro *coroSelf() {
+    return current;
+}
+
+/*
+ * coroSetLocal, coroLocal - one pointer of request state per coroutine,
+ *     what a worker keeps in a thread local variable.
+ */
+
+void coroSetLocal(void *p) {
+    if (current)
+        current->local = p;
+}
+
+void *coroLocal() {
+    return current ? current->local : NULL;
+}
+
+/*
+ * ringSqe, ringWait - queue an operation of the running coroutine on the
+ *     ring of its loop, then yield until it completes. The result is that
+ *     of the system call, a negative errno on failure.
+ */
+
+static struct io_uring_sqe *ringSqe(int opcode, int fd) {
+    struct io_uring_sqe *sqe = uringSqe(current->loop->ring);
+
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (unsigned long)current;
+    return sqe;
+}
+
+static int ringWait() {
+    yield();
+    return current->res;
+}
+
+static int onRing() {
+    return current != NULL && current->loop->ring != NULL;
+}
+
+/*
+ * coroWait - yield until fd has one of events (POLLIN, POLLOUT, which
+ *     epoll shares), an error or a hang up. Each wait arms a one shot
+ *     registration, or a poll on the ring, so an fd never wakes a
+ *     coroutine which is not waiting for it. Returns -1 if fd can not be
+ *     watched.
+ */
+
+int coroWait(int fd, unsigned int events) {
+    Coro *co = current;
+    struct epoll_event ev;
+    int op;
+
+    if (co->loop->ring != NULL) {
+        ringSqe(IORING_OP_POLL_ADD, fd)->poll32_events = events;
+        return ringWait() < 0 ? -1 : 0;
+    }
+
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = co;
+    op = (fd == co->watched[0] || fd == co->watched[1])
+        ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(co->loop->epfd, op, fd, &ev) < 0) {
+        /* a closed fd left the instance, a handed over one stays */
+        op = op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+        if (epoll_ctl(co->loop->epfd, op, fd, &ev) < 0)
+            return -1;
+    }
+    if (op == EPOLL_CTL_ADD) {
+        co->watched[1] = co->watched[0];
+        co->watched[0] = fd;
+    }
+    yield();
+    return 0;
+}
+
+/*
+ * coroPark - yield until coroUnpark. The caller must not hold a lock.
+ */
+
+void coroPark() {
+    yield();
+}
+
+/*
+ * coroUnpark - make a parked coroutine runnable, from any thread. The
+ *     running coroutine is not parked, unparking it does nothing.
+ */
+
+void coroUnpark(Coro *co) {
+    Loop *l = co->loop;
+    unsigned long one = 1;
+
+    if (co == current)
+        return;
+    if (l == myLoop) {
+        makeReady(l, co);
+        return;
+    }
+    pthread_mutex_lock(&l->mutex);
+    co->next = l->remote;
+    l->remote = co;
+    pthread_mutex_unlock(&l->mutex);
+    if (write(l->wakefd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+/*
+ * coroRead - read like read(2), waiting in a coroutine instead of
+ *     blocking. On the ring it is a recv, the data lands in buf straight
+ *     away without a readiness round trip first.
+ */
+
+ssize_t coroRead(int fd, void *buf, size_t n) {
+    struct io_uring_sqe *sqe;
+    ssize_t rc;
+
+    while (onRing()) {
+        sqe = ringSqe(IORING_OP_RECV, fd);
+        sqe->addr = (unsigned long)buf;
+        sqe->len = n > INT_MAX ? INT_MAX : n;
+        if ((rc = ringWait()) >= 0)
+            return rc;
+        if (rc != -EINTR && rc != -EAGAIN) {
+            errno = -rc;
+            return -1;
+        }
+    }
+    for (; ;) {
+        if ((rc = read(fd, buf, n)) >= 0)
+            return rc;
+        if (errno == EINTR)
+            continue;
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || current == NULL
+                || coroWait(fd, POLLIN) < 0)
+            return -1;
+    }
+}
+
+/*
+ * coroWriten - write all n bytes like rio_writen.
+ */
+
+ssize_t coroWriten(int fd, void *usrbuf, size_t n) {
+    struct io_uring_sqe *sqe;
+    size_t nleft = n;
+    ssize_t nwritten;
+    char *bufp = usrbuf;
+
+    while (nleft > 0 && onRing()) {
+        sqe = ringSqe(IORING_OP_SEND, fd);
+        sqe->addr = (unsigned long)bufp;
+        sqe->len = nleft > INT_MAX ? INT_MAX : nleft;
+        sqe->msg_flags = MSG_NOSIGNAL;
+        if ((nwritten = ringWait()) <= 0) {
+            if (nwritten == -EINTR || nwritten == -EAGAIN)
+                continue;
+            errno = nwritten < 0 ? -nwritten : EPIPE;
+            return -1;
+        }
+        nleft -= nwritten;
+        bufp += nwritten;
+    }
+    while (nleft > 0) {
+        if ((nwritten = write(fd, bufp, nleft)) <= 0) {
+            if (nwritten < 0 && errno == EINTR)
+                continue;
+            if (nwritten < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)
+                    && current != NULL && coroWait(fd, POLLOUT) == 0)
+                continue;
+            return -1;
+        }
+        nleft -= nwritten;
+        bufp += nwritten;
+    }
+    return n;
+}
+
+/*
+ * coroConnect - connect a non-blocking socket, waiting in the coroutine
+ *     until the connection is up or failed. Returns 0 or -1 with errno.
+ */
+
+int coroConnect(int fd, struct sockaddr *addr, socklen_t len) {
+    struct io_uring_sqe *sqe;
+    socklen_t errlen = sizeof(int);
+    int rc;
+
+    if (onRing()) {
+        sqe = ringSqe(IORING_OP_CONNECT, fd);
+        sqe->addr = (unsigned long)addr;
+        sqe->off = len;
+        if ((rc = ringWait()) < 0) {
+            errno = -rc;
+            return -1;
+        }
+        return 0;
+    }
+    if (connect(fd, addr, len) == 0)
+        return 0;
+    if (errno != EINPROGRESS || current == NULL || coroWait(fd, POLLOUT) < 0
+            || getsockopt(fd, SOL_SOCKET, SO_ERROR, &rc, &errlen) < 0)
+        return -1;
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * rioRead - the buffered read under coroReadnb and coroReadlineb, as in
+ *     csapp but through coroRead.
+ */
+
+static ssize_t rioRead(rio_t *rp, char *usrbuf, size_t n) {
+    int cnt;
+
+    while (rp->rio_cnt <= 0) {
+        rp->rio_cnt = coroRead(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf));
+        if (rp->rio_cnt < 0)
+            return -1;
+        else if (rp->rio_cnt == 0)
+            return 0;
+        else
+            rp->rio_bufptr = rp->rio_buf;
+    }
+
+    cnt = n < (size_t)rp->rio_cnt ? (int)n : rp->rio_cnt;
+    memcpy(usrbuf, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    return cnt;
+}
+
+ssize_t coroReadnb(rio_t *rp, void *usrbuf, size_t n) {
+    size_t nleft = n;
+    ssize_t nread;
+    char *bufp = usrbuf;
+
+    while (nleft > 0) {
+        if ((nread = rioRead(rp, bufp, nleft)) < 0)
+            return -1;
+        else if (nread == 0)
+            break;
+        nleft -= nread;
+        bufp += nread;
+    }
+    return n - nleft;
+}
+
+ssize_t coroReadlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
+    size_t n;
+    int rc;
+    char c, *bufp = usrbuf;
+
+    for (n = 1; n < maxlen; n++) {
+        if ((rc = rioRead(rp, &c, 1)) == 1) {
+            *bufp++ = c;
+            if (c == '\n') {
+                n++;
+                break;
+            }
+        }
+        else if (rc == 0) {
+            if (n == 1)
+                return 0;
+            break;
+        }
+        else
+            return -1;
+    }
+    *bufp = '\0';
+    return n - 1;
+}
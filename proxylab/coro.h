@@ -0,0 +1,66 @@
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include "csapp.h"
+
+/*
+ * Coroutine loop is defined as followed:
+ *     Instead of handing connections to worker threads, a listener may
+ *     run one event loop thread which serves every connection it accepts
+ *     as a coroutine. A coroutine runs the same straight line request
+ *     code as a worker on a small stack of its own. Where a worker would
+ *     block, the coroutine registers the socket with the epoll instance
+ *     of its loop and switches back to the loop, which resumes it once
+ *     the socket is ready.
+ *
+ *     All socket I/O of a request goes through coroRead, coroWriten,
+ *     coroConnect and the rio style readers below. Called outside of a
+ *     coroutine they are plain blocking calls, so workers use them as
+ *     well. Inside one the sockets are non-blocking and every EAGAIN
+ *     becomes a wait.
+ *
+ *     With -I uring the loop runs on an io_uring instead of epoll: the
+ *     listener has a multishot accept, and a coroutine queues its recv,
+ *     send, connect or poll on the ring and yields until the completion
+ *     comes back. Everything the coroutines queued in one round goes to
+ *     the kernel in a single io_uring_enter, which also waits for the
+ *     next completions. A recv is single shot, into the buffer of the
+ *     caller: a multishot one would need a provided buffer ring to copy
+ *     out of, and would go on reading while the coroutine is not.
+ *
+ *     A coroutine may also park itself until another thread, or another
+ *     coroutine, unparks it, which is how it waits for an upstream slot.
+ *     It may start more coroutines on its loop with coroSpawn, one per
+ *     stream of an HTTP/2 connection (h2.h).
+ *     Deadlines still come from the timer wheel: shutting a socket down
+ *     makes it ready, and the coroutine sees the error.
+ *
+ *     Every coroutine has its own request arena, swapped in whenever it
+ *     is resumed. Finished coroutines are kept, up to CORO_POOL per
+ *     loop, with their stack and arena for the next one.
+ */
+
+#define CORO_STACK_SIZE (256 * 1024)    /* reserved, touched as needed */
+#define CORO_ARENA_SIZE (16 * 1024)
+#define CORO_POOL 256
+#define CORO_EVENTS 256
+#define CORO_RING_ENTRIES 1024
+
+typedef struct _coro Coro;
+
+void coroLoop(int, int, int, void (*)(int));
+int coroSpawn(void (*)(void *), void*);
+Coro *coroSelf();
+void coroSetLocal(void*);
+void *coroLocal();
+int coroWait(int, unsigned int);
+void coroPark();
+void coroUnpark(Coro*);
+
+ssize_t coroRead(int, void*, size_t);
+ssize_t coroWriten(int, void*, size_t);
+int coroConnect(int, struct sockaddr*, socklen_t);
+ssize_t coroReadnb(rio_t*, void*, size_t);
+ssize_t coroReadlineb(rio_t*, void*, size_t);
+
+#endif /* __CORO_H__ */
@@ -0,0 +1,264 @@
+/*
+ * fuzz-parse - fuzz target over the parsers of parse.c
+ *
+ *     LLVMFuzzerTestOneInput runs one input through parseHostPort,
+ *     parseUri, parseHeader, parseStatusLine and parseLength, and checks
+ *     what they promise in parse.h: a field which does not fit is an
+ *     error, a port is 1 to 65535, a path starts with "/", a value points
+ *     into its line. The input and every output buffer are heap blocks of
+ *     their exact size, so AddressSanitizer catches a byte read or written
+ *     past them.
+ *
+ *     Built with clang it is a libFuzzer target. With FUZZ_DRIVER, for
+ *     gcc which has no libFuzzer, it gets a main of its own:
+ *
+ *         ./fuzz-parse file...     run each file once, e.g. a crash
+ *         ./fuzz-parse -           run stdin once, for afl-fuzz
+ *         ./fuzz-parse [-runs=n] [-seed=s]
+ *                                  mutate the seeds below n times
+ *
+ *     A failing input is written to crash-parse before the process dies.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <sanitizer/common_interface_defs.h>
+
+#include "parse.h"
+
+/* small on purpose, so inputs reach the "does not fit" paths */
+#define FUZZ_HOST_SIZE 32
+#define FUZZ_PORT_SIZE 6
+#define FUZZ_PATH_SIZE 64
+
+static const uint8_t *curData;
+static size_t curSize;
+
+static void saveInput() {
+    FILE *fp;
+
+    if ((fp = fopen("crash-parse", "wb")) == NULL)
+        return;
+    fwrite(curData, 1, curSize, fp);
+    fclose(fp);
+    fprintf(stderr, "input written to crash-parse\n");
+}
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "fuzz-parse: %s:%d: %s\n", __FILE__, __LINE__, \
+                #cond); \
+            saveInput(); \
+            abort(); \
+        } \
+    } while (0)
+
+static void checkPort(char *port) {
+    char *p;
+
+    for (p = port; *p; p++)
+        CHECK(isdigit((unsigned char)*p));
+    CHECK(p > port && strtol(port, NULL, 10) >= 1
+        && strtol(port, NULL, 10) <= 65535);
+}
+
+static void checkHost(char *host) {
+    char *p;
+
+    CHECK(strlen(host) < FUZZ_HOST_SIZE);
+    for (p = host; *p; p++)
+        CHECK((unsigned char)*p > ' ' && *p != 0x7f);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    char *raw, *line, *host, *port, *path, *value;
+    long n;
+    int rc;
+
+    curData = data;
+    curSize = size;
+    raw = (char *)malloc(size ? size : 1);
+    line = (char *)malloc(size + 1);
+    host = (char *)malloc(FUZZ_HOST_SIZE);
+    port = (char *)malloc(FUZZ_PORT_SIZE);
+    path = (char *)malloc(FUZZ_PATH_SIZE);
+    memcpy(raw, data, size);
+    memcpy(line, data, size);
+    line[size] = '\0';
+
+    /* raw has no null char, only len bytes may be looked at */
+    if (parseHostPort(raw, size, host, FUZZ_HOST_SIZE, port,
+            FUZZ_PORT_SIZE) == 0) {
+        CHECK(host[0] != '\0');
+        checkHost(host);
+        checkPort(port);
+    }
+
+    if ((rc = parseUri(line, host, FUZZ_HOST_SIZE, port, FUZZ_PORT_SIZE,
+            path, FUZZ_PATH_SIZE)) == 0) {
+        CHECK(line[0] == '/' ? host[0] == '\0' : host[0] != '\0');
+        checkHost(host);
+        checkPort(port);
+        CHECK(path[0] == '/' && strlen(path) < FUZZ_PATH_SIZE);
+    }
+    else
+        CHECK(rc == -1);
+
+    if ((value = parseHeader(line, "Content-Length")) != NULL) {
+        CHECK(value > line && value <= line + strlen(line));
+        CHECK(!strncasecmp(line, "Content-Length:", 15));
+        CHECK(*value != ' ' && *value != '\t');
+        if ((n = parseLength(value)) >= 0)
+            CHECK(isdigit((unsigned char)*value));
+    }
+
+    rc = parseStatusLine(line);
+    CHECK(rc == -1 || (rc >= 0 && rc <= 999
+        && !strncasecmp(line, "HTTP/", 5)));
+
+    n = parseLength(line);
+    CHECK(n >= -1);
+    CHECK(n == -1 || isdigit((unsigned char)line[0]));
+
+    free(raw);
+    free(line);
+    free(host);
+    free(port);
+    free(path);
+    return 0;
+}
+
+#ifdef FUZZ_DRIVER
+
+#define FUZZ_MAX_INPUT 512
+#define FUZZ_RUNS 100000
+
+static const char *seeds[] = {
+    "example.com",
+    "example.com:8080",
+    "[::1]:443",
+    "[fe80::1%eth0]",
+    "http://example.com/index.html",
+    "HTTP://Example.COM:81?q=1",
+    "/path/only?x=y#frag",
+    "http://[::1]:65535/a",
+    "Content-Length: 1024\r\n",
+    "content-length:\t42 \r\n",
+    "Content-Length: 99999999999999999999\r\n",
+    "HTTP/1.1 200 OK\r\n",
+    "HTTP/1.0 404\r\n",
+    "http/1.1   206 Partial Content\r\n",
+    "123456789",
+};
+
+/* pieces the parsers branch on, spliced in by mutate */
+static const char *tokens[] = {
+    ":", " ", "\t", "\r\n", "/", "?", "[", "]", "http://", "HTTP/",
+    "Content-Length:", "0", "65535", "65536", "99999999999999999999",
+};
+
+#define NELEMS(a) (sizeof(a) / sizeof((a)[0]))
+
+static size_t mutate(uint8_t *buf, size_t len) {
+    const char *tok;
+    size_t pos, k, tlen;
+    int i, rounds = 1 + rand() % 8;
+
+    for (i = 0; i < rounds; i++) {
+        pos = len ? rand() % (len + 1) : 0;
+        switch (rand() % 5) {
+        case 0:
+            if (pos < len)
+                buf[pos] ^= 1 << (rand() % 8);
+            break;
+        case 1:
+            if (pos < len)
+                buf[pos] = rand();
+            break;
+        case 2:
+            /* delete up to 8 bytes */
+            k = rand() % 9;
+            if (pos + k > len)
+                k = len - pos;
+            memmove(buf + pos, buf + pos + k, len - pos - k);
+            len -= k;
+            break;
+        case 3:
+            tok = tokens[rand() % NELEMS(tokens)];
+            tlen = strlen(tok);
+            if (len + tlen > FUZZ_MAX_INPUT)
+                break;
+            memmove(buf + pos + tlen, buf + pos, len - pos);
+            memcpy(buf + pos, tok, tlen);
+            len += tlen;
+            break;
+        default:
+            /* repeat a run of the input, to get past the size limits */
+            if (pos >= len)
+                break;
+            k = 1 + rand() % (len - pos);
+            if (len + k > FUZZ_MAX_INPUT)
+                break;
+            memmove(buf + pos + k, buf + pos, len - pos);
+            len += k;
+            break;
+        }
+    }
+    return len;
+}
+
+static int runFile(char *name) {
+    uint8_t buf[64 * 1024];
+    size_t len;
+    FILE *fp;
+
+    if ((fp = strcmp(name, "-") ? fopen(name, "rb") : stdin) == NULL) {
+        perror(name);
+        return -1;
+    }
+    len = fread(buf, 1, sizeof(buf), fp);
+    if (fp != stdin)
+        fclose(fp);
+    LLVMFuzzerTestOneInput(buf, len);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    uint8_t buf[FUZZ_MAX_INPUT];
+    unsigned long runs = FUZZ_RUNS, i;
+    unsigned seed = 0;
+    size_t len;
+    int files = 0, a;
+
+    __sanitizer_set_death_callback(saveInput);
+    for (a = 1; a < argc; a++) {
+        if (!strncmp(argv[a], "-runs=", 6))
+            runs = strtoul(argv[a] + 6, NULL, 10);
+        else if (!strncmp(argv[a], "-seed=", 6))
+            seed = strtoul(argv[a] + 6, NULL, 10);
+        else {
+            if (runFile(argv[a]) < 0)
+                return 1;
+            files++;
+        }
+    }
+    if (files > 0)
+        return 0;
+
+    srand(seed);
+    for (i = 0; i < NELEMS(seeds); i++)
+        LLVMFuzzerTestOneInput((const uint8_t *)seeds[i], strlen(seeds[i]));
+    for (i = 0; i < runs; i++) {
+        len = strlen(seeds[i % NELEMS(seeds)]);
+        memcpy(buf, seeds[i % NELEMS(seeds)], len);
+        len = mutate(buf, len);
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    printf("fuzz-parse: %lu inputs, seed %u, no failures\n", runs, seed);
+    return 0;
+}
+
+#endif /* FUZZ_DRIVER */
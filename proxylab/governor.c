@@ -0,0 +1,140 @@
+#include "csapp.h"
+#include "stats.h"
+#include "arena.h"
+#include "coro.h"
+#include "governor.h"
+
+typedef struct _governorWaiter {
+    pthread_cond_t cond;
+    Coro *co;               /* parked instead of waiting on cond */
+    int granted;
+    struct _governorWaiter *next;
+} GovernorWaiter;
+
+static pthread_mutex_t govMutex = PTHREAD_MUTEX_INITIALIZER;
+static long limit = DEFAULT_INFLIGHT_LIMIT;
+static long inflight = 0;
+static long peak = 0;
+static int nwait = 0;
+static GovernorWaiter *head = NULL, *tail = NULL;
+
+/*
+ * wakeWaiters - admit waiting misses while the total is below the limit,
+ *     the oldest first. Must hold govMutex.
+ */
+
+static void wakeWaiters() {
+    GovernorWaiter *w;
+
+    while ((w = head) != NULL && inflight < limit) {
+        if ((head = w->next) == NULL)
+            tail = NULL;
+        nwait--;
+        w->granted = 1;
+        if (w->co)
+            coroUnpark(w->co);
+        else
+            pthread_cond_signal(&w->cond);
+    }
+}
+
+/*
+ * releaseBytes - give back what governorHold reserved, the arena calls
+ *     it at the reset.
+ */
+
+static void releaseBytes(void *p) {
+    pthread_mutex_lock(&govMutex);
+    inflight -= (long)(size_t)p;
+    wakeWaiters();
+    pthread_mutex_unlock(&govMutex);
+}
+
+static void dumpGovernor(FILE *fp) {
+    pthread_mutex_lock(&govMutex);
+    fprintf(fp, "# TYPE proxy_inflight_bytes gauge\n");
+    fprintf(fp, "proxy_inflight_bytes %ld\n", inflight);
+    fprintf(fp, "# TYPE proxy_inflight_peak_bytes gauge\n");
+    fprintf(fp, "proxy_inflight_peak_bytes %ld\n", peak);
+    fprintf(fp, "# TYPE proxy_inflight_limit_bytes gauge\n");
+    fprintf(fp, "proxy_inflight_limit_bytes %ld\n", limit);
+    fprintf(fp, "# TYPE proxy_governor_waiting gauge\n");
+    fprintf(fp, "proxy_governor_waiting %d\n", nwait);
+    pthread_mutex_unlock(&govMutex);
+}
+
+/*
+ * governorInit - keep the bytes in flight below max, 0 does not.
+ */
+
+void governorInit(long max) {
+    limit = max;
+    statsRegisterDump(dumpGovernor);
+}
+
+/*
+ * governorAdmit - let a new miss go on, waiting while the total is over
+ *     the limit. Returns -1 if it is shed.
+ */
+
+int governorAdmit() {
+    GovernorWaiter w;
+
+    pthread_mutex_lock(&govMutex);
+    if (limit == 0 || (inflight < limit && head == NULL)) {
+        pthread_mutex_unlock(&govMutex);
+        return 0;
+    }
+    if (nwait >= GOVERNOR_MAX_WAITERS) {
+        pthread_mutex_unlock(&govMutex);
+        statsInc(STAT_GOVERNOR_SHED);
+        return -1;
+    }
+
+    statsInc(STAT_GOVERNOR_WAITS);
+    if ((w.co = coroSelf()) == NULL)
+        pthread_cond_init(&w.cond, NULL);
+    w.granted = 0;
+    w.next = NULL;
+    if (tail)
+        tail->next = &w;
+    else
+        head = &w;
+    tail = &w;
+    nwait++;
+
+    while (!w.granted) {
+        if (w.co) {
+            pthread_mutex_unlock(&govMutex);
+            coroPark();
+            pthread_mutex_lock(&govMutex);
+        }
+        else
+            pthread_cond_wait(&w.cond, &govMutex);
+    }
+    pthread_mutex_unlock(&govMutex);
+    if (w.co == NULL)
+        pthread_cond_destroy(&w.cond);
+    return 0;
+}
+
+/*
+ * governorHold - reserve n bytes for the request until its arena is
+ *     reset. Unless force is set, nothing is reserved and -1 returned if
+ *     n would take the total over the limit.
+ */
+
+int governorHold(long n, int force) {
+    pthread_mutex_lock(&govMutex);
+    if (!force && limit > 0 && inflight + n > limit) {
+        pthread_mutex_unlock(&govMutex);
+        return -1;
+    }
+    inflight += n;
+    if (inflight > peak)
+        peak = inflight;
+    pthread_mutex_unlock(&govMutex);
+
+    arenaDefer(releaseBytes, (void *)(size_t)n);
+    return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef __GOVERNOR_H__
+#define __GOVERNOR_H__
+
+/*
+ * Memory governor is defined as followed:
+ *     Every byte a request holds of a body on its way from origin to the
+ *     client counts as in flight, from when it is reserved until the
+ *     request arena is reset. Together they must stay below a limit.
+ *
+ *     A body the request buffers whole (to cache it, or to let go of the
+ *     origin before a slow client is written) is reserved up front and
+ *     only buffered if the reservation fits. Otherwise it is relayed one
+ *     chunk at a time, reading from origin pauses while the client is
+ *     written, and it is not cached. The relay chunk itself is always
+ *     granted, a request can not go on without it.
+ *
+ *     A new miss is admitted while the total is below the limit. Above
+ *     it, the miss waits in a FIFO queue until releases bring the total
+ *     back down, or is shed with a 503 if GOVERNOR_MAX_WAITERS are
+ *     waiting already. A coroutine parks while it waits. A limit of 0
+ *     turns the governor off.
+ */
+
+#define DEFAULT_INFLIGHT_LIMIT (256L << 20)
+#define GOVERNOR_MAX_WAITERS 256
+
+void governorInit(long);
+int governorAdmit();
+int governorHold(long, int);
+
+#endif /* __GOVERNOR_H__ */
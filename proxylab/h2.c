@@ -0,0 +1,949 @@
+#include <stddef.h>
+#include <netinet/tcp.h>
+
+#include "csapp.h"
+#include "stats.h"
+#include "timer.h"
+#include "coro.h"
+#include "hpack.h"
+#include "h2.h"
+
+/* Frame types */
+enum {
+    FRAME_DATA,
+    FRAME_HEADERS,
+    FRAME_PRIORITY,
+    FRAME_RST_STREAM,
+    FRAME_SETTINGS,
+    FRAME_PUSH_PROMISE,
+    FRAME_PING,
+    FRAME_GOAWAY,
+    FRAME_WINDOW_UPDATE,
+    FRAME_CONTINUATION
+};
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+/* Error codes */
+enum {
+    ERR_NONE,
+    ERR_PROTOCOL,
+    ERR_INTERNAL,
+    ERR_FLOW_CONTROL,
+    ERR_SETTINGS_TIMEOUT,
+    ERR_STREAM_CLOSED,
+    ERR_FRAME_SIZE,
+    ERR_REFUSED_STREAM,
+    ERR_CANCEL,
+    ERR_COMPRESSION,
+    ERR_CONNECT,
+    ERR_ENHANCE_YOUR_CALM
+};
+
+/* Settings */
+enum {
+    SETTINGS_HEADER_TABLE_SIZE = 1,
+    SETTINGS_ENABLE_PUSH,
+    SETTINGS_MAX_CONCURRENT_STREAMS,
+    SETTINGS_INITIAL_WINDOW_SIZE,
+    SETTINGS_MAX_FRAME_SIZE
+};
+
+#define FRAME_HEADER 9
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffffL
+#define MAX_AUTHORITY 256
+#define MAX_PATH 4096
+
+/* a coroutine waiting for the writer or for window, on its stack */
+typedef struct _h2Waiter {
+    Coro *co;
+    struct _h2Waiter *next;
+} H2Waiter;
+
+typedef struct _h2Conn H2Conn;
+
+struct _h2Stream {
+    H2Conn *c;
+    unsigned int id;
+    long window;            /* what may still be sent */
+    int started;
+    int reset;              /* by the client, or given up here */
+    int headSent;
+    char *head;             /* response head collected so far */
+    int headLen;
+    unsigned long startUs;
+    struct _h2Stream *next;
+    rio_t rio;              /* holds the request */
+};
+
+struct _h2Conn {
+    int fd;
+    int wfd;                /* what frames are written to, see serveH2 */
+    rio_t *rp;
+    H2Serve serve;
+    Coro *owner;            /* the connection's coroutine, NULL in a worker */
+    int ownerWaiting;
+    int dead;
+    int goaway;
+    int open;               /* streams not done */
+    unsigned int lastId;
+    long window;
+    long initialWindow;     /* of new streams */
+    HpackTable decoder;
+    HpackTable encoder;
+    int writing;
+    H2Waiter *writers;
+    H2Waiter *windowWaiters;
+    H2Stream *streams;      /* in the order they were opened */
+    H2Stream *lastStream;
+    Timer idle;
+    unsigned char *block;   /* a header block to be continued */
+    int blockLen;
+    unsigned int blockId;
+    int outLen;
+    unsigned char in[H2_FRAME_SIZE];
+    unsigned char out[H2_OUT_SIZE];
+};
+
+/* the request of a stream, rebuilt from the fields of its header block */
+typedef struct _h2Request {
+    char method[16];
+    char scheme[16];
+    char authority[MAX_AUTHORITY];
+    char host[MAX_AUTHORITY];
+    char path[MAX_PATH];
+    char fields[RIO_BUFSIZE];
+    int len;
+    int bad;
+    int tooLarge;
+} H2Request;
+
+/* connection specific, they have no meaning in HTTP/2 */
+static const char *hopByHop[] = {
+    "connection", "proxy-connection", "keep-alive", "transfer-encoding",
+    "upgrade", "te", NULL
+};
+
+static int readFrame(H2Conn*);
+
+static unsigned int get31(unsigned char *p) {
+    return (unsigned int)(p[0] & 0x7f) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static void put32(unsigned char *p, unsigned int v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static int isHopByHop(char *name, int len) {
+    int i;
+
+    for (i = 0; hopByHop[i]; i++)
+        if ((int)strlen(hopByHop[i]) == len
+                && !strncasecmp(hopByHop[i], name, len))
+            return 1;
+    return 0;
+}
+
+/*
+ * waitOn, wakeAll - park the running coroutine on a list, make all on a
+ *     list runnable again. Only a coroutine ever waits.
+ */
+
+static void waitOn(H2Waiter **list) {
+    H2Waiter w;
+
+    w.co = coroSelf();
+    w.next = *list;
+    *list = &w;
+    coroPark();
+}
+
+static void wakeAll(H2Waiter **list) {
+    H2Waiter *w, *next;
+
+    for (w = *list, *list = NULL; w; w = next) {
+        next = w->next;
+        coroUnpark(w->co);
+    }
+}
+
+/*
+ * lockWriter, unlockWriter - one stream at a time adds frames to the
+ *     output buffer and writes it. The header blocks must also be
+ *     encoded in the order they are sent. A worker never waits here.
+ */
+
+static void lockWriter(H2Conn *c) {
+    while (c->writing)
+        waitOn(&c->writers);
+    c->writing = 1;
+}
+
+static void unlockWriter(H2Conn *c) {
+    c->writing = 0;
+    wakeAll(&c->writers);
+}
+
+/*
+ * flush - write the output buffer. On failure the socket is shut down,
+ *     which ends the reader as well.
+ */
+
+static void flush(H2Conn *c) {
+    if (c->outLen > 0 && !c->dead) {
+        if (coroWriten(c->wfd, c->out, c->outLen) < 0) {
+            c->dead = 1;
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        else
+            timerTouch(&c->idle);
+    }
+    c->outLen = 0;
+}
+
+static void appendFrame(H2Conn *c, int type, int flags, unsigned int id,
+    void *payload, int len) {
+
+    unsigned char *p;
+
+    if (c->outLen + FRAME_HEADER + len > H2_OUT_SIZE)
+        flush(c);
+    p = c->out + c->outLen;
+    p[0] = len >> 16;
+    p[1] = len >> 8;
+    p[2] = len;
+    p[3] = type;
+    p[4] = flags;
+    put32(p + 5, id);
+    if (len > 0)
+        memcpy(p + FRAME_HEADER, payload, len);
+    c->outLen += FRAME_HEADER + len;
+}
+
+/*
+ * sendFrame - send a frame of its own, everything but HEADERS and DATA.
+ */
+
+static void sendFrame(H2Conn *c, int type, int flags, unsigned int id,
+    void *payload, int len) {
+
+    lockWriter(c);
+    appendFrame(c, type, flags, id, payload, len);
+    flush(c);
+    unlockWriter(c);
+}
+
+static void sendRst(H2Conn *c, unsigned int id, int code) {
+    unsigned char payload[4];
+
+    put32(payload, code);
+    sendFrame(c, FRAME_RST_STREAM, 0, id, payload, 4);
+}
+
+static void resetStream(H2Stream *st, int code) {
+    st->reset = 1;
+    sendRst(st->c, st->id, code);
+    wakeAll(&st->c->windowWaiters);
+}
+
+/*
+ * connError - end the connection with a GOAWAY. Returns -1 for readFrame.
+ */
+
+static int connError(H2Conn *c, int code) {
+    unsigned char payload[8];
+
+    put32(payload, c->lastId);
+    put32(payload + 4, code);
+    sendFrame(c, FRAME_GOAWAY, 0, 0, payload, 8);
+    c->dead = 1;
+    return -1;
+}
+
+/*
+ * sendStatus - answer a stream which is not served with just a status.
+ */
+
+static void sendStatus(H2Conn *c, unsigned int id, int status) {
+    unsigned char block[16];
+    char code[4];
+    int n;
+
+    snprintf(code, sizeof(code), "%d", status);
+    lockWriter(c);
+    n = hpackBegin(&c->encoder, block, sizeof(block));
+    n += hpackEncode(&c->encoder, block + n, sizeof(block) - n, ":status", 7,
+        code, 3);
+    appendFrame(c, FRAME_HEADERS, FLAG_END_HEADERS | FLAG_END_STREAM, id,
+        block, n);
+    flush(c);
+    unlockWriter(c);
+}
+
+/*
+ * sendHead - turn an HTTP/1.x response head into a HEADERS frame, plus
+ *     CONTINUATIONs if it takes more than one. It is only added to the
+ *     output buffer, the body or the end of the stream follows soon.
+ *     Fields which would not fit the block are dropped, so encoding can
+ *     not fail halfway and leave the client's table behind ours.
+ */
+
+static int sendHead(H2Stream *st, char *head, int len) {
+    H2Conn *c = st->c;
+    unsigned char block[H2_MAX_HEAD];
+    char *line, *next, *colon, *value, *end = head + len;
+    int i, n, room, nameLen, valueLen, status;
+
+    if (strncmp(head, "HTTP/", 5) || (line = memchr(head, ' ', len)) == NULL
+            || (status = atoi(line + 1)) < 100 || status > 999)
+        return -1;
+
+    lockWriter(c);
+    n = hpackBegin(&c->encoder, block, sizeof(block));
+    n += hpackEncode(&c->encoder, block + n, sizeof(block) - n, ":status", 7,
+        line + 1, 3);
+
+    line = (char *)memchr(head, '\n', len) + 1;
+    for (; line < end && *line != '\r' && *line != '\n'; line = next) {
+        if ((next = memchr(line, '\n', end - line)) == NULL)
+            break;
+        next++;
+        if ((colon = memchr(line, ':', next - line)) == NULL)
+            continue;
+        nameLen = colon - line;
+        for (value = colon + 1; *value == ' ' || *value == '\t'; value++)
+            ;
+        for (valueLen = next - value; valueLen > 0
+                && (value[valueLen - 1] == '\r' || value[valueLen - 1] == '\n'
+                    || value[valueLen - 1] == ' '); valueLen--)
+            ;
+        if (nameLen == 0 || isHopByHop(line, nameLen))
+            continue;
+
+        room = sizeof(block) - n;
+        if (nameLen + valueLen + 16 > room)
+            break;
+        for (i = 0; i < nameLen; i++)
+            line[i] = tolower(line[i]);
+        n += hpackEncode(&c->encoder, block + n, room, line, nameLen,
+            value, valueLen);
+    }
+
+    for (i = 0; i < n; i += H2_FRAME_SIZE)
+        appendFrame(c, i == 0 ? FRAME_HEADERS : FRAME_CONTINUATION,
+            i + H2_FRAME_SIZE >= n ? FLAG_END_HEADERS : 0, st->id, block + i,
+            n - i < H2_FRAME_SIZE ? n - i : H2_FRAME_SIZE);
+    unlockWriter(c);
+    return 0;
+}
+
+/*
+ * waitWindow - until the stream may send again. A worker reads the
+ *     frames of the connection itself meanwhile.
+ */
+
+static void waitWindow(H2Stream *st) {
+    H2Conn *c = st->c;
+
+    while (!c->dead && !st->reset && (c->window <= 0 || st->window <= 0)) {
+        if (c->owner == NULL)
+            readFrame(c);
+        else
+            waitOn(&c->windowWaiters);
+    }
+}
+
+static char *findBlankLine(char *p, int len) {
+    int i;
+
+    for (i = 0; i + 4 <= len; i++)
+        if (!memcmp(p + i, "\r\n\r\n", 4))
+            return p + i + 4;
+    return NULL;
+}
+
+/*
+ * h2Write - write to the client of a stream what would be written to a
+ *     client socket: the response head, which is collected until it is
+ *     complete, then its body. Returns n, or -1 once the stream or the
+ *     connection failed.
+ */
+
+ssize_t h2Write(H2Stream *st, void *buf, size_t n) {
+    H2Conn *c = st->c;
+    char *p = buf, *end;
+    size_t left = n;
+    int len, from, copy;
+
+    if (c->dead || st->reset)
+        return -1;
+
+    if (!st->headSent) {
+        if (st->head == NULL)
+            st->head = (char *)Malloc(H2_MAX_HEAD);
+        copy = left < (size_t)(H2_MAX_HEAD - st->headLen)
+            ? (int)left : H2_MAX_HEAD - st->headLen;
+        memcpy(st->head + st->headLen, p, copy);
+        from = st->headLen > 3 ? st->headLen - 3 : 0;
+        st->headLen += copy;
+        if ((end = findBlankLine(st->head + from, st->headLen - from))
+                == NULL) {
+            if (st->headLen < H2_MAX_HEAD)
+                return n;
+            resetStream(st, ERR_INTERNAL);
+            return -1;
+        }
+
+        /* what follows the head in buf is body */
+        copy -= st->headLen - (end - st->head);
+        p += copy;
+        left -= copy;
+        if (sendHead(st, st->head, end - st->head) < 0) {
+            resetStream(st, ERR_INTERNAL);
+            return -1;
+        }
+        st->headSent = 1;
+        Free(st->head);
+        st->head = NULL;
+        if (left == 0)
+            return n;
+    }
+
+    lockWriter(c);
+    while (left > 0 && !c->dead && !st->reset) {
+        if (c->window <= 0 || st->window <= 0) {
+            flush(c);
+            unlockWriter(c);
+            waitWindow(st);
+            lockWriter(c);
+            continue;
+        }
+        len = left < H2_FRAME_SIZE ? (int)left : H2_FRAME_SIZE;
+        if (len > c->window)
+            len = c->window;
+        if (len > st->window)
+            len = st->window;
+        appendFrame(c, FRAME_DATA, 0, st->id, p, len);
+        c->window -= len;
+        st->window -= len;
+        p += len;
+        left -= len;
+    }
+    flush(c);
+    unlockWriter(c);
+    return c->dead || st->reset ? -1 : (ssize_t)n;
+}
+
+/*
+ * endStream - the request path is done with the stream. A response
+ *     whose head never came complete is reset.
+ */
+
+static void endStream(H2Stream *st) {
+    H2Conn *c = st->c;
+    unsigned char payload[4];
+
+    if (c->dead || st->reset)
+        return;
+    lockWriter(c);
+    if (st->headSent)
+        appendFrame(c, FRAME_DATA, FLAG_END_STREAM, st->id, NULL, 0);
+    else {
+        put32(payload, ERR_INTERNAL);
+        appendFrame(c, FRAME_RST_STREAM, 0, st->id, payload, 4);
+    }
+    flush(c);
+    unlockWriter(c);
+}
+
+static H2Stream *findStream(H2Conn *c, unsigned int id) {
+    H2Stream *st;
+
+    for (st = c->streams; st; st = st->next)
+        if (st->id == id)
+            return st;
+    return NULL;
+}
+
+static void removeStream(H2Stream *st) {
+    H2Conn *c = st->c;
+    H2Stream **pp, *prev = NULL;
+
+    for (pp = &c->streams; *pp != st; pp = &(*pp)->next)
+        prev = *pp;
+    *pp = st->next;
+    if (c->lastStream == st)
+        c->lastStream = prev;
+    c->open--;
+    if (st->head)
+        Free(st->head);
+    Free(st);
+
+    if (c->open == 0 && c->ownerWaiting) {
+        c->ownerWaiting = 0;
+        coroUnpark(c->owner);
+    }
+}
+
+static void runStream(H2Stream *st) {
+    H2Conn *c = st->c;
+
+    st->started = 1;
+    if (!c->dead) {
+        c->serve(st, &st->rio, c->fd, st->startUs);
+        endStream(st);
+    }
+    removeStream(st);
+}
+
+static void streamMain(void *arg) {
+    runStream((H2Stream *)arg);
+}
+
+/*
+ * runPending - a worker serves the streams opened so far in order.
+ */
+
+static void runPending(H2Conn *c) {
+    H2Stream *st;
+
+    while (!c->dead) {
+        for (st = c->streams; st && st->started; st = st->next)
+            ;
+        if (st == NULL)
+            return;
+        runStream(st);
+    }
+}
+
+static void copyPseudo(H2Request *r, char *dst, int size, char *value,
+    int len) {
+
+    if (len >= size) {
+        r->tooLarge = 1;
+        return;
+    }
+    memcpy(dst, value, len);
+    dst[len] = '\0';
+}
+
+/*
+ * addField - take a field of a request. The request goes out as text,
+ *     so a field which could end its line early makes it bad.
+ */
+
+static void addField(void *arg, char *name, int nameLen, char *value,
+    int valueLen) {
+
+    H2Request *r = (H2Request *)arg;
+    int i;
+    char ch;
+
+    for (i = 0; i < nameLen + valueLen; i++) {
+        ch = i < nameLen ? name[i] : value[i - nameLen];
+        if (ch == '\r' || ch == '\n' || ch == '\0') {
+            r->bad = 1;
+            return;
+        }
+    }
+    if (nameLen == 0) {
+        r->bad = 1;
+        return;
+    }
+
+    if (name[0] == ':') {
+        if (nameLen == 7 && !memcmp(name, ":method", 7))
+            copyPseudo(r, r->method, sizeof(r->method), value, valueLen);
+        else if (nameLen == 7 && !memcmp(name, ":scheme", 7))
+            copyPseudo(r, r->scheme, sizeof(r->scheme), value, valueLen);
+        else if (nameLen == 10 && !memcmp(name, ":authority", 10))
+            copyPseudo(r, r->authority, sizeof(r->authority), value,
+                valueLen);
+        else if (nameLen == 5 && !memcmp(name, ":path", 5))
+            copyPseudo(r, r->path, sizeof(r->path), value, valueLen);
+        else
+            r->bad = 1;
+        return;
+    }
+    if (nameLen == 4 && !strncasecmp(name, "host", 4)) {
+        copyPseudo(r, r->host, sizeof(r->host), value, valueLen);
+        return;
+    }
+    if (isHopByHop(name, nameLen))
+        return;
+    if (r->len + nameLen + valueLen + 4 >= (int)sizeof(r->fields)) {
+        r->tooLarge = 1;
+        return;
+    }
+    r->len += sprintf(r->fields + r->len, "%.*s: %.*s\r\n", nameLen, name,
+        valueLen, value);
+}
+
+/*
+ * onHeaderBlock - a complete header block. A new stream is opened for
+ *     it, unless the request is one the proxy can not serve.
+ */
+
+static int onHeaderBlock(H2Conn *c, unsigned int id, unsigned char *block,
+    int len) {
+
+    H2Request r;
+    H2Stream *st;
+    int status = 0;
+
+    r.method[0] = r.scheme[0] = r.authority[0] = r.host[0] = r.path[0] = '\0';
+    r.len = r.bad = r.tooLarge = 0;
+    if (hpackDecode(&c->decoder, block, len, addField, &r) < 0)
+        return connError(c, ERR_COMPRESSION);
+
+    /* trailers of a request, or of one refused */
+    if (id <= c->lastId)
+        return 0;
+    c->lastId = id;
+    if (c->goaway || c->open >= H2_MAX_STREAMS) {
+        sendRst(c, id, ERR_REFUSED_STREAM);
+        return 0;
+    }
+
+    if (r.authority[0] == '\0')
+        strcpy(r.authority, r.host);
+    if (!strcmp(r.method, "CONNECT"))
+        status = 501;
+    else if (r.bad || r.method[0] == '\0' || r.path[0] != '/'
+            || r.authority[0] == '\0' || strcmp(r.scheme, "http"))
+        status = 400;
+    else if (r.tooLarge)
+        status = 431;
+    if (status) {
+        sendStatus(c, id, status);
+        return 0;
+    }
+
+    st = (H2Stream *)Malloc(sizeof(H2Stream));
+    st->rio.rio_cnt = snprintf(st->rio.rio_buf, RIO_BUFSIZE,
+        "%s http://%s%s HTTP/1.1\r\nHost: %s\r\n%.*s\r\n", r.method,
+        r.authority, r.path, r.authority, r.len, r.fields);
+    if (st->rio.rio_cnt >= RIO_BUFSIZE) {
+        Free(st);
+        sendStatus(c, id, 431);
+        return 0;
+    }
+    st->rio.rio_fd = -1;
+    st->rio.rio_bufptr = st->rio.rio_buf;
+    st->c = c;
+    st->id = id;
+    st->window = c->initialWindow;
+    st->started = st->reset = st->headSent = st->headLen = 0;
+    st->head = NULL;
+    st->startUs = statsNow();
+    st->next = NULL;
+    if (c->lastStream)
+        c->lastStream->next = st;
+    else
+        c->streams = st;
+    c->lastStream = st;
+    c->open++;
+    statsInc(STAT_H2_STREAMS);
+
+    if (c->owner != NULL && coroSpawn(streamMain, st) < 0) {
+        removeStream(st);
+        sendRst(c, id, ERR_REFUSED_STREAM);
+    }
+    return 0;
+}
+
+static int onHeaders(H2Conn *c, int flags, unsigned int id,
+    unsigned char *p, int len) {
+
+    int pad;
+
+    if (id == 0 || !(id & 1))
+        return connError(c, ERR_PROTOCOL);
+    if (flags & FLAG_PADDED) {
+        if (len < 1 || (pad = p[0]) + 1 > len)
+            return connError(c, ERR_PROTOCOL);
+        p++;
+        len -= pad + 1;
+    }
+    if (flags & FLAG_PRIORITY) {
+        if (len < 5)
+            return connError(c, ERR_PROTOCOL);
+        p += 5;
+        len -= 5;
+    }
+    if (flags & FLAG_END_HEADERS)
+        return onHeaderBlock(c, id, p, len);
+
+    c->block = (unsigned char *)Malloc(H2_MAX_HEADER_BLOCK);
+    memcpy(c->block, p, len);
+    c->blockLen = len;
+    c->blockId = id;
+    return 0;
+}
+
+static int onContinuation(H2Conn *c, int flags, unsigned int id,
+    unsigned char *p, int len) {
+
+    int rc;
+
+    if (c->block == NULL || id != c->blockId)
+        return connError(c, ERR_PROTOCOL);
+    if (c->blockLen + len > H2_MAX_HEADER_BLOCK)
+        return connError(c, ERR_ENHANCE_YOUR_CALM);
+    memcpy(c->block + c->blockLen, p, len);
+    c->blockLen += len;
+    if (!(flags & FLAG_END_HEADERS))
+        return 0;
+    rc = onHeaderBlock(c, id, c->block, c->blockLen);
+    Free(c->block);
+    c->block = NULL;
+    return rc;
+}
+
+/*
+ * onData - request bodies are not forwarded, only GET is. What the
+ *     client sends anyway is dropped and its window given back.
+ */
+
+static int onData(H2Conn *c, unsigned int id, int len) {
+    unsigned char payload[4];
+
+    if (id == 0)
+        return connError(c, ERR_PROTOCOL);
+    if (len == 0)
+        return 0;
+    put32(payload, len);
+    lockWriter(c);
+    appendFrame(c, FRAME_WINDOW_UPDATE, 0, 0, payload, 4);
+    if (findStream(c, id))
+        appendFrame(c, FRAME_WINDOW_UPDATE, 0, id, payload, 4);
+    flush(c);
+    unlockWriter(c);
+    return 0;
+}
+
+static int onSettings(H2Conn *c, int flags, unsigned char *p, int len) {
+    unsigned int value;
+    int i, id;
+    long delta;
+    H2Stream *st;
+
+    if (flags & FLAG_ACK)
+        return len == 0 ? 0 : connError(c, ERR_FRAME_SIZE);
+    if (len % 6)
+        return connError(c, ERR_FRAME_SIZE);
+
+    /* the encoder may not change under a HEADERS being added */
+    lockWriter(c);
+    for (i = 0; i < len; i += 6) {
+        id = p[i] << 8 | p[i + 1];
+        value = (unsigned int)p[i + 2] << 24 | p[i + 3] << 16
+            | p[i + 4] << 8 | p[i + 5];
+        switch (id) {
+        case SETTINGS_HEADER_TABLE_SIZE:
+            hpackSetLimit(&c->encoder, value > HPACK_TABLE_SIZE
+                ? HPACK_TABLE_SIZE : (int)value);
+            break;
+        case SETTINGS_ENABLE_PUSH:
+            if (value > 1) {
+                unlockWriter(c);
+                return connError(c, ERR_PROTOCOL);
+            }
+            break;
+        case SETTINGS_INITIAL_WINDOW_SIZE:
+            if (value > MAX_WINDOW) {
+                unlockWriter(c);
+                return connError(c, ERR_FLOW_CONTROL);
+            }
+            delta = (long)value - c->initialWindow;
+            c->initialWindow = value;
+            for (st = c->streams; st; st = st->next)
+                st->window += delta;
+            break;
+        case SETTINGS_MAX_FRAME_SIZE:
+            /* never sent larger frames than the default anyway */
+            if (value < H2_FRAME_SIZE || value > 0xffffff) {
+                unlockWriter(c);
+                return connError(c, ERR_PROTOCOL);
+            }
+            break;
+        }
+    }
+    appendFrame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+    flush(c);
+    unlockWriter(c);
+    wakeAll(&c->windowWaiters);
+    return 0;
+}
+
+static int onWindowUpdate(H2Conn *c, unsigned int id, unsigned char *p,
+    int len) {
+
+    unsigned int inc;
+    H2Stream *st;
+
+    if (len != 4)
+        return connError(c, ERR_FRAME_SIZE);
+    inc = get31(p);
+    if (id == 0) {
+        if (inc == 0)
+            return connError(c, ERR_PROTOCOL);
+        if (c->window + inc > MAX_WINDOW)
+            return connError(c, ERR_FLOW_CONTROL);
+        c->window += inc;
+    }
+    else if ((st = findStream(c, id)) != NULL && !st->reset) {
+        if (inc == 0 || st->window + inc > MAX_WINDOW)
+            resetStream(st, inc == 0 ? ERR_PROTOCOL : ERR_FLOW_CONTROL);
+        else
+            st->window += inc;
+    }
+    wakeAll(&c->windowWaiters);
+    return 0;
+}
+
+/*
+ * readFrame - read and handle the next frame from the client. Returns
+ *     -1 once the connection is over.
+ */
+
+static int readFrame(H2Conn *c) {
+    unsigned char head[FRAME_HEADER];
+    unsigned int id;
+    int len, type, flags;
+    H2Stream *st;
+
+    if (coroReadnb(c->rp, head, FRAME_HEADER) != FRAME_HEADER) {
+        c->dead = 1;
+        return -1;
+    }
+    len = head[0] << 16 | head[1] << 8 | head[2];
+    type = head[3];
+    flags = head[4];
+    id = get31(head + 5);
+    if (len > H2_FRAME_SIZE)
+        return connError(c, ERR_FRAME_SIZE);
+    if (coroReadnb(c->rp, c->in, len) != len) {
+        c->dead = 1;
+        return -1;
+    }
+    timerTouch(&c->idle);
+    if (c->block != NULL && type != FRAME_CONTINUATION)
+        return connError(c, ERR_PROTOCOL);
+
+    switch (type) {
+    case FRAME_DATA:
+        return onData(c, id, len);
+    case FRAME_HEADERS:
+        return onHeaders(c, flags, id, c->in, len);
+    case FRAME_CONTINUATION:
+        return onContinuation(c, flags, id, c->in, len);
+    case FRAME_RST_STREAM:
+        if (len != 4)
+            return connError(c, ERR_FRAME_SIZE);
+        if ((st = findStream(c, id)) != NULL) {
+            st->reset = 1;
+            wakeAll(&c->windowWaiters);
+        }
+        return 0;
+    case FRAME_SETTINGS:
+        return onSettings(c, flags, c->in, len);
+    case FRAME_PING:
+        if (len != 8)
+            return connError(c, ERR_FRAME_SIZE);
+        if (!(flags & FLAG_ACK))
+            sendFrame(c, FRAME_PING, FLAG_ACK, 0, c->in, 8);
+        return 0;
+    case FRAME_GOAWAY:
+        c->goaway = 1;
+        return 0;
+    case FRAME_WINDOW_UPDATE:
+        return onWindowUpdate(c, id, c->in, len);
+    case FRAME_PUSH_PROMISE:
+        return connError(c, ERR_PROTOCOL);
+    default:
+        /* PRIORITY and unknown types are ignored */
+        return 0;
+    }
+}
+
+/*
+ * serveH2 - serve an HTTP/2 connection whose preface line was read from
+ *     rp. Returns once the client is gone and every stream is done, the
+ *     caller closes fd. idleMs bounds the time without a frame either way.
+ *
+ *     In a coroutine the stream coroutines write frames while this one
+ *     may be waiting to read. Two coroutines can not wait on one fd in
+ *     the same epoll instance, so the writers use a dup of it.
+ */
+
+void serveH2(rio_t *rp, int fd, unsigned long idleMs, H2Serve serve) {
+    H2Conn *c;
+    char preface[8];
+    unsigned char settings[6];
+    int on = 1;
+
+    c = (H2Conn *)Malloc(sizeof(H2Conn));
+    memset(c, 0, offsetof(H2Conn, in));
+    c->fd = c->wfd = fd;
+    c->rp = rp;
+    c->serve = serve;
+    c->owner = coroSelf();
+    c->window = c->initialWindow = DEFAULT_WINDOW;
+    hpackInit(&c->decoder);
+    hpackInit(&c->encoder);
+    timerArm(&c->idle, fd, TIMEOUT_IDLE, idleMs);
+
+    if (coroReadnb(rp, preface, 8) != 8
+            || memcmp(preface, "\r\nSM\r\n\r\n", 8)
+            || (c->owner != NULL && (c->wfd = dup(fd)) < 0))
+        goto out;
+    statsInc(STAT_H2_CONNECTIONS);
+    /*
+     * the connection stays open between responses, and the frames are
+     * already gathered in c->out, so Nagle would only hold the last
+     * segment of a response until the client's delayed ACK
+     */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+    /* everything else is left at its default */
+    settings[0] = 0;
+    settings[1] = SETTINGS_MAX_CONCURRENT_STREAMS;
+    put32(settings + 2, H2_MAX_STREAMS);
+    sendFrame(c, FRAME_SETTINGS, 0, 0, settings, 6);
+
+    while (!c->dead && readFrame(c) == 0) {
+        if (c->owner == NULL)
+            runPending(c);
+    }
+
+out:
+    /* whatever still waits on the client fails now */
+    c->dead = 1;
+    shutdown(fd, SHUT_RDWR);
+    wakeAll(&c->windowWaiters);
+    wakeAll(&c->writers);
+    while (c->owner != NULL && c->open > 0) {
+        c->ownerWaiting = 1;
+        coroPark();
+    }
+    while (c->streams)
+        removeStream(c->streams);
+
+    timerCancel(&c->idle);
+    if (c->wfd >= 0 && c->wfd != fd)
+        close(c->wfd);
+    if (c->block)
+        Free(c->block);
+    hpackFree(&c->decoder);
+    hpackFree(&c->encoder);
+    Free(c);
+}
@@ -0,0 +1,49 @@
+#ifndef __H2_H__
+#define __H2_H__
+
+#include "csapp.h"
+
+/*
+ * HTTP/2 is defined as followed:
+ *     A client which knows the proxy speaks HTTP/2 in the clear (h2c
+ *     with prior knowledge, RFC 9113 section 3.3) opens with the
+ *     connection preface instead of a request line. serveRequest spots
+ *     its first line and hands the connection to serveH2, which runs it
+ *     until the client goes away.
+ *
+ *     Each stream is served as if its request came in on a connection
+ *     of its own. Its header block is decoded (hpack.h) and turned back
+ *     into an HTTP/1.1 request for the absolute URI of :authority and
+ *     :path, which the serve function of the caller runs through the
+ *     usual request path, cache and upstream included. What that path
+ *     writes to the client is passed to h2Write, which sends the response
+ *     head as a HEADERS frame and the body as DATA frames.
+ *
+ *     In a coroutine (coro.h) every stream runs in a coroutine of its
+ *     own, so a miss does not hold up the hits next to it. A worker
+ *     serves the streams of its connection one after the other.
+ *
+ *     A body is sent within the flow control windows of its stream and
+ *     of the connection. A stream which runs out waits for the client's
+ *     WINDOW_UPDATE; a worker reads the frames of the connection itself
+ *     while it waits, in a coroutine the connection's coroutine does.
+ *     The frames of all streams go out through one buffer, so the
+ *     HEADERS of a response leave together with its first DATA.
+ */
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n"
+#define H2_FRAME_SIZE 16384         /* SETTINGS_MAX_FRAME_SIZE, the default */
+#define H2_MAX_STREAMS 100          /* SETTINGS_MAX_CONCURRENT_STREAMS */
+#define H2_MAX_HEADER_BLOCK 65536   /* HEADERS and its CONTINUATIONs */
+#define H2_MAX_HEAD 16384           /* response head, as HTTP/1.x */
+#define H2_OUT_SIZE (4 * (9 + H2_FRAME_SIZE))
+
+typedef struct _h2Stream H2Stream;
+
+/* serves a stream: its request in a rio, the connection, its start */
+typedef void (*H2Serve)(H2Stream*, rio_t*, int, unsigned long);
+
+void serveH2(rio_t*, int, unsigned long, H2Serve);
+ssize_t h2Write(H2Stream*, void*, size_t);
+
+#endif /* __H2_H__ */
@@ -0,0 +1,526 @@
+#include "csapp.h"
+#include "hpack.h"
+
+typedef struct _hpackStatic {
+    char *name;
+    char *value;
+} HpackStatic;
+
+/* RFC 7541 appendix A, index 0 is not used */
+static const HpackStatic staticTable[HPACK_STATIC + 1] = {
+    {NULL, NULL},
+    {":authority", ""},
+    {":method", "GET"},
+    {":method", "POST"},
+    {":path", "/"},
+    {":path", "/index.html"},
+    {":scheme", "http"},
+    {":scheme", "https"},
+    {":status", "200"},
+    {":status", "204"},
+    {":status", "206"},
+    {":status", "304"},
+    {":status", "400"},
+    {":status", "404"},
+    {":status", "500"},
+    {"accept-charset", ""},
+    {"accept-encoding", "gzip, deflate"},
+    {"accept-language", ""},
+    {"accept-ranges", ""},
+    {"accept", ""},
+    {"access-control-allow-origin", ""},
+    {"age", ""},
+    {"allow", ""},
+    {"authorization", ""},
+    {"cache-control", ""},
+    {"content-disposition", ""},
+    {"content-encoding", ""},
+    {"content-language", ""},
+    {"content-length", ""},
+    {"content-location", ""},
+    {"content-range", ""},
+    {"content-type", ""},
+    {"cookie", ""},
+    {"date", ""},
+    {"etag", ""},
+    {"expect", ""},
+    {"expires", ""},
+    {"from", ""},
+    {"host", ""},
+    {"if-match", ""},
+    {"if-modified-since", ""},
+    {"if-none-match", ""},
+    {"if-range", ""},
+    {"if-unmodified-since", ""},
+    {"last-modified", ""},
+    {"link", ""},
+    {"location", ""},
+    {"max-forwards", ""},
+    {"proxy-authenticate", ""},
+    {"proxy-authorization", ""},
+    {"range", ""},
+    {"referer", ""},
+    {"refresh", ""},
+    {"retry-after", ""},
+    {"server", ""},
+    {"set-cookie", ""},
+    {"strict-transport-security", ""},
+    {"transfer-encoding", ""},
+    {"user-agent", ""},
+    {"vary", ""},
+    {"via", ""},
+    {"www-authenticate", ""},
+};
+
+/* RFC 7541 appendix B, without EOS */
+static const unsigned int huffCode[256] = {
+    0x1ff8, 0x7fffd8, 0xfffffe2, 0xfffffe3, 0xfffffe4, 0xfffffe5,
+    0xfffffe6, 0xfffffe7, 0xfffffe8, 0xffffea, 0x3ffffffc, 0xfffffe9,
+    0xfffffea, 0x3ffffffd, 0xfffffeb, 0xfffffec, 0xfffffed, 0xfffffee,
+    0xfffffef, 0xffffff0, 0xffffff1, 0xffffff2, 0x3ffffffe, 0xffffff3,
+    0xffffff4, 0xffffff5, 0xffffff6, 0xffffff7, 0xffffff8, 0xffffff9,
+    0xffffffa, 0xffffffb, 0x14, 0x3f8, 0x3f9, 0xffa,
+    0x1ff9, 0x15, 0xf8, 0x7fa, 0x3fa, 0x3fb,
+    0xf9, 0x7fb, 0xfa, 0x16, 0x17, 0x18,
+    0x0, 0x1, 0x2, 0x19, 0x1a, 0x1b,
+    0x1c, 0x1d, 0x1e, 0x1f, 0x5c, 0xfb,
+    0x7ffc, 0x20, 0xffb, 0x3fc, 0x1ffa, 0x21,
+    0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62,
+    0x63, 0x64, 0x65, 0x66, 0x67, 0x68,
+    0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e,
+    0x6f, 0x70, 0x71, 0x72, 0xfc, 0x73,
+    0xfd, 0x1ffb, 0x7fff0, 0x1ffc, 0x3ffc, 0x22,
+    0x7ffd, 0x3, 0x23, 0x4, 0x24, 0x5,
+    0x25, 0x26, 0x27, 0x6, 0x74, 0x75,
+    0x28, 0x29, 0x2a, 0x7, 0x2b, 0x76,
+    0x2c, 0x8, 0x9, 0x2d, 0x77, 0x78,
+    0x79, 0x7a, 0x7b, 0x7ffe, 0x7fc, 0x3ffd,
+    0x1ffd, 0xffffffc, 0xfffe6, 0x3fffd2, 0xfffe7, 0xfffe8,
+    0x3fffd3, 0x3fffd4, 0x3fffd5, 0x7fffd9, 0x3fffd6, 0x7fffda,
+    0x7fffdb, 0x7fffdc, 0x7fffdd, 0x7fffde, 0xffffeb, 0x7fffdf,
+    0xffffec, 0xffffed, 0x3fffd7, 0x7fffe0, 0xffffee, 0x7fffe1,
+    0x7fffe2, 0x7fffe3, 0x7fffe4, 0x1fffdc, 0x3fffd8, 0x7fffe5,
+    0x3fffd9, 0x7fffe6, 0x7fffe7, 0xffffef, 0x3fffda, 0x1fffdd,
+    0xfffe9, 0x3fffdb, 0x3fffdc, 0x7fffe8, 0x7fffe9, 0x1fffde,
+    0x7fffea, 0x3fffdd, 0x3fffde, 0xfffff0, 0x1fffdf, 0x3fffdf,
+    0x7fffeb, 0x7fffec, 0x1fffe0, 0x1fffe1, 0x3fffe0, 0x1fffe2,
+    0x7fffed, 0x3fffe1, 0x7fffee, 0x7fffef, 0xfffea, 0x3fffe2,
+    0x3fffe3, 0x3fffe4, 0x7ffff0, 0x3fffe5, 0x3fffe6, 0x7ffff1,
+    0x3ffffe0, 0x3ffffe1, 0xfffeb, 0x7fff1, 0x3fffe7, 0x7ffff2,
+    0x3fffe8, 0x1ffffec, 0x3ffffe2, 0x3ffffe3, 0x3ffffe4, 0x7ffffde,
+    0x7ffffdf, 0x3ffffe5, 0xfffff1, 0x1ffffed, 0x7fff2, 0x1fffe3,
+    0x3ffffe6, 0x7ffffe0, 0x7ffffe1, 0x3ffffe7, 0x7ffffe2, 0xfffff2,
+    0x1fffe4, 0x1fffe5, 0x3ffffe8, 0x3ffffe9, 0xffffffd, 0x7ffffe3,
+    0x7ffffe4, 0x7ffffe5, 0xfffec, 0xfffff3, 0xfffed, 0x1fffe6,
+    0x3fffe9, 0x1fffe7, 0x1fffe8, 0x7ffff3, 0x3fffea, 0x3fffeb,
+    0x1ffffee, 0x1ffffef, 0xfffff4, 0xfffff5, 0x3ffffea, 0x7ffff4,
+    0x3ffffeb, 0x7ffffe6, 0x3ffffec, 0x3ffffed, 0x7ffffe7, 0x7ffffe8,
+    0x7ffffe9, 0x7ffffea, 0x7ffffeb, 0xffffffe, 0x7ffffec, 0x7ffffed,
+    0x7ffffee, 0x7ffffef, 0x7fffff0, 0x3ffffee,
+};
+
+static const unsigned char huffLen[256] = {
+    13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+    28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+    6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+    5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+    13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+    7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+    15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+    6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+    20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+    24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+    22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+    21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+    26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+    19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+    20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+    26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+#define HUFF_EOS 256
+
+/* fields whose value changes with every object are not worth an entry */
+static const char *perObject[] = {
+    "content-length", "content-range", "date", "last-modified", "etag",
+    "expires", "age", "set-cookie", NULL
+};
+
+/*
+ * The Huffman decoding tree: the children of each node, a leaf is
+ * -(symbol + 1). The code is complete, so every node has both.
+ */
+static short huffTree[HUFF_EOS + 1][2];
+static int huffNodes = 1;
+static pthread_once_t huffOnce = PTHREAD_ONCE_INIT;
+
+static void addCode(int sym, unsigned int code, int len) {
+    int node = 0, bit;
+
+    for (len--; len > 0; len--) {
+        bit = (code >> len) & 1;
+        if (huffTree[node][bit] == 0)
+            huffTree[node][bit] = huffNodes++;
+        node = huffTree[node][bit];
+    }
+    huffTree[node][code & 1] = -(sym + 1);
+}
+
+static void buildTree() {
+    int i;
+
+    for (i = 0; i < 256; i++)
+        addCode(i, huffCode[i], huffLen[i]);
+    addCode(HUFF_EOS, 0x3fffffff, 30);
+}
+
+/*
+ * huffDecode - decode len bytes of Huffman code to out, which has room
+ *     for len * 8 / 5 bytes, the shortest code has five bits. What is
+ *     left of the last byte must be the start of EOS, all ones, and EOS
+ *     itself may not appear. Returns the decoded length or -1.
+ */
+
+static int huffDecode(unsigned char *in, int len, char *out) {
+    int i, bit, b, next, node = 0, depth = 0, ones = 1, n = 0;
+
+    for (i = 0; i < len; i++) {
+        for (bit = 7; bit >= 0; bit--) {
+            b = (in[i] >> bit) & 1;
+            next = huffTree[node][b];
+            depth++;
+            ones &= b;
+            if (next >= 0) {
+                node = next;
+                continue;
+            }
+            if (next == -(HUFF_EOS + 1))
+                return -1;
+            out[n++] = -next - 1;
+            node = depth = 0;
+            ones = 1;
+        }
+    }
+    return depth > 7 || !ones ? -1 : n;
+}
+
+/*
+ * getInt - an integer with a prefix of prefix bits, RFC 7541 section 5.1.
+ */
+
+static int getInt(unsigned char **p, unsigned char *end, int prefix,
+    int *value) {
+
+    unsigned int v, mask = (1 << prefix) - 1;
+    int shift = 0;
+    unsigned char b;
+
+    if (*p >= end)
+        return -1;
+    if ((v = *(*p)++ & mask) < mask) {
+        *value = v;
+        return 0;
+    }
+    do {
+        if (*p >= end || shift > 21)
+            return -1;
+        b = *(*p)++;
+        v += (b & 0x7f) << shift;
+        shift += 7;
+    } while (b & 0x80);
+    *value = v;
+    return 0;
+}
+
+/*
+ * getString - a string literal, Huffman coded ones are decoded to
+ *     *scratch, which is moved past them.
+ */
+
+static int getString(unsigned char **p, unsigned char *end, char **scratch,
+    char **s, int *len) {
+
+    int huffman, n;
+
+    if (*p >= end)
+        return -1;
+    huffman = **p & 0x80;
+    if (getInt(p, end, 7, &n) < 0 || n > end - *p)
+        return -1;
+    if (!huffman) {
+        *s = (char *)*p;
+        *len = n;
+    }
+    else {
+        if ((*len = huffDecode(*p, n, *scratch)) < 0)
+            return -1;
+        *s = *scratch;
+        *scratch += *len;
+    }
+    *p += n;
+    return 0;
+}
+
+static int putInt(unsigned char *out, int room, int prefix, int flags,
+    int v) {
+
+    int mask = (1 << prefix) - 1, n = 0;
+
+    if (room < 1)
+        return -1;
+    if (v < mask) {
+        out[0] = flags | v;
+        return 1;
+    }
+    out[n++] = flags | mask;
+    for (v -= mask; v >= 0x80; v >>= 7) {
+        if (n >= room)
+            return -1;
+        out[n++] = (v & 0x7f) | 0x80;
+    }
+    if (n >= room)
+        return -1;
+    out[n++] = v;
+    return n;
+}
+
+static int putString(unsigned char *out, int room, char *s, int len) {
+    int n;
+
+    if ((n = putInt(out, room, 7, 0, len)) < 0 || n + len > room)
+        return -1;
+    memcpy(out + n, s, len);
+    return n + len;
+}
+
+static HpackEntry *dynamicEntry(HpackTable *t, int i) {
+    return &t->entry[(t->first + i) % HPACK_ENTRIES];
+}
+
+/*
+ * evict - drop the oldest entries until the table is at most max bytes.
+ */
+
+static void evict(HpackTable *t, int max) {
+    HpackEntry *e;
+
+    while (t->count > 0 && t->size > max) {
+        e = dynamicEntry(t, t->count - 1);
+        t->size -= e->nameLen + e->valueLen + 32;
+        Free(e->name);
+        t->count--;
+    }
+}
+
+/*
+ * insert - add a field as the newest entry. name may be an entry which
+ *     makes room for it, so it is copied first.
+ */
+
+static void insert(HpackTable *t, char *name, int nameLen, char *value,
+    int valueLen) {
+
+    int cost = nameLen + valueLen + 32;
+    HpackEntry *e;
+    char *copy;
+
+    if (cost > t->max) {
+        evict(t, 0);
+        return;
+    }
+    copy = (char *)Malloc(nameLen + valueLen);
+    memcpy(copy, name, nameLen);
+    memcpy(copy + nameLen, value, valueLen);
+    evict(t, t->max - cost);
+
+    t->first = (t->first + HPACK_ENTRIES - 1) % HPACK_ENTRIES;
+    e = &t->entry[t->first];
+    e->name = copy;
+    e->value = copy + nameLen;
+    e->nameLen = nameLen;
+    e->valueLen = valueLen;
+    t->count++;
+    t->size += cost;
+}
+
+static int lookup(HpackTable *t, int index, char **name, int *nameLen,
+    char **value, int *valueLen) {
+
+    HpackEntry *e;
+
+    if (index >= 1 && index <= HPACK_STATIC) {
+        *name = staticTable[index].name;
+        *nameLen = strlen(*name);
+        *value = staticTable[index].value;
+        *valueLen = strlen(*value);
+        return 0;
+    }
+    if (index <= HPACK_STATIC || index > HPACK_STATIC + t->count)
+        return -1;
+    e = dynamicEntry(t, index - HPACK_STATIC - 1);
+    *name = e->name;
+    *nameLen = e->nameLen;
+    *value = e->value;
+    *valueLen = e->valueLen;
+    return 0;
+}
+
+/*
+ * hpackInit - an empty table of the default size.
+ */
+
+void hpackInit(HpackTable *t) {
+    pthread_once(&huffOnce, buildTree);
+    memset(t, 0, sizeof(*t));
+    t->max = t->limit = HPACK_TABLE_SIZE;
+}
+
+void hpackFree(HpackTable *t) {
+    evict(t, 0);
+}
+
+/*
+ * hpackSetLimit - the peer's SETTINGS_HEADER_TABLE_SIZE, for the encoder.
+ *     A change is announced at the start of the next block.
+ */
+
+void hpackSetLimit(HpackTable *t, int limit) {
+    if (limit > HPACK_TABLE_SIZE)
+        limit = HPACK_TABLE_SIZE;
+    if (limit == t->max)
+        return;
+    t->max = limit;
+    evict(t, limit);
+    t->update = 1;
+}
+
+/*
+ * hpackDecode - decode the header block in, calling field for each of
+ *     its fields in order. Returns -1 on a compression error, after which
+ *     the table is of no use any more.
+ */
+
+int hpackDecode(HpackTable *t, unsigned char *in, int len, HpackField field,
+    void *arg) {
+
+    unsigned char *p = in, *end = in + len;
+    char small[1024], *buf, *scratch, *name, *value;
+    int nameLen, valueLen, index, indexing, size, fields = 0, rc = -1;
+
+    size = len * 8 / 5 + 1;
+    scratch = buf = size <= (int)sizeof(small) ? small : (char *)Malloc(size);
+
+    while (p < end) {
+        if (*p & 0x80) {
+            /* indexed field */
+            if (getInt(&p, end, 7, &index) < 0
+                    || lookup(t, index, &name, &nameLen, &value,
+                        &valueLen) < 0)
+                goto out;
+            field(arg, name, nameLen, value, valueLen);
+        }
+        else if ((*p & 0xe0) == 0x20) {
+            /* dynamic table size update, only before the first field */
+            if (fields > 0 || getInt(&p, end, 5, &size) < 0
+                    || size > t->limit)
+                goto out;
+            t->max = size;
+            evict(t, size);
+            continue;
+        }
+        else {
+            /* literal, with incremental indexing or without */
+            indexing = (*p & 0xc0) == 0x40;
+            if (getInt(&p, end, indexing ? 6 : 4, &index) < 0)
+                goto out;
+            if (index == 0) {
+                if (getString(&p, end, &scratch, &name, &nameLen) < 0)
+                    goto out;
+            }
+            else if (lookup(t, index, &name, &nameLen, &value,
+                    &valueLen) < 0)
+                goto out;
+            if (getString(&p, end, &scratch, &value, &valueLen) < 0)
+                goto out;
+            field(arg, name, nameLen, value, valueLen);
+            if (indexing)
+                insert(t, name, nameLen, value, valueLen);
+        }
+        fields++;
+    }
+    rc = 0;
+
+out:
+    if (buf != small)
+        Free(buf);
+    return rc;
+}
+
+/*
+ * hpackBegin - start a header block in out, with the size update which
+ *     may be due. Returns the bytes written or -1 if out is too small.
+ */
+
+int hpackBegin(HpackTable *t, unsigned char *out, int room) {
+    int n;
+
+    if (!t->update)
+        return 0;
+    if ((n = putInt(out, room, 5, 0x20, t->max)) > 0)
+        t->update = 0;
+    return n;
+}
+
+/*
+ * hpackEncode - append one field, name in lower case, to the block in
+ *     out. Returns the bytes written or -1 if out is too small, in which
+ *     case the table is unchanged.
+ */
+
+int hpackEncode(HpackTable *t, unsigned char *out, int room, char *name,
+    int nameLen, char *value, int valueLen) {
+
+    int i, n, m, index = 0, indexing = 1;
+    HpackEntry *e;
+    const HpackStatic *s;
+
+    for (i = 1; i <= HPACK_STATIC; i++) {
+        s = &staticTable[i];
+        if ((int)strlen(s->name) != nameLen
+                || memcmp(s->name, name, nameLen))
+            continue;
+        if ((int)strlen(s->value) == valueLen
+                && !memcmp(s->value, value, valueLen))
+            return putInt(out, room, 7, 0x80, i);
+        if (index == 0)
+            index = i;
+    }
+    for (i = 0; i < t->count; i++) {
+        e = dynamicEntry(t, i);
+        if (e->nameLen != nameLen || memcmp(e->name, name, nameLen))
+            continue;
+        if (e->valueLen == valueLen && !memcmp(e->value, value, valueLen))
+            return putInt(out, room, 7, 0x80, HPACK_STATIC + 1 + i);
+        if (index == 0)
+            index = HPACK_STATIC + 1 + i;
+    }
+
+    for (i = 0; perObject[i]; i++)
+        if ((int)strlen(perObject[i]) == nameLen
+                && !memcmp(perObject[i], name, nameLen))
+            indexing = 0;
+
+    if ((n = indexing ? putInt(out, room, 6, 0x40, index)
+            : putInt(out, room, 4, 0, index)) < 0)
+        return -1;
+    if (index == 0) {
+        if ((m = putString(out + n, room - n, name, nameLen)) < 0)
+            return -1;
+        n += m;
+    }
+    if ((m = putString(out + n, room - n, value, valueLen)) < 0)
+        return -1;
+    if (indexing)
+        insert(t, name, nameLen, value, valueLen);
+    return n + m;
+}
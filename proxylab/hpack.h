@@ -0,0 +1,54 @@
+#ifndef __HPACK_H__
+#define __HPACK_H__
+
+/*
+ * HPACK is defined as followed:
+ *     The header compression of HTTP/2 (RFC 7541). A header block is a
+ *     sequence of fields, each either an index into the static table of
+ *     common fields or into the dynamic table, or a name and a value,
+ *     optionally Huffman coded, which may be added to the dynamic table.
+ *     Each direction of a connection has a dynamic table of its own; the
+ *     decoder's follows the peer's encoder as long as every block is
+ *     decoded, in the order it was sent.
+ *
+ *     The decoder takes everything RFC 7541 allows. The encoder never
+ *     Huffman codes. It adds the fields which repeat from response to
+ *     response (content-type, server, ...) to the dynamic table, so they
+ *     cost one byte after the first time, and sends the ones which change
+ *     with every object (content-length, ...) as plain literals.
+ */
+
+#define HPACK_STATIC 61
+/* SETTINGS_HEADER_TABLE_SIZE, the default, both ways */
+#define HPACK_TABLE_SIZE 4096
+/* an entry costs its name and value plus 32 bytes */
+#define HPACK_ENTRIES (HPACK_TABLE_SIZE / 32)
+
+typedef struct _hpackEntry {
+    char *name;             /* name and value share one allocation */
+    char *value;
+    int nameLen;
+    int valueLen;
+} HpackEntry;
+
+typedef struct _hpackTable {
+    HpackEntry entry[HPACK_ENTRIES];
+    int first;              /* the newest entry */
+    int count;
+    int size;
+    int max;
+    int limit;              /* what max may be raised to */
+    int update;             /* encoder: max changed, tell the decoder */
+} HpackTable;
+
+/* called for every field of a block, the strings are not terminated */
+typedef void (*HpackField)(void*, char*, int, char*, int);
+
+void hpackInit(HpackTable*);
+void hpackFree(HpackTable*);
+void hpackSetLimit(HpackTable*, int);
+int hpackDecode(HpackTable*, unsigned char*, int, HpackField, void*);
+int hpackBegin(HpackTable*, unsigned char*, int);
+int hpackEncode(HpackTable*, unsigned char*, int, char*, int, char*, int);
+
+#endif /* __HPACK_H__ */
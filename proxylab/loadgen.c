@@ -0,0 +1,639 @@
+/*
+ * loadgen - load generator and replay benchmark for the proxy
+ *
+ *     Client threads send HTTP/1.0 GET requests through the proxy, one
+ *     connection per request, for a fixed number of requests or a fixed
+ *     duration. The URLs either come from a trace file (one absolute URL
+ *     per line, replayed in order and wrapped around) or are drawn from
+ *     a Zipf distribution over a set of objects on the origin stand-in.
+ *
+ *     The origin stand-in is a tiny HTTP server started in the same
+ *     process. Object /obj/<id> has a size derived from <id> and is
+ *     served after a configurable delay, and every request it receives
+ *     is counted, which gives the number of origin requests and hence
+ *     the hit ratio of the proxy. It honors single byte Range requests
+ *     and counts the body bytes it sends.
+ *
+ *     With -C every request goes through its own CONNECT tunnel instead,
+ *     which measures the tunnel pump. Large objects (-s) and few clients
+ *     give the throughput of a single tunnel.
+ *
+ *     With -D some extra clients fetch large objects, a new one each
+ *     time so the proxy misses, and read the body at a fixed rate through
+ *     a small receive buffer. Against the fast origin stand-in that shows
+ *     what the proxy holds for clients slower than origin.
+ */
+
+#include <getopt.h>
+#include <time.h>
+
+#include "csapp.h"
+
+#define MAXURLS (1 << 20)
+
+typedef struct _options {
+    int conns;              /* concurrent client threads */
+    long requests;          /* total requests, 0 means use duration */
+    double duration;        /* seconds */
+    int objects;            /* distinct objects for Zipf */
+    double zipf;            /* Zipf exponent */
+    long minSize;           /* object size range */
+    long maxSize;
+    int delayMs;            /* origin latency */
+    long rangeLen;          /* request random ranges of this length */
+    char *originPort;
+    char *traceFile;
+    char *type;             /* Content-Type of origin objects */
+    char *proxyHost;
+    char *proxyPort;
+    int external;           /* do not start the origin stand-in */
+    int tunnel;             /* send each request through a CONNECT tunnel */
+    int slow;               /* clients which trickle their request header */
+    int slowReaders;        /* clients which read large bodies slowly */
+    long bigSize;           /* size of the objects slow readers fetch */
+    long readRate;          /* bytes per second of a slow reader */
+} Options;
+
+typedef struct _worker {
+    pthread_t tid;
+    int id;
+    unsigned long seed;
+    long done;
+    long errors;
+    long bytes;
+    long cap;
+    unsigned long *lat;     /* latency of every request in us */
+} Worker;
+
+static Options opt = {
+    .conns = 8,
+    .requests = 10000,
+    .duration = 0,
+    .objects = 1000,
+    .zipf = 0.8,
+    .minSize = 16384,
+    .maxSize = 16384,
+    .delayMs = 0,
+    .rangeLen = 0,
+    .originPort = "18000",
+    .traceFile = NULL,
+    .type = "text/plain",
+    .external = 0,
+    .tunnel = 0,
+    .slow = 0,
+    .slowReaders = 0,
+    .bigSize = 4 << 20,
+    .readRate = 160 << 10,
+};
+
+static char **urls = NULL;
+static int urlCount = 0;
+static double *zipfCdf = NULL;
+static long originRequests = 0;
+static long originBytes = 0;
+static long issued = 0;
+static unsigned long deadlineUs = 0;
+static char *fillBuf = NULL;
+static int slowStop = 0;
+static long slowCut = 0;            /* slow connections closed by the proxy */
+static long bigIssued = 0;
+static long slowReads = 0;          /* bodies slow readers read to the end */
+static long slowFailed = 0;
+static long slowBytes = 0;
+
+static unsigned long nowUs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* xorshift64* - cheap per thread random numbers */
+static unsigned long nextRand(unsigned long *state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 2685821657736338717UL;
+}
+
+/*
+ * objectSize - size of object <id>, spread deterministically over the
+ *     configured range so every request for the same id sees the same size.
+ */
+
+static long objectSize(long id) {
+    unsigned long h = (unsigned long)id * 0x9E3779B97F4A7C15UL;
+
+    if (opt.maxSize <= opt.minSize)
+        return opt.minSize;
+    return opt.minSize + (long)((h >> 16) % (opt.maxSize - opt.minSize + 1));
+}
+
+/*
+ * originServe - serve one origin connection.
+ */
+
+static void *originServe(void *vargp) {
+    int fd = (int)(size_t)vargp;
+    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], hdr[MAXLINE];
+    char *pos;
+    long id = 0, size, left, n, first = -1, last = -1;
+    rio_t rio;
+    struct timespec delay;
+
+    pthread_detach(pthread_self());
+    __atomic_fetch_add(&originRequests, 1, __ATOMIC_RELAXED);
+
+    Rio_readinitb(&rio, fd);
+    if (rio_readlineb(&rio, buf, MAXLINE) <= 0
+            || sscanf(buf, "%s %s", method, uri) != 2) {
+        close(fd);
+        return NULL;
+    }
+    while (rio_readlineb(&rio, hdr, MAXLINE) > 0 && strcmp(hdr, "\r\n")) {
+        if (!strncasecmp(hdr, "Range: bytes=", 13)
+                && sscanf(hdr + 13, "%ld-%ld", &first, &last) < 1)
+            first = -1;
+    }
+
+    if (opt.delayMs > 0) {
+        delay.tv_sec = opt.delayMs / 1000;
+        delay.tv_nsec = (opt.delayMs % 1000) * 1000000L;
+        nanosleep(&delay, NULL);
+    }
+
+    if ((pos = strstr(uri, "/obj/")) != NULL)
+        id = atol(pos + 5);
+    size = strstr(uri, "/big/") ? opt.bigSize : objectSize(id);
+
+    if (first >= 0 && first < size) {
+        if (last < first || last >= size)
+            last = size - 1;
+        sprintf(hdr, "HTTP/1.0 206 Partial Content\r\nServer: loadgen\r\n"
+            "Content-Type: %s\r\nContent-Range: bytes %ld-%ld/%ld\r\n"
+            "Content-Length: %ld\r\n\r\n", opt.type, first, last, size,
+            last - first + 1);
+        size = last - first + 1;
+    }
+    else
+        sprintf(hdr, "HTTP/1.0 200 OK\r\nServer: loadgen\r\n"
+            "Content-Type: %s\r\nContent-Length: %ld\r\n\r\n",
+            opt.type, size);
+    if (rio_writen(fd, hdr, strlen(hdr)) < 0) {
+        close(fd);
+        return NULL;
+    }
+    __atomic_fetch_add(&originBytes, size, __ATOMIC_RELAXED);
+    for (left = size; left > 0; left -= n) {
+        n = left < MAXBUF ? left : MAXBUF;
+        if (rio_writen(fd, fillBuf, n) < 0)
+            break;
+    }
+    close(fd);
+    return NULL;
+}
+
+static void *originThread(void *vargp) {
+    int listenfd = (int)(size_t)vargp, connfd;
+    pthread_t tid;
+
+    for (; ;) {
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0)
+            continue;
+        Pthread_create(&tid, NULL, originServe, (void *)(size_t)connfd);
+    }
+    return NULL;
+}
+
+/*
+ * buildZipf - cumulative distribution of rank k having weight 1/k^s.
+ */
+
+static void buildZipf() {
+    double total = 0;
+    int i;
+
+    zipfCdf = (double *)Malloc(opt.objects * sizeof(double));
+    for (i = 0; i < opt.objects; i++) {
+        total += 1.0 / pow(i + 1, opt.zipf);
+        zipfCdf[i] = total;
+    }
+    for (i = 0; i < opt.objects; i++)
+        zipfCdf[i] /= total;
+}
+
+static int sampleZipf(unsigned long *seed) {
+    double u = (nextRand(seed) >> 11) * (1.0 / 9007199254740992.0);
+    int lo = 0, hi = opt.objects - 1, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (zipfCdf[mid] < u)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static void loadTrace() {
+    FILE *fp;
+    char line[MAXLINE];
+
+    if ((fp = fopen(opt.traceFile, "r")) == NULL) {
+        fprintf(stderr, "Can not open trace %s\n", opt.traceFile);
+        exit(1);
+    }
+    urls = (char **)Malloc(MAXURLS * sizeof(char *));
+    while (urlCount < MAXURLS && fgets(line, MAXLINE, fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#')
+            continue;
+        urls[urlCount++] = strdup(line);
+    }
+    fclose(fp);
+    if (urlCount == 0) {
+        fprintf(stderr, "Trace %s is empty\n", opt.traceFile);
+        exit(1);
+    }
+}
+
+/*
+ * openTunnel - CONNECT to the host of url and wait for the 200. Returns
+ *     the path part of url which is requested through the tunnel, or
+ *     NULL on failure.
+ */
+
+static char *openTunnel(int fd, char *url) {
+    char buf[2 * MAXLINE + 64], target[MAXLINE], *path;
+    long total = 0, n;
+
+    snprintf(target, sizeof(target), "%s", url + 7);
+    if ((path = strchr(url + 7, '/')) == NULL)
+        return NULL;
+    target[path - (url + 7)] = '\0';
+
+    snprintf(buf, sizeof(buf), "CONNECT %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+        target, target);
+    if (rio_writen(fd, buf, strlen(buf)) < 0)
+        return NULL;
+
+    /* the proxy sends nothing after its response until we do */
+    do {
+        if ((n = read(fd, buf + total, sizeof(buf) - 1 - total)) <= 0)
+            return NULL;
+        total += n;
+        buf[total] = '\0';
+    } while (strstr(buf, "\r\n\r\n") == NULL && total < MAXLINE);
+
+    if (strncmp(buf, "HTTP/", 5) || strchr(buf, ' ') == NULL
+            || atoi(strchr(buf, ' ') + 1) != 200)
+        return NULL;
+    return path;
+}
+
+/*
+ * fetchOne - send one request through the proxy and read the response
+ *     to the end. Returns the number of bytes received or -1.
+ */
+
+static long fetchOne(char *url, char *extra) {
+    char buf[MAXLINE + 32];
+    long total, n;
+    int fd, status = 0;
+
+    if ((fd = open_clientfd(opt.proxyHost, opt.proxyPort)) < 0)
+        return -1;
+
+    if (opt.tunnel && (url = openTunnel(fd, url)) == NULL) {
+        close(fd);
+        return -1;
+    }
+
+    snprintf(buf, sizeof(buf), "GET %s HTTP/1.0\r\n%s\r\n", url, extra);
+    if (rio_writen(fd, buf, strlen(buf)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    /* the status line arrives in the first segment */
+    if ((total = read(fd, buf, sizeof(buf) - 1)) > 0) {
+        buf[total] = '\0';
+        if (!strncmp(buf, "HTTP/", 5) && strchr(buf, ' '))
+            status = atoi(strchr(buf, ' ') + 1);
+    }
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        total += n;
+    close(fd);
+
+    if (n < 0 || status < 200 || status >= 400)
+        return -1;
+    return total;
+}
+
+static void *clientThread(void *vargp) {
+    Worker *w = (Worker *)vargp;
+    char url[MAXLINE], extra[MAXLINE] = "";
+    unsigned long start;
+    long seq, n, size, first;
+    int id;
+
+    for (; ;) {
+        seq = __atomic_fetch_add(&issued, 1, __ATOMIC_RELAXED);
+        if (opt.requests > 0 ? seq >= opt.requests : nowUs() >= deadlineUs)
+            break;
+
+        if (urls != NULL)
+            snprintf(url, sizeof(url), "%s", urls[seq % urlCount]);
+        else {
+            id = sampleZipf(&w->seed);
+            snprintf(url, sizeof(url), "http://localhost:%s/obj/%d",
+                opt.originPort, id);
+            if (opt.rangeLen > 0) {
+                size = objectSize(id);
+                first = (long)(nextRand(&w->seed) % size);
+                snprintf(extra, sizeof(extra), "Range: bytes=%ld-%ld\r\n",
+                    first, first + opt.rangeLen - 1);
+            }
+        }
+
+        start = nowUs();
+        if ((n = fetchOne(url, extra)) < 0) {
+            w->errors++;
+            continue;
+        }
+        if (w->done == w->cap) {
+            w->cap = w->cap ? w->cap * 2 : 4096;
+            w->lat = (unsigned long *)Realloc(w->lat,
+                w->cap * sizeof(unsigned long));
+        }
+        w->lat[w->done++] = nowUs() - start;
+        w->bytes += n;
+    }
+    return NULL;
+}
+
+/*
+ * slowThread - hold a connection open by sending a request header a byte
+ *     a second and never finishing it. When the proxy cuts it off, count
+ *     it and start over.
+ */
+
+static void *slowThread(void *vargp) {
+    char line[MAXLINE];
+    struct timespec second = { 1, 0 };
+    size_t i;
+    int fd;
+
+    snprintf(line, sizeof(line), "GET http://localhost:%s/obj/0 HTTP/1.0\r\n"
+        "X-Slow: ", opt.originPort);
+    while (!__atomic_load_n(&slowStop, __ATOMIC_RELAXED)) {
+        if ((fd = open_clientfd(opt.proxyHost, opt.proxyPort)) < 0) {
+            nanosleep(&second, NULL);
+            continue;
+        }
+        for (i = 0; !__atomic_load_n(&slowStop, __ATOMIC_RELAXED); i++) {
+            if (write(fd, i < strlen(line) ? line + i : "a", 1) != 1) {
+                __atomic_fetch_add(&slowCut, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            nanosleep(&second, NULL);
+        }
+        close(fd);
+    }
+    return NULL;
+}
+
+/*
+ * openSlow - connect to the proxy with a small receive buffer, so the
+ *     kernel does not soak up the body a slow reader does not read.
+ */
+
+static int openSlow() {
+    struct addrinfo hints, *list, *p;
+    int fd = -1, rcvbuf = 16384;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    if (getaddrinfo(opt.proxyHost, opt.proxyPort, &hints, &list) != 0)
+        return -1;
+    for (p = list; p; p = p->ai_next) {
+        if ((fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(list);
+    return fd;
+}
+
+/*
+ * slowReader - fetch a new large object each round and read its body
+ *     at opt.readRate, sleeping after every read for as long as its
+ *     bytes take at that rate.
+ */
+
+static void *slowReader(void *vargp) {
+    char buf[16384];
+    struct timespec pause;
+    long n, total, id;
+    int fd;
+
+    while (!__atomic_load_n(&slowStop, __ATOMIC_RELAXED)) {
+        if ((fd = openSlow()) < 0) {
+            __atomic_fetch_add(&slowFailed, 1, __ATOMIC_RELAXED);
+            sleep(1);
+            continue;
+        }
+        id = __atomic_fetch_add(&bigIssued, 1, __ATOMIC_RELAXED);
+        snprintf(buf, sizeof(buf), "GET http://localhost:%s/big/%ld "
+            "HTTP/1.0\r\n\r\n", opt.originPort, id);
+        total = 0;
+        if (rio_writen(fd, buf, strlen(buf)) > 0) {
+            while (!__atomic_load_n(&slowStop, __ATOMIC_RELAXED)
+                    && (n = read(fd, buf, sizeof(buf))) > 0) {
+                total += n;
+                pause.tv_sec = n / opt.readRate;
+                pause.tv_nsec = (long)(1e9 * (n % opt.readRate)
+                    / opt.readRate);
+                nanosleep(&pause, NULL);
+            }
+        }
+        close(fd);
+        __atomic_fetch_add(&slowBytes, total, __ATOMIC_RELAXED);
+        if (total > opt.bigSize)
+            __atomic_fetch_add(&slowReads, 1, __ATOMIC_RELAXED);
+        else if (!__atomic_load_n(&slowStop, __ATOMIC_RELAXED))
+            __atomic_fetch_add(&slowFailed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int cmpLong(const void *a, const void *b) {
+    unsigned long x = *(const unsigned long *)a, y = *(const unsigned long *)b;
+    return (x > y) - (x < y);
+}
+
+static unsigned long percentile(unsigned long *lat, long n, double p) {
+    long idx = (long)(p / 100.0 * n);
+
+    if (n == 0)
+        return 0;
+    if (idx >= n)
+        idx = n - 1;
+    return lat[idx];
+}
+
+static void usage(char *name) {
+    fprintf(stderr, "usage: %s [options] <proxy host> <proxy port>\n", name);
+    fprintf(stderr, "   -c <n>        concurrent clients (8)\n");
+    fprintf(stderr, "   -n <n>        total requests (10000)\n");
+    fprintf(stderr, "   -t <sec>      run for a duration instead of -n\n");
+    fprintf(stderr, "   -u <n>        distinct objects for Zipf (1000)\n");
+    fprintf(stderr, "   -z <s>        Zipf exponent (0.8)\n");
+    fprintf(stderr, "   -s <min[:max]> object size in bytes (16384)\n");
+    fprintf(stderr, "   -l <ms>       origin latency (0)\n");
+    fprintf(stderr, "   -R <bytes>    request random ranges of this length\n");
+    fprintf(stderr, "   -o <port>     origin stand-in port (18000)\n");
+    fprintf(stderr, "   -T <type>     origin Content-Type (text/plain)\n");
+    fprintf(stderr, "   -f <file>     replay URLs from a trace file\n");
+    fprintf(stderr, "   -x            do not start the origin stand-in\n");
+    fprintf(stderr, "   -C            request through CONNECT tunnels\n");
+    fprintf(stderr, "   -S <n>        also hold n slow clients which send"
+        " a header byte a second\n");
+    fprintf(stderr, "   -D <n>        also run n slow readers which fetch"
+        " large objects\n");
+    fprintf(stderr, "   -B <bytes>    object size of the slow readers"
+        " (4194304)\n");
+    fprintf(stderr, "   -r <bytes/s>  read rate of a slow reader (163840)\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    Worker *workers;
+    unsigned long start, elapsed, *all;
+    long done = 0, errors = 0, bytes = 0, i;
+    int c, listenfd;
+    pthread_t tid;
+    double sec;
+    char *pos;
+
+    while ((c = getopt(argc, argv, "hc:n:t:u:z:s:l:R:o:T:f:xCS:D:B:r:")) != -1) {
+        switch (c) {
+        case 'c': opt.conns = atoi(optarg); break;
+        case 'n': opt.requests = atol(optarg); break;
+        case 't': opt.duration = atof(optarg); opt.requests = 0; break;
+        case 'u': opt.objects = atoi(optarg); break;
+        case 'z': opt.zipf = atof(optarg); break;
+        case 's':
+            opt.minSize = opt.maxSize = atol(optarg);
+            if ((pos = strchr(optarg, ':')) != NULL)
+                opt.maxSize = atol(pos + 1);
+            break;
+        case 'l': opt.delayMs = atoi(optarg); break;
+        case 'R': opt.rangeLen = atol(optarg); break;
+        case 'o': opt.originPort = optarg; break;
+        case 'T': opt.type = optarg; break;
+        case 'f': opt.traceFile = optarg; break;
+        case 'x': opt.external = 1; break;
+        case 'C': opt.tunnel = 1; break;
+        case 'S': opt.slow = atoi(optarg); break;
+        case 'D': opt.slowReaders = atoi(optarg); break;
+        case 'B': opt.bigSize = atol(optarg); break;
+        case 'r': opt.readRate = atol(optarg); break;
+        case 'h':
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 2 || opt.conns <= 0 || opt.objects <= 0
+            || (opt.requests <= 0 && opt.duration <= 0) || opt.bigSize <= 0
+            || opt.readRate <= 0)
+        usage(argv[0]);
+    opt.proxyHost = argv[optind];
+    opt.proxyPort = argv[optind + 1];
+
+    Signal(SIGPIPE, SIG_IGN);
+
+    /* compressible but not trivial filler for object bodies */
+    fillBuf = (char *)Malloc(MAXBUF);
+    for (i = 0; i < MAXBUF; i++)
+        fillBuf[i] = "the quick brown fox jumps over the lazy dog\n"[i % 44];
+
+    if (opt.traceFile != NULL)
+        loadTrace();
+    else
+        buildZipf();
+
+    if (!opt.external) {
+        if ((listenfd = open_listenfd(opt.originPort)) < 0) {
+            fprintf(stderr, "Can not listen on origin port %s\n",
+                opt.originPort);
+            exit(1);
+        }
+        Pthread_create(&tid, NULL, originThread, (void *)(size_t)listenfd);
+    }
+
+    /* slow clients get a head start to tie up proxy workers */
+    for (i = 0; i < opt.slow; i++) {
+        Pthread_create(&tid, NULL, slowThread, NULL);
+        pthread_detach(tid);
+    }
+    for (i = 0; i < opt.slowReaders; i++) {
+        Pthread_create(&tid, NULL, slowReader, NULL);
+        pthread_detach(tid);
+    }
+    if (opt.slow > 0 || opt.slowReaders > 0)
+        sleep(1);
+
+    workers = (Worker *)Calloc(opt.conns, sizeof(Worker));
+    start = nowUs();
+    deadlineUs = start + (unsigned long)(opt.duration * 1e6);
+    for (i = 0; i < opt.conns; i++) {
+        workers[i].id = i;
+        workers[i].seed = 0x2545F4914F6CDD1DUL * (i + 1);
+        Pthread_create(&workers[i].tid, NULL, clientThread, &workers[i]);
+    }
+    for (i = 0; i < opt.conns; i++) {
+        Pthread_join(workers[i].tid, NULL);
+        done += workers[i].done;
+        errors += workers[i].errors;
+        bytes += workers[i].bytes;
+    }
+    elapsed = nowUs() - start;
+    sec = elapsed / 1e6;
+    __atomic_store_n(&slowStop, 1, __ATOMIC_RELAXED);
+
+    all = (unsigned long *)Malloc((done + 1) * sizeof(unsigned long));
+    for (done = 0, i = 0; i < opt.conns; i++) {
+        memcpy(all + done, workers[i].lat, workers[i].done * sizeof(long));
+        done += workers[i].done;
+    }
+    qsort(all, done, sizeof(unsigned long), cmpLong);
+
+    printf("requests      %ld\n", done);
+    printf("errors        %ld\n", errors);
+    printf("duration      %.2f s\n", sec);
+    printf("throughput    %.1f req/s  %.2f MB/s\n", done / sec,
+        bytes / sec / (1 << 20));
+    printf("latency us    p50 %lu  p90 %lu  p99 %lu  p99.9 %lu  max %lu\n",
+        percentile(all, done, 50), percentile(all, done, 90),
+        percentile(all, done, 99), percentile(all, done, 99.9),
+        done ? all[done - 1] : 0);
+    if (!opt.external) {
+        printf("origin reqs   %ld\n", originRequests);
+        printf("origin bytes  %.2f MB\n", originBytes / (double)(1 << 20));
+        printf("hit ratio     %.2f %%\n", done ? 100.0 *
+            (done - (originRequests < done ? originRequests : done)) / done
+            : 0.0);
+    }
+    if (opt.slow > 0)
+        printf("slow cut off  %ld\n", slowCut);
+    if (opt.slowReaders > 0)
+        printf("slow reads    %ld  failed %ld  %.2f MB\n", slowReads,
+            slowFailed, slowBytes / (double)(1 << 20));
+    return errors ? 2 : 0;
+}
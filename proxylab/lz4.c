@@ -0,0 +1,182 @@
+#include <string.h>
+
+#include "lz4.h"
+
+#define MIN_MATCH 4
+#define HASH_BITS 12
+/* the block ends with this many literals, the last match starts before */
+#define LAST_LITERALS 5
+#define MF_LIMIT 12
+#define MAX_DISTANCE 65535
+
+static unsigned int read32(unsigned char *p) {
+    unsigned int v;
+
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static unsigned int hash32(unsigned int v) {
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*
+ * putLength - the part of a length which did not fit into its 4 bits of
+ *     the token, as 255s and a final byte below 255.
+ */
+
+static unsigned char *putLength(unsigned char *op, long len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/*
+ * putSequence - literals followed by a match of matchLen bytes offset
+ *     back, no match when matchLen is 0. Returns NULL if it does not fit
+ *     before oend.
+ */
+
+static unsigned char *putSequence(unsigned char *op, unsigned char *oend,
+    unsigned char *lit, long litLen, long offset, long matchLen) {
+
+    unsigned char *token;
+
+    if (op + 1 + litLen / 255 + 1 + litLen + 2 + matchLen / 255 + 1 > oend)
+        return NULL;
+
+    token = op++;
+    if (litLen >= 15) {
+        *token = 15 << 4;
+        op = putLength(op, litLen - 15);
+    }
+    else
+        *token = litLen << 4;
+    memcpy(op, lit, litLen);
+    op += litLen;
+    if (matchLen == 0)
+        return op;
+
+    *op++ = offset & 0xff;
+    *op++ = offset >> 8;
+    matchLen -= MIN_MATCH;
+    if (matchLen >= 15) {
+        *token |= 15;
+        op = putLength(op, matchLen - 15);
+    }
+    else
+        *token |= matchLen;
+    return op;
+}
+
+/*
+ * lz4Compress - compress n bytes of src into dst of room bytes. Returns
+ *     the size of the block, or 0 if it did not fit.
+ */
+
+long lz4Compress(char *src, long n, char *dst, long room) {
+    unsigned int table[1 << HASH_BITS], seq, h;
+    unsigned char *base = (unsigned char *)src, *ip = base, *anchor = base;
+    unsigned char *end = base + n, *ref, *op = (unsigned char *)dst;
+    unsigned char *oend = op + room;
+    long len;
+
+    memset(table, 0, sizeof(table));
+    while (n >= MF_LIMIT + 1 && ip < end - MF_LIMIT) {
+        seq = read32(ip);
+        h = hash32(seq);
+        ref = base + table[h];
+        table[h] = ip - base;
+        if (ref >= ip || ip - ref > MAX_DISTANCE || read32(ref) != seq) {
+            ip++;
+            continue;
+        }
+
+        /* the match may have started before ip */
+        while (ip > anchor && ref > base && ip[-1] == ref[-1]) {
+            ip--;
+            ref--;
+        }
+        for (len = MIN_MATCH; ip + len < end - LAST_LITERALS
+                && ip[len] == ref[len]; len++)
+            ;
+
+        if ((op = putSequence(op, oend, anchor, ip - anchor, ip - ref, len))
+                == NULL)
+            return 0;
+        ip += len;
+        anchor = ip;
+    }
+
+    if ((op = putSequence(op, oend, anchor, end - anchor, 0, 0)) == NULL)
+        return 0;
+    return op - (unsigned char *)dst;
+}
+
+/*
+ * lz4Decompress - decompress a block of n bytes into dst, which it must
+ *     fill exactly. Returns -1 if the block is corrupt.
+ */
+
+int lz4Decompress(char *src, long n, char *dst, long size) {
+    unsigned char *ip = (unsigned char *)src, *iend = ip + n;
+    unsigned char *op = (unsigned char *)dst, *oend = op + size, *match;
+    unsigned char token, b;
+    long len, offset;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        len = token >> 4;
+        if (len == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        if (len > iend - ip || len > oend - op)
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+        /* the last sequence has no match */
+        if (ip == iend)
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > op - (unsigned char *)dst)
+            return -1;
+
+        len = token & 15;
+        if (len == 15) {
+            do {
+                if (ip >= iend)
+                    return -1;
+                b = *ip++;
+                len += b;
+            } while (b == 255);
+        }
+        len += MIN_MATCH;
+        if (len > oend - op)
+            return -1;
+
+        /* a match may overlap its own output, then it repeats */
+        match = op - offset;
+        if (offset >= len) {
+            memcpy(op, match, len);
+            op += len;
+        }
+        else {
+            while (len-- > 0)
+                *op++ = *match++;
+        }
+    }
+    return op == oend ? 0 : -1;
+}
@@ -0,0 +1,24 @@
+#ifndef __LZ4_H__
+#define __LZ4_H__
+
+/*
+ * LZ4 is defined as followed:
+ *     The LZ4 block format, as written by the reference implementation
+ *     and read by any LZ4 block decoder. A block is a sequence of
+ *     sequences, each a token, literals copied as they are and a match
+ *     copied from up to 64 KB back in the output. The last sequence has
+ *     literals only, and the last five bytes are always literals.
+ *
+ *     The compressor is the greedy single pass one of the reference,
+ *     with a hash table of 4-byte prefixes and no chains, which is what
+ *     makes LZ4 cheap enough to run on every demotion (cache.h). Blocks
+ *     carry no length, the caller keeps the original size.
+ */
+
+/* the largest block compressing n bytes may give */
+#define LZ4_BOUND(n) ((n) + (n) / 255 + 16)
+
+long lz4Compress(char*, long, char*, long);
+int lz4Decompress(char*, long, char*, long);
+
+#endif /* __LZ4_H__ */
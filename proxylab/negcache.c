@@ -0,0 +1,187 @@
+#include "csapp.h"
+#include "stats.h"
+#include "arena.h"
+#include "negcache.h"
+
+#define NEG_BUCKETS 1024
+
+typedef struct _negEntry {
+    char *key;              /* "host:port", with the filename for a status */
+    int kind;
+    int status;
+    char *response;         /* head and body, NEG_STATUS only */
+    long len;
+    unsigned long expires;  /* us, see statsNow */
+    struct _negEntry *hnext;
+} NegEntry;
+
+static pthread_mutex_t negMutex = PTHREAD_MUTEX_INITIALIZER;
+static NegEntry *entries[NEG_BUCKETS];
+static long count = 0;
+static unsigned long ttlUs = DEFAULT_NEG_TTL * 1000000UL;
+
+static unsigned int hashKey(char *key) {
+    unsigned int h = 2166136261u;
+
+    for (; *key; key++)
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    return h;
+}
+
+static void freeEntry(NegEntry *e) {
+    count--;
+    Free(e->key);
+    if (e->response)
+        Free(e->response);
+    Free(e);
+}
+
+/*
+ * findEntry - the live entry of key, the expired ones of its bucket are
+ *     dropped on the way. Must hold negMutex.
+ */
+
+static NegEntry *findEntry(char *key, unsigned long now) {
+    NegEntry **pp = &entries[hashKey(key) % NEG_BUCKETS], *e;
+
+    while ((e = *pp) != NULL) {
+        if (e->expires <= now) {
+            *pp = e->hnext;
+            freeEntry(e);
+            continue;
+        }
+        if (!strcmp(e->key, key))
+            return e;
+        pp = &e->hnext;
+    }
+    return NULL;
+}
+
+/*
+ * addEntry - a new entry for key, NULL if the cache is full. Must hold
+ *     negMutex and have looked for key with findEntry.
+ */
+
+static NegEntry *addEntry(char *key, int kind, unsigned long now) {
+    unsigned int b = hashKey(key) % NEG_BUCKETS;
+    NegEntry *e;
+
+    if (count >= NEG_MAX_ENTRIES)
+        return NULL;
+    e = (NegEntry *)Calloc(1, sizeof(NegEntry));
+    e->key = strdup(key);
+    e->kind = kind;
+    e->expires = now + ttlUs;
+    e->hnext = entries[b];
+    entries[b] = e;
+    count++;
+    statsInc(STAT_NEG_INSERTS);
+    return e;
+}
+
+static void dumpNegCache(FILE *fp) {
+    pthread_mutex_lock(&negMutex);
+    fprintf(fp, "# TYPE proxy_negative_entries gauge\n");
+    fprintf(fp, "proxy_negative_entries %ld\n", count);
+    pthread_mutex_unlock(&negMutex);
+}
+
+/*
+ * negInit - keep failures for ttl seconds, 0 keeps none.
+ */
+
+void negInit(int ttl) {
+    ttlUs = ttl * 1000000UL;
+    statsRegisterDump(dumpNegCache);
+}
+
+/*
+ * negOrigin - why host:port failed lately, NEG_NONE if it did not.
+ */
+
+int negOrigin(char *host, char *port) {
+    char key[MAXLINE];
+    NegEntry *e;
+    int kind = NEG_NONE;
+
+    if (ttlUs == 0)
+        return NEG_NONE;
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+
+    pthread_mutex_lock(&negMutex);
+    if ((e = findEntry(key, statsNow())) != NULL) {
+        kind = e->kind;
+        statsInc(STAT_NEG_HITS);
+    }
+    pthread_mutex_unlock(&negMutex);
+    return kind;
+}
+
+void negOriginFailed(char *host, char *port, int kind) {
+    char key[MAXLINE];
+    unsigned long now = statsNow();
+
+    if (ttlUs == 0)
+        return;
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+
+    pthread_mutex_lock(&negMutex);
+    if (findEntry(key, now) == NULL)
+        addEntry(key, kind, now);
+    pthread_mutex_unlock(&negMutex);
+}
+
+/*
+ * negResponse - the error response origin gave for filename lately, a
+ *     copy from the request arena, and its length and status. NULL if
+ *     there is none.
+ */
+
+char *negResponse(char *host, char *port, char *filename, long *len,
+    int *status) {
+
+    char key[MAXLINE], *response = NULL;
+    NegEntry *e;
+
+    if (ttlUs == 0)
+        return NULL;
+    snprintf(key, sizeof(key), "%s:%s%s", host, port, filename);
+
+    pthread_mutex_lock(&negMutex);
+    if ((e = findEntry(key, statsNow())) != NULL) {
+        response = (char *)arenaAlloc(e->len);
+        memcpy(response, e->response, e->len);
+        *len = e->len;
+        *status = e->status;
+        statsInc(STAT_NEG_HITS);
+    }
+    pthread_mutex_unlock(&negMutex);
+    return response;
+}
+
+/*
+ * negAddResponse - keep an error response, head and body, which came
+ *     for filename.
+ */
+
+void negAddResponse(char *host, char *port, char *filename, char *response,
+    long len, int status) {
+
+    char key[MAXLINE];
+    unsigned long now = statsNow();
+    NegEntry *e;
+
+    if (ttlUs == 0 || len > NEG_MAX_RESPONSE)
+        return;
+    snprintf(key, sizeof(key), "%s:%s%s", host, port, filename);
+
+    pthread_mutex_lock(&negMutex);
+    if (findEntry(key, now) == NULL
+            && (e = addEntry(key, NEG_STATUS, now)) != NULL) {
+        e->response = (char *)Malloc(len);
+        memcpy(e->response, response, len);
+        e->len = len;
+        e->status = status;
+    }
+    pthread_mutex_unlock(&negMutex);
+}
@@ -0,0 +1,40 @@
+#ifndef __NEGCACHE_H__
+#define __NEGCACHE_H__
+
+/*
+ * Negative cache is defined as followed:
+ *     Failures are remembered for a short time, so a dead origin costs
+ *     one resolution or one connect timeout per TTL rather than one per
+ *     request, and a missing object one fetch.
+ *
+ *     An origin ("host:port") whose name did not resolve or which could
+ *     not be connected to is answered with 502 until its entry expires,
+ *     without taking an upstream slot. A 404 or 5xx response which was
+ *     read completely, head and body, is kept under the origin and the
+ *     filename and replayed as it came, in place of a fetch.
+ *
+ *     Entries are never refreshed, an origin is tried again once its
+ *     entry has expired. Expired entries are dropped by whoever walks
+ *     past them. A TTL of 0 turns the cache off.
+ */
+
+#define DEFAULT_NEG_TTL 5           /* seconds */
+#define NEG_MAX_ENTRIES 4096
+/* a larger error response is not worth keeping */
+#define NEG_MAX_RESPONSE 4096
+
+/* why an origin failed, myOpen_clientfd returns the negative */
+enum {
+    NEG_NONE,
+    NEG_UNRESOLVED,
+    NEG_UNREACHABLE,
+    NEG_STATUS                      /* a response, not an origin */
+};
+
+void negInit(int);
+int negOrigin(char*, char*);
+void negOriginFailed(char*, char*, int);
+char *negResponse(char*, char*, char*, long*, int*);
+void negAddResponse(char*, char*, char*, char*, long, int);
+
+#endif /* __NEGCACHE_H__ */
@@ -0,0 +1,163 @@
+#include <ctype.h>
+#include <limits.h>
+
+#include "csapp.h"
+#include "parse.h"
+
+/*
+ * copyField - copy the len bytes at src into dst of size bytes, with the
+ *     null char. Returns -1 if they do not fit.
+ */
+
+static int copyField(char *dst, int size, char *src, int len) {
+    if (len < 0 || len >= size)
+        return -1;
+    memcpy(dst, src, len);
+    dst[len] = '\0';
+    return 0;
+}
+
+/*
+ * parseHostPort - split the len bytes of "host[:port]" at src into host
+ *     and port. Returns -1 if the host is empty or holds a space or a
+ *     control char, if the port is not one, or if either does not fit.
+ */
+
+int parseHostPort(char *src, int len, char *host, int hostSize, char *port,
+    int portSize) {
+
+    char *end = src + len, *colon, *p;
+    long value = 0;
+
+    if (len > 0 && src[0] == '[') {
+        /* an IPv6 literal keeps its brackets */
+        if ((p = memchr(src, ']', len)) == NULL
+                || (p + 1 < end && p[1] != ':'))
+            return -1;
+        colon = p + 1 < end ? p + 1 : NULL;
+    }
+    else
+        colon = memchr(src, ':', len);
+
+    if (colon == NULL) {
+        if (copyField(port, portSize, DEFAULT_HTTP_PORT,
+                strlen(DEFAULT_HTTP_PORT)) < 0)
+            return -1;
+        colon = end;
+    }
+    else {
+        for (p = colon + 1; p < end; p++)
+            if (!isdigit((unsigned char)*p)
+                    || (value = value * 10 + *p - '0') > 65535)
+                return -1;
+        if (value == 0
+                || copyField(port, portSize, colon + 1, end - colon - 1) < 0)
+            return -1;
+    }
+
+    for (p = src; p < colon; p++)
+        if ((unsigned char)*p <= ' ' || *p == 0x7f)
+            return -1;
+    if (colon == src)
+        return -1;
+    return copyField(host, hostSize, src, colon - src);
+}
+
+/*
+ * parseUri - split the URI of a request line into host, port and path.
+ *     A URI with no scheme is taken as "host[:port][/path]", one in
+ *     origin form leaves host empty. Returns -1 if it is none of them.
+ */
+
+int parseUri(char *uri, char *host, int hostSize, char *port, int portSize,
+    char *path, int pathSize) {
+
+    int len;
+
+    if (uri[0] == '/') {
+        host[0] = '\0';
+        if (copyField(port, portSize, DEFAULT_HTTP_PORT,
+                strlen(DEFAULT_HTTP_PORT)) < 0)
+            return -1;
+        return copyField(path, pathSize, uri, strlen(uri));
+    }
+
+    if (!strncasecmp(uri, "http://", 7))
+        uri += 7;
+    len = strcspn(uri, "/?");
+    if (parseHostPort(uri, len, host, hostSize, port, portSize) < 0)
+        return -1;
+    uri += len;
+
+    /* "http://host" and "http://host?q" have the root as path */
+    if (*uri != '/') {
+        if (pathSize < 2)
+            return -1;
+        path[0] = '/';
+        return copyField(path + 1, pathSize - 1, uri, strlen(uri));
+    }
+    return copyField(path, pathSize, uri, strlen(uri));
+}
+
+/*
+ * parseVersion - true for the versions of a request the proxy serves.
+ */
+
+int parseVersion(char *version) {
+    return !strcasecmp(version, "HTTP/1.0") || !strcasecmp(version, "HTTP/1.1")
+        || !strcasecmp(version, "HTTP/0.9");
+}
+
+/*
+ * parseHeader - the value of a header line if its name is name, NULL
+ *     otherwise. It still ends with the line.
+ */
+
+char* parseHeader(char *line, char *name) {
+    int n = strlen(name);
+
+    if (strncasecmp(line, name, n) || line[n] != ':')
+        return NULL;
+    for (line += n + 1; *line == ' ' || *line == '\t'; line++)
+        ;
+    return line;
+}
+
+/*
+ * parseStatusLine - the status code of a response status line, -1 if it
+ *     is not one.
+ */
+
+int parseStatusLine(char *line) {
+    char *p;
+
+    if (strncasecmp(line, "HTTP/", 5) || (p = strchr(line, ' ')) == NULL)
+        return -1;
+    while (*p == ' ')
+        p++;
+    if (!isdigit((unsigned char)p[0]) || !isdigit((unsigned char)p[1])
+            || !isdigit((unsigned char)p[2]) || isdigit((unsigned char)p[3]))
+        return -1;
+    return (p[0] - '0') * 100 + (p[1] - '0') * 10 + p[2] - '0';
+}
+
+/*
+ * parseLength - a header value which must be a length in decimal, up to
+ *     the line end or trailing spaces. Returns -1 if it is not.
+ */
+
+long parseLength(char *value) {
+    long n = 0;
+    char *p;
+
+    for (p = value; isdigit((unsigned char)*p); p++) {
+        if (n > (LONG_MAX - 9) / 10)
+            return -1;
+        n = n * 10 + *p - '0';
+    }
+    if (p == value)
+        return -1;
+    while (*p == ' ' || *p == '\t')
+        p++;
+    return *p == '\0' || *p == '\r' || *p == '\n' ? n : -1;
+}
@@ -0,0 +1,32 @@
+#ifndef __PARSE_H__
+#define __PARSE_H__
+
+/*
+ * HTTP parsing is defined as followed:
+ *     The pieces of requests and responses the proxy looks into are
+ *     parsed here, from strings only, so nothing depends on a socket and
+ *     every function can be driven with any bytes at all. Nothing is
+ *     written past the sizes passed in, a field which does not fit is an
+ *     error rather than cut short.
+ *
+ *     URI:
+ *           absolute "http://host[:port][/path]", the scheme in any case,
+ *           or origin form "/path" whose host comes from the Host header.
+ *     Host and port:
+ *           "host[:port]", an IPv6 literal in brackets. The port is 1 to
+ *           65535 in decimal and 80 when it is missing.
+ *     Header line:
+ *           "Name:" in any case, the value follows after optional spaces
+ *           and runs up to the line end.
+ */
+
+#define DEFAULT_HTTP_PORT "80"
+
+int parseHostPort(char*, int, char*, int, char*, int);
+int parseUri(char*, char*, int, char*, int, char*, int);
+int parseVersion(char*);
+char* parseHeader(char*, char*);
+int parseStatusLine(char*);
+long parseLength(char*);
+
+#endif /* __PARSE_H__ */
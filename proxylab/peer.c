@@ -0,0 +1,513 @@
+#include <netinet/tcp.h>
+
+#include "csapp.h"
+#include "stats.h"
+#include "arena.h"
+#include "cache.h"
+#include "coro.h"
+#include "peer.h"
+
+/* op, flags and the lengths of port, host, filename and header */
+#define PEER_REQUEST_HEAD 12
+/* typeLen, size and total */
+#define PEER_HIT_HEAD 20
+/* larger requests or answers are taken as garbage */
+#define PEER_MAX_FIELD (64 * 1024)
+#define PEER_MAX_OBJECT (1L << 30)
+/* the header lines of an object go into a MAXBUF response head */
+#define PEER_MAX_TYPE (MAXBUF / 2)
+/* a peer which could not be connected to is left alone this long */
+#define PEER_RETRY_MS 1000
+
+typedef struct _peerConn {
+    int fd;
+    rio_t rio;
+    struct _peerConn *next;
+} PeerConn;
+
+struct _peer {
+    char *host;
+    char *port;
+    int self;
+    pthread_mutex_t mutex;
+    PeerConn *idle;             /* pooled connections, most recent first */
+    int nidle;
+    unsigned long downUntil;    /* ms, see timerNowMs */
+    unsigned long requests;     /* asked by this instance */
+    unsigned long hits;
+};
+
+/* a point of a member on the ring */
+typedef struct _ringPoint {
+    unsigned int hash;
+    Peer *peer;
+} RingPoint;
+
+static Peer peers[MAX_PEERS];
+static int npeers = 0;
+static RingPoint *ring = NULL;
+static int npoints = 0;
+static PeerFill fill = NULL;
+static PeerConnect connectPeer = NULL;
+
+/*
+ * mixHash - the finalizer of MurmurHash3. FNV alone leaves keys which
+ *     differ in their last bytes close together, which clusters them on
+ *     the ring.
+ */
+
+static unsigned int mixHash(unsigned int h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+static unsigned int hashString(char *s) {
+    unsigned int h = 2166136261u;
+
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * 16777619u;
+    return mixHash(h);
+}
+
+static int cmpPoint(const void *a, const void *b) {
+    unsigned int x = ((RingPoint *)a)->hash, y = ((RingPoint *)b)->hash;
+
+    return x < y ? -1 : x > y;
+}
+
+static void put16(unsigned char *p, unsigned long v) {
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static void put32(unsigned char *p, unsigned long v) {
+    put16(p, v >> 16);
+    put16(p + 2, v);
+}
+
+static void put64(unsigned char *p, unsigned long v) {
+    put32(p, v >> 32);
+    put32(p + 4, v);
+}
+
+static unsigned long get16(unsigned char *p) {
+    return (unsigned long)p[0] << 8 | p[1];
+}
+
+static unsigned long get32(unsigned char *p) {
+    return get16(p) << 16 | get16(p + 2);
+}
+
+static unsigned long get64(unsigned char *p) {
+    return get32(p) << 32 | get32(p + 4);
+}
+
+/*
+ * noDelay - requests and answers are written as a head and a body, Nagle
+ *     would hold the body back for the delayed ACK of the head.
+ */
+
+static void noDelay(int fd) {
+    int on = 1;
+
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+/*
+ * readField - read a string of len bytes sent by a peer into the request
+ *     arena, NUL terminated. NULL if the connection failed.
+ */
+
+static char *readField(rio_t *rp, unsigned long len) {
+    char *s = (char *)arenaAlloc(len + 1);
+
+    if (coroReadnb(rp, s, len) != (ssize_t)len)
+        return NULL;
+    s[len] = '\0';
+    return s;
+}
+
+/*
+ * answer - answer one request of a peer from the cache, filling it first
+ *     on a miss. Returns -1 if the peer is gone.
+ */
+
+static int answer(int fd, char *port, char *host, char *filename,
+    char *header, int flags) {
+
+    unsigned char head[1 + PEER_HIT_HEAD];
+    char *object, *type;
+    long size, total;
+    int gzip = flags & PEER_GZIP, status = PEER_HIT;
+
+    statsInc(STAT_PEER_SERVED);
+    /* no request target holds a space, only the name of a segment */
+    if (strstr(filename, SEGMENT_SEP) != NULL) {
+        head[0] = PEER_MISS;
+        return coroWriten(fd, head, 1) == 1 ? 0 : -1;
+    }
+    if ((object = findItemInCache(port, host, filename, header, &size, &type,
+            &total, gzip)) == NULL) {
+        statsInc(STAT_PEER_FILLS);
+        status = PEER_FILLED;
+        fill(host, port, filename, header);
+        object = findItemInCache(port, host, filename, header, &size, &type,
+            &total, gzip);
+    }
+
+    /* the asking member would refuse header lines this long */
+    if (object == NULL || strlen(type) > PEER_MAX_TYPE) {
+        head[0] = PEER_MISS;
+        return coroWriten(fd, head, 1) == 1 ? 0 : -1;
+    }
+    head[0] = status;
+    put32(head + 1, strlen(type));
+    put64(head + 5, size);
+    put64(head + 13, total);
+    if (coroWriten(fd, head, sizeof(head)) < 0
+            || coroWriten(fd, type, strlen(type)) < 0
+            || coroWriten(fd, object, size) < 0)
+        return -1;
+    return 0;
+}
+
+/*
+ * serveThread - serve the requests of a peer connection one after the
+ *     other, until the peer closes it.
+ */
+
+static void *serveThread(void *vargp) {
+    int fd = (int)(size_t)vargp;
+    unsigned char head[PEER_REQUEST_HEAD];
+    unsigned long len[4];
+    char *field[4];
+    rio_t rio;
+    int i;
+
+    Pthread_detach(pthread_self());
+    noDelay(fd);
+    Rio_readinitb(&rio, fd);
+
+    while (coroReadnb(&rio, head, sizeof(head)) == sizeof(head)) {
+        len[0] = get16(head + 2);
+        len[1] = get16(head + 4);
+        len[2] = get16(head + 6);
+        len[3] = get32(head + 8);
+        if (head[0] != PEER_GET || len[3] > PEER_MAX_FIELD)
+            break;
+        for (i = 0; i < 4; i++)
+            if ((field[i] = readField(&rio, len[i])) == NULL)
+                break;
+        if (i < 4 || answer(fd, field[0], field[1], field[2], field[3],
+                head[1]) < 0)
+            break;
+        arenaReset();
+    }
+    arenaReset();
+    close(fd);
+    return NULL;
+}
+
+static void *listenThread(void *vargp) {
+    int listenfd = (int)(size_t)vargp, connfd;
+    pthread_t tid;
+
+    for (; ;) {
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0)
+            continue;
+        Pthread_create(&tid, NULL, serveThread, (void *)(size_t)connfd);
+    }
+    return NULL;
+}
+
+static void dumpPeers(FILE *fp) {
+    unsigned long requests, hits, allRequests = 0, allHits = 0;
+    int i;
+
+    fprintf(fp, "# TYPE proxy_peer_members gauge\n");
+    fprintf(fp, "proxy_peer_members %d\n", npeers);
+    fprintf(fp, "# TYPE proxy_peer_owner_requests gauge\n");
+    fprintf(fp, "# TYPE proxy_peer_owner_hits gauge\n");
+    for (i = 0; i < npeers; i++) {
+        if (peers[i].self)
+            continue;
+        requests = __atomic_load_n(&peers[i].requests, __ATOMIC_RELAXED);
+        hits = __atomic_load_n(&peers[i].hits, __ATOMIC_RELAXED);
+        fprintf(fp, "proxy_peer_owner_requests{peer=\"%s:%s\"} %lu\n",
+            peers[i].host, peers[i].port, requests);
+        fprintf(fp, "proxy_peer_owner_hits{peer=\"%s:%s\"} %lu\n",
+            peers[i].host, peers[i].port, hits);
+        allRequests += requests;
+        allHits += hits;
+    }
+    fprintf(fp, "# TYPE proxy_peer_hit_ratio gauge\n");
+    fprintf(fp, "proxy_peer_hit_ratio %g\n",
+        allRequests ? (double)allHits / allRequests : 0.0);
+}
+
+/*
+ * addPeer - add the member "host:port". Returns NULL if it is malformed
+ *     or there are too many.
+ */
+
+static Peer *addPeer(char *member) {
+    char *colon = strrchr(member, ':');
+    Peer *p;
+    int i;
+
+    if (colon == NULL || colon == member || atoi(colon + 1) <= 0)
+        return NULL;
+    for (i = 0; i < npeers; i++) {
+        p = &peers[i];
+        if (strlen(p->host) == (size_t)(colon - member)
+                && !strncmp(p->host, member, colon - member)
+                && atoi(p->port) == atoi(colon + 1))
+            return p;
+    }
+    if (npeers == MAX_PEERS)
+        return NULL;
+
+    p = &peers[npeers++];
+    p->host = strndup(member, colon - member);
+    p->port = strdup(colon + 1);
+    pthread_mutex_init(&p->mutex, NULL);
+    return p;
+}
+
+/*
+ * peerInit - join the group members, a comma separated list of
+ *     "host:port", as self, listening on the port of self unless listenfd
+ *     is open already (see restart.h). Returns the listening socket, or
+ *     -1 if a member is malformed or the port can not be listened on.
+ */
+
+int peerInit(char *self, char *members, PeerFill fillFn,
+    PeerConnect connectFn, int listenfd) {
+
+    char *list = strdup(members), *member, *save;
+    char name[MAXLINE];
+    Peer *p;
+    pthread_t tid;
+    int i, j;
+
+    for (member = strtok_r(list, ",", &save); member != NULL;
+            member = strtok_r(NULL, ",", &save))
+        if (addPeer(member) == NULL) {
+            free(list);
+            return -1;
+        }
+    free(list);
+    if ((p = addPeer(self)) == NULL)
+        return -1;
+    p->self = 1;
+
+    ring = (RingPoint *)Malloc(npeers * PEER_VNODES * sizeof(RingPoint));
+    for (i = 0; i < npeers; i++)
+        for (j = 0; j < PEER_VNODES; j++) {
+            snprintf(name, sizeof(name), "%s:%d#%d", peers[i].host,
+                atoi(peers[i].port), j);
+            ring[npoints].hash = hashString(name);
+            ring[npoints++].peer = &peers[i];
+        }
+    qsort(ring, npoints, sizeof(RingPoint), cmpPoint);
+
+    fill = fillFn;
+    connectPeer = connectFn;
+    if (listenfd < 0 && (listenfd = open_listenfd(p->port)) < 0)
+        return -1;
+    Pthread_create(&tid, NULL, listenThread, (void *)(size_t)listenfd);
+    statsRegisterDump(dumpPeers);
+    return listenfd;
+}
+
+/*
+ * peerOwner - the member owning a URL, NULL if it is this one or there
+ *     is no group.
+ */
+
+Peer *peerOwner(char *port, char *host, char *filename) {
+    char key[3 * MAXLINE];
+    unsigned int hash;
+    int lo = 0, hi = npoints, mid;
+
+    if (npoints == 0)
+        return NULL;
+    hash = mixHash(cacheKey(port, host, filename, key, sizeof(key)));
+
+    /* the first point at or after hash, past the last is the first */
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (ring[mid].hash < hash)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == npoints)
+        lo = 0;
+    return ring[lo].peer->self ? NULL : ring[lo].peer;
+}
+
+/*
+ * takeConn - an idle connection to p, a new one if there is none or
+ *     fresh is set. NULL if p could not be connected to.
+ */
+
+static PeerConn *takeConn(Peer *p, int fresh, int *pooled) {
+    PeerConn *c = NULL;
+    int fd;
+
+    *pooled = 0;
+    if (!fresh) {
+        pthread_mutex_lock(&p->mutex);
+        if ((c = p->idle) != NULL) {
+            p->idle = c->next;
+            p->nidle--;
+        }
+        pthread_mutex_unlock(&p->mutex);
+    }
+    if (c != NULL) {
+        *pooled = 1;
+        return c;
+    }
+
+    if ((fd = connectPeer(p->host, p->port)) < 0) {
+        __atomic_store_n(&p->downUntil, timerNowMs() + PEER_RETRY_MS,
+            __ATOMIC_RELAXED);
+        return NULL;
+    }
+    noDelay(fd);
+    c = (PeerConn *)Malloc(sizeof(PeerConn));
+    c->fd = fd;
+    Rio_readinitb(&c->rio, fd);
+    return c;
+}
+
+static void putConn(Peer *p, PeerConn *c) {
+    pthread_mutex_lock(&p->mutex);
+    if (p->nidle < PEER_POOL) {
+        c->next = p->idle;
+        p->idle = c;
+        p->nidle++;
+        c = NULL;
+    }
+    pthread_mutex_unlock(&p->mutex);
+    if (c != NULL) {
+        close(c->fd);
+        Free(c);
+    }
+}
+
+/*
+ * exchange - send the request on c and read the answer into obj. Returns
+ *     its status or -1 if the connection failed, answered says whether
+ *     any of the answer came.
+ */
+
+static int exchange(PeerConn *c, unsigned char *req, long reqLen,
+    PeerObject *obj, int *answered) {
+
+    unsigned char status, head[PEER_HIT_HEAD];
+    unsigned long typeLen, size, total;
+
+    *answered = 0;
+    if (coroWriten(c->fd, req, reqLen) != reqLen
+            || coroReadnb(&c->rio, &status, 1) != 1)
+        return -1;
+    *answered = 1;
+    if (status == PEER_MISS)
+        return PEER_MISS;
+    if ((status != PEER_HIT && status != PEER_FILLED)
+            || coroReadnb(&c->rio, head, sizeof(head)) != sizeof(head))
+        return -1;
+
+    /* checked unsigned, so a size of 2^63 or more can not turn negative */
+    typeLen = get32(head);
+    size = get64(head + 4);
+    total = get64(head + 12);
+    if (typeLen > PEER_MAX_TYPE || size > PEER_MAX_OBJECT
+            || total > PEER_MAX_OBJECT || size > total
+            || (obj->type = readField(&c->rio, typeLen)) == NULL)
+        return -1;
+    obj->size = size;
+    obj->total = total;
+    obj->object = (char *)arenaAlloc(obj->size > 0 ? obj->size : 1);
+    if (coroReadnb(&c->rio, obj->object, obj->size) != obj->size) {
+        arenaFree(obj->object);
+        arenaFree(obj->type);
+        return -1;
+    }
+    return status;
+}
+
+/*
+ * peerFetch - ask the owner p for a URL, sending along header, the
+ *     request header for origin. The answer must come within ms, timer
+ *     holds the connection meanwhile. Unless the answer is PEER_MISS obj
+ *     is filled in from the request arena. Returns the answer, or -1 if p
+ *     failed.
+ *
+ *     A pooled connection may have been closed by the peer while it was
+ *     idle, a request which gets no answer on one is tried once more on
+ *     a new connection.
+ */
+
+int peerFetch(Peer *p, char *port, char *host, char *filename, char *header,
+    int acceptGzip, Timer *timer, unsigned long ms, PeerObject *obj) {
+
+    unsigned long len[4] = { strlen(port), strlen(host), strlen(filename),
+        strlen(header) };
+    unsigned char *req, *pos;
+    long reqLen = PEER_REQUEST_HEAD + len[0] + len[1] + len[2] + len[3];
+    int status = -1, attempt, pooled = 0, answered = 0, expired;
+    PeerConn *c;
+
+    if (timerNowMs() < __atomic_load_n(&p->downUntil, __ATOMIC_RELAXED)
+            || len[0] > 0xffff || len[1] > 0xffff || len[2] > 0xffff
+            || len[3] > PEER_MAX_FIELD)
+        return -1;
+
+    req = (unsigned char *)arenaAlloc(reqLen);
+    req[0] = PEER_GET;
+    req[1] = acceptGzip ? PEER_GZIP : 0;
+    put16(req + 2, len[0]);
+    put16(req + 4, len[1]);
+    put16(req + 6, len[2]);
+    put32(req + 8, len[3]);
+    pos = req + PEER_REQUEST_HEAD;
+    memcpy(pos, port, len[0]);
+    memcpy(pos += len[0], host, len[1]);
+    memcpy(pos += len[1], filename, len[2]);
+    memcpy(pos += len[2], header, len[3]);
+
+    statsInc(STAT_PEER_REQUESTS);
+    __atomic_add_fetch(&p->requests, 1, __ATOMIC_RELAXED);
+    for (attempt = 0; attempt < 2; attempt++) {
+        if ((c = takeConn(p, attempt > 0, &pooled)) == NULL)
+            break;
+        timerArm(timer, c->fd, TIMEOUT_TTFB, ms);
+        status = exchange(c, req, reqLen, obj, &answered);
+        expired = !timerArmed(timer);
+        timerCancel(timer);
+        if (status >= 0) {
+            putConn(p, c);
+            break;
+        }
+        close(c->fd);
+        Free(c);
+        if (!pooled || answered || expired)
+            break;
+    }
+    arenaFree(req);
+
+    if (status == PEER_HIT) {
+        statsInc(STAT_PEER_HITS);
+        __atomic_add_fetch(&p->hits, 1, __ATOMIC_RELAXED);
+    }
+    else if (status < 0)
+        statsInc(STAT_PEER_ERRORS);
+    return status;
+}
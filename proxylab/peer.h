@@ -0,0 +1,79 @@
+#ifndef __PEER_H__
+#define __PEER_H__
+
+#include "csapp.h"
+#include "timer.h"
+
+/*
+ * Peer cache is defined as followed:
+ *     Several proxies may share their caches. Every member of the group
+ *     is given the same list of members ("host:port" of their peer
+ *     ports) and its own entry. The members own the URLs by consistent
+ *     hashing: each has PEER_VNODES points on a ring of 32-bit hashes
+ *     and a URL, by its canonical cache key, belongs to the first point
+ *     at or after its hash. A member joining or leaving only moves the
+ *     URLs next to its own points.
+ *
+ *     A member which misses a URL it does not own asks the owner before
+ *     it goes to origin. The owner answers from its cache and, if it
+ *     misses too, fetches the object into its cache first (PeerFill),
+ *     so every object is fetched and stored by its owner only. The
+ *     asking member serves what it gets without caching it. If the
+ *     owner can not be reached or the object can not be cached (too
+ *     large, an error status), the member goes to origin itself.
+ *
+ *     Members talk over persistent TCP connections, up to PEER_POOL idle
+ *     ones kept per peer, one request at a time each. A request is
+ *
+ *         op (1)  flags (1)  port (2)  host (2)  filename (2)  header (4)
+ *
+ *     byte lengths in network order, followed by the four strings: the
+ *     URL and the request header the member would send to origin, which
+ *     picks the Vary variant. The answer is a status byte, for a hit or
+ *     a fill followed by
+ *
+ *         type (4)  size (8)  total (8)
+ *
+ *     and the header lines of the object and its bytes.
+ */
+
+#define PEER_VNODES 128
+#define PEER_POOL 8
+#define MAX_PEERS 64
+
+/* op */
+enum {
+    PEER_GET = 1
+};
+
+/* flags */
+#define PEER_GZIP 1         /* the client accepts gzip */
+
+/* status */
+enum {
+    PEER_HIT,               /* from the cache of the owner */
+    PEER_FILLED,            /* fetched by the owner for this request */
+    PEER_MISS
+};
+
+typedef struct _peer Peer;
+
+typedef struct _peerObject {
+    char *object;           /* from the request arena */
+    char *type;
+    long size;
+    long total;
+} PeerObject;
+
+/* fetch a URL into the local cache, with the request header given */
+typedef void (*PeerFill)(char *host, char *port, char *filename,
+    char *header);
+/* connect to host:port, -1 if that failed */
+typedef int (*PeerConnect)(char *host, char *port);
+
+int peerInit(char*, char*, PeerFill, PeerConnect, int);
+Peer *peerOwner(char*, char*, char*);
+int peerFetch(Peer*, char*, char*, char*, char*, int, Timer*, unsigned long,
+    PeerObject*);
+
+#endif /* __PEER_H__ */
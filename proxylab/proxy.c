@@ -17,9 +17,29 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
+#include <errno.h>
+#include <sys/prctl.h>
 
 #include "csapp.h"
 #include "cache.h"
+#include "stats.h"
+#include "accesslog.h"
+#include "tunnel.h"
+#include "topology.h"
+#include "arena.h"
+#include "warmup.h"
+#include "upstream.h"
+#include "timer.h"
+#include "uring.h"
+#include "coro.h"
+#include "h2.h"
+#include "negcache.h"
+#include "peer.h"
+#include "governor.h"
+#include "restart.h"
+#include "shmcache.h"
+#include "parse.h"
 /* Constant defined here */
 
 #define boolean int
@@ -29,84 +49,705 @@
 /* the number of the digit of port is between 1 and 5, plus the null char */
 #define MAXPORT 6
 
+/* 
+ * Range requests are served from fixed size segments of the object, each
+ * fetched from origin with its own Range request and cached on its own.
+ */
+#define SEGMENT_SIZE 65536
+
+/* origin bodies too large to cache are relayed in chunks of this size */
+#define RELAY_CHUNK 65536
+
+/* body bytes a request may buffer ahead of its client, see governor.h */
+#define DEFAULT_CONN_BUDGET (1L << 20)
+
+#define DEFAULT_WORKERS 64
+/* accepted connections waiting for a worker */
+#define CONN_QUEUE_SIZE 1024
+#define MAX_LISTENERS 64
+
+/* deadlines in seconds, see timer.h */
+#define DEFAULT_HEADER_TIMEOUT 10
+#define DEFAULT_CONNECT_TIMEOUT 5
+#define DEFAULT_TTFB_TIMEOUT 30
+#define DEFAULT_IDLE_TIMEOUT 30
+#define DEFAULT_WRITE_TIMEOUT 30
+
+/* how often a draining proxy checks for connections left */
+#define DRAIN_POLL_MS 100
+
+/* a prefork process which dies is replaced after this long */
+#define RESPAWN_DELAY_MS 100
+
 /* You won't lose style points for including these long lines in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *connection_hdr = "Connection: close\r\n";
 static const char *proxy_connection_hdr = "Proxy-Connection: close\r\n";
+static char *connect_ok = "HTTP/1.0 200 Connection established\r\n\r\n";
+
+/* Command line options */
+typedef struct _proxyOptions {
+    char *adminPort;
+    char *logFile;
+    long cacheSize;
+    long maxObjectSize;
+    int shards;
+    int hotShare;
+    int workers;
+    int listeners;
+    boolean pin;
+    int tunnelIdle;
+    char *warmFile;
+    int warmFetchers;
+    boolean warmBackground;
+    int originConns;
+    int upstreamConns;
+    unsigned long timeouts[TIMEOUT_PHASES];     /* ms */
+    int ioBackend;
+    boolean coroutines;
+    int negTtl;
+    char *peerSelf;
+    char *peerGroup;
+    long connBudget;
+    long inflightLimit;
+    char *restartPath;
+    int drainTimeout;
+    long sharedSize;
+    int processes;
+} ProxyOptions;
+
+/* Handed from main to a worker through the connection queue */
+typedef struct _connInfo {
+    int fd;
+    unsigned long acceptUs;
+} ConnInfo;
+
+/*
+ * Connection queue: a bounded buffer between the accepting thread and the
+ * workers, slots counts free entries and items queued connections.
+ */
+typedef struct _connQueue {
+    ConnInfo buf[CONN_QUEUE_SIZE];
+    int front;
+    int rear;
+    sem_t mutex;
+    sem_t slots;
+    sem_t items;
+} ConnQueue;
+
+/*
+ * Listener: each has its own SO_REUSEPORT socket on the proxy port, its
+ * own accepting thread and its own queue and workers. The kernel spreads
+ * new connections over the sockets, so accepting scales with listeners
+ * and nothing is shared between them but the cache.
+ * With pinning all threads of a listener run on its node, see topology.h.
+ */
+typedef struct _listener {
+    int listenfd;
+    int node;
+    int nextCpu;            /* round robin over the CPUs of node */
+    ConnQueue queue;
+} Listener;
+
+static Listener *listeners;
+static boolean pinThreads = false;
+static int ioBackend = IO_EPOLL;
+static long connBudget = DEFAULT_CONN_BUDGET;
+/* the client of warm-up and peer fills */
+static int devnull = -1;
+
+/* written once the sockets are handed over, see restart.h */
+static int drainPipe[2] = { -1, -1 };
+static int drainTimeout = DEFAULT_DRAIN_TIMEOUT;
+/* connections accepted and not served to the end yet */
+static int openConns = 0;
+
+/* deadlines in ms, per phase, see timer.h */
+static unsigned long timeoutMs[TIMEOUT_PHASES];
+/*
+ * The client and the origin connection of the request being served, and
+ * the HTTP/2 stream which stands in for its client, if any.
+ */
+typedef struct _reqLocal {
+    Timer client;
+    Timer upstream;
+    H2Stream *stream;
+} ReqLocal;
+
+/* a worker serves one request at a time, a coroutine has its own */
+static __thread ReqLocal workerLocal;
+
+/* Errors the proxy answers itself */
+enum {
+    ERR_NOT_IMPLEMENTED,
+    ERR_BAD_REQUEST,
+    ERR_BAD_HEADER,
+    ERR_BAD_CONNECT,
+    ERR_UNRESOLVED,
+    ERR_UNREACHABLE,
+    ERR_RANGE,
+    ERR_CLOSED,
+    ERR_TIMEOUT,
+    ERR_INTERNAL,
+    ERR_OVERLOADED,
+    ERRORS
+};
+
+/*
+ * The response of an error is the same for every request, so it is built
+ * once by initErrors and then written as it is.
+ */
+typedef struct _proxyError {
+    char *errnum;
+    char *shortmsg;
+    char *longmsg;
+    char *response;
+    int len;
+} ProxyError;
+
+static ProxyError proxyErrors[ERRORS] = {
+    [ERR_NOT_IMPLEMENTED] = { "501", "Not Implemented",
+        "Proxy does not forward this method" },
+    [ERR_BAD_REQUEST] = { "400", "Bad Request",
+        "Proxy can not parse the request" },
+    [ERR_BAD_HEADER] = { "400", "Bad Request", "Invalid Header" },
+    [ERR_BAD_CONNECT] = { "400", "Bad Request",
+        "CONNECT needs a host:port target" },
+    [ERR_UNRESOLVED] = { "502", "Bad Gateway",
+        "Proxy can not resolve the specified server" },
+    [ERR_UNREACHABLE] = { "502", "Bad Gateway",
+        "Proxy can not connect to the specified server" },
+    [ERR_RANGE] = { "502", "Bad Gateway",
+        "Proxy can not fetch the requested range" },
+    [ERR_CLOSED] = { "502", "Bad Gateway", "Origin closed the connection" },
+    [ERR_TIMEOUT] = { "504", "Gateway Timeout",
+        "Origin did not answer in time" },
+    [ERR_INTERNAL] = { "500", "Internal Error",
+        "Proxy encountered an critical error." },
+    [ERR_OVERLOADED] = { "503", "Service Unavailable",
+        "Proxy is out of buffer memory" },
+};
+
+/* Request headers the proxy acts on itself */
+typedef struct _reqHeaders {
+    char range[MAXLINE];
+    boolean acceptGzip;
+} ReqHeaders;
+
+/* A single byte range, -1 marks a missing bound */
+typedef struct _byteRange {
+    long start;
+    long end;
+} ByteRange;
 
-extern pthread_rwlock_t rwMutex;
-extern sem_t acMutex;
-extern ProxyCache proxyCache;
 
 static boolean isAddtReq(char*);
-static int myOpen_clientfd(char *, char *);
-static void* serveClient(void *);
-static void clienterror(int, char *, char *, char *, char *);
-static char* assemHeaders(rio_t*, char*, char*, char*);
-static void serveContentByWeb(char*, char*, char*, char*, int);
-static void serveContentByCache(char*, int, int, char*);
+static int myOpen_clientfd(char *, char *, unsigned long);
+static int openUpstream(ReqStat*, char*, char*, UpstreamOrigin**);
+static void closeUpstream(int, UpstreamOrigin*);
+static int myOpen_listenfd(char *, boolean);
+static void serveClient(ConnInfo*);
+static void* workerThread(void *);
+static void* acceptThread(void *);
+static void* loopThread(void *);
+static void initErrors();
+static void clienterror(ReqStat*, int, int);
+static void originError(ReqStat*, int, int);
+static char* assemHeaders(rio_t*, char*, char*, char*, ReqHeaders*);
+static boolean acceptsGzip(char*);
+static void serveContentByWeb(ReqStat*, char*, char*, char*, char*, int);
+static void serveContentByCache(ReqStat*, char*, int, long, char*);
+static void keepResponse(ReqStat*, char*, char*, char*, char*, char*, long,
+    char*, long, char*);
+static boolean serveRequest(ReqStat*, rio_t*, int);
+static void serveStream(H2Stream*, rio_t*, int, unsigned long);
+static boolean serveConnect(ReqStat*, rio_t*, int, char*);
+static boolean parseRange(char*, ByteRange*);
+static boolean resolveRange(ByteRange*, long);
+static void serveRange(ReqStat*, char*, char*, char*, char*, ByteRange*, int);
+static char* fetchSegment(ReqStat*, char*, char*, char*, char*, long,
+    long*, long*, char*);
+static ssize_t clientWrite(ReqStat*, int, void*, size_t);
+static ssize_t upstreamRead(rio_t*, void*, size_t);
+static void upstreamError(ReqStat*, int, char*);
+static int warmFetch(char*, char*, char*);
+static void peerFill(char*, char*, char*, char*);
+static int peerConnect(char*, char*);
+static boolean serveFromPeer(ReqStat*, char*, char*, char*, char*, boolean,
+    int);
+static void drainAndExit();
+
+static ReqLocal *reqLocal() {
+    ReqLocal *t = (ReqLocal *)coroLocal();
+
+    return t ? t : &workerLocal;
+}
+
+static Timer *clientTimer() {
+    return &reqLocal()->client;
+}
+
+static Timer *upstreamTimer() {
+    return &reqLocal()->upstream;
+}
+
+/*
+ * clientWrite - every byte sent to the client goes through here, so the
+ *     first byte time and the byte count of the request are tracked.
+ *     The write deadline is restarted on every chunk, a client which is
+ *     slow but keeps reading is fine, one which stops is cut off. The
+ *     client of an HTTP/2 stream is the stream.
+ */
+
+static ssize_t clientWrite(ReqStat *rs, int fd, void *buf, size_t n)
+{
+    size_t done, len;
+    H2Stream *st = reqLocal()->stream;
+
+    if (rs->firstByteUs == 0)
+        rs->firstByteUs = statsNow();
+    rs->bytes += n;
+
+    if (!timerArmed(clientTimer()))
+        timerArm(clientTimer(), fd, TIMEOUT_WRITE, timeoutMs[TIMEOUT_WRITE]);
+    for (done = 0; done < n; done += len) {
+        len = n - done < RELAY_CHUNK ? n - done : RELAY_CHUNK;
+        timerTouch(clientTimer());
+        if ((st ? h2Write(st, (char *)buf + done, len)
+                : coroWriten(fd, (char *)buf + done, len)) < 0)
+            return -1;
+    }
+    return n;
+}
+
+/*
+ * upstreamRead - read n bytes of body from origin like rio_readnb, in
+ *     chunks which each restart the idle deadline.
+ */
+
+static ssize_t upstreamRead(rio_t *rp, void *buf, size_t n)
+{
+    size_t done = 0, len;
+    ssize_t got;
+
+    while (done < n) {
+        len = n - done < RELAY_CHUNK ? n - done : RELAY_CHUNK;
+        timerTouch(upstreamTimer());
+        if ((got = coroReadnb(rp, (char *)buf + done, len)) < 0)
+            return -1;
+        done += got;
+        if ((size_t)got < len)
+            break;
+    }
+    return done;
+}
+
+/*
+ * upstreamError - origin failed before anything was sent to the client,
+ *     504 if it ran into a deadline and 502 otherwise.
+ */
+
+static void upstreamError(ReqStat *rs, int fd, char *host)
+{
+    if (!timerArmed(upstreamTimer()))
+        clienterror(rs, fd, ERR_TIMEOUT);
+    else
+        clienterror(rs, fd, ERR_CLOSED);
+}
+
+/*
+ * originError - the origin could not be connected to, why is what
+ *     myOpen_clientfd returned.
+ */
+
+static void originError(ReqStat *rs, int fd, int why)
+{
+    clienterror(rs, fd, why == -NEG_UNRESOLVED ? ERR_UNRESOLVED
+        : ERR_UNREACHABLE);
+}
+
+/*
+ * initErrors - build the response of every error
+ */
+
+static void initErrors()
+{
+    char body[MAXLINE], buf[MAXBUF];
+    ProxyError *e;
+    int n;
+
+    for (e = proxyErrors; e < proxyErrors + ERRORS; e++) {
+        n = snprintf(body, sizeof(body), "<html><title>Proxy Error</title>"
+            "<body bgcolor=\"ffffff\">\r\n%s: %s\r\n<p>%s\r\n"
+            "<hr><em>The proxy server</em>\r\n",
+            e->errnum, e->shortmsg, e->longmsg);
+        e->len = snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\n"
+            "Content-type: text/html\r\nContent-length: %d\r\n\r\n%s",
+            e->errnum, e->shortmsg, n, body);
+        e->response = strdup(buf);
+    }
+}
 
 /*
  * clienterror - returns an error message to the client
  */
 
-static void clienterror(int fd, char *cause, char *errnum,
-         char *shortmsg, char *longmsg)
+static void clienterror(ReqStat *rs, int fd, int err)
 {
-    char buf[MAXLINE], body[MAXBUF];
+    rs->status = atoi(proxyErrors[err].errnum);
+    statsInc(STAT_CLIENT_ERRORS);
+    clientWrite(rs, fd, proxyErrors[err].response, proxyErrors[err].len);
+}
 
-    /* Build the HTTP response body */
-    sprintf(body, "<html><title>Proxy Error</title>");
-    sprintf(body, "%s<body bgcolor=""ffffff"">\r\n", body);
-    sprintf(body, "%s%s: %s\r\n", body, errnum, shortmsg);
-    sprintf(body, "%s<p>%s: %s\r\n", body, longmsg, cause);
-    sprintf(body, "%s<hr><em>The proxy server</em>\r\n", body);
+/*
+ * connQueueInsert - add a connection at the rear, blocks while full.
+ */
 
-    /* Print the HTTP response */
-    sprintf(buf, "HTTP/1.0 %s %s\r\n", errnum, shortmsg);
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-type: text/html\r\n");
-    rio_writen(fd, buf, strlen(buf));
-    sprintf(buf, "Content-length: %d\r\n\r\n", (int)strlen(body));
-    rio_writen(fd, buf, strlen(buf));
-    rio_writen(fd, body, strlen(body));
+static void connQueueInsert(ConnQueue *q, ConnInfo *ci) {
+    P(&q->slots);
+    P(&q->mutex);
+    q->buf[(++q->rear) % CONN_QUEUE_SIZE] = *ci;
+    V(&q->mutex);
+    V(&q->items);
 }
 
 /*
- * serveClient - worker thread routine
- *     receive a socket as client file descriptor.
- *
- *        It will parse the incoming HTTP headers and search the cache using
- *     corresponding information and decide whether to server the content
- *     by cache directly or by web.
+ * connQueueRemove - take the connection at the front, blocks while empty.
  */
 
-static void* serveClient(void* connfd) {
+static void connQueueRemove(ConnQueue *q, ConnInfo *ci) {
+    P(&q->items);
+    P(&q->mutex);
+    *ci = q->buf[(++q->front) % CONN_QUEUE_SIZE];
+    V(&q->mutex);
+    V(&q->slots);
+}
 
-    char method[MAXLINE] = "\0", uri[MAXLINE] = "\0", version[MAXLINE] = "\0";
-    char firstline[MAXLINE], host[MAXLINE] = "\0", buf[MAXLINE] = "\0",
-        port[MAXPORT] = "\0", filename[MAXLINE] = "\0";
-    rio_t rio;
-    int fd = (int)(size_t)connfd, size;
-    char* header, *pos, *ciPtr, *type = NULL;
+/*
+ * workerThread - worker thread routine
+ *     serve connections from the queue of its listener forever.
+ */
+
+static void* workerThread(void* vargp) {
+
+    Listener *l = (Listener *)vargp;
+    ConnInfo ci;
 
     /* Detach the thread to avoid explicit thread join. */
     pthread_detach(pthread_self());
 
-    /* Read request line and headers */
+    /* pin before the first request allocates anything */
+    if (pinThreads)
+        numaPinThread(l->node,
+            __atomic_fetch_add(&l->nextCpu, 1, __ATOMIC_RELAXED));
+
+    for (; ;) {
+        connQueueRemove(&l->queue, &ci);
+        serveClient(&ci);
+    }
+    return NULL;
+}
+
+/*
+ * uringAccept - accept with one multishot accept on a ring of this
+ *     thread. Every io_uring_enter picks up the connections of all the
+ *     completions which arrived since the last one. Returns if the ring
+ *     can not be used, to fall back on accept.
+ */
+
+static void uringAccept(Listener *l) {
+    Uring ring;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    int armed = 0, res, more;
+    ConnInfo ci;
+
+    if (uringInit(&ring, 64) < 0)
+        return;
+
+    /* the drain pipe turning readable ends the loop */
+    if (drainPipe[0] >= 0) {
+        sqe = uringSqe(&ring);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = drainPipe[0];
+        sqe->poll_events = POLLIN;
+        sqe->user_data = 1;
+    }
+
+    for (; ;) {
+        if (!armed) {
+            sqe = uringSqe(&ring);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->fd = l->listenfd;
+            sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+            sqe->accept_flags = SOCK_CLOEXEC;
+            armed = 1;
+        }
+        if (uringSubmit(&ring, 1) < 0 && errno != EINTR) {
+            perror("io_uring_enter");
+            close(ring.fd);
+            return;
+        }
+
+        while ((cqe = uringCqe(&ring)) != NULL) {
+            res = cqe->res;
+            more = cqe->flags & IORING_CQE_F_MORE;
+            if (cqe->user_data == 1) {
+                uringCqeSeen(&ring);
+                close(ring.fd);
+                return;
+            }
+            uringCqeSeen(&ring);
+
+            /* the kernel ended the multishot, it is armed again */
+            if (!more)
+                armed = 0;
+            if (res < 0) {
+                if (res == -EINVAL && !more) {
+                    /* no multishot accept in this kernel */
+                    close(ring.fd);
+                    return;
+                }
+                continue;
+            }
+            ci.fd = res;
+            ci.acceptUs = statsNow();
+            statsInc(STAT_ACCEPTS);
+            __atomic_fetch_add(&openConns, 1, __ATOMIC_RELAXED);
+            connQueueInsert(&l->queue, &ci);
+        }
+    }
+}
+
+/*
+ * acceptOrDrain - accept on listenfd until the proxy starts draining,
+ *     see restart.h. The socket is non-blocking, the next proxy accepts
+ *     on it as well. Returns -1 once draining.
+ */
+
+static int acceptOrDrain(int listenfd, SA *addr, socklen_t *len) {
+    struct pollfd pfd[2];
+    int fd;
+
+    pfd[0].fd = listenfd;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = drainPipe[0];
+    pfd[1].events = POLLIN;
+    for (; ;) {
+        if (poll(pfd, 2, -1) < 0 && errno != EINTR)
+            unix_error("poll error");
+        if (pfd[1].revents)
+            return -1;
+        if (!pfd[0].revents)
+            continue;
+        if ((fd = accept(listenfd, addr, len)) >= 0)
+            return fd;
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR
+                && errno != ECONNABORTED)
+            unix_error("Accept error");
+    }
+}
+
+/*
+ * acceptThread - accept on the socket of one listener and queue the
+ *     connections for its workers, until the proxy starts draining.
+ */
+
+static void* acceptThread(void* vargp) {
+
+    Listener *l = (Listener *)vargp;
+    struct sockaddr_storage clientaddr;
+    socklen_t clientlen;
+    ConnInfo ci;
+
+    if (pinThreads)
+        numaPinThread(l->node,
+            __atomic_fetch_add(&l->nextCpu, 1, __ATOMIC_RELAXED));
+
+    if (ioBackend == IO_URING)
+        uringAccept(l);
+
+    for (; ;) {
+        clientlen = sizeof(clientaddr);
+        if (drainPipe[0] < 0)
+            ci.fd = Accept(l->listenfd, (SA *)&clientaddr, &clientlen);
+        else if ((ci.fd = acceptOrDrain(l->listenfd, (SA *)&clientaddr,
+                &clientlen)) < 0)
+            break;
+
+        /* 
+         * The accept time goes along with connfd so the worker can tell
+         * how long the request waited before its first byte was sent.
+         */
+
+        ci.acceptUs = statsNow();
+        statsInc(STAT_ACCEPTS);
+        __atomic_fetch_add(&openConns, 1, __ATOMIC_RELAXED);
+        connQueueInsert(&l->queue, &ci);
+    }
+    return NULL;
+}
+
+/*
+ * serveCoro - serve a connection accepted by a coroutine loop, in its
+ *     coroutine. The timers of the request live on its stack.
+ */
+
+static void serveCoro(int fd) {
+    ReqLocal local;
+    ConnInfo ci;
+
+    memset(&local, 0, sizeof(local));
+    coroSetLocal(&local);
+    ci.fd = fd;
+    ci.acceptUs = statsNow();
+    statsInc(STAT_ACCEPTS);
+    __atomic_fetch_add(&openConns, 1, __ATOMIC_RELAXED);
+    serveClient(&ci);
+
+    /* nothing may point into the stack once the coroutine is reused */
+    timerCancel(&local.client);
+    timerCancel(&local.upstream);
+}
+
+/*
+ * loopThread - with -E, a listener's coroutine loop replaces its accept
+ *     thread and workers.
+ */
+
+static void* loopThread(void* vargp) {
+
+    Listener *l = (Listener *)vargp;
+
+    if (pinThreads)
+        numaPinThread(l->node,
+            __atomic_fetch_add(&l->nextCpu, 1, __ATOMIC_RELAXED));
+    coroLoop(l->listenfd, drainPipe[0], ioBackend, serveCoro);
+    return NULL;
+}
+
+/*
+ * serveClient - serve one accepted client socket.
+ *
+ *        The request itself is handled by serveRequest, the timing of the
+ *     whole connection is recorded once it is closed. A CONNECT socket is
+ *     owned by the tunnel pump afterwards and is not closed here. All
+ *     buffers of the request come from the arena of the worker, which is
+ *     reset at the end. An HTTP/2 connection is not a request of its own,
+ *     its streams are recorded one by one and it is left with status 0.
+ */
+
+static void serveClient(ConnInfo* ci) {
+
+    ReqStat rs;
+    rio_t rio;
+    int fd = ci->fd;
+    boolean handedOver;
+
+    memset(&rs, 0, sizeof(rs));
+    rs.acceptUs = ci->acceptUs;
+    rs.status = 200;
+
+    /* 
+     * Both timers are cancelled whatever the outcome, an fd handed to
+     * the tunnel pump must not be shut down by a deadline of this
+     * request, nor an fd which reuses its number later.
+     */
     Rio_readinitb(&rio, fd);
-    if (rio_readlineb(&rio, buf, MAXLINE) < 0)
-        return NULL;
+    handedOver = serveRequest(&rs, &rio, fd);
+    timerCancel(clientTimer());
+    timerCancel(upstreamTimer());
+    if (!handedOver)
+        close(fd);
+    arenaReset();
+    __atomic_fetch_sub(&openConns, 1, __ATOMIC_RELAXED);
+    if (rs.status == 0)
+        return;
+    rs.endUs = statsNow();
+    statsRecordRequest(&rs);
+    logRequest(&rs);
+}
+
+/*
+ * serveStream - serve a stream of an HTTP/2 connection, see h2.h, like
+ *     a request on a connection of its own. rp holds the request, what
+ *     is written to the client goes to the stream.
+ */
+
+static void serveStream(H2Stream *st, rio_t *rp, int fd,
+    unsigned long startUs) {
+
+    ReqLocal local;
+    ReqStat rs;
+
+    /* a stream's coroutine has its own, a worker uses its own */
+    memset(&local, 0, sizeof(local));
+    coroSetLocal(&local);
+    reqLocal()->stream = st;
+
+    memset(&rs, 0, sizeof(rs));
+    rs.acceptUs = startUs;
+    rs.status = 200;
+    serveRequest(&rs, rp, fd);
+
+    timerCancel(clientTimer());
+    timerCancel(upstreamTimer());
+    reqLocal()->stream = NULL;
+    arenaReset();
+    rs.endUs = statsNow();
+    statsRecordRequest(&rs);
+    logRequest(&rs);
+}
+
+/*
+ * serveRequest - parse the incoming HTTP headers and search the cache
+ *     using corresponding information and decide whether to server the
+ *     content by cache directly or by web. The request is read from rp.
+ *     Returns true if fd was handed over to a tunnel.
+ */
+
+static boolean serveRequest(ReqStat *rs, rio_t *rp, int fd) {
+
+    char method[MAXLINE], uri[MAXLINE], version[MAXLINE];
+    char firstline[MAXLINE], host[MAXLINE], buf[MAXLINE], port[MAXPORT],
+        filename[MAXLINE];
+    ReqHeaders reqHdrs;
+    long size, total;
+    ByteRange range;
+    boolean hasRange;
+    char* header, *ciPtr, *type = NULL;
+    int n;
+
+    /* 
+     * Only the first byte of the buffers is cleared, zeroing them all
+     * would touch every page of a coroutine's stack.
+     */
+    method[0] = uri[0] = version[0] = buf[0] = '\0';
+    host[0] = port[0] = filename[0] = '\0';
+
+    /* Read request line and headers */
+    timerArm(clientTimer(), fd, TIMEOUT_HEADER, timeoutMs[TIMEOUT_HEADER]);
+    if (coroReadlineb(rp, buf, MAXLINE) < 0)
+        return false;
+
+    /* an HTTP/2 client with prior knowledge, see h2.h */
+    if (!strcmp(buf, H2_PREFACE) && reqLocal()->stream == NULL) {
+        timerCancel(clientTimer());
+        rs->status = 0;
+        serveH2(rp, fd, timeoutMs[TIMEOUT_IDLE], serveStream);
+        return false;
+    }
 
     sscanf(buf, "%s %s %s", method, uri, version);
+    snprintf(rs->method, sizeof(rs->method), "%.*s",
+            (int)sizeof(rs->method) - 1, method);
+    if (!strcasecmp(method, "CONNECT"))
+        return serveConnect(rs, rp, fd, uri);
     if (strcasecmp(method, "GET")) {
-        clienterror(fd, method, "501", "Not Implemented",
-                    "Proxy does not forward this method");
-        return NULL;
+        clienterror(rs, fd, ERR_NOT_IMPLEMENTED);
+        return false;
     }
 
-    sprintf(firstline, "%s ", method);
-
     /* parse uri 
      *    1. eliminate http:// protocol
      *    2. parse filename, port number and host from uri
@@ -120,72 +761,447 @@ static void* serveClient(void* connfd) {
      *          host: www.cmu.edu
      *          port: 8080
      *           filename: /index.html
+     *        3. /index.html
+     *          host and port: from the Host header
+     *           filename: /index.html
      *
-     *    3. throw exception if illegal header is found
+     *    3. throw exception if illegal header is found, see parse.h
      */
 
-    if (!strncasecmp(uri, "http://", 7)) {
-        if ((pos = strchr(uri + 7, '/')) == NULL) {
+    if (!parseVersion(version) || parseUri(uri, host, sizeof(host), port,
+            sizeof(port), filename, sizeof(filename)) < 0
+            || snprintf(firstline, sizeof(firstline), "%s %s HTTP/1.0\r\n",
+            method, filename) >= (int)sizeof(firstline)) {
+        clienterror(rs, fd, ERR_BAD_REQUEST);
+        return false;
+    }
+
+    reqHdrs.range[0] = '\0';
+    reqHdrs.acceptGzip = false;
+    header = assemHeaders(rp, firstline, host, port, &reqHdrs);
+    timerCancel(clientTimer());
+    if (header == NULL)
+        return false;
+    snprintf(rs->host, sizeof(rs->host), "%.*s",
+            (int)sizeof(rs->host) - 1, host);
+    snprintf(rs->port, sizeof(rs->port), "%.*s",
+            (int)sizeof(rs->port) - 1, port);
+    snprintf(rs->path, sizeof(rs->path), "%.*s",
+            (int)sizeof(rs->path) - 1, filename);
+
+    if (strlen(header) == 0 || host[0] == '\0') {
+        clienterror(rs, fd, ERR_BAD_HEADER);
+        arenaFree(header);
+        return false;
+    }
 
-            strcat(firstline, "/");
-            strcpy(host, uri + 7);
+    /* 
+     * Only a single byte range is supported. Anything else (multiple
+     * ranges, other units) is answered with the whole object, which
+     * is allowed by RFC 7233.
+     */
+    hasRange = parseRange(reqHdrs.range, &range);
 
-            strcat(filename, "/");
+    /* 
+     * type and size will be assigned in findItemInCache if cache hit.
+     * Byte ranges refer to the identity encoding, so a Range request
+     * never gets the compressed variant.
+     */
+    if ((ciPtr = findItemInCache(port, host, filename, header, &size, &type,
+            &total, reqHdrs.acceptGzip && !hasRange)) != NULL) {
+        rs->hit = true;
+        statsInc(STAT_HITS);
+        arenaFree(header);
+        if (hasRange && !resolveRange(&range, size)) {
+            rs->status = 416;
+            sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+                "Content-Range: bytes */%ld\r\nContent-length: 0\r\n\r\n",
+                size);
+            clientWrite(rs, fd, buf, strlen(buf));
         }
-        else {
-            strcat(firstline, pos);
-            strcat(filename, pos);
-            *pos = '\0';
-            strcpy(host, uri + 7);
-        }
-        if (strlen(host) == 0) {
-            clienterror(fd, uri, "400", "Bad Request",
-                    "Proxy can not parse the request");
-            return NULL;
+        else if (hasRange) {
+            /* type holds whole header lines, it may not leave room */
+            if ((n = snprintf(buf, sizeof(buf), "HTTP/1.0 206 Partial Content"
+                    "\r\nConnection: close\r\n%sContent-Range: bytes "
+                    "%ld-%ld/%ld\r\nContent-length: %ld\r\n\r\n", type,
+                    range.start, range.end, size,
+                    range.end - range.start + 1)) >= (int)sizeof(buf))
+                clienterror(rs, fd, ERR_INTERNAL);
+            else {
+                rs->status = 206;
+                clientWrite(rs, fd, buf, n);
+                clientWrite(rs, fd, ciPtr + range.start,
+                    range.end - range.start + 1);
+            }
         }
+        else
+            serveContentByCache(rs, ciPtr, fd, size, type);
+        arenaFree(type);
+        arenaFree(ciPtr);
+    }
+    else if (hasRange) {
+        serveRange(rs, header, host, port, filename, &range, fd);
+        arenaFree(header);
     }
     else {
-        strcpy(firstline, uri);
-        strcpy(filename, uri);
+        statsInc(STAT_MISSES);
+        if (!serveFromPeer(rs, header, host, filename, port,
+                reqHdrs.acceptGzip, fd))
+            serveContentByWeb(rs, header, host, filename, port, fd);
+        arenaFree(header);
     }
+    return false;
+}
+
+/*
+ * serveConnect - answer a CONNECT request. The target is "host:port",
+ *     once the upstream connection is up the client gets a 200 and both
+ *     sockets are handed to the tunnel pump. Returns true if they were.
+ */
 
-    if ((pos = strchr(host + 6, ':')) == NULL) {
-        strcpy(port, "80");
+static boolean serveConnect(ReqStat *rs, rio_t *rp, int fd, char *uri) {
+
+    char host[MAXLINE], buf[MAXLINE], port[MAXPORT];
+    unsigned long start;
+    int proxyfd, why;
+
+    /* the port is not optional */
+    if (strrchr(uri, ':') == NULL || parseHostPort(uri, strlen(uri), host,
+            sizeof(host), port, sizeof(port)) < 0) {
+        clienterror(rs, fd, ERR_BAD_CONNECT);
+        return false;
     }
-    else {
-        *pos = '\0';
-        strcpy(port, pos + 1);
+    snprintf(rs->host, sizeof(rs->host), "%.*s",
+            (int)sizeof(rs->host) - 1, host);
+    snprintf(rs->port, sizeof(rs->port), "%.*s",
+            (int)sizeof(rs->port) - 1, port);
+
+    /* nothing in the request headers matters to a tunnel */
+    while (coroReadlineb(rp, buf, MAXLINE) > 0 && strcmp(buf, "\r\n"))
+        ;
+    timerCancel(clientTimer());
+
+    if ((why = negOrigin(host, port)) != NEG_NONE) {
+        originError(rs, fd, -why);
+        return false;
+    }
+    start = statsNow();
+    if ((proxyfd = myOpen_clientfd(host, port,
+            timeoutMs[TIMEOUT_CONNECT])) < 0) {
+        statsInc(STAT_UPSTREAM_ERRORS);
+        negOriginFailed(host, port, -proxyfd);
+        originError(rs, fd, proxyfd);
+        return false;
+    }
+    rs->connectUs = statsNow() - start;
+
+    /* 
+     * A client may send the first bytes of the tunnel without waiting
+     * for the 200, anything rio already buffered belongs to the origin.
+     */
+    if ((rp->rio_cnt > 0
+            && coroWriten(proxyfd, rp->rio_bufptr, rp->rio_cnt) < 0)
+            || clientWrite(rs, fd, connect_ok, strlen(connect_ok)) < 0) {
+        close(proxyfd);
+        return false;
+    }
+
+    /* the write deadline of the 200 must not shut the tunnel down */
+    timerCancel(clientTimer());
+    addTunnel(fd, proxyfd);
+    return true;
+}
+
+/*
+ * parseRange - parse the value of a Range header, e.g. "bytes=0-499",
+ *     "bytes=500-" or "bytes=-500". Returns false unless it is exactly
+ *     one byte range.
+ */
+
+static boolean parseRange(char* value, ByteRange* range) {
+    char *end;
+
+    if (strncasecmp(value, "bytes=", 6) || strchr(value, ','))
+        return false;
+    value += 6;
+
+    range->start = range->end = -1;
+    if (*value != '-') {
+        range->start = strtol(value, &end, 10);
+        if (end == value || *end != '-' || range->start < 0)
+            return false;
+        value = end;
+    }
+    value++;
+    if (*value != '\0') {
+        range->end = strtol(value, &end, 10);
+        if (end == value || *end != '\0' || range->end < 0)
+            return false;
+    }
+
+    if (range->start < 0 && range->end < 0)
+        return false;
+    if (range->start >= 0 && range->end >= 0 && range->end < range->start)
+        return false;
+    return true;
+}
+
+/*
+ * resolveRange - turn a parsed range into absolute first and last byte
+ *     of an object of total bytes. Returns false if not satisfiable.
+ */
+
+static boolean resolveRange(ByteRange* range, long total) {
+    if (range->start < 0) {
+        /* suffix range: the last end bytes */
+        if (range->end == 0 || total == 0)
+            return false;
+        range->start = range->end >= total ? 0 : total - range->end;
+        range->end = total - 1;
+        return true;
+    }
+    if (range->start >= total)
+        return false;
+    if (range->end < 0 || range->end >= total)
+        range->end = total - 1;
+    return true;
+}
+
+/*
+ * serveRange - answer a Range request which missed the whole object cache.
+ *     The range is served segment by segment, every segment comes either
+ *     from cache or from a Range request to origin and is cached on its
+ *     own, so seeking inside a large object only transfers the segments
+ *     around the requested bytes.
+ */
+
+static void serveRange(ReqStat* rs, char* header, char* host, char* port,
+    char* filename, ByteRange* range, int fd) {
+
+    char buf[MAXBUF], type[MAXLINE], *seg;
+    long len, total, k, first, last, from, to;
+    int n;
+    boolean suffix = (range->start < 0);
+
+    type[0] = '\0';
+
+    /* a suffix range needs the total size before we know where it starts */
+    k = suffix ? 0 : range->start / SEGMENT_SIZE;
+    if ((seg = fetchSegment(rs, header, host, port, filename, k, &len,
+            &total, type)) == NULL) {
+        clienterror(rs, fd, ERR_RANGE);
+        return;
+    }
+
+    if (!resolveRange(range, total)) {
+        arenaFree(seg);
+        rs->status = 416;
+        sprintf(buf, "HTTP/1.0 416 Range Not Satisfiable\r\n"
+            "Content-Range: bytes */%ld\r\nContent-length: 0\r\n\r\n",
+            total);
+        clientWrite(rs, fd, buf, strlen(buf));
+        return;
+    }
+
+    first = range->start / SEGMENT_SIZE;
+    last = range->end / SEGMENT_SIZE;
+    if (suffix && first != k) {
+        arenaFree(seg);
+        seg = NULL;
+    }
+
+    if ((n = snprintf(buf, sizeof(buf), "HTTP/1.0 206 Partial Content\r\n"
+            "Connection: close\r\n%sContent-Range: bytes %ld-%ld/%ld\r\n"
+            "Content-length: %ld\r\n\r\n", type, range->start, range->end,
+            total, range->end - range->start + 1)) >= (int)sizeof(buf)) {
+        arenaFree(seg);
+        clienterror(rs, fd, ERR_INTERNAL);
+        return;
+    }
+    rs->status = 206;
+    clientWrite(rs, fd, buf, n);
+
+    for (k = first; k <= last; k++) {
+        if (seg == NULL && (seg = fetchSegment(rs, header, host, port,
+                filename, k, &len, &total, type)) == NULL)
+            return;
+
+        from = (k == first) ? range->start - k * SEGMENT_SIZE : 0;
+        to = (k == last) ? range->end - k * SEGMENT_SIZE : len - 1;
+        if (to >= len)
+            to = len - 1;
+        if (from <= to && clientWrite(rs, fd, seg + from, to - from + 1) < 0) {
+            arenaFree(seg);
+            return;
+        }
+        arenaFree(seg);
+        seg = NULL;
+    }
+}
+
+/*
+ * openUpstream - wait for an upstream slot of the origin, then connect to
+ *     it. The slot is held until closeUpstream. Returns what
+ *     myOpen_clientfd did if the connect failed, the slot is given back
+ *     then. An origin which failed lately is not tried, see negcache.h.
+ */
+
+static int openUpstream(ReqStat* rs, char* host, char* port,
+    UpstreamOrigin** slot) {
+
+    unsigned long start;
+    int proxyfd, why;
+
+    if ((why = negOrigin(host, port)) != NEG_NONE)
+        return -why;
+    *slot = upstreamAcquire(host, port);
+    start = statsNow();
+    if ((proxyfd = myOpen_clientfd(host, port,
+            timeoutMs[TIMEOUT_CONNECT])) < 0) {
+        statsInc(STAT_UPSTREAM_ERRORS);
+        negOriginFailed(host, port, -proxyfd);
+        upstreamRelease(*slot);
+        return proxyfd;
     }
+    if (rs->connectUs == 0)
+        rs->connectUs = statsNow() - start;
+    return proxyfd;
+}
+
+static void closeUpstream(int proxyfd, UpstreamOrigin* slot) {
+    timerCancel(upstreamTimer());
+    close(proxyfd);
+    upstreamRelease(slot);
+}
 
-    if (strcasecmp(version, "HTTP/1.1") + strcasecmp(version, "HTTP/1.0")
-            + strcasecmp(version, "HTTP/0.9") == 1) {
-        clienterror(fd, method, "400", "Bad Request",
-                    "Proxy can not parse the request");
+/*
+ * fetchSegment - return segment k of an object (from the request arena,
+ *     freed by the caller) and set its length, the total object size and the
+ *     Content-Type line.
+ *
+ *     The cache is searched first. On a miss the segment is requested
+ *     from origin with a Range header. An origin without Range support
+ *     answers 200 with the whole body, then the bytes before the segment
+ *     are skipped. A small object which fits into segment 0 is cached as
+ *     the whole object, so later plain requests hit it as well.
+ */
+
+static char* fetchSegment(ReqStat* rs, char* header, char* host, char* port,
+    char* filename, long k, long* len, long* total, char* type) {
+
+    char segname[MAXLINE], buf[MAXLINE], *req, *content, *ctype, *pos;
+    int proxyfd, status = 0;
+    long skip = 0, want, got, left, n;
+    unsigned long start;
+    UpstreamOrigin *slot;
+    rio_t rio_p;
+
+    snprintf(segname, sizeof(segname), "%s" SEGMENT_SEP "%ld", filename, k);
+    if ((content = findItemInCache(port, host, segname, header, len, &ctype,
+            total, false)) != NULL || (k == 0 && (content = findItemInCache(
+            port, host, filename, header, len, &ctype, total, false))
+            != NULL)) {
+        rs->hit = true;
+        statsInc(STAT_HITS);
+        strcpy(type, ctype);
+        arenaFree(ctype);
+        return content;
+    }
+    statsInc(STAT_MISSES);
+
+    /* the assembled header ends with an empty line, put Range before it */
+    req = (char *)arenaAlloc(strlen(header) + 64);
+    strcpy(req, header);
+    sprintf(req + strlen(req) - 2, "Range: bytes=%ld-%ld\r\n\r\n",
+        k * SEGMENT_SIZE, (k + 1) * SEGMENT_SIZE - 1);
+
+    if ((proxyfd = openUpstream(rs, host, port, &slot)) < 0) {
+        arenaFree(req);
         return NULL;
     }
 
-    sprintf(firstline, "%s HTTP/1.0\r\n", firstline);
-    if ((header = assemHeaders(&rio, firstline, host, port)) == NULL) {
-        close(fd);
-        return NULL;    
+    Rio_readinitb(&rio_p, proxyfd);
+    if (coroWriten(proxyfd, req, strlen(req)) < 0) {
+        arenaFree(req);
+        closeUpstream(proxyfd, slot);
+        return NULL;
+    }
+    arenaFree(req);
+
+    start = statsNow();
+    timerArm(upstreamTimer(), proxyfd, TIMEOUT_TTFB, timeoutMs[TIMEOUT_TTFB]);
+    *total = -1;
+    type[0] = '\0';
+    do {
+        if (coroReadlineb(&rio_p, buf, MAXLINE) <= 0) {
+            statsInc(STAT_UPSTREAM_ERRORS);
+            closeUpstream(proxyfd, slot);
+            return NULL;
+        }
+        if (status == 0) {
+            if (rs->ttfbUs == 0)
+                rs->ttfbUs = statsNow() - start;
+            timerArm(upstreamTimer(), proxyfd, TIMEOUT_IDLE,
+                timeoutMs[TIMEOUT_IDLE]);
+            if ((status = parseStatusLine(buf)) < 0)
+                break;
+        }
+        else if ((pos = parseHeader(buf, "Content-Range")) != NULL
+                && (pos = strchr(pos, '/')) != NULL)
+            *total = parseLength(pos + 1);
+        else if ((pos = parseHeader(buf, "Content-Length")) != NULL
+                && status == 200)
+            *total = parseLength(pos);
+        else if ((parseHeader(buf, "Content-Type") != NULL
+                || parseHeader(buf, "Vary") != NULL)
+                && strlen(type) + strlen(buf) < MAXLINE)
+            strcat(type, buf);
     }
-    if (strlen(header) == 0) {
-        clienterror(fd, method, "400", "Bad Request",
-                    "Invalid Header");
+    while (strcmp(buf, "\r\n"));
+
+    if ((status != 200 && status != 206) || *total < 0) {
+        statsInc(STAT_UPSTREAM_ERRORS);
+        closeUpstream(proxyfd, slot);
         return NULL;
     }
 
-    /* type and size will be assigned in findItemInCache if cache hit */
-    if ((ciPtr = findItemInCache(port, host, filename, &size, type)) == NULL)
-        serveContentByWeb(header, host, filename, port, fd);
-    else {
-        serveContentByCache(ciPtr, fd, size, type);
-        Free(ciPtr);
-        Free(type);
+    /* origin ignored Range, skip to the segment in the full body */
+    if (status == 200)
+        skip = k * SEGMENT_SIZE;
+    want = *total - k * SEGMENT_SIZE;
+    if (want > SEGMENT_SIZE)
+        want = SEGMENT_SIZE;
+    if (want <= 0) {
+        closeUpstream(proxyfd, slot);
+        *len = 0;
+        return (char *)arenaAlloc(1);
     }
-    close(fd);
 
-    return NULL;
+    content = (char *)arenaAlloc(want);
+    for (left = skip; left > 0; left -= n) {
+        if ((n = upstreamRead(&rio_p, content,
+                left < want ? left : want)) <= 0) {
+            arenaFree(content);
+            closeUpstream(proxyfd, slot);
+            return NULL;
+        }
+    }
+    if ((got = upstreamRead(&rio_p, content, want)) != want) {
+        arenaFree(content);
+        closeUpstream(proxyfd, slot);
+        return NULL;
+    }
+    closeUpstream(proxyfd, slot);
+    statsAdd(STAT_BYTES_FROM_ORIGIN, got);
+
+    *len = got;
+    if (k == 0 && *total <= SEGMENT_SIZE)
+        addToCache(port, host, filename, header, *len, content, type,
+            *total);
+    else
+        addToCache(port, host, segname, header, *len, content, type,
+            *total);
+    return content;
 }
 
 /* 
@@ -193,160 +1209,341 @@ static void* serveClient(void* connfd) {
  *     the header contains Content-Length and Content-type. 
  */
 
-static void serveContentByCache(char* content, int fd, int size, char* type) 
+static void serveContentByCache(ReqStat *rs, char* content, int fd,
+    long size, char* type) 
 {
-    char buf[MAXBUF] = "\0";
-    printf("Cache Hit\n");
-    sprintf(buf, "HTTP/1.0 200 OK\r\n");    
-    sprintf(buf, "%sConnection: close\r\n%s", buf, type);
-    sprintf(buf, "%sContent-length: %d\r\n\r\n", buf, (int)strlen(content));
-    rio_writen(fd, buf, strlen(buf));       
-    rio_writen(fd, content, size);         
+    char buf[MAXBUF];
+    int n;
+
+    if ((n = snprintf(buf, sizeof(buf), "HTTP/1.0 200 OK\r\nConnection: "
+            "close\r\n%sContent-length: %ld\r\n\r\n", type, size))
+            >= (int)sizeof(buf)) {
+        clienterror(rs, fd, ERR_INTERNAL);
+        return;
+    }
+    clientWrite(rs, fd, buf, n);       
+    clientWrite(rs, fd, content, size);         
 }
 
 
+/*
+ * serveFromPeer - on a miss, serve a URL another member of the peer group
+ *     owns from its cache (peer.h). The object is not cached here, the
+ *     owner keeps it. Returns false if the owner is this proxy or it did
+ *     not have the object, then the request goes to origin.
+ */
+
+static boolean serveFromPeer(ReqStat *rs, char *header, char *host,
+    char *filename, char *port, boolean acceptGzip, int fd)
+{
+    Peer *owner;
+    PeerObject obj;
+    int status;
+
+    if ((owner = peerOwner(port, host, filename)) == NULL)
+        return false;
+    status = peerFetch(owner, port, host, filename, header, acceptGzip,
+        upstreamTimer(), timeoutMs[TIMEOUT_TTFB], &obj);
+    if (status < 0 || status == PEER_MISS)
+        return false;
+    serveContentByCache(rs, obj.object, fd, obj.size, obj.type);
+    arenaFree(obj.object);
+    arenaFree(obj.type);
+    return true;
+}
+
+/*
+ * keepResponse - a response read completely from origin is cached if it
+ *     is a 200, the cache replays every object as one. A 404 or 5xx goes
+ *     to the negative cache, head and body as they came.
+ */
+
+static void keepResponse(ReqStat *rs, char *host, char *port,
+    char *filename, char *header, char *resp, long respLen, char *content,
+    long length, char *type)
+{
+    char *all;
+
+    if (rs->status == 200)
+        addToCache(port, host, filename, header, length, content, type,
+            length);
+    else if ((rs->status == 404 || rs->status >= 500)
+            && respLen + length <= NEG_MAX_RESPONSE) {
+        all = (char *)arenaAlloc(respLen + length);
+        memcpy(all, resp, respLen);
+        memcpy(all + respLen, content, length);
+        negAddResponse(host, port, filename, all, respLen + length,
+            rs->status);
+        arenaFree(all);
+    }
+}
+
 /* 
  * serveContentByWeb - When cache miss, we connect to the host and
  *    retrieve the file.
  */
 
-static void serveContentByWeb(char* header, char* host, 
+static void serveContentByWeb(ReqStat *rs, char* header, char* host, 
     char* filename, char* port, int fd) {
 
-    int proxyfd = 0, length = -1, count = 0;
+    int proxyfd = 0, status;
+    long length = -1, count = 0, capacity, respLen = 0, respCap = MAXBUF;
+    long maxObject = proxyCache.maxObjectSize, chunk;
+    boolean overBudget = false;
+    unsigned long start;
+    UpstreamOrigin *slot;
     rio_t rio_p;
-    char buf[MAXLINE], type[MAXLINE] = "\0";
-    char content[MAX_OBJECT_SIZE] = "\0";
+    char buf[MAXLINE], type[MAXLINE], *pos, *content, *resp;
+
+    type[0] = '\0';
+    /* origin failed this one lately, see negcache.h */
+    if ((resp = negResponse(host, port, filename, &respLen,
+            &rs->status)) != NULL) {
+        clientWrite(rs, fd, resp, respLen);
+        arenaFree(resp);
+        return;
+    }
 
-    if ((proxyfd = myOpen_clientfd(host, port)) < 0) {
-        clienterror(fd, host, "400", "Bad Request",
-                    "Proxy can not connect to the specified server");
+    if (governorAdmit() < 0) {
+        clienterror(rs, fd, ERR_OVERLOADED);
+        return;
+    }
+
+    if ((proxyfd = openUpstream(rs, host, port, &slot)) < 0) {
+        originError(rs, fd, proxyfd);
         return;
     }
 
     Rio_readinitb(&rio_p, proxyfd);
 
-    if (rio_writen(proxyfd, header, strlen(header)) != (int)strlen(header)) {
-        clienterror(fd, "Unknown Error", "500", "Internal Error",
-                    "Proxy encountered an critical error.");
-        close(proxyfd);
+    if (coroWriten(proxyfd, header, strlen(header)) != (int)strlen(header)) {
+        clienterror(rs, fd, ERR_INTERNAL);
+        closeUpstream(proxyfd, slot);
         return;
     }
 
-    Free(header);
+    start = statsNow();
+    timerArm(upstreamTimer(), proxyfd, TIMEOUT_TTFB, timeoutMs[TIMEOUT_TTFB]);
 
-    /* received header will be forwarded to the client */
+    /* 
+     * The received header is collected rather than forwarded line by
+     * line, so a body which is read completely can be taken from origin
+     * before the client sees a byte, see below.
+     */
+    resp = (char*)arenaAlloc(respCap);
     do {
-        if (rio_readlineb(&rio_p, buf, MAXLINE) < 0) {
-            close(proxyfd);
+        if (coroReadlineb(&rio_p, buf, MAXLINE) <= 0) {
+            statsInc(STAT_UPSTREAM_ERRORS);
+            upstreamError(rs, fd, host);
+            arenaFree(resp);
+            closeUpstream(proxyfd, slot);
             return;
         }
 
-        printf("%s", buf);
-        if (strncasecmp(buf, "Content-Length: ", 16) == 0) {
-            length = atoi(buf + 16);
+        /* first line from origin is the status line */
+        if (rs->ttfbUs == 0) {
+            rs->ttfbUs = statsNow() - start;
+            if ((status = parseStatusLine(buf)) > 0)
+                rs->status = status;
+            timerArm(upstreamTimer(), proxyfd, TIMEOUT_IDLE,
+                timeoutMs[TIMEOUT_IDLE]);
+        }
+        if ((pos = parseHeader(buf, "Content-Length")) != NULL) {
+            length = parseLength(pos);
+        }
+        /* 
+         * An origin encoding must be replayed on every cache hit, Vary
+         * as well, it also picks the variant, see findItemInCache.
+         */
+        if ((parseHeader(buf, "Content-Type") != NULL
+                || parseHeader(buf, "Content-Encoding") != NULL
+                || parseHeader(buf, "Vary") != NULL)
+                && strlen(type) + strlen(buf) < MAXLINE) {
+            strcat(type, buf);
         }
-        if (strncasecmp(buf, "Content-Type: ", 14) == 0) {
-            strcpy(type, buf);
+
+        if (respLen + (long)strlen(buf) >= respCap) {
+            respCap *= 2;
+            resp = (char*)arenaGrow(resp, respCap);
         }
-        rio_writen(fd, buf, strlen(buf));
+        strcpy(resp + respLen, buf);
+        respLen += strlen(buf);
     }
     while(strcmp(buf, "\r\n"));
     
-    /* If length is specified in content-length, we check if length 
-     * is smaller than Max_Object_Size. If so, we save it to the cache.
+    /* 
+     * If length is specified in content-length, we check if length 
+     * is smaller than the max object size. If so, we read the whole
+     * object into a buffer of that length and save it to the cache.
      * 
-     * If no length is specified, we just read like the length is Max.
+     * If no length is specified, the buffer grows while reading until
+     * the body ends, or until it exceeds the max object size, then
+     * what was read so far is sent and the rest is relayed.
+     *
+     * Otherwise the body is relayed in RELAY_CHUNK pieces.
+     *
+     * Whenever the whole response is in memory the origin connection
+     * is closed before the client is written, so a slow client holds
+     * a worker but not an origin connection.
+     *
+     * A body is only buffered as far as the budget of the connection
+     * goes and the memory governor grants it (governor.h). Past that it
+     * is relayed in chunks no larger than the budget, each read from
+     * origin only once the client took the one before, and it is not
+     * cached.
      */
 
-    if (length >= 0 && length <= MAX_OBJECT_SIZE) {
-        if (rio_readnb(&rio_p, content, length) < 1) {
-            close(proxyfd);
+    chunk = connBudget < RELAY_CHUNK ? connBudget : RELAY_CHUNK;
+    if (length >= 0 && length <= maxObject && length <= connBudget
+            && governorHold(length, false) == 0) {
+        content = (char*)arenaAlloc(length > 0 ? length : 1);
+        if (upstreamRead(&rio_p, content, length) != length) {
+            upstreamError(rs, fd, host);
+            arenaFree(content);
+            arenaFree(resp);
+            closeUpstream(proxyfd, slot);
             return;
         }
-
-        rio_writen(fd, content, length);
-        addToCache(port, host, filename, length, content, type);
-    }
-    else if (length > MAX_OBJECT_SIZE) {
-        while ((count = rio_readnb(&rio_p, content, MAX_OBJECT_SIZE)) != 0)
-            rio_writen(fd, content, count);
+        closeUpstream(proxyfd, slot);
+
+        statsAdd(STAT_BYTES_FROM_ORIGIN, length);
+        clientWrite(rs, fd, resp, respLen);
+        clientWrite(rs, fd, content, length);
+        keepResponse(rs, host, port, filename, header, resp, respLen,
+            content, length, type);
+        arenaFree(content);
+        arenaFree(resp);
+        return;
     }
-    else {
-        if ((count = rio_readnb(&rio_p, content, MAX_OBJECT_SIZE)) < 0) {
-            close(proxyfd);
-            return;
+    else if (length < 0) {
+        capacity = chunk;
+        governorHold(capacity, true);
+        content = (char*)arenaAlloc(capacity);
+        while (length <= maxObject
+                && (count = upstreamRead(&rio_p, content + (length + 1),
+                    capacity - (length + 1))) > 0) {
+            length += count;
+            if (length + 1 == capacity) {
+                if (capacity * 2 > connBudget
+                        || governorHold(capacity, false) < 0) {
+                    overBudget = true;
+                    statsInc(STAT_BUDGET_RELAYS);
+                    break;
+                }
+                capacity *= 2;
+                content = (char*)arenaGrow(content, capacity);
+            }
         }
-        rio_writen(fd, content, count);
-        if (count < MAX_OBJECT_SIZE) {
-            addToCache(port, host, filename, length, content, type);
+        length++;
+        if (count < 0) {
+            upstreamError(rs, fd, host);
+            arenaFree(content);
+            arenaFree(resp);
+            closeUpstream(proxyfd, slot);
+            return;
         }
-        else {
-            /* Use loop to read */
-            while ((count = rio_readnb(&rio_p, content, MAX_OBJECT_SIZE)) > 0)
-                rio_writen(fd, content, count);
-            if (count < 0) {
-                close(proxyfd);
-                return;
-            }
+        /* the body ended */
+        if (count == 0)
+            closeUpstream(proxyfd, slot);
+
+        statsAdd(STAT_BYTES_FROM_ORIGIN, length);
+        clientWrite(rs, fd, resp, respLen);
+        clientWrite(rs, fd, content, length);
+        if (length <= maxObject && !overBudget)
+            keepResponse(rs, host, port, filename, header, resp, respLen,
+                content, length, type);
+        if (count == 0) {
+            arenaFree(content);
+            arenaFree(resp);
+            return;
         }
     }
-    
-    printf("Received: %d\n", length);
-    close(proxyfd);
+    else {
+        if (length <= maxObject)
+            statsInc(STAT_BUDGET_RELAYS);
+        clientWrite(rs, fd, resp, respLen);
+        governorHold(chunk, true);
+        content = (char*)arenaAlloc(chunk);
+    }
+
+    /* relay whatever is left */
+    while ((count = upstreamRead(&rio_p, content, chunk)) > 0) {
+        statsAdd(STAT_BYTES_FROM_ORIGIN, count);
+        if (clientWrite(rs, fd, content, count) < 0)
+            break;
+    }
+
+    arenaFree(content);
+    arenaFree(resp);
+    closeUpstream(proxyfd, slot);
 }
 
 
 /*
  * assemHeaders - read HTTP request headers
+ *     headers the proxy handles itself are recorded in reqHdrs.
  */
 
-static char* assemHeaders(rio_t *rp, char* firstline, char* host, char* port)
+static char* assemHeaders(rio_t *rp, char* firstline, char* host, char* port,
+    ReqHeaders* reqHdrs)
 {
     char buf[MAXLINE];
     char* header, *pos;
     int charCount = 0;
     int curSize = MAXBUF;
-    int hasHost = false;
-
-    header = (char *)malloc(curSize * sizeof(char));
+    int hasHost = false, len;
+
+    /* there is always room for one more line, or the Host line */
+    charCount = strlen(firstline) + strlen(user_agent_hdr)
+        + strlen(connection_hdr) + strlen(proxy_connection_hdr);
+    while (charCount + MAXLINE + 16 >= curSize)
+        curSize *= 2;
+    header = (char *)arenaAlloc(curSize * sizeof(char));
     memset(header, 0, sizeof(char));
     strcat(header, firstline);
     strcat(header, user_agent_hdr);
     strcat(header, connection_hdr);
     strcat(header, proxy_connection_hdr);
-    charCount = strlen(header);
     do {
-        if (rio_readlineb(rp, buf, MAXLINE) < 0) {
-            Free(header);
+        /* the client must not go away before the end of the header */
+        if (coroReadlineb(rp, buf, MAXLINE) <= 0) {
+            arenaFree(header);
             return NULL;
         }
+        if (!strcmp(buf, "\n"))
+            strcpy(buf, "\r\n");
         charCount += strlen(buf);
-        if (charCount >= curSize) {
+        if (charCount + MAXLINE + 16 >= curSize) {
             curSize *= 2;
-            header = (char *)realloc(header, curSize * sizeof(char));
+            header = (char *)arenaGrow(header, curSize * sizeof(char));
         }
 
         /* 
          * If host is specified in client header, it should override 
-         * the previous parsed one.
+         * the previous parsed one. A Host which is not valid leaves the
+         * header empty.
          */
 
-        if (strncasecmp(buf, "Host: ", 6) == 0) {
+        if ((pos = parseHeader(buf, "Host")) != NULL) {
             hasHost = true;
-            *(strchr(buf, '\r')) = '\0';
-
-            if ((pos = strchr(buf + 6, ':')) == NULL) {
-                strcpy(port, "80");
+            for (len = strcspn(pos, "\r\n"); len > 0
+                    && (pos[len - 1] == ' ' || pos[len - 1] == '\t'); len--)
+                ;
+            if (parseHostPort(pos, len, host, MAXLINE, port, MAXPORT) < 0) {
+                header[0] = '\0';
+                return header;
             }
-            else {
-                *pos = '\0';
-                strcpy(port, pos + 1);
-            }
-            strcpy(host, buf + 6);
-            strcat(buf, "\r\n");
         }
 
+        /* Range is answered by the proxy itself, see serveRange. */
+        if ((pos = parseHeader(buf, "Range")) != NULL) {
+            strcpy(reqHdrs->range, pos);
+            reqHdrs->range[strcspn(reqHdrs->range, "\r\n")] = '\0';
+        }
+
+        if ((pos = parseHeader(buf, "Accept-Encoding")) != NULL)
+            reqHdrs->acceptGzip = acceptsGzip(pos);
+
         /* Only additional headers could be forwarded. */
         if (isAddtReq(buf)) {
             strcat(header, buf);
@@ -357,7 +1554,7 @@ static char* assemHeaders(rio_t *rp, char* firstline, char* host, char* port)
     }
     while(strcmp(buf, "\r\n"));
 
-    if (!hasHost) {
+    if (!hasHost && host[0] != '\0') {
         pos = header + (strlen(header) - 2);
         sprintf(pos, "Host: %s\r\n\r\n", host);
     }
@@ -365,6 +1562,29 @@ static char* assemHeaders(rio_t *rp, char* firstline, char* host, char* port)
     return header;
 }
 
+/*
+ * acceptsGzip - true if an Accept-Encoding value allows gzip, i.e. it
+ *     lists gzip or * without q=0.
+ */
+
+static boolean acceptsGzip(char* value) {
+    char lower[MAXLINE], *pos, *q, *comma;
+    int i;
+
+    for (i = 0; value[i] && i < MAXLINE - 1; i++)
+        lower[i] = tolower(value[i]);
+    lower[i] = '\0';
+
+    if ((pos = strstr(lower, "gzip")) == NULL
+            && (pos = strchr(lower, '*')) == NULL)
+        return false;
+    comma = strchr(pos, ',');
+    if ((q = strstr(pos, "q=")) != NULL && (comma == NULL || q < comma)
+            && atof(q + 2) == 0)
+        return false;
+    return true;
+}
+
 /* 
  * isAddtReq - return true if the header should not be override
  *       by our proxy.
@@ -372,76 +1592,648 @@ static char* assemHeaders(rio_t *rp, char* firstline, char* host, char* port)
 
 static boolean isAddtReq(char* buf) {
 
-    if (strncasecmp(buf, "Connection: ", 12) == 0)
+    if (parseHeader(buf, "Connection") != NULL)
+        return false;
+
+    if (parseHeader(buf, "Proxy-Connection") != NULL)
+        return false;
+
+    if (parseHeader(buf, "User-Agent") != NULL)
         return false;
 
-    if (strncasecmp(buf, "Proxy-Connection: ", 18) == 0)
+    if (parseHeader(buf, "Range") != NULL)
         return false;
 
-    if (strncasecmp(buf, "User-Agent: ", 12) == 0)
+    if (parseHeader(buf, "If-Range") != NULL)
         return false;
 
     return true;
 }
 
+/*
+ * warmFetch - fetch one object of the warm-up list like a miss would, the
+ *     body goes to /dev/null instead of a client. Returns true if the
+ *     object is cached afterwards.
+ */
+
+static int warmFetch(char* host, char* port, char* filename) {
+
+    ReqStat rs;
+    char *header, *type, *hostHdr;
+    long size, total;
+    boolean cached;
+
+    header = (char *)arenaAlloc(strlen(filename) + strlen(host) + MAXLINE);
+    hostHdr = strcmp(port, "80") ? ":" : "";
+    sprintf(header, "GET %s HTTP/1.0\r\n%s%s%sHost: %s%s%s\r\n\r\n",
+        filename, user_agent_hdr, connection_hdr, proxy_connection_hdr,
+        host, hostHdr, *hostHdr ? port : "");
+
+    if (findItemInCache(port, host, filename, header, &size, &type, &total,
+            true) != NULL) {
+        arenaReset();
+        return true;
+    }
+
+    memset(&rs, 0, sizeof(rs));
+    rs.status = 200;
+    serveContentByWeb(&rs, header, host, filename, port, devnull);
+
+    cached = findItemInCache(port, host, filename, header, &size, &type,
+        &total, true) != NULL;
+    arenaReset();
+    return cached;
+}
+
+/*
+ * peerFill - fetch a URL another member asked for into the cache, the
+ *     member gets it from there. header is the one it would have sent to
+ *     origin itself.
+ */
+
+static void peerFill(char* host, char* port, char* filename, char* header) {
+
+    ReqStat rs;
+
+    memset(&rs, 0, sizeof(rs));
+    rs.status = 200;
+    serveContentByWeb(&rs, header, host, filename, port, devnull);
+}
+
+static int peerConnect(char* host, char* port) {
+    return myOpen_clientfd(host, port, timeoutMs[TIMEOUT_CONNECT]);
+}
+
+/*
+ * parseSize - parse a byte count with an optional K, M or G suffix
+ *     (powers of 1024). Returns -1 if it is not a positive size.
+ */
+
+static long parseSize(char *arg)
+{
+    char *end;
+    long value = strtol(arg, &end, 10);
+
+    switch (*end) {
+    case 'k': case 'K': value <<= 10; end++; break;
+    case 'm': case 'M': value <<= 20; end++; break;
+    case 'g': case 'G': value <<= 30; end++; break;
+    }
+    if (end == arg || *end != '\0' || value <= 0)
+        return -1;
+    return value;
+}
+
+/*
+ * parseTimeouts - parse "h:c:f:i:w" seconds into ms. Returns -1 if a
+ *     field is not a positive number.
+ */
+
+static int parseTimeouts(char *arg, unsigned long *ms)
+{
+    char *end;
+    long sec;
+    int i;
+
+    for (i = 0; i < TIMEOUT_PHASES && *arg; i++) {
+        if (*arg != ':') {
+            if ((sec = strtol(arg, &end, 10)) <= 0
+                    || (*end != ':' && *end != '\0'))
+                return -1;
+            ms[i] = sec * 1000;
+            arg = end;
+        }
+        if (*arg == ':')
+            arg++;
+    }
+    return *arg ? -1 : 0;
+}
+
+/*
+ * drainAndExit - once the sockets are handed over to the next proxy, stop
+ *     accepting and exit when the connections and tunnels left are done,
+ *     or the drain timeout is up.
+ */
+
+static void drainAndExit() {
+    struct timespec tick = { 0, DRAIN_POLL_MS * 1000000L };
+    long waited;
+    char c = 0;
+
+    if (write(drainPipe[1], &c, 1) != 1)
+        unix_error("write error");
+    for (waited = 0; waited < drainTimeout * 1000L; waited += DRAIN_POLL_MS) {
+        nanosleep(&tick, NULL);
+        if (__atomic_load_n(&openConns, __ATOMIC_RELAXED) == 0
+                && tunnelsActive() == 0)
+            break;
+    }
+
+    /* the records of the last requests reach the access log */
+    tick.tv_nsec = 2 * LOG_FLUSH_MS * 1000000L;
+    nanosleep(&tick, NULL);
+    exit(0);
+}
+
+/*
+ * forkServer - fork a serving process, which exits along with the parent.
+ */
+
+static pid_t forkServer() {
+    pid_t parent = getpid(), pid;
+
+    if ((pid = Fork()) == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() != parent)
+            exit(0);
+    }
+    return pid;
+}
+
+/*
+ * prefork - fork n processes, which share the listening sockets and the
+ *     shared cache, see shmcache.h. The parent stays behind and replaces
+ *     a process which dies. Returns the index of the process, in it.
+ */
+
+static int prefork(int n) {
+    struct timespec delay = { 0, RESPAWN_DELAY_MS * 1000000L };
+    pid_t *pids = (pid_t *)Calloc(n, sizeof(pid_t)), pid;
+    int i, status;
+
+    for (i = 0; i < n; i++)
+        if ((pids[i] = forkServer()) == 0)
+            return i;
+
+    for (; ;) {
+        if ((pid = waitpid(-1, &status, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            unix_error("waitpid error");
+        }
+        for (i = 0; i < n && pids[i] != pid; i++)
+            ;
+        if (i == n)
+            continue;
+        fprintf(stderr, "Process %d exited (status %d), starting another.\n",
+            (int)pid, status);
+        nanosleep(&delay, NULL);
+        if ((pids[i] = forkServer()) == 0)
+            return i;
+    }
+}
+
+/*
+ * usage - print the command line options and exit
+ */
+
+static void usage(char *name)
+{
+    fprintf(stderr, "usage: %s [options] <port>\n", name);
+    fprintf(stderr, "   -a <port>  serve /metrics on this port\n");
+    fprintf(stderr, "   -l <file>  append an access log record per request\n");
+    fprintf(stderr, "   -c <size>  total cache size, K/M/G suffix allowed"
+        " (%d)\n", DEFAULT_CACHE_SIZE);
+    fprintf(stderr, "   -o <size>  max cacheable object size (%d)\n",
+        DEFAULT_OBJECT_SIZE);
+    fprintf(stderr, "   -s <n>     cache shards (picked from the cache size)\n");
+    fprintf(stderr, "   -H <pct>   share of the cache kept uncompressed, the"
+        " rest holds LZ4\n              compressed objects (%d)\n",
+        DEFAULT_HOT_SHARE);
+    fprintf(stderr, "   -w <n>     worker threads (%d)\n", DEFAULT_WORKERS);
+    fprintf(stderr, "   -L <n>     SO_REUSEPORT listeners, workers are split"
+        " among them (1)\n");
+    fprintf(stderr, "   -P         pin listener i and its workers to the CPUs"
+        " of NUMA node i %% nodes\n");
+    fprintf(stderr, "   -i <sec>   close CONNECT tunnels idle this long (%d)\n",
+        DEFAULT_TUNNEL_IDLE);
+    fprintf(stderr, "   -W <file>  warm the cache from a URL list or access"
+        " log before serving\n");
+    fprintf(stderr, "   -j <n>     parallel warm-up fetches (%d)\n",
+        DEFAULT_WARM_FETCHERS);
+    fprintf(stderr, "   -B         warm up in the background while serving\n");
+    fprintf(stderr, "   -u <n>     connections per origin, more requests"
+        " queue (%d)\n", DEFAULT_ORIGIN_CONNS);
+    fprintf(stderr, "   -U <n>     connections to all origins (%d)\n",
+        DEFAULT_UPSTREAM_CONNS);
+    fprintf(stderr, "   -t <h:c:f:i:w>  seconds allowed for the request header,"
+        " upstream connect,\n              first response byte, upstream"
+        " idle and client write\n              (%d:%d:%d:%d:%d), an empty"
+        " field keeps its default\n", DEFAULT_HEADER_TIMEOUT,
+        DEFAULT_CONNECT_TIMEOUT, DEFAULT_TTFB_TIMEOUT, DEFAULT_IDLE_TIMEOUT,
+        DEFAULT_WRITE_TIMEOUT);
+    fprintf(stderr, "   -I <io>    epoll or uring, the backend of the accept"
+        " loops, tunnels and,\n              with -E, of all socket I/O"
+        " (epoll)\n");
+    fprintf(stderr, "   -E         serve the connections of each listener as"
+        " coroutines on one\n              event loop thread, instead of"
+        " workers\n");
+    fprintf(stderr, "   -n <sec>   remember failed origins and 404/5xx"
+        " responses this long,\n              0 does not (%d)\n",
+        DEFAULT_NEG_TTL);
+    fprintf(stderr, "   -p <host:port>  this proxy in the peer group, peers"
+        " connect to this port\n");
+    fprintf(stderr, "   -G <host:port,...>  the members of the peer group,"
+        " which share their\n              caches by consistent hashing\n");
+    fprintf(stderr, "   -b <size>  body bytes a request may buffer ahead of"
+        " its client, larger\n              bodies are relayed and not"
+        " cached (%ldK, or -o if larger)\n", DEFAULT_CONN_BUDGET >> 10);
+    fprintf(stderr, "   -M <size>  body bytes in flight over all requests,"
+        " new misses wait\n              or are shed above, 0 for no limit"
+        " (%ldM)\n", DEFAULT_INFLIGHT_LIMIT >> 20);
+    fprintf(stderr, "   -R <path>  take the sockets over from the proxy"
+        " serving this control\n              socket, which drains, and serve"
+        " it for the next one\n");
+    fprintf(stderr, "   -d <sec>   how long a proxy taken over from may"
+        " drain (%d)\n", DEFAULT_DRAIN_TIMEOUT);
+    fprintf(stderr, "   -S <size>  keep the cache in a shared memory segment"
+        " of this size instead,\n              shared by all processes and"
+        " handed over by -R\n");
+    fprintf(stderr, "   -F <n>     serve from n prefork processes, the admin"
+        " port and warm-up\n              are the first one's (1)\n");
+    exit(1);
+}
+
 int main(int argc, char* argv[])
 {
-    int listenfd, connfd, clientlen;
-    struct sockaddr_in clientaddr;
-    int port;
+    int port, c, i, j, workers, n = 0, taken, adminfd = -1, peerfd = -1;
+    int cachefd = -1, procIndex = 0;
+    int fds[RESTART_MAX_FDS], roles[RESTART_MAX_FDS];
+    Listener *l;
     pthread_t pid;
+    ProxyOptions opt = {
+        .adminPort = NULL,
+        .logFile = NULL,
+        .cacheSize = DEFAULT_CACHE_SIZE,
+        .maxObjectSize = DEFAULT_OBJECT_SIZE,
+        .shards = 0,
+        .hotShare = DEFAULT_HOT_SHARE,
+        .workers = DEFAULT_WORKERS,
+        .listeners = 1,
+        .pin = false,
+        .tunnelIdle = DEFAULT_TUNNEL_IDLE,
+        .warmFile = NULL,
+        .warmFetchers = DEFAULT_WARM_FETCHERS,
+        .warmBackground = false,
+        .originConns = DEFAULT_ORIGIN_CONNS,
+        .upstreamConns = DEFAULT_UPSTREAM_CONNS,
+        .timeouts = {
+            DEFAULT_HEADER_TIMEOUT * 1000,
+            DEFAULT_CONNECT_TIMEOUT * 1000,
+            DEFAULT_TTFB_TIMEOUT * 1000,
+            DEFAULT_IDLE_TIMEOUT * 1000,
+            DEFAULT_WRITE_TIMEOUT * 1000,
+        },
+        .ioBackend = IO_EPOLL,
+        .coroutines = false,
+        .negTtl = DEFAULT_NEG_TTL,
+        .peerSelf = NULL,
+        .peerGroup = NULL,
+        .connBudget = 0,
+        .inflightLimit = DEFAULT_INFLIGHT_LIMIT,
+        .restartPath = NULL,
+        .drainTimeout = DEFAULT_DRAIN_TIMEOUT,
+        .sharedSize = 0,
+        .processes = 1,
+    };
     
     /* Check command line args */
-    if (argc != 2) {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
-        exit(1);
+    while ((c = getopt(argc, argv, "ha:l:c:o:s:H:w:L:Pi:W:j:Bu:U:t:I:En:p:G:b:M:R:d:S:F:")) != -1) {
+        switch (c) {
+        case 'a':
+            opt.adminPort = optarg;
+            break;
+        case 'l':
+            opt.logFile = optarg;
+            break;
+        case 'c':
+            if ((opt.cacheSize = parseSize(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'o':
+            if ((opt.maxObjectSize = parseSize(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 's':
+            if ((opt.shards = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'H':
+            if ((opt.hotShare = atoi(optarg)) < 0 || opt.hotShare > 100)
+                usage(argv[0]);
+            break;
+        case 'w':
+            if ((opt.workers = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'L':
+            if ((opt.listeners = atoi(optarg)) <= 0
+                    || opt.listeners > MAX_LISTENERS)
+                usage(argv[0]);
+            break;
+        case 'P':
+            opt.pin = true;
+            break;
+        case 'i':
+            if ((opt.tunnelIdle = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'W':
+            opt.warmFile = optarg;
+            break;
+        case 'j':
+            if ((opt.warmFetchers = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'B':
+            opt.warmBackground = true;
+            break;
+        case 'u':
+            if ((opt.originConns = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'U':
+            if ((opt.upstreamConns = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 't':
+            if (parseTimeouts(optarg, opt.timeouts) < 0)
+                usage(argv[0]);
+            break;
+        case 'I':
+            if (!strcmp(optarg, "uring"))
+                opt.ioBackend = IO_URING;
+            else if (!strcmp(optarg, "epoll"))
+                opt.ioBackend = IO_EPOLL;
+            else
+                usage(argv[0]);
+            break;
+        case 'E':
+            opt.coroutines = true;
+            break;
+        case 'n':
+            if ((opt.negTtl = atoi(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'p':
+            opt.peerSelf = optarg;
+            break;
+        case 'G':
+            opt.peerGroup = optarg;
+            break;
+        case 'b':
+            if ((opt.connBudget = parseSize(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'M':
+            if (!strcmp(optarg, "0"))
+                opt.inflightLimit = 0;
+            else if ((opt.inflightLimit = parseSize(optarg)) < 0)
+                usage(argv[0]);
+            break;
+        case 'R':
+            opt.restartPath = optarg;
+            break;
+        case 'd':
+            if ((opt.drainTimeout = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'S':
+            if ((opt.sharedSize = parseSize(optarg)) < SHM_MIN_SIZE)
+                usage(argv[0]);
+            break;
+        case 'F':
+            if ((opt.processes = atoi(optarg)) <= 0)
+                usage(argv[0]);
+            break;
+        case 'h':
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1 || (opt.peerGroup != NULL) != (opt.peerSelf != NULL))
+        usage(argv[0]);
+    /* the peer port and the control socket belong to one process */
+    if (opt.processes > 1 && (opt.peerGroup != NULL
+            || opt.restartPath != NULL))
+        usage(argv[0]);
+    if (opt.maxObjectSize > opt.cacheSize)
+        opt.maxObjectSize = opt.cacheSize;
+    /* by default every cacheable object may be buffered */
+    if (opt.connBudget == 0)
+        opt.connBudget = opt.maxObjectSize > DEFAULT_CONN_BUDGET
+            ? opt.maxObjectSize : DEFAULT_CONN_BUDGET;
+    if (opt.workers < opt.listeners)
+        opt.workers = opt.listeners;
+    if (opt.ioBackend == IO_URING && !uringSupported()) {
+        fprintf(stderr, "io_uring is not available, using epoll.\n");
+        opt.ioBackend = IO_EPOLL;
     }
 
     /* ignore the SIGPIPE signal */
     Signal(SIGPIPE, SIG_IGN);
 
-    port = atoi(argv[1]);
+    port = atoi(argv[optind]);
 
     if (port <= 1024 || port >= 65536) {
         fprintf(stderr, "Invalid port number.\n");
         exit(1);
     }
 
-    if ((listenfd = Open_listenfd(argv[1])) < 0) {
+    /* 
+     * With -R the sockets of the proxy already running are taken over,
+     * its listeners replace -L.
+     */
+
+    if (opt.restartPath != NULL) {
+        if ((n = restartTakeover(opt.restartPath, fds, roles,
+                RESTART_MAX_FDS)) < 0) {
+            fprintf(stderr, "Can not take over from %s.\n",
+                opt.restartPath);
+            exit(1);
+        }
+        for (i = 0, taken = 0; i < n; i++)
+            taken += roles[i] == RESTART_PROXY;
+        if (taken > 0)
+            opt.listeners = taken < MAX_LISTENERS ? taken : MAX_LISTENERS;
+        if (pipe(drainPipe) < 0)
+            unix_error("pipe error");
+        drainTimeout = opt.drainTimeout;
+    }
+
+    /* all sockets are bound before anything starts accepting */
+    listeners = (Listener *)Calloc(opt.listeners, sizeof(Listener));
+    for (i = 0; i < opt.listeners; i++)
+        listeners[i].listenfd = -1;
+    for (i = 0, j = 0; i < n; i++) {
+        if (roles[i] == RESTART_PROXY && j < opt.listeners)
+            listeners[j++].listenfd = fds[i];
+        else if (roles[i] == RESTART_ADMIN && opt.adminPort != NULL)
+            adminfd = fds[i];
+        else if (roles[i] == RESTART_PEER && opt.peerGroup != NULL)
+            peerfd = fds[i];
+        else if (roles[i] == RESTART_CACHE && opt.sharedSize > 0)
+            cachefd = fds[i];
+        else
+            close(fds[i]);
+    }
+    for (i = 0; i < opt.listeners; i++) {
+        if (listeners[i].listenfd < 0 && (listeners[i].listenfd =
+                myOpen_listenfd(argv[optind], opt.listeners > 1)) < 0) {
+            fprintf(stderr, "Can not listen on port %s.\n", argv[optind]);
+            exit(1);
+        }
+
+        /* the next proxy accepts on it as well, see acceptOrDrain */
+        if (opt.restartPath != NULL)
+            fcntl(listeners[i].listenfd, F_SETFL,
+                fcntl(listeners[i].listenfd, F_GETFL) | O_NONBLOCK);
+    }
+
+    if (opt.sharedSize > 0
+            && (cachefd = shmCacheInit(opt.sharedSize, cachefd)) < 0) {
+        fprintf(stderr, "Can not map a shared cache of %ld bytes.\n",
+            opt.sharedSize);
         exit(1);
     }
+
+    /* from here on every process has its own threads */
+    if (opt.processes > 1)
+        procIndex = prefork(opt.processes);
+
+    numaInit();
+    pinThreads = opt.pin;
+    memcpy(timeoutMs, opt.timeouts, sizeof(timeoutMs));
+    startTimerWheel();
+    ioBackend = opt.ioBackend;
+    startTunnelPump(opt.tunnelIdle, opt.ioBackend);
+    if (opt.adminPort != NULL && procIndex == 0)
+        adminfd = startAdminServer(opt.adminPort, adminfd,
+            timeoutMs[TIMEOUT_HEADER], timeoutMs[TIMEOUT_WRITE]);
+    if (opt.logFile != NULL)
+        startAccessLog(opt.logFile);
     
-    /* Initialize proxyCache and mutex */
-    proxyCache.tail = proxyCache.head;
-    proxyCache.remainSpace = MAX_CACHE_SIZE;
-    Sem_init(&acMutex, 0, 1);
-    pthread_rwlock_init(&rwMutex, NULL);
+    /* Initialize proxyCache, the connection queues and the workers */
+    initCache(opt.cacheSize, opt.maxObjectSize, opt.shards, opt.hotShare);
+    upstreamInit(opt.originConns, opt.upstreamConns);
+    negInit(opt.negTtl);
+    governorInit(opt.inflightLimit);
+    connBudget = opt.connBudget;
+    initErrors();
+
+    if ((opt.warmFile != NULL || opt.peerGroup != NULL)
+            && (devnull = open("/dev/null", O_WRONLY)) < 0)
+        unix_error("open /dev/null error");
+    if (opt.peerGroup != NULL && (peerfd = peerInit(opt.peerSelf,
+            opt.peerGroup, peerFill, peerConnect, peerfd)) < 0) {
+        fprintf(stderr, "Can not join peer group %s as %s.\n", opt.peerGroup,
+            opt.peerSelf);
+        exit(1);
+    }
+
+    /* the listening sockets queue clients while the warm-up blocks */
+    if (opt.warmFile != NULL && procIndex == 0) {
+        warmCache(opt.warmFile, opt.warmFetchers, warmFetch,
+            opt.warmBackground);
+    }
+
+    for (i = 0; i < opt.listeners; i++) {
+        l = &listeners[i];
+        l->node = i % numaNodes();
+        if (opt.coroutines)
+            continue;
+        l->queue.front = l->queue.rear = 0;
+        Sem_init(&l->queue.mutex, 0, 1);
+        Sem_init(&l->queue.slots, 0, CONN_QUEUE_SIZE);
+        Sem_init(&l->queue.items, 0, 0);
+
+        /* the first listeners get the remainder */
+        workers = opt.workers / opt.listeners
+            + (i < opt.workers % opt.listeners);
+        for (j = 0; j < workers; j++)
+            Pthread_create(&pid, NULL, workerThread, l);
+    }
+
+    /* ready to serve, the proxy taken over from drains */
+    if (opt.restartPath != NULL) {
+        for (i = 0, n = 0; i < opt.listeners; i++) {
+            fds[n] = listeners[i].listenfd;
+            roles[n++] = RESTART_PROXY;
+        }
+        if (adminfd >= 0) {
+            fds[n] = adminfd;
+            roles[n++] = RESTART_ADMIN;
+        }
+        if (peerfd >= 0) {
+            fds[n] = peerfd;
+            roles[n++] = RESTART_PEER;
+        }
+        if (cachefd >= 0) {
+            fds[n] = cachefd;
+            roles[n++] = RESTART_CACHE;
+        }
+        restartServe(opt.restartPath, fds, roles, n, drainAndExit);
+    }
 
     /* 
-     * Waiting for incoming request. If so, create new threads and serve the
-     * request.
+     * Waiting for incoming request. The main thread accepts for the
+     * first listener, until the proxy drains and drainAndExit exits.
      */
 
-    clientlen = (int)sizeof(clientaddr);
-    for (; ;) {
-        connfd = Accept(listenfd, (SA *)&clientaddr, (socklen_t *)&clientlen);
-        
-        /* 
-         * It should be noted that we pretend connfd to be an address, instead
-         * of a number. It will be tranferred to int the worker thread.
-         */
+    for (i = 1; i < opt.listeners; i++)
+        Pthread_create(&pid, NULL,
+            opt.coroutines ? loopThread : acceptThread, &listeners[i]);
+    if (opt.coroutines)
+        loopThread(&listeners[0]);
+    else
+        acceptThread(&listeners[0]);
+    pthread_exit(NULL);
+}
 
-        Pthread_create(&pid, NULL, serveClient, (void *)(size_t)(connfd));
+/*
+ * connectWithin - connect, giving up after ms. The socket is left
+ *     blocking, unless it is a coroutine's which stays non-blocking.
+ *     A coroutine connects through its loop, the timer wheel aborts it
+ *     by shutting the socket down.
+ */
+
+static int connectWithin(int fd, struct sockaddr *addr, socklen_t len,
+    unsigned long ms) {
+
+    struct pollfd pfd;
+    int flags, err = 0, rc;
+    socklen_t errlen = sizeof(err);
+
+    flags = fcntl(fd, F_GETFL);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    if (coroSelf() != NULL) {
+        timerArm(upstreamTimer(), fd, TIMEOUT_CONNECT, ms);
+        rc = coroConnect(fd, addr, len);
+        timerCancel(upstreamTimer());
+        return rc;
+    }
+    if ((rc = connect(fd, addr, len)) < 0 && errno == EINPROGRESS) {
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        if ((rc = poll(&pfd, 1, ms)) == 0)
+            statsInc(STAT_TIMEOUTS + TIMEOUT_CONNECT);
+        if (rc <= 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0
+                || err != 0)
+            rc = -1;
+        else
+            rc = 0;
     }
-    pthread_rwlock_destroy(&rwMutex);
-    return 0;
+    fcntl(fd, F_SETFL, flags);
+    return rc;
 }
 
 /* 
- * myOpen_clientfd - When getaddrinfo fails, it won't exit
+ * myOpen_clientfd - When getaddrinfo fails, it won't exit. Each address
+ *     gets ms to connect. Returns -NEG_UNRESOLVED if the name did not
+ *     resolve and -NEG_UNREACHABLE if no address could be connected to.
  */
 
-static int myOpen_clientfd(char *hostname, char *port) {
+static int myOpen_clientfd(char *hostname, char *port, unsigned long ms) {
     int clientfd;
     struct addrinfo hints, *listp, *p;
 
@@ -450,9 +2242,8 @@ static int myOpen_clientfd(char *hostname, char *port) {
     hints.ai_socktype = SOCK_STREAM;  /* Open a connection */
     hints.ai_flags = AI_NUMERICSERV;  /* ... using a numeric port arg. */
     hints.ai_flags |= AI_ADDRCONFIG;  /* Recommended for connections */
-    if (getaddrinfo(hostname, port, &hints, &listp) < 0) {
-        printf("get address info failed\n");
-        return -1;
+    if (getaddrinfo(hostname, port, &hints, &listp) != 0) {
+        return -NEG_UNRESOLVED;
     }
 
     /* Walk the list for one that we can successfully connect to */
@@ -463,18 +2254,61 @@ static int myOpen_clientfd(char *hostname, char *port) {
             continue; /* Socket failed, try the next */
 
         /* Connect to the server */
-        if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1)
+        if (connectWithin(clientfd, p->ai_addr, p->ai_addrlen, ms) != -1)
             break; /* Success */
         close(clientfd); /* Connect failed, try another */  
     }
     /* Clean up */
     Freeaddrinfo(listp);
     if (!p) {/* All connects failed */
-        return -1;
+        return -NEG_UNREACHABLE;
     }
     else {
         return clientfd;
     }
 }
 
+/*
+ * myOpen_listenfd - open_listenfd with SO_REUSEPORT when reuseport is
+ *     set, so several sockets can be bound to the same port.
+ */
+
+static int myOpen_listenfd(char *port, boolean reuseport) {
+    int listenfd, optval = 1;
+    struct addrinfo hints, *listp, *p;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;             /* Accept connections */
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; /* ... on any IP address */
+    hints.ai_flags |= AI_NUMERICSERV;            /* ... using port number */
+    if (getaddrinfo(NULL, port, &hints, &listp) != 0)
+        return -1;
+
+    /* Walk the list for one that we can bind to */
+    for (p = listp; p; p = p->ai_next) {
+        if ((listenfd =
+                socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+            continue;
+
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+            (const void *)&optval, sizeof(int));
+        if (reuseport && setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                (const void *)&optval, sizeof(int)) < 0) {
+            close(listenfd);
+            continue;
+        }
 
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+            break; /* Success */
+        close(listenfd);
+    }
+
+    Freeaddrinfo(listp);
+    if (!p)
+        return -1;
+    if (listen(listenfd, LISTENQ) < 0) {
+        close(listenfd);
+        return -1;
+    }
+    return listenfd;
+}
@@ -0,0 +1,190 @@
+#include <sys/un.h>
+
+#include "csapp.h"
+#include "restart.h"
+
+#define RESTART_TAKE 'T'
+#define RESTART_ACK 'A'
+
+typedef struct _restartState {
+    int listenfd;
+    int oldfd;              /* to the proxy taken over from, until acked */
+    int n;
+    int fds[RESTART_MAX_FDS];
+    int roles[RESTART_MAX_FDS];
+    void (*drain)(void);
+} RestartState;
+
+static RestartState state = { .oldfd = -1 };
+
+static int unixAddr(char *path, struct sockaddr_un *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path))
+        return -1;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+/*
+ * restartTakeover - take the listening sockets over from the proxy
+ *     serving the control socket path, up to max of them, into fds and
+ *     their roles. Returns how many there are, 0 if no proxy serves path
+ *     and -1 if the handover failed. The old proxy goes on serving until
+ *     restartServe acknowledges.
+ */
+
+int restartTakeover(char *path, int *fds, int *roles, int max) {
+    struct sockaddr_un addr;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(RESTART_MAX_FDS * sizeof(int))];
+    unsigned char roleBuf[RESTART_MAX_FDS];
+    char c = RESTART_TAKE;
+    int fd, n, i;
+    ssize_t got;
+
+    if (unixAddr(path, &addr) < 0
+            || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        return -1;
+    if (connect(fd, (SA *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        return errno == ENOENT || errno == ECONNREFUSED ? 0 : -1;
+    }
+    if (rio_writen(fd, &c, 1) != 1) {
+        close(fd);
+        return -1;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = roleBuf;
+    iov.iov_len = sizeof(roleBuf);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    while ((got = recvmsg(fd, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    cmsg = got > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS) {
+        close(fd);
+        return -1;
+    }
+
+    /* one role byte per socket */
+    n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if (n != got || n > max) {
+        for (i = 0; i < n; i++)
+            close(((int *)CMSG_DATA(cmsg))[i]);
+        close(fd);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), n * sizeof(int));
+    for (i = 0; i < n; i++)
+        roles[i] = roleBuf[i];
+
+    state.oldfd = fd;
+    return n;
+}
+
+/*
+ * handOver - pass every listening socket and its role to the proxy on
+ *     connfd. Returns 0 once it acknowledged.
+ */
+
+static int handOver(int connfd) {
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    char control[CMSG_SPACE(RESTART_MAX_FDS * sizeof(int))];
+    unsigned char roleBuf[RESTART_MAX_FDS];
+    char c;
+    int i;
+
+    if (rio_readn(connfd, &c, 1) != 1 || c != RESTART_TAKE)
+        return -1;
+
+    for (i = 0; i < state.n; i++)
+        roleBuf[i] = state.roles[i];
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = roleBuf;
+    iov.iov_len = state.n;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(state.n * sizeof(int));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(state.n * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), state.fds, state.n * sizeof(int));
+
+    if (sendmsg(connfd, &msg, 0) != state.n)
+        return -1;
+    return rio_readn(connfd, &c, 1) == 1 && c == RESTART_ACK ? 0 : -1;
+}
+
+/*
+ * controlThread - wait for the next proxy, hand over to it and drain.
+ *     A proxy which failed to take over is ignored, the next may try.
+ */
+
+static void *controlThread(void *vargp) {
+    int connfd;
+
+    pthread_detach(pthread_self());
+
+    for (; ;) {
+        if ((connfd = accept(state.listenfd, NULL, NULL)) < 0)
+            continue;
+        if (handOver(connfd) == 0)
+            break;
+        close(connfd);
+    }
+    close(connfd);
+    close(state.listenfd);
+    state.drain();
+    return NULL;
+}
+
+/*
+ * restartServe - let the proxy taken over from drain, if any, and serve
+ *     the control socket path, so a proxy started later can take over the
+ *     n listening sockets fds with their roles. drain is called once it
+ *     did, it must not return.
+ */
+
+void restartServe(char *path, int *fds, int *roles, int n,
+    void (*drain)(void)) {
+
+    struct sockaddr_un addr;
+    pthread_t tid;
+    char c = RESTART_ACK;
+
+    if (unixAddr(path, &addr) < 0) {
+        fprintf(stderr, "Control socket path %s is too long.\n", path);
+        exit(1);
+    }
+    state.n = n < RESTART_MAX_FDS ? n : RESTART_MAX_FDS;
+    memcpy(state.fds, fds, state.n * sizeof(int));
+    memcpy(state.roles, roles, state.n * sizeof(int));
+    state.drain = drain;
+
+    if (state.oldfd >= 0) {
+        rio_writen(state.oldfd, &c, 1);
+        close(state.oldfd);
+        state.oldfd = -1;
+    }
+
+    /* the path of the old proxy, which is done with it */
+    unlink(path);
+    if ((state.listenfd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0
+            || bind(state.listenfd, (SA *)&addr, sizeof(addr)) < 0
+            || listen(state.listenfd, 4) < 0) {
+        fprintf(stderr, "Can not serve control socket %s.\n", path);
+        exit(1);
+    }
+    Pthread_create(&tid, NULL, controlThread, NULL);
+}
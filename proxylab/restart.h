@@ -0,0 +1,38 @@
+#ifndef __RESTART_H__
+#define __RESTART_H__
+
+/*
+ * Hot restart is defined as followed:
+ *     A proxy started with a control socket path (-R) takes its listening
+ *     sockets over from the proxy already serving on that path, if
+ *     there is one, instead of binding them. It connects to the path and
+ *     gets every listening socket of the old proxy with its role, passed
+ *     as SCM_RIGHTS. Once it is ready to serve (the cache is set up and
+ *     warmed), it acknowledges with one byte. The sockets are the same
+ *     ones, so connections waiting in their accept queues are not
+ *     refused, whichever process accepts them.
+ *
+ *     The old proxy stops accepting as soon as the new one acknowledged,
+ *     lets the requests and tunnels it has finish and exits once it has
+ *     none left, or when the drain timeout is up. The new proxy serves
+ *     the control socket itself from then on, for the next restart.
+ *
+ *     Only a shared cache (see shmcache.h) is handed over, its segment
+ *     like a socket. Otherwise the new proxy starts cold.
+ */
+
+#define DEFAULT_DRAIN_TIMEOUT 30            /* seconds */
+#define RESTART_MAX_FDS 80
+
+/* roles of the sockets handed over */
+enum {
+    RESTART_PROXY,                          /* one per listener */
+    RESTART_ADMIN,
+    RESTART_PEER,
+    RESTART_CACHE                           /* the shared cache segment */
+};
+
+int restartTakeover(char*, int*, int*, int);
+void restartServe(char*, int*, int*, int, void (*)(void));
+
+#endif /* __RESTART_H__ */
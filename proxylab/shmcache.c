@@ -0,0 +1,330 @@
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "csapp.h"
+#include "stats.h"
+#include "arena.h"
+#include "shmcache.h"
+
+#define SHM_MAGIC 0x73686d6361636865UL
+#define SHM_VERSION 1
+
+typedef struct _shmHeader {
+    unsigned long magic;                /* stored last, once set up */
+    unsigned long version;
+    unsigned long size;                 /* of the segment */
+    unsigned long nbuckets;
+    unsigned long indexOffset;
+    unsigned long logOffset;
+    unsigned long logSize;
+    unsigned long head __attribute__((aligned(64)));
+} ShmHeader;
+
+typedef struct _shmEntry {
+    unsigned long pos;
+    unsigned long len;
+    long size;
+    long total;
+    unsigned int hash;
+    unsigned int keyLen;                /* with the null char */
+    unsigned int typeLen;
+    unsigned int flags;
+} ShmEntry;
+
+static ShmHeader *seg = NULL;
+static unsigned long *slots;
+static char *logBase;
+
+static unsigned long tagOf(unsigned int hash) {
+    /* never 0, so a used slot is never 0 either */
+    return (hash >> 16) | 1;
+}
+
+static unsigned long *bucketOf(unsigned int hash) {
+    return slots + (hash & (seg->nbuckets - 1)) * SHM_WAYS;
+}
+
+static ShmEntry *entryAt(unsigned long pos) {
+    return (ShmEntry *)(logBase + pos % seg->logSize);
+}
+
+/*
+ * isLive - true if nothing appended so far wrapped around onto the entry
+ *     at pos. An entry never wraps, so this does not depend on its size.
+ */
+
+static int isLive(unsigned long pos) {
+    return __atomic_load_n(&seg->head, __ATOMIC_ACQUIRE)
+        <= pos + seg->logSize;
+}
+
+/*
+ * reserve - take len bytes at the head of the log. An entry which would
+ *     wrap around the end starts over at the front.
+ */
+
+static unsigned long reserve(unsigned long len) {
+    unsigned long old, start, off;
+
+    old = __atomic_load_n(&seg->head, __ATOMIC_RELAXED);
+    do {
+        off = old % seg->logSize;
+        start = off + len > seg->logSize ? old + seg->logSize - off : old;
+    } while (!__atomic_compare_exchange_n(&seg->head, &old, start + len, 1,
+        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+    /* the entry is not written before the head moved past it */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return start;
+}
+
+/*
+ * sameKey - true if the slot points to a live entry stored under key.
+ */
+
+static int sameKey(unsigned long slot, char *key, int keyLen,
+    unsigned int hash) {
+
+    unsigned long pos = slot >> 16;
+    ShmEntry *e = entryAt(pos);
+
+    return isLive(pos) && __atomic_load_n(&e->pos, __ATOMIC_ACQUIRE) == pos
+        && e->hash == hash && e->keyLen == (unsigned int)keyLen
+        && !memcmp(e + 1, key, keyLen);
+}
+
+/*
+ * publish - put the entry at pos into a slot of its bucket: the one of
+ *     the same key, a free or stale one, or else the oldest.
+ */
+
+static void publish(char *key, int keyLen, unsigned int hash,
+    unsigned long pos) {
+
+    unsigned long *bucket = bucketOf(hash), slot, victim, oldest,
+        want = pos << 16 | tagOf(hash);
+    int i, tries, pick;
+
+    for (tries = 0; tries < SHM_WAYS; tries++) {
+        pick = 0;
+        victim = oldest = ULONG_MAX;
+        for (i = 0; i < SHM_WAYS; i++) {
+            slot = __atomic_load_n(&bucket[i], __ATOMIC_ACQUIRE);
+            if (slot == 0 || !isLive(slot >> 16)
+                    || ((slot & 0xffff) == tagOf(hash)
+                    && sameKey(slot, key, keyLen, hash))) {
+                pick = i;
+                victim = slot;
+                break;
+            }
+            if ((slot >> 16) < oldest) {
+                oldest = slot >> 16;
+                pick = i;
+                victim = slot;
+            }
+        }
+        if (__atomic_compare_exchange_n(&bucket[pick], &victim, want, 0,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+/*
+ * readEntry - copy the entry at pos into the request arena if it is
+ *     stored under key. Returns the object, or NULL and the Vary names in
+ *     type for a Vary record.
+ */
+
+static char *readEntry(unsigned long pos, char *key, int keyLen,
+    unsigned int hash, long *size, long *total, char **type, int *flags) {
+
+    ShmEntry *e = entryAt(pos), h;
+    char *object = NULL, *p;
+
+    if (!isLive(pos) || __atomic_load_n(&e->pos, __ATOMIC_ACQUIRE) != pos)
+        return NULL;
+    memcpy(&h, e, sizeof(h));
+    if (h.hash != hash || h.keyLen != (unsigned int)keyLen
+            || h.len > seg->logSize - pos % seg->logSize || h.typeLen == 0
+            || h.size < 0 || sizeof(h) + keyLen + h.typeLen + h.size > h.len
+            || memcmp(e + 1, key, keyLen))
+        return NULL;
+
+    p = (char *)(e + 1) + keyLen;
+    *type = (char *)arenaAlloc(h.typeLen + 64);
+    memcpy(*type, p, h.typeLen);
+    (*type)[h.typeLen - 1] = '\0';
+    if (!(h.flags & SHM_VARY)) {
+        object = (char *)arenaAlloc(h.size > 0 ? h.size : 1);
+        memcpy(object, p + h.typeLen, h.size);
+    }
+
+    /* the copies are done before the head is looked at again */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (!isLive(pos)) {
+        statsInc(STAT_SHARED_TORN);
+        if (object)
+            arenaFree(object);
+        arenaFree(*type);
+        return NULL;
+    }
+
+    *size = h.size;
+    *total = h.total;
+    *flags = h.flags;
+    return object;
+}
+
+static void dumpShared(FILE *fp) {
+    fprintf(fp, "# TYPE proxy_shared_cache_bytes gauge\n");
+    fprintf(fp, "proxy_shared_cache_bytes %lu\n", seg->logSize);
+    fprintf(fp, "# TYPE proxy_shared_cache_appended_bytes_total counter\n");
+    fprintf(fp, "proxy_shared_cache_appended_bytes_total %lu\n",
+        __atomic_load_n(&seg->head, __ATOMIC_RELAXED));
+}
+
+/*
+ * formatSegment - lay out an empty cache over the segment.
+ */
+
+static void formatSegment(unsigned long size) {
+    unsigned long nbuckets = 1, indexOffset;
+
+    while (nbuckets * SHM_WAYS * SHM_SLOT_BYTES < size)
+        nbuckets <<= 1;
+    indexOffset = (sizeof(ShmHeader) + 63) & ~63UL;
+
+    seg->magic = 0;
+    seg->version = SHM_VERSION;
+    seg->size = size;
+    seg->nbuckets = nbuckets;
+    seg->indexOffset = indexOffset;
+    seg->logOffset = indexOffset + nbuckets * SHM_WAYS * sizeof(long);
+    seg->logSize = (size - seg->logOffset) & ~63UL;
+    seg->head = 0;
+    memset((char *)seg + indexOffset, 0, nbuckets * SHM_WAYS * sizeof(long));
+    __atomic_store_n(&seg->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+}
+
+/*
+ * shmCacheInit - map a segment of size bytes as the cache. fd is the one
+ *     of a hot restart, which is kept if it is as large and set up
+ *     already, otherwise a new segment is made. Returns the descriptor
+ *     of the segment, or -1.
+ */
+
+int shmCacheInit(long size, int fd) {
+    char name[64];
+    struct stat st;
+
+    size &= ~4095L;
+    if (fd >= 0 && (fstat(fd, &st) < 0 || st.st_size != size)) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) {
+        /* nobody opens it by name, processes inherit it or get it passed */
+        snprintf(name, sizeof(name), "/proxy-cache-%d", (int)getpid());
+        if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0)
+            return -1;
+        shm_unlink(name);
+        if (ftruncate(fd, size) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    if ((seg = (ShmHeader *)mmap(NULL, size, PROT_READ | PROT_WRITE,
+            MAP_SHARED, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        seg = NULL;
+        return -1;
+    }
+    if (seg->magic != SHM_MAGIC || seg->version != SHM_VERSION
+            || seg->size != (unsigned long)size)
+        formatSegment(size);
+    slots = (unsigned long *)((char *)seg + seg->indexOffset);
+    logBase = (char *)seg + seg->logOffset;
+
+    statsRegisterDump(dumpShared);
+    return fd;
+}
+
+int shmCacheEnabled() {
+    return seg != NULL;
+}
+
+/*
+ * shmCacheFind - look key up. Returns a copy of the object in the request
+ *     arena and sets size, total, flags and type, a copy with room to
+ *     append header lines. A Vary record returns NULL with SHM_VARY set
+ *     in flags and the Vary names in type.
+ */
+
+char* shmCacheFind(char *key, unsigned int hash, long *size, long *total,
+    char **type, int *flags) {
+
+    unsigned long *bucket = bucketOf(hash), slot, pos;
+    int i, keyLen = strlen(key) + 1;
+    char *object;
+
+    *flags = 0;
+    for (i = 0; i < SHM_WAYS; i++) {
+        slot = __atomic_load_n(&bucket[i], __ATOMIC_ACQUIRE);
+        if ((slot & 0xffff) != tagOf(hash))
+            continue;
+        pos = slot >> 16;
+        object = readEntry(pos, key, keyLen, hash, size, total, type, flags);
+        if (object == NULL && !(*flags & SHM_VARY))
+            continue;
+
+        /* about to be overwritten, append it again */
+        if (pos + seg->logSize - seg->logSize / SHM_REFRESH
+                < __atomic_load_n(&seg->head, __ATOMIC_RELAXED)) {
+            statsInc(STAT_SHARED_REFRESHES);
+            shmCacheAdd(key, hash, *type, object, *size, *total, *flags);
+        }
+        return object;
+    }
+    return NULL;
+}
+
+/*
+ * shmCacheAdd - append an entry for key, which replaces the one stored
+ *     under it before. Objects larger than 1/SHM_MAX_SHARE of the log are
+ *     not stored.
+ */
+
+void shmCacheAdd(char *key, unsigned int hash, char *type, char *object,
+    long size, long total, int flags) {
+
+    int keyLen = strlen(key) + 1, typeLen = strlen(type) + 1;
+    unsigned long len, pos;
+    ShmEntry *e;
+    char *p;
+
+    if (flags & SHM_VARY)
+        size = 0;
+    len = (sizeof(ShmEntry) + keyLen + typeLen + size + 63) & ~63UL;
+    if (len > seg->logSize / SHM_MAX_SHARE)
+        return;
+
+    pos = reserve(len);
+    e = entryAt(pos);
+    e->len = len;
+    e->size = size;
+    e->total = total;
+    e->hash = hash;
+    e->keyLen = keyLen;
+    e->typeLen = typeLen;
+    e->flags = flags;
+    p = (char *)(e + 1);
+    memcpy(p, key, keyLen);
+    memcpy(p + keyLen, type, typeLen);
+    if (size > 0)
+        memcpy(p + keyLen + typeLen, object, size);
+    __atomic_store_n(&e->pos, pos, __ATOMIC_RELEASE);
+
+    publish(key, keyLen, hash, pos);
+}
@@ -0,0 +1,58 @@
+#ifndef __SHMCACHE_H__
+#define __SHMCACHE_H__
+
+/*
+ * Shared cache is defined as followed:
+ *     With -S the cache lives in one POSIX shared memory segment instead
+ *     of the heap, so all processes of a prefork proxy (-F) share one
+ *     cache, and a hot restart (see restart.h) hands it over. Nothing in
+ *     the segment is a pointer, everything is found by its offset.
+ *
+ *     Segment:
+ *           [header]: the geometry of the segment and the head of the
+ *            log. A segment whose header does not match is set up anew.
+ *           [index]: buckets of SHM_WAYS slots, a cache line each. A slot
+ *            is one 64 bit word: the log position of an entry and 16
+ *            bits of its hash as a tag, or 0 when free.
+ *           [log]: a ring the entries are appended to. The head only
+ *            grows, an entry is stored at its position modulo the size
+ *            of the log and never wraps around the end. Appending
+ *            overwrites the oldest entries, so they are evicted first in
+ *            first out. A hit on an entry in the oldest 1/SHM_REFRESH of
+ *            the log appends it again, which keeps popular objects.
+ *     Entry:
+ *           [pos]: its own position, stored last once it is whole.
+ *           [len]: of the whole entry, aligned.
+ *           [size, total, flags]: as in cache.h, gzipped or a Vary
+ *            record whose type holds the Vary names.
+ *           followed by the key, the type and the object.
+ *
+ *     There are no locks. A writer reserves room by moving the head with
+ *     a compare and swap, writes its entry and then stores it in a slot
+ *     of its bucket with another one. A reader copies an entry into the
+ *     request arena and checks that the head did not pass it meanwhile,
+ *     otherwise the copy may be torn and counts as a miss. A process
+ *     which dies at any point leaves at most an unreachable hole in the
+ *     log, so there is nothing to recover and no lock left held.
+ */
+
+#define SHM_MIN_SIZE (1L << 20)
+#define SHM_WAYS 8
+/* the index has a slot per this many bytes of log */
+#define SHM_SLOT_BYTES 2048
+/* objects larger than this share of the log are not cached */
+#define SHM_MAX_SHARE 8
+#define SHM_REFRESH 4
+
+/* entry flags */
+enum {
+    SHM_GZIPPED = 1,
+    SHM_VARY = 2
+};
+
+int shmCacheInit(long, int);
+int shmCacheEnabled();
+char* shmCacheFind(char*, unsigned int, long*, long*, char**, int*);
+void shmCacheAdd(char*, unsigned int, char*, char*, long, long, int);
+
+#endif /* __SHMCACHE_H__ */
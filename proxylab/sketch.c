@@ -0,0 +1,92 @@
+#include "csapp.h"
+#include "sketch.h"
+
+static SketchEntry counters[SKETCH_SIZE];
+static int used = 0;
+static unsigned long samples = 0;
+static pthread_mutex_t sketchMutex = PTHREAD_MUTEX_INITIALIZER;
+static __thread unsigned int tick = 0;
+
+static void decay() {
+    int i;
+
+    for (i = 0; i < used; i++) {
+        counters[i].count /= 2;
+        counters[i].error /= 2;
+    }
+}
+
+/*
+ * sketchHit - count a hit of the first len bytes of key, whose hash is
+ *     hash, if it is sampled.
+ */
+
+void sketchHit(char *key, int len, unsigned int hash) {
+    SketchEntry *e, *min;
+    int i;
+
+    if (++tick % SKETCH_SAMPLE != 0)
+        return;
+    if (len >= SKETCH_KEY)
+        len = SKETCH_KEY - 1;
+    if (pthread_mutex_trylock(&sketchMutex) != 0)
+        return;
+
+    if (++samples % SKETCH_DECAY == 0)
+        decay();
+
+    min = NULL;
+    for (i = 0; i < used; i++) {
+        e = &counters[i];
+        if (e->hash == hash && !strncmp(e->key, key, len)
+                && e->key[len] == '\0') {
+            e->count++;
+            pthread_mutex_unlock(&sketchMutex);
+            return;
+        }
+        if (min == NULL || e->count < min->count)
+            min = e;
+    }
+
+    if (used < SKETCH_SIZE) {
+        e = &counters[used++];
+        e->error = 0;
+        e->count = 1;
+    }
+    else {
+        e = min;
+        e->error = e->count;
+        e->count++;
+    }
+    e->hash = hash;
+    memcpy(e->key, key, len);
+    e->key[len] = '\0';
+    pthread_mutex_unlock(&sketchMutex);
+}
+
+static int cmpCount(const void *a, const void *b) {
+    const SketchEntry *x = (const SketchEntry *)a, *y = (const SketchEntry *)b;
+
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+/*
+ * sketchTop - copy the n hottest keys to out, hottest first. Returns
+ *     how many there are.
+ */
+
+int sketchTop(SketchEntry *out, int n) {
+    SketchEntry copy[SKETCH_SIZE];
+    int m;
+
+    pthread_mutex_lock(&sketchMutex);
+    m = used;
+    memcpy(copy, counters, m * sizeof(SketchEntry));
+    pthread_mutex_unlock(&sketchMutex);
+
+    qsort(copy, m, sizeof(SketchEntry), cmpCount);
+    if (n > m)
+        n = m;
+    memcpy(out, copy, n * sizeof(SketchEntry));
+    return n;
+}
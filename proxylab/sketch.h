@@ -0,0 +1,34 @@
+#ifndef __SKETCH_H__
+#define __SKETCH_H__
+
+/*
+ * Hot key sketch is defined as followed:
+ *     A Space-Saving summary of the keys most often hit in the cache.
+ *     It has SKETCH_SIZE counters. A key which has a counter gets it
+ *     incremented, any other key takes over the smallest counter and
+ *     adds one to it, so a count overestimates by at most the error
+ *     recorded when the key took the counter over.
+ *
+ *     Only one hit in SKETCH_SAMPLE of each thread is counted, and a hit
+ *     which finds the sketch busy is dropped, so the hit path never
+ *     waits. Counts are halved every SKETCH_DECAY samples to let old
+ *     favourites fade.
+ */
+
+#define SKETCH_SIZE 256
+#define SKETCH_SAMPLE 16
+#define SKETCH_DECAY 65536
+/* longer keys are truncated, they still count by the hash of all of it */
+#define SKETCH_KEY 128
+
+typedef struct _sketchEntry {
+    unsigned int hash;
+    unsigned long count;    /* samples */
+    unsigned long error;    /* count may be too high by this much */
+    char key[SKETCH_KEY];
+} SketchEntry;
+
+void sketchHit(char*, int, unsigned int);
+int sketchTop(SketchEntry*, int);
+
+#endif /* __SKETCH_H__ */
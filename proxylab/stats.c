@@ -0,0 +1,438 @@
+#include <time.h>
+
+#include "csapp.h"
+#include "stats.h"
+#include "timer.h"
+
+/*
+ * All StatBlocks ever created are kept in a singly linked list which only
+ * grows. A thread claims a free block on its first update and releases it
+ * when it exits, so the number of blocks is bounded by the peak number of
+ * live threads. Released blocks keep their values, which keeps every
+ * counter monotonic no matter how threads come and go.
+ */
+
+static StatBlock *blockList = NULL;
+static __thread StatBlock *myBlock = NULL;
+static pthread_key_t blockKey;
+static pthread_once_t blockOnce = PTHREAD_ONCE_INIT;
+
+/* registered by the main thread at startup, never removed */
+static void (*dumpHooks[MAX_DUMP_HOOKS])(FILE *);
+static struct {
+    char *path;
+    void (*fn)(FILE *, char *);
+} pages[MAX_ADMIN_PAGES];
+static int nPages = 0;
+static int nDumpHooks = 0;
+
+static const char *counterNames[STAT_COUNTERS] = {
+    "proxy_connections_accepted_total",
+    "proxy_requests_total",
+    "proxy_cache_hits_total",
+    "proxy_cache_misses_total",
+    "proxy_cache_local_node_hits_total",
+    "proxy_cache_remote_node_hits_total",
+    "proxy_cache_evictions_total",
+    "proxy_cache_inserts_total",
+    "proxy_variant_inserts_total",
+    "proxy_cache_compressed_inserts_total",
+    "proxy_cache_compress_saved_bytes_total",
+    "proxy_cache_warm_hits_total",
+    "proxy_cache_promotions_total",
+    "proxy_cache_demotions_total",
+    "proxy_cache_lz4_saved_bytes_total",
+    "proxy_client_bytes_total",
+    "proxy_origin_bytes_total",
+    "proxy_upstream_errors_total",
+    "proxy_upstream_queued_total",
+    "proxy_timeouts_header_total",
+    "proxy_timeouts_connect_total",
+    "proxy_timeouts_ttfb_total",
+    "proxy_timeouts_idle_total",
+    "proxy_timeouts_write_total",
+    "proxy_client_errors_total",
+    "proxy_log_drops_total",
+    "proxy_arena_heap_allocs_total",
+    "proxy_tunnels_opened_total",
+    "proxy_tunnels_closed_total",
+    "proxy_tunnels_idle_closed_total",
+    "proxy_tunnel_bytes_up_total",
+    "proxy_tunnel_bytes_down_total",
+    "proxy_h2_connections_total",
+    "proxy_h2_streams_total",
+    "proxy_negative_hits_total",
+    "proxy_negative_inserts_total",
+    "proxy_peer_requests_total",
+    "proxy_peer_hits_total",
+    "proxy_peer_errors_total",
+    "proxy_peer_served_total",
+    "proxy_peer_fills_total",
+    "proxy_governor_waits_total",
+    "proxy_governor_shed_total",
+    "proxy_budget_relays_total",
+    "proxy_shared_cache_torn_reads_total",
+    "proxy_shared_cache_refreshes_total",
+};
+
+static const char *phaseNames[HIST_PHASES] = {
+    "first_byte",
+    "upstream_connect",
+    "upstream_ttfb",
+    "upstream_queue",
+    "total",
+    "warm_decompress",
+};
+
+/*
+ * bump - single writer increment. Only the owning thread writes a block,
+ *     so a relaxed load and store is enough and avoids a locked instruction.
+ */
+
+static inline void bump(unsigned long *p, unsigned long delta) {
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + delta,
+        __ATOMIC_RELAXED);
+}
+
+static void releaseBlock(void *block) {
+    __atomic_store_n(&((StatBlock *)block)->inUse, 0, __ATOMIC_RELEASE);
+}
+
+static void makeBlockKey() {
+    pthread_key_create(&blockKey, releaseBlock);
+}
+
+/*
+ * getBlock - return the StatBlock of the calling thread. A released block
+ *     is reused when there is one, otherwise a new block is pushed onto
+ *     the list. Both paths are lock free.
+ */
+
+static StatBlock *getBlock() {
+    StatBlock *ptr;
+    int expected;
+
+    if (myBlock != NULL)
+        return myBlock;
+
+    pthread_once(&blockOnce, makeBlockKey);
+
+    for (ptr = __atomic_load_n(&blockList, __ATOMIC_ACQUIRE); ptr;
+            ptr = ptr->next) {
+        expected = 0;
+        if (__atomic_compare_exchange_n(&ptr->inUse, &expected, 1, 0,
+                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+
+    if (ptr == NULL) {
+        ptr = (StatBlock *)Calloc(1, sizeof(StatBlock));
+        ptr->inUse = 1;
+        ptr->next = __atomic_load_n(&blockList, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&blockList, &ptr->next, ptr,
+                0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+
+    pthread_setspecific(blockKey, ptr);
+    myBlock = ptr;
+    return ptr;
+}
+
+/*
+ * histBucket - map a value to its log-linear bucket. Values below HIST_SUB
+ *     get their own bucket, larger values keep HIST_SUB_BITS significant
+ *     bits below the most significant one.
+ */
+
+static int histBucket(unsigned long value) {
+    int msb;
+
+    if (value < HIST_SUB)
+        return (int)value;
+
+    msb = 63 - __builtin_clzl(value);
+    if (msb > HIST_MAX_MSB)
+        return HIST_BUCKETS - 1;
+
+    return (msb - HIST_SUB_BITS + 1) * HIST_SUB
+        + (int)((value >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*
+ * statsNow - get the current monotonic time in micro-second.
+ */
+
+unsigned long statsNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+void statsAdd(int idx, unsigned long delta) {
+    bump(&getBlock()->counter[idx], delta);
+}
+
+/*
+ * statsRead - current value of a counter summed over all threads.
+ */
+
+unsigned long statsRead(int idx) {
+    StatBlock *ptr;
+    unsigned long sum = 0;
+
+    for (ptr = __atomic_load_n(&blockList, __ATOMIC_ACQUIRE); ptr;
+            ptr = ptr->next)
+        sum += __atomic_load_n(&ptr->counter[idx], __ATOMIC_RELAXED);
+    return sum;
+}
+
+/*
+ * statsRecord - record one latency sample (in micro-second) of a phase.
+ */
+
+void statsRecord(int phase, int hit, unsigned long us) {
+    Histogram *hist = &getBlock()->hist[phase][hit ? 1 : 0];
+
+    bump(&hist->count[histBucket(us)], 1);
+    bump(&hist->sum, us);
+}
+
+/*
+ * statsRecordRequest - called once the connection is done. Every phase
+ *     that happened is recorded relative to its own start.
+ */
+
+void statsRecordRequest(ReqStat *rs) {
+    statsInc(STAT_REQUESTS);
+    statsAdd(STAT_BYTES_TO_CLIENT, rs->bytes);
+    if (rs->firstByteUs)
+        statsRecord(HIST_FIRST_BYTE, rs->hit, rs->firstByteUs - rs->acceptUs);
+    if (rs->connectUs)
+        statsRecord(HIST_UPSTREAM_CONNECT, rs->hit, rs->connectUs);
+    if (rs->ttfbUs)
+        statsRecord(HIST_UPSTREAM_TTFB, rs->hit, rs->ttfbUs);
+    statsRecord(HIST_TOTAL, rs->hit, rs->endUs - rs->acceptUs);
+}
+
+/*
+ * dumpHistogram - print one histogram in Prometheus text format. Only the
+ *     power of two boundaries are exported, which are exact since every
+ *     sub-bucket lies entirely between two of them.
+ */
+
+static void dumpHistogram(FILE *fp, const char *phase, const char *cache,
+    Histogram *hist) {
+
+    unsigned long cum = 0, total = 0;
+    int i, k, limit, idx = 0;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        total += hist->count[i];
+
+    for (k = 1; k <= HIST_MAX_MSB + 1; k++) {
+        limit = (k < HIST_SUB_BITS) ? (1 << k)
+            : (k - HIST_SUB_BITS + 1) * HIST_SUB;
+        if (limit > HIST_BUCKETS)
+            limit = HIST_BUCKETS;
+        for (; idx < limit; idx++)
+            cum += hist->count[idx];
+        fprintf(fp, "proxy_latency_seconds_bucket{phase=\"%s\",cache=\"%s\","
+            "le=\"%g\"} %lu\n", phase, cache, (double)(1UL << k) / 1e6, cum);
+    }
+    fprintf(fp, "proxy_latency_seconds_bucket{phase=\"%s\",cache=\"%s\","
+        "le=\"+Inf\"} %lu\n", phase, cache, total);
+    fprintf(fp, "proxy_latency_seconds_sum{phase=\"%s\",cache=\"%s\"} %g\n",
+        phase, cache, (double)hist->sum / 1e6);
+    fprintf(fp, "proxy_latency_seconds_count{phase=\"%s\",cache=\"%s\"} %lu\n",
+        phase, cache, total);
+}
+
+/*
+ * statsDump - sum all blocks and print them in Prometheus text format.
+ *     Values written concurrently may be missed by this pass and show up
+ *     in the next one, which is fine for monitoring.
+ */
+
+void statsDump(FILE *fp) {
+    static Histogram sum[HIST_PHASES][2];
+    static unsigned long counter[STAT_COUNTERS];
+    static pthread_mutex_t dumpMutex = PTHREAD_MUTEX_INITIALIZER;
+    StatBlock *ptr;
+    int i, j, k;
+
+    /* the scratch area is too large for the admin thread stack */
+    pthread_mutex_lock(&dumpMutex);
+    memset(sum, 0, sizeof(sum));
+    memset(counter, 0, sizeof(counter));
+
+    for (ptr = __atomic_load_n(&blockList, __ATOMIC_ACQUIRE); ptr;
+            ptr = ptr->next) {
+        for (i = 0; i < STAT_COUNTERS; i++)
+            counter[i] += __atomic_load_n(&ptr->counter[i], __ATOMIC_RELAXED);
+        for (i = 0; i < HIST_PHASES; i++) {
+            for (j = 0; j < 2; j++) {
+                for (k = 0; k < HIST_BUCKETS; k++)
+                    sum[i][j].count[k] += __atomic_load_n(
+                        &ptr->hist[i][j].count[k], __ATOMIC_RELAXED);
+                sum[i][j].sum += __atomic_load_n(&ptr->hist[i][j].sum,
+                    __ATOMIC_RELAXED);
+            }
+        }
+    }
+
+    for (i = 0; i < STAT_COUNTERS; i++) {
+        fprintf(fp, "# TYPE %s counter\n", counterNames[i]);
+        fprintf(fp, "%s %lu\n", counterNames[i], counter[i]);
+    }
+
+    fprintf(fp, "# TYPE proxy_latency_seconds histogram\n");
+    for (i = 0; i < HIST_PHASES; i++) {
+        dumpHistogram(fp, phaseNames[i], "miss", &sum[i][0]);
+        dumpHistogram(fp, phaseNames[i], "hit", &sum[i][1]);
+    }
+    for (i = 0; i < __atomic_load_n(&nDumpHooks, __ATOMIC_ACQUIRE); i++)
+        dumpHooks[i](fp);
+    pthread_mutex_unlock(&dumpMutex);
+}
+
+/*
+ * statsRegisterDump - have fn append its own metrics to every dump.
+ *     The slot is filled before the count is published, so the admin
+ *     thread may already be running.
+ */
+
+void statsRegisterDump(void (*fn)(FILE *)) {
+    if (nDumpHooks < MAX_DUMP_HOOKS) {
+        dumpHooks[nDumpHooks] = fn;
+        __atomic_store_n(&nDumpHooks, nDumpHooks + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * statsRegisterPage - serve GET path on the admin port with fn, which
+ *     gets the query string of the request ("" if there is none).
+ */
+
+void statsRegisterPage(char *path, void (*fn)(FILE *, char *)) {
+    if (nPages < MAX_ADMIN_PAGES) {
+        pages[nPages].path = path;
+        pages[nPages].fn = fn;
+        __atomic_store_n(&nPages, nPages + 1, __ATOMIC_RELEASE);
+    }
+}
+
+/*
+ * findPage - the registered page for path, whose query string is cut off
+ *     and returned in query.
+ */
+
+static int findPage(char *path, char **query) {
+    int i;
+
+    if ((*query = strchr(path, '?')) != NULL)
+        *(*query)++ = '\0';
+    else
+        *query = "";
+    for (i = 0; i < __atomic_load_n(&nPages, __ATOMIC_ACQUIRE); i++)
+        if (!strcmp(path, pages[i].path))
+            return i;
+    return -1;
+}
+
+/* deadlines of an admin request, the -t header and write timeouts */
+static unsigned long adminHeaderMs;
+static unsigned long adminWriteMs;
+static Timer adminTimer;
+
+/*
+ * adminThread - serve the admin port. Each connection gets one response:
+ *     GET /metrics returns the statistics, GET of a registered page that
+ *     page, anything else is a 404. There is only this thread, so a
+ *     client which does not finish its request, or does not read the
+ *     response, is cut off by the timer wheel like a proxy client.
+ */
+
+static void *adminThread(void *vargp) {
+    int listenfd = (int)(size_t)vargp, connfd;
+    char buf[MAXLINE], method[MAXLINE], path[MAXLINE], hdr[MAXLINE];
+    char *body, *query;
+    int page;
+    size_t bodyLen;
+    rio_t rio;
+    FILE *fp;
+
+    pthread_detach(pthread_self());
+
+    for (; ;) {
+        if ((connfd = accept(listenfd, NULL, NULL)) < 0)
+            continue;
+
+        timerArm(&adminTimer, connfd, TIMEOUT_HEADER, adminHeaderMs);
+        Rio_readinitb(&rio, connfd);
+        if (rio_readlineb(&rio, buf, MAXLINE) <= 0
+                || sscanf(buf, "%s %s", method, path) != 2) {
+            timerCancel(&adminTimer);
+            close(connfd);
+            continue;
+        }
+        /* drain request headers */
+        while (rio_readlineb(&rio, hdr, MAXLINE) > 0 && strcmp(hdr, "\r\n"))
+            ;
+
+        body = NULL;
+        bodyLen = 0;
+        if ((fp = open_memstream(&body, &bodyLen)) == NULL) {
+            timerCancel(&adminTimer);
+            close(connfd);
+            continue;
+        }
+        if (!strcasecmp(method, "GET") && !strncmp(path, "/metrics", 8)) {
+            statsDump(fp);
+            fclose(fp);
+            sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+                "version=0.0.4\r\nContent-length: %d\r\n\r\n", (int)bodyLen);
+        }
+        else if (!strcasecmp(method, "GET")
+                && (page = findPage(path, &query)) >= 0) {
+            pages[page].fn(fp, query);
+            fclose(fp);
+            sprintf(hdr, "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n"
+                "Content-length: %d\r\n\r\n", (int)bodyLen);
+        }
+        else {
+            fprintf(fp, "Not Found\n");
+            fclose(fp);
+            sprintf(hdr, "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain"
+                "\r\nContent-length: %d\r\n\r\n", (int)bodyLen);
+        }
+        timerArm(&adminTimer, connfd, TIMEOUT_WRITE, adminWriteMs);
+        rio_writen(connfd, hdr, strlen(hdr));
+        rio_writen(connfd, body, bodyLen);
+        timerCancel(&adminTimer);
+        free(body);
+        close(connfd);
+    }
+    return NULL;
+}
+
+/*
+ * startAdminServer - serve the admin port from its own thread, on
+ *     listenfd if it is open already (see restart.h). A request must
+ *     arrive within headerMs and its response be taken within writeMs,
+ *     the timer wheel must be running. Returns the listening socket.
+ */
+
+int startAdminServer(char *port, int listenfd, unsigned long headerMs,
+    unsigned long writeMs) {
+    pthread_t tid;
+
+    adminHeaderMs = headerMs;
+    adminWriteMs = writeMs;
+
+    if (listenfd < 0 && (listenfd = Open_listenfd(port)) < 0)
+        exit(1);
+
+    Pthread_create(&tid, NULL, adminThread, (void *)(size_t)listenfd);
+    return listenfd;
+}
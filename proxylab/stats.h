@@ -0,0 +1,136 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+/*
+ * Statistics are defined as followed:
+ *     Counters:
+ *           plain event counts (requests, hits, evictions, ...).
+ *     Histograms:
+ *           HDR-style log-linear latency histograms in microseconds.
+ *           Every power of two is split into HIST_SUB sub-buckets, so
+ *           the relative error of any recorded value is below 1/HIST_SUB.
+ *
+ * Every thread owns a private StatBlock and is the only writer of it, so
+ * updating a counter or a histogram never takes a lock. The admin thread
+ * walks all blocks and sums them when /metrics is requested.
+ */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+/* the largest tracked value is 2^HIST_MAX_MSB us (about 9.5 hours) */
+#define HIST_MAX_MSB 35
+#define HIST_BUCKETS ((HIST_MAX_MSB - HIST_SUB_BITS + 2) * HIST_SUB)
+
+/* other modules may append their own gauges to /metrics */
+#define MAX_DUMP_HOOKS 16
+/* and serve their own pages on the admin port */
+#define MAX_ADMIN_PAGES 8
+
+/* Counter index */
+enum {
+    STAT_ACCEPTS,
+    STAT_REQUESTS,
+    STAT_HITS,
+    STAT_MISSES,
+    STAT_LOCAL_NODE_HITS,
+    STAT_REMOTE_NODE_HITS,
+    STAT_EVICTIONS,
+    STAT_CACHE_INSERTS,
+    STAT_VARIANT_INSERTS,
+    STAT_COMPRESSED_INSERTS,
+    STAT_COMPRESS_SAVED_BYTES,
+    STAT_WARM_HITS,             /* tiers, see cache.h */
+    STAT_PROMOTIONS,
+    STAT_DEMOTIONS,
+    STAT_LZ4_SAVED_BYTES,
+    STAT_BYTES_TO_CLIENT,
+    STAT_BYTES_FROM_ORIGIN,
+    STAT_UPSTREAM_ERRORS,
+    STAT_UPSTREAM_QUEUED,
+    STAT_TIMEOUTS,              /* one counter per phase of timer.h */
+    STAT_TIMEOUTS_CONNECT,
+    STAT_TIMEOUTS_TTFB,
+    STAT_TIMEOUTS_IDLE,
+    STAT_TIMEOUTS_WRITE,
+    STAT_CLIENT_ERRORS,
+    STAT_LOG_DROPS,
+    STAT_ARENA_HEAP_ALLOCS,
+    STAT_TUNNELS_OPENED,
+    STAT_TUNNELS_CLOSED,
+    STAT_TUNNELS_IDLE_CLOSED,
+    STAT_TUNNEL_BYTES_UP,
+    STAT_TUNNEL_BYTES_DOWN,
+    STAT_H2_CONNECTIONS,
+    STAT_H2_STREAMS,
+    STAT_NEG_HITS,
+    STAT_NEG_INSERTS,
+    STAT_PEER_REQUESTS,         /* peer group, see peer.h */
+    STAT_PEER_HITS,
+    STAT_PEER_ERRORS,
+    STAT_PEER_SERVED,
+    STAT_PEER_FILLS,
+    STAT_GOVERNOR_WAITS,        /* memory governor, see governor.h */
+    STAT_GOVERNOR_SHED,
+    STAT_BUDGET_RELAYS,
+    STAT_SHARED_TORN,           /* shared cache, see shmcache.h */
+    STAT_SHARED_REFRESHES,
+    STAT_COUNTERS
+};
+
+/* Histogram index */
+enum {
+    HIST_FIRST_BYTE,        /* accept to first byte sent to client */
+    HIST_UPSTREAM_CONNECT,  /* upstream connect, misses only */
+    HIST_UPSTREAM_TTFB,     /* request sent to first byte from origin */
+    HIST_UPSTREAM_QUEUE,    /* wait for an upstream slot, see upstream.h */
+    HIST_TOTAL,             /* accept to connection close */
+    HIST_WARM_DECOMPRESS,   /* inflating a hit of the warm tier */
+    HIST_PHASES
+};
+
+typedef struct _histogram {
+    unsigned long count[HIST_BUCKETS];
+    unsigned long sum;
+} Histogram;
+
+typedef struct _statBlock {
+    unsigned long counter[STAT_COUNTERS];
+    Histogram hist[HIST_PHASES][2];     /* [phase][miss = 0, hit = 1] */
+    int inUse;
+    struct _statBlock *next;
+} StatBlock;
+
+/*
+ * Per request timing, filled in along the request path and recorded into
+ * the histograms by statsRecordRequest. All times are in microseconds,
+ * zero means the phase did not happen. The request identity is kept for
+ * the access log.
+ */
+typedef struct _reqStat {
+    unsigned long acceptUs;
+    unsigned long firstByteUs;
+    unsigned long connectUs;
+    unsigned long ttfbUs;
+    unsigned long endUs;
+    long bytes;
+    int hit;
+    int status;
+    char method[16];
+    char host[64];
+    char port[8];
+    char path[128];
+} ReqStat;
+
+unsigned long statsNow();
+void statsAdd(int, unsigned long);
+unsigned long statsRead(int);
+void statsRecord(int, int, unsigned long);
+void statsRecordRequest(ReqStat*);
+void statsDump(FILE*);
+void statsRegisterDump(void (*)(FILE*));
+void statsRegisterPage(char*, void (*)(FILE*, char*));
+int startAdminServer(char*, int, unsigned long, unsigned long);
+
+#define statsInc(idx) statsAdd((idx), 1)
+
+#endif /* __STATS_H__ */
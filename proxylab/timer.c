@@ -0,0 +1,141 @@
+#include "csapp.h"
+#include "stats.h"
+#include "timer.h"
+
+static Timer *wheel[TIMER_SLOTS];
+static pthread_mutex_t wheelMutex = PTHREAD_MUTEX_INITIALIZER;
+
+unsigned long timerNowMs() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static int slotOf(unsigned long ms) {
+    return (ms / TIMER_TICK_MS) % TIMER_SLOTS;
+}
+
+/* wheelLink and wheelUnlink need wheelMutex */
+static void wheelLink(Timer *t) {
+    int s = slotOf(__atomic_load_n(&t->expires, __ATOMIC_RELAXED));
+
+    t->slot = s;
+    t->prev = NULL;
+    t->next = wheel[s];
+    if (wheel[s])
+        wheel[s]->prev = t;
+    wheel[s] = t;
+}
+
+static void wheelUnlink(Timer *t) {
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        wheel[t->slot] = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+}
+
+/*
+ * expireSlot - fire the timers of slot s which are due. A timer which was
+ *     touched since it was linked is moved to the slot of its new expiry.
+ */
+
+static void expireSlot(int s, unsigned long now) {
+    Timer *t, *next, *moved = NULL;
+    unsigned long expires;
+
+    for (t = wheel[s]; t; t = next) {
+        next = t->next;
+        expires = __atomic_load_n(&t->expires, __ATOMIC_RELAXED);
+        if (expires > now && slotOf(expires) == s)
+            continue;
+
+        wheelUnlink(t);
+
+        if (expires > now) {
+            t->next = moved;
+            moved = t;
+            continue;
+        }
+        __atomic_store_n(&t->armed, 0, __ATOMIC_RELAXED);
+        shutdown(t->fd, SHUT_RDWR);
+        statsInc(STAT_TIMEOUTS + t->phase);
+    }
+
+    for (t = moved; t; t = next) {
+        next = t->next;
+        wheelLink(t);
+    }
+}
+
+static void *wheelThread(void *vargp) {
+    unsigned long last = timerNowMs(), now, tick;
+    struct timespec delay = { 0, TIMER_TICK_MS * 1000000L };
+
+    pthread_detach(pthread_self());
+
+    for (; ;) {
+        nanosleep(&delay, NULL);
+        now = timerNowMs();
+
+        /* visit every slot passed since the last round, at most once */
+        pthread_mutex_lock(&wheelMutex);
+        tick = last / TIMER_TICK_MS;
+        do {
+            expireSlot(tick % TIMER_SLOTS, now);
+        } while (++tick <= now / TIMER_TICK_MS
+            && tick - last / TIMER_TICK_MS < TIMER_SLOTS);
+        pthread_mutex_unlock(&wheelMutex);
+        last = now;
+    }
+    return NULL;
+}
+
+void startTimerWheel() {
+    pthread_t tid;
+
+    Pthread_create(&tid, NULL, wheelThread, NULL);
+}
+
+/*
+ * timerArm - shut fd down unless the timer is cancelled or touched within
+ *     ms. Re-arming an armed timer replaces it.
+ */
+
+void timerArm(Timer *t, int fd, int phase, unsigned long ms) {
+    pthread_mutex_lock(&wheelMutex);
+    if (t->armed)
+        wheelUnlink(t);
+    t->fd = fd;
+    t->phase = phase;
+    t->ms = ms;
+    __atomic_store_n(&t->expires, timerNowMs() + ms, __ATOMIC_RELAXED);
+    __atomic_store_n(&t->armed, 1, __ATOMIC_RELAXED);
+    wheelLink(t);
+    pthread_mutex_unlock(&wheelMutex);
+}
+
+/*
+ * timerTouch - progress was made, restart the period of an idle timer.
+ */
+
+void timerTouch(Timer *t) {
+    __atomic_store_n(&t->expires, timerNowMs() + t->ms, __ATOMIC_RELAXED);
+}
+
+void timerCancel(Timer *t) {
+    if (!__atomic_load_n(&t->armed, __ATOMIC_RELAXED))
+        return;
+    pthread_mutex_lock(&wheelMutex);
+    if (t->armed) {
+        wheelUnlink(t);
+        t->armed = 0;
+    }
+    pthread_mutex_unlock(&wheelMutex);
+}
+
+int timerArmed(Timer *t) {
+    return __atomic_load_n(&t->armed, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,54 @@
+#ifndef __TIMER_H__
+#define __TIMER_H__
+
+/*
+ * Timer wheel is defined as followed:
+ *     All I/O of the proxy is blocking, so a deadline is enforced from
+ *     the outside: a timer holds a socket, and when it expires the wheel
+ *     thread shuts the socket down. The blocked read or write returns
+ *     at once and the worker unwinds through its normal error path. A
+ *     coroutine (coro.h) waiting on the socket is woken the same way.
+ *
+ *     The wheel has TIMER_SLOTS slots of TIMER_TICK_MS each. A timer sits
+ *     in the slot of its expiry time, a deadline further out than one
+ *     revolution is skipped until its round comes. Idle timers are
+ *     touched by their owner after every bit of progress, which only
+ *     moves the expiry time; the wheel notices when it reaches the old
+ *     slot and moves the timer on, so touching never takes the lock.
+ *
+ *     A timer must be cancelled before its socket is closed. Once
+ *     timerCancel returns the timer can not fire any more.
+ */
+
+#define TIMER_TICK_MS 50
+#define TIMER_SLOTS 256
+
+/* Deadline phases */
+enum {
+    TIMEOUT_HEADER,         /* whole request header from the client */
+    TIMEOUT_CONNECT,        /* upstream connect */
+    TIMEOUT_TTFB,           /* request sent to first response line */
+    TIMEOUT_IDLE,           /* no progress on the upstream body */
+    TIMEOUT_WRITE,          /* no progress writing to the client */
+    TIMEOUT_PHASES
+};
+
+typedef struct _timer {
+    int fd;
+    int phase;
+    int armed;
+    int slot;                       /* where it is linked */
+    unsigned long ms;               /* duration, also the idle period */
+    unsigned long expires;          /* ms, may be pushed out by touch */
+    struct _timer *prev;
+    struct _timer *next;
+} Timer;
+
+void startTimerWheel();
+void timerArm(Timer*, int, int, unsigned long);
+void timerTouch(Timer*);
+void timerCancel(Timer*);
+int timerArmed(Timer*);
+unsigned long timerNowMs();
+
+#endif /* __TIMER_H__ */
@@ -0,0 +1,126 @@
+/* CPU affinity is a GNU extension, so this file stays off csapp.h */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "stats.h"
+#include "topology.h"
+
+/* CPUs of every node, nodes are numbered densely in the order found */
+static int nodeCount = 0;
+static int nodeId[MAX_NUMA_NODES];
+static int nodeCpus[MAX_NUMA_NODES][CPU_SETSIZE];
+static int nodeCpuCount[MAX_NUMA_NODES];
+static int cpuNode[CPU_SETSIZE];
+
+/* set once a thread is pinned, -1 means ask the kernel every time */
+static __thread int myNode = -1;
+
+/*
+ * parseCpuList - add the CPUs of a list like "0-3,8-11" to node n.
+ */
+
+static void parseCpuList(char *list, int n) {
+    char *pos = list, *end;
+    long first, last, cpu;
+
+    while (*pos && *pos != '\n') {
+        first = last = strtol(pos, &end, 10);
+        if (end == pos)
+            return;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            nodeCpus[n][nodeCpuCount[n]++] = cpu;
+            cpuNode[cpu] = n;
+        }
+        pos = (*end == ',') ? end + 1 : end;
+    }
+}
+
+static void dumpNuma(FILE *fp) {
+    fprintf(fp, "# TYPE proxy_numa_nodes gauge\n");
+    fprintf(fp, "proxy_numa_nodes %d\n", nodeCount);
+}
+
+/*
+ * numaInit - discover the nodes and their CPUs.
+ */
+
+void numaInit() {
+    char path[64], list[4096];
+    FILE *fp;
+    long cpu, ncpu;
+    int id;
+
+    for (id = 0; id < MAX_NUMA_NODES * 4 && nodeCount < MAX_NUMA_NODES;
+            id++) {
+        sprintf(path, "/sys/devices/system/node/node%d/cpulist", id);
+        if ((fp = fopen(path, "r")) == NULL)
+            continue;
+        if (fgets(list, sizeof(list), fp) != NULL) {
+            parseCpuList(list, nodeCount);
+            /* memory only nodes have no CPUs to pin to */
+            if (nodeCpuCount[nodeCount] > 0)
+                nodeId[nodeCount++] = id;
+        }
+        fclose(fp);
+    }
+
+    if (nodeCount == 0) {
+        ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+        for (cpu = 0; cpu < ncpu && cpu < CPU_SETSIZE; cpu++) {
+            nodeCpus[0][cpu] = cpu;
+            cpuNode[cpu] = 0;
+        }
+        nodeCpuCount[0] = cpu > 0 ? cpu : 1;
+        nodeId[0] = 0;
+        nodeCount = 1;
+    }
+
+    statsRegisterDump(dumpNuma);
+}
+
+int numaNodes() {
+    return nodeCount;
+}
+
+/*
+ * numaCurrentNode - dense node number of the calling thread.
+ */
+
+int numaCurrentNode() {
+    int cpu;
+
+    if (myNode >= 0)
+        return myNode;
+    if ((cpu = sched_getcpu()) < 0 || cpu >= CPU_SETSIZE)
+        return 0;
+    return cpuNode[cpu];
+}
+
+/*
+ * numaPinThread - bind the calling thread to the idx-th CPU of node
+ *     (both taken modulo their counts). Returns -1 if the kernel refused.
+ */
+
+int numaPinThread(int node, int idx) {
+    cpu_set_t set;
+    int cpu;
+
+    node %= nodeCount;
+    cpu = nodeCpus[node][idx % nodeCpuCount[node]];
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        fprintf(stderr, "Can not pin to cpu %d of node %d\n", cpu,
+            nodeId[node]);
+        return -1;
+    }
+    myNode = node;
+    return 0;
+}
@@ -0,0 +1,26 @@
+#ifndef __TOPOLOGY_H__
+#define __TOPOLOGY_H__
+
+/*
+ * Topology is defined as followed:
+ *     The topology is read from /sys/devices/system/node at startup, a
+ *     machine without it is one node holding every online CPU.
+ *
+ *     With pinning, listener i and all of its workers are bound to the
+ *     CPUs of node i % nodes, workers round robin over those CPUs. Every
+ *     per-thread structure (connection buffers, stat blocks, log rings,
+ *     cache objects a worker inserts) is allocated and first touched by
+ *     its thread, so the default first-touch policy of the kernel keeps
+ *     it on the node of that thread. A connection then stays on one node
+ *     from accept to close, and only cache hits on objects inserted by
+ *     another node cross the interconnect; those are counted.
+ */
+
+#define MAX_NUMA_NODES 64
+
+void numaInit();
+int numaNodes();
+int numaCurrentNode();
+int numaPinThread(int, int);
+
+#endif /* __TOPOLOGY_H__ */
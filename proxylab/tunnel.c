@@ -0,0 +1,665 @@
+/* splice and pipe2 are GNU extensions, so this file stays off csapp.h */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+#include "tunnel.h"
+#include "uring.h"
+
+#define MAX_EVENTS 256
+
+struct _tunnel;
+
+/* epoll user data, tells which socket of which tunnel is ready */
+typedef struct _tunnelRef {
+    struct _tunnel *t;
+    int side;
+} TunnelRef;
+
+/* one direction of a tunnel: from -> pipe -> to */
+typedef struct _tunnelDir {
+    int from;
+    int to;
+    int pipe[2];
+    long pending;           /* bytes sitting in the pipe */
+    int eof;                /* from reached end of file */
+    int stat;               /* counter of the bytes moved */
+    /* io_uring backend, the buffer replaces the pipe */
+    struct _tunnel *t;
+    char *buf;
+    int slot;               /* in the registered pool, -1 if malloc'd */
+    int reading;            /* the operation in flight is the read */
+    long len;               /* bytes in buf */
+    long off;               /* of which written */
+} TunnelDir;
+
+typedef struct _tunnel {
+    int fd[2];              /* [client, origin] */
+    unsigned int events[2]; /* registered epoll interest per socket */
+    TunnelRef ref[2];
+    TunnelDir dir[2];       /* [client to origin, origin to client] */
+    unsigned long lastActive;
+    int dead;               /* closed, freed after the current batch */
+    int inflight;           /* io_uring operations not completed yet */
+    struct _tunnel *prev;
+    struct _tunnel *next;
+} Tunnel;
+
+/* user_data of the io_uring operations which are not a tunnel direction */
+#define URING_WAKE 1
+#define URING_TICK 2
+
+static int backend = IO_EPOLL;
+static int epfd = -1;
+static int wakefd = -1;
+static int idleSec = DEFAULT_TUNNEL_IDLE;
+static long pipeSize = 0;
+static long active = 0;
+static Tunnel *tunnels = NULL;
+static Tunnel *deadList = NULL;
+static Tunnel *newList = NULL;          /* added, not yet registered */
+static pthread_mutex_t tunnelMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* io_uring backend, only the pump thread touches these */
+static Uring ring;
+static char *pool = NULL;
+static int freeSlots[TUNNEL_FIXED_BUFS];
+static int nFree = 0;
+
+static unsigned long nowSec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return ts.tv_sec;
+}
+
+/*
+ * unlinkTunnel - remove a tunnel from the list, tunnelMutex must be held.
+ */
+
+static void unlinkTunnel(Tunnel *t) {
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        tunnels = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+}
+
+/*
+ * closeTunnel - close the sockets and pipes of an unlinked tunnel. The
+ *     struct itself may still be referenced by events of the current
+ *     epoll batch, so it is only freed by freeDead. Only the pump thread
+ *     does this.
+ */
+
+static void closeTunnel(Tunnel *t) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        close(t->fd[i]);
+        close(t->dir[i].pipe[0]);
+        close(t->dir[i].pipe[1]);
+    }
+    t->dead = 1;
+    t->next = deadList;
+    deadList = t;
+    __atomic_fetch_sub(&active, 1, __ATOMIC_RELAXED);
+    statsInc(STAT_TUNNELS_CLOSED);
+}
+
+static void freeDead() {
+    Tunnel *t;
+
+    while ((t = deadList) != NULL) {
+        deadList = t->next;
+        free(t);
+    }
+}
+
+/*
+ * pumpDir - move as many bytes as possible in one direction without
+ *     blocking. Returns -1 on error, 0 otherwise.
+ */
+
+static int pumpDir(Tunnel *t, TunnelDir *d) {
+    ssize_t n;
+
+    for (; ;) {
+        if (d->pending > 0) {
+            n = splice(d->pipe[0], NULL, d->to, NULL, d->pending,
+                SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n < 0)
+                return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+            d->pending -= n;
+            statsAdd(d->stat, n);
+            t->lastActive = nowSec();
+            continue;
+        }
+        if (d->eof)
+            return 0;
+
+        n = splice(d->from, NULL, d->pipe[1], NULL, TUNNEL_PIPE_SIZE,
+            SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n < 0)
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        if (n == 0) {
+            /* pass the half close on */
+            d->eof = 1;
+            shutdown(d->to, SHUT_WR);
+            return 0;
+        }
+        d->pending += n;
+    }
+}
+
+/*
+ * updateInterest - register what each socket waits for. A socket is
+ *     watched for reading while the direction it feeds has an empty pipe
+ *     and for writing while the direction it drains has bytes pending.
+ */
+
+static void updateInterest(Tunnel *t) {
+    struct epoll_event ev;
+    unsigned int want;
+    int side;
+
+    for (side = 0; side < 2; side++) {
+        want = 0;
+        if (!t->dir[side].eof && t->dir[side].pending == 0)
+            want |= EPOLLIN;
+        if (t->dir[1 - side].pending > 0)
+            want |= EPOLLOUT;
+        if (want == t->events[side])
+            continue;
+
+        ev.events = want;
+        ev.data.ptr = &t->ref[side];
+        epoll_ctl(epfd, EPOLL_CTL_MOD, t->fd[side], &ev);
+        t->events[side] = want;
+    }
+}
+
+/*
+ * registerNew - move the tunnels handed over by addTunnel into the list
+ *     and the epoll set. Done by the pump thread so that nothing else
+ *     ever touches a registered tunnel.
+ */
+
+static void registerNew() {
+    struct epoll_event ev;
+    unsigned long count;
+    Tunnel *t, *next;
+    int i;
+
+    if (read(wakefd, &count, sizeof(count)) < 0)
+        return;
+
+    pthread_mutex_lock(&tunnelMutex);
+    t = newList;
+    newList = NULL;
+    for (; t; t = next) {
+        next = t->next;
+        t->prev = NULL;
+        t->next = tunnels;
+        if (tunnels)
+            tunnels->prev = t;
+        tunnels = t;
+
+        for (i = 0; i < 2; i++) {
+            t->events[i] = EPOLLIN;
+            ev.events = EPOLLIN;
+            ev.data.ptr = &t->ref[i];
+            epoll_ctl(epfd, EPOLL_CTL_ADD, t->fd[i], &ev);
+        }
+    }
+    pthread_mutex_unlock(&tunnelMutex);
+}
+
+static void abortTunnel(Tunnel *);
+
+/*
+ * sweepIdle - close every tunnel which was idle for too long.
+ */
+
+static void sweepIdle() {
+    Tunnel *t, *next;
+    unsigned long now = nowSec();
+
+    pthread_mutex_lock(&tunnelMutex);
+    for (t = tunnels; t; t = next) {
+        next = t->next;
+        if (now - t->lastActive < (unsigned long)idleSec)
+            continue;
+        unlinkTunnel(t);
+        if (backend == IO_URING)
+            abortTunnel(t);
+        else
+            closeTunnel(t);
+        statsInc(STAT_TUNNELS_IDLE_CLOSED);
+    }
+    pthread_mutex_unlock(&tunnelMutex);
+}
+
+static void *pumpThread(void *vargp) {
+    struct epoll_event events[MAX_EVENTS];
+    unsigned long lastSweep = nowSec();
+    Tunnel *t;
+    int i, n;
+
+    pthread_detach(pthread_self());
+
+    for (; ;) {
+        n = epoll_wait(epfd, events, MAX_EVENTS, 1000);
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                registerNew();
+                continue;
+            }
+            t = ((TunnelRef *)events[i].data.ptr)->t;
+            if (t->dead)
+                continue;
+
+            if (pumpDir(t, &t->dir[0]) < 0 || pumpDir(t, &t->dir[1]) < 0
+                    || (t->dir[0].eof && t->dir[0].pending == 0
+                        && t->dir[1].eof && t->dir[1].pending == 0)) {
+                pthread_mutex_lock(&tunnelMutex);
+                unlinkTunnel(t);
+                pthread_mutex_unlock(&tunnelMutex);
+                closeTunnel(t);
+                continue;
+            }
+            updateInterest(t);
+        }
+
+        if (nowSec() != lastSweep) {
+            lastSweep = nowSec();
+            sweepIdle();
+        }
+        freeDead();
+    }
+    return NULL;
+}
+
+/*
+ * armRead, armWrite - queue the next operation of a direction, it is
+ *     submitted along with the others of the batch.
+ */
+
+static void armRead(TunnelDir *d) {
+    struct io_uring_sqe *sqe = uringSqe(&ring);
+
+    sqe->opcode = d->slot >= 0 ? IORING_OP_READ_FIXED : IORING_OP_RECV;
+    sqe->fd = d->from;
+    sqe->addr = (unsigned long)d->buf;
+    sqe->len = TUNNEL_PIPE_SIZE;
+    /* sockets have no file position */
+    sqe->off = (__u64)-1;
+    sqe->user_data = (unsigned long)d;
+    d->reading = 1;
+    d->t->inflight++;
+}
+
+static void armWrite(TunnelDir *d) {
+    struct io_uring_sqe *sqe = uringSqe(&ring);
+
+    if (d->slot >= 0)
+        sqe->opcode = IORING_OP_WRITE_FIXED;
+    else {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->msg_flags = MSG_NOSIGNAL;
+    }
+    sqe->fd = d->to;
+    sqe->addr = (unsigned long)(d->buf + d->off);
+    sqe->len = d->len - d->off;
+    sqe->off = (__u64)-1;
+    sqe->user_data = (unsigned long)d;
+    d->reading = 0;
+    d->t->inflight++;
+}
+
+/*
+ * freeTunnel - release an io_uring tunnel with nothing in flight.
+ */
+
+static void freeTunnel(Tunnel *t) {
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        close(t->fd[i]);
+        if (t->dir[i].slot >= 0)
+            freeSlots[nFree++] = t->dir[i].slot;
+        else
+            free(t->dir[i].buf);
+    }
+    free(t);
+    __atomic_fetch_sub(&active, 1, __ATOMIC_RELAXED);
+    statsInc(STAT_TUNNELS_CLOSED);
+}
+
+/*
+ * abortTunnel - close an unlinked io_uring tunnel. Shutting the sockets
+ *     down completes whatever is in flight, the last completion frees it.
+ */
+
+static void abortTunnel(Tunnel *t) {
+    t->dead = 1;
+    if (t->inflight == 0) {
+        freeTunnel(t);
+        return;
+    }
+    shutdown(t->fd[0], SHUT_RDWR);
+    shutdown(t->fd[1], SHUT_RDWR);
+}
+
+/*
+ * completeDir - the operation of a direction finished with res.
+ */
+
+static void completeDir(TunnelDir *d, int res) {
+    Tunnel *t = d->t;
+    TunnelDir *other = &t->dir[d == &t->dir[0]];
+
+    if (--t->inflight == 0 && t->dead) {
+        freeTunnel(t);
+        return;
+    }
+    if (t->dead)
+        return;
+
+    if (res == -EINTR || res == -EAGAIN) {
+        if (d->reading)
+            armRead(d);
+        else
+            armWrite(d);
+        return;
+    }
+    if (res < 0)
+        goto fail;
+
+    t->lastActive = nowSec();
+    if (d->reading) {
+        if (res > 0) {
+            d->len = res;
+            d->off = 0;
+            armWrite(d);
+            return;
+        }
+        /* pass the half close on */
+        d->eof = 1;
+        shutdown(d->to, SHUT_WR);
+        if (other->eof && t->inflight == 0)
+            goto fail;
+        return;
+    }
+
+    d->off += res;
+    statsAdd(d->stat, res);
+    if (d->off < d->len)
+        armWrite(d);
+    else
+        armRead(d);
+    return;
+
+fail:
+    pthread_mutex_lock(&tunnelMutex);
+    unlinkTunnel(t);
+    pthread_mutex_unlock(&tunnelMutex);
+    abortTunnel(t);
+}
+
+static void armWake() {
+    static unsigned long count;
+    struct io_uring_sqe *sqe = uringSqe(&ring);
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wakefd;
+    sqe->addr = (unsigned long)&count;
+    sqe->len = sizeof(count);
+    sqe->user_data = URING_WAKE;
+}
+
+static void armTick() {
+    static struct __kernel_timespec second = { 1, 0 };
+    struct io_uring_sqe *sqe = uringSqe(&ring);
+
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (unsigned long)&second;
+    sqe->len = 1;
+    sqe->user_data = URING_TICK;
+}
+
+/*
+ * uringRegisterNew - like registerNew, but the tunnels get their buffers
+ *     and start reading from both sides.
+ */
+
+static void uringRegisterNew() {
+    Tunnel *t, *next;
+    int i;
+
+    pthread_mutex_lock(&tunnelMutex);
+    t = newList;
+    newList = NULL;
+    for (; t; t = next) {
+        next = t->next;
+        for (i = 0; i < 2; i++) {
+            if (nFree > 0) {
+                t->dir[i].slot = freeSlots[--nFree];
+                t->dir[i].buf = pool + (long)t->dir[i].slot * TUNNEL_PIPE_SIZE;
+            }
+            else {
+                t->dir[i].slot = -1;
+                t->dir[i].buf = (char *)malloc(TUNNEL_PIPE_SIZE);
+            }
+        }
+        if (t->dir[0].buf == NULL || t->dir[1].buf == NULL) {
+            freeTunnel(t);
+            continue;
+        }
+
+        t->prev = NULL;
+        t->next = tunnels;
+        if (tunnels)
+            tunnels->prev = t;
+        tunnels = t;
+        armRead(&t->dir[0]);
+        armRead(&t->dir[1]);
+    }
+    pthread_mutex_unlock(&tunnelMutex);
+}
+
+/*
+ * uringPumpThread - the pump of the io_uring backend. The ring is set up
+ *     here, it belongs to this thread.
+ */
+
+static void *uringPumpThread(void *vargp) {
+    struct io_uring_cqe *cqe;
+    struct iovec iov;
+    unsigned long data;
+    int i, res;
+
+    pthread_detach(pthread_self());
+
+    if (uringInit(&ring, TUNNEL_RING_ENTRIES) < 0) {
+        perror("io_uring_setup");
+        exit(1);
+    }
+    pool = mmap(NULL, (long)TUNNEL_FIXED_BUFS * TUNNEL_PIPE_SIZE,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    iov.iov_base = pool;
+    iov.iov_len = (long)TUNNEL_FIXED_BUFS * TUNNEL_PIPE_SIZE;
+    /* without a registered pool every tunnel has malloc'd buffers */
+    if (pool != MAP_FAILED && uringRegisterBuffers(&ring, &iov, 1) == 0)
+        for (i = TUNNEL_FIXED_BUFS - 1; i >= 0; i--)
+            freeSlots[nFree++] = i;
+
+    armWake();
+    armTick();
+    for (; ;) {
+        if (uringSubmit(&ring, 1) < 0 && errno != EINTR && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+        while ((cqe = uringCqe(&ring)) != NULL) {
+            data = cqe->user_data;
+            res = cqe->res;
+            uringCqeSeen(&ring);
+
+            if (data == URING_WAKE) {
+                uringRegisterNew();
+                armWake();
+            }
+            else if (data == URING_TICK) {
+                sweepIdle();
+                armTick();
+            }
+            else
+                completeDir((TunnelDir *)data, res);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * dumpTunnels - tunnel gauges for /metrics. The memory per tunnel is the
+ *     Tunnel struct plus the capacity of its two pipes.
+ */
+
+static void dumpTunnels(FILE *fp) {
+    fprintf(fp, "# TYPE proxy_tunnels_active gauge\n");
+    fprintf(fp, "proxy_tunnels_active %ld\n",
+        __atomic_load_n(&active, __ATOMIC_RELAXED));
+    fprintf(fp, "# TYPE proxy_tunnel_memory_bytes gauge\n");
+    fprintf(fp, "proxy_tunnel_memory_bytes %ld\n",
+        (long)sizeof(Tunnel) + 2 * pipeSize);
+}
+
+/*
+ * startTunnelPump - create the pump thread of the io backend, with the
+ *     epoll instance for IO_EPOLL.
+ */
+
+void startTunnelPump(int idle, int io) {
+    struct epoll_event ev;
+    pthread_t tid;
+
+    idleSec = idle;
+    backend = io;
+    if (backend == IO_URING) {
+        /* the ring reads the wake ups, a blocking eventfd suits it */
+        if ((wakefd = eventfd(0, EFD_CLOEXEC)) < 0) {
+            perror("eventfd");
+            exit(1);
+        }
+        pipeSize = TUNNEL_PIPE_SIZE;
+        statsRegisterDump(dumpTunnels);
+        if (pthread_create(&tid, NULL, uringPumpThread, NULL) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+        return;
+    }
+
+    if ((epfd = epoll_create1(0)) < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+    if ((wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror("eventfd");
+        exit(1);
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, wakefd, &ev);
+
+    statsRegisterDump(dumpTunnels);
+    if (pthread_create(&tid, NULL, pumpThread, NULL) != 0) {
+        perror("pthread_create");
+        exit(1);
+    }
+}
+
+/*
+ * addTunnel - hand a connected pair of sockets to the pump. Both sockets
+ *     belong to the pump afterwards, the caller must not touch them. The
+ *     pump thread is woken through wakefd to register the tunnel.
+ */
+
+void addTunnel(int clientfd, int originfd) {
+    unsigned long one = 1;
+    Tunnel *t;
+    int i, flags;
+
+    if ((t = (Tunnel *)calloc(1, sizeof(Tunnel))) == NULL) {
+        close(clientfd);
+        close(originfd);
+        return;
+    }
+    t->fd[0] = clientfd;
+    t->fd[1] = originfd;
+    for (i = 0; backend == IO_EPOLL && i < 2; i++) {
+        if (pipe2(t->dir[i].pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+            if (i == 1) {
+                close(t->dir[0].pipe[0]);
+                close(t->dir[0].pipe[1]);
+            }
+            close(clientfd);
+            close(originfd);
+            free(t);
+            return;
+        }
+        fcntl(t->dir[i].pipe[0], F_SETPIPE_SZ, TUNNEL_PIPE_SIZE);
+        fcntl(t->fd[i], F_SETFL, fcntl(t->fd[i], F_GETFL) | O_NONBLOCK);
+        t->ref[i].t = t;
+        t->ref[i].side = i;
+    }
+
+    /* 
+     * The ring would answer EAGAIN rather than wait on a non-blocking
+     * socket, which the sockets of a coroutine are.
+     */
+    for (i = 0; backend == IO_URING && i < 2; i++)
+        if ((flags = fcntl(t->fd[i], F_GETFL)) & O_NONBLOCK)
+            fcntl(t->fd[i], F_SETFL, flags & ~O_NONBLOCK);
+    if (pipeSize == 0)
+        pipeSize = fcntl(t->dir[0].pipe[0], F_GETPIPE_SZ);
+
+    t->dir[0].t = t->dir[1].t = t;
+    t->dir[0].from = clientfd;
+    t->dir[0].to = originfd;
+    t->dir[0].stat = STAT_TUNNEL_BYTES_UP;
+    t->dir[1].from = originfd;
+    t->dir[1].to = clientfd;
+    t->dir[1].stat = STAT_TUNNEL_BYTES_DOWN;
+    t->lastActive = nowSec();
+
+    pthread_mutex_lock(&tunnelMutex);
+    t->next = newList;
+    newList = t;
+    pthread_mutex_unlock(&tunnelMutex);
+
+    __atomic_fetch_add(&active, 1, __ATOMIC_RELAXED);
+    statsInc(STAT_TUNNELS_OPENED);
+
+    if (write(wakefd, &one, sizeof(one)) < 0)
+        perror("eventfd write");
+}
+
+/*
+ * tunnelsActive - the tunnels the pump has open.
+ */
+
+long tunnelsActive() {
+    return __atomic_load_n(&active, __ATOMIC_RELAXED);
+}
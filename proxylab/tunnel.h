@@ -0,0 +1,39 @@
+#ifndef __TUNNEL_H__
+#define __TUNNEL_H__
+
+/*
+ * Tunnel is defined as followed:
+ *     After a CONNECT request is answered the worker hands both sockets
+ *     to the tunnel pump and goes back to serve other connections.
+ *
+ *     The pump is one thread running an epoll loop over all tunnels.
+ *     Bytes move kernel side only: splice from the source socket into a
+ *     pipe and from the pipe into the destination socket, one pipe per
+ *     direction. A direction waits for its source to be readable while
+ *     its pipe is empty and for its destination to be writable while
+ *     not, so a slow reader stalls only its own direction.
+ *
+ *     With the io_uring backend the pump waits on a ring instead. Each
+ *     direction has one buffer of TUNNEL_PIPE_SIZE and one operation in
+ *     flight: a read from its source, then writes to its destination
+ *     until the buffer is drained, then the next read. This gives the
+ *     same bound as the pipe. Buffers come from a registered pool while
+ *     it lasts, so the kernel needs not map them on every operation, and
+ *     all operations queued while handling a batch of completions are
+ *     submitted together with the wait for the next batch.
+ *
+ *     A tunnel is closed when both directions saw end of file, on any
+ *     error, or when no byte moved for the idle timeout.
+ */
+
+#define DEFAULT_TUNNEL_IDLE 300         /* seconds */
+#define TUNNEL_PIPE_SIZE 65536          /* capacity of each pipe */
+/* io_uring backend: registered buffers, one per direction */
+#define TUNNEL_FIXED_BUFS 256
+#define TUNNEL_RING_ENTRIES 1024
+
+void startTunnelPump(int, int);
+void addTunnel(int, int);
+long tunnelsActive();
+
+#endif /* __TUNNEL_H__ */
@@ -0,0 +1,221 @@
+#include "csapp.h"
+#include "stats.h"
+#include "upstream.h"
+#include "coro.h"
+
+#define ORIGIN_BUCKETS 1024
+
+typedef struct _upstreamWaiter {
+    pthread_cond_t cond;
+    Coro *co;               /* parked instead of waiting on cond */
+    int granted;
+    struct _upstreamWaiter *next;
+} UpstreamWaiter;
+
+/*
+ * An origin lives in the table while it holds a slot or has waiters and
+ * is freed as soon as it has neither.
+ */
+struct _upstreamOrigin {
+    char *key;
+    int active;
+    long nwait;
+    UpstreamWaiter *head;
+    UpstreamWaiter *tail;
+    int inRing;
+    struct _upstreamOrigin *ringPrev;
+    struct _upstreamOrigin *ringNext;
+    struct _upstreamOrigin *hnext;
+};
+
+static pthread_mutex_t gateMutex = PTHREAD_MUTEX_INITIALIZER;
+static UpstreamOrigin *origins[ORIGIN_BUCKETS];
+static UpstreamOrigin *ring = NULL;     /* head of the ring */
+static int perOrigin = DEFAULT_ORIGIN_CONNS;
+static int budget = DEFAULT_UPSTREAM_CONNS;
+static int active = 0;
+static long waiting = 0;
+
+static unsigned int hashKey(char *key) {
+    unsigned int h = 2166136261u;
+
+    for (; *key; key++)
+        h = (h ^ (unsigned char)*key) * 16777619u;
+    return h;
+}
+
+static void ringAdd(UpstreamOrigin *o) {
+    if (ring == NULL) {
+        o->ringPrev = o->ringNext = o;
+        ring = o;
+    }
+    else {
+        /* the tail is just before the head */
+        o->ringNext = ring;
+        o->ringPrev = ring->ringPrev;
+        ring->ringPrev->ringNext = o;
+        ring->ringPrev = o;
+    }
+    o->inRing = 1;
+}
+
+static void ringRemove(UpstreamOrigin *o) {
+    if (o->ringNext == o)
+        ring = NULL;
+    else {
+        o->ringPrev->ringNext = o->ringNext;
+        o->ringNext->ringPrev = o->ringPrev;
+        if (ring == o)
+            ring = o->ringNext;
+    }
+    o->inRing = 0;
+}
+
+/*
+ * dispatch - hand free budget to waiting origins, one slot per origin in
+ *     turn. Must hold gateMutex.
+ */
+
+static void dispatch() {
+    UpstreamOrigin *o;
+    UpstreamWaiter *w;
+
+    while (active < budget && ring != NULL) {
+        o = ring;
+        w = o->head;
+        if ((o->head = w->next) == NULL)
+            o->tail = NULL;
+        o->nwait--;
+        waiting--;
+        o->active++;
+        active++;
+        w->granted = 1;
+        if (w->co)
+            coroUnpark(w->co);
+        else
+            pthread_cond_signal(&w->cond);
+
+        if (o->head == NULL || o->active >= perOrigin)
+            ringRemove(o);
+        else
+            ring = o->ringNext;
+    }
+}
+
+static UpstreamOrigin *findOrigin(char *key, int create) {
+    unsigned int b = hashKey(key) % ORIGIN_BUCKETS;
+    UpstreamOrigin *o;
+
+    for (o = origins[b]; o; o = o->hnext)
+        if (!strcmp(o->key, key))
+            return o;
+    if (!create)
+        return NULL;
+
+    o = (UpstreamOrigin *)Calloc(1, sizeof(UpstreamOrigin));
+    o->key = strdup(key);
+    o->hnext = origins[b];
+    origins[b] = o;
+    return o;
+}
+
+static void dropOrigin(UpstreamOrigin *o) {
+    UpstreamOrigin **pp;
+
+    for (pp = &origins[hashKey(o->key) % ORIGIN_BUCKETS]; *pp;
+            pp = &(*pp)->hnext) {
+        if (*pp == o) {
+            *pp = o->hnext;
+            break;
+        }
+    }
+    Free(o->key);
+    Free(o);
+}
+
+static void dumpUpstream(FILE *fp) {
+    pthread_mutex_lock(&gateMutex);
+    fprintf(fp, "# TYPE proxy_upstream_active gauge\n");
+    fprintf(fp, "proxy_upstream_active %d\n", active);
+    fprintf(fp, "# TYPE proxy_upstream_waiting gauge\n");
+    fprintf(fp, "proxy_upstream_waiting %ld\n", waiting);
+    pthread_mutex_unlock(&gateMutex);
+}
+
+void upstreamInit(int originConns, int totalConns) {
+    perOrigin = originConns;
+    budget = totalConns;
+    statsRegisterDump(dumpUpstream);
+}
+
+/*
+ * upstreamAcquire - wait for a slot to connect to host:port. The origin
+ *     returned must be given back to upstreamRelease once the connection
+ *     is closed. A coroutine parks while it waits, its loop goes on.
+ */
+
+UpstreamOrigin *upstreamAcquire(char *host, char *port) {
+    char key[MAXLINE];
+    UpstreamOrigin *o;
+    UpstreamWaiter w;
+    unsigned long start = statsNow();
+
+    snprintf(key, sizeof(key), "%s:%s", host, port);
+
+    pthread_mutex_lock(&gateMutex);
+    o = findOrigin(key, 1);
+
+    /* queue behind anyone already waiting, for the origin or the budget */
+    if (o->nwait == 0 && o->active < perOrigin && active < budget
+            && ring == NULL) {
+        o->active++;
+        active++;
+        pthread_mutex_unlock(&gateMutex);
+        statsRecord(HIST_UPSTREAM_QUEUE, 0, statsNow() - start);
+        return o;
+    }
+
+    statsInc(STAT_UPSTREAM_QUEUED);
+    if ((w.co = coroSelf()) == NULL)
+        pthread_cond_init(&w.cond, NULL);
+    w.granted = 0;
+    w.next = NULL;
+    if (o->tail)
+        o->tail->next = &w;
+    else
+        o->head = &w;
+    o->tail = &w;
+    o->nwait++;
+    waiting++;
+    if (!o->inRing && o->active < perOrigin)
+        ringAdd(o);
+    dispatch();
+
+    while (!w.granted) {
+        if (w.co) {
+            pthread_mutex_unlock(&gateMutex);
+            coroPark();
+            pthread_mutex_lock(&gateMutex);
+        }
+        else
+            pthread_cond_wait(&w.cond, &gateMutex);
+    }
+    pthread_mutex_unlock(&gateMutex);
+    if (w.co == NULL)
+        pthread_cond_destroy(&w.cond);
+
+    statsRecord(HIST_UPSTREAM_QUEUE, 0, statsNow() - start);
+    return o;
+}
+
+void upstreamRelease(UpstreamOrigin *o) {
+    pthread_mutex_lock(&gateMutex);
+    o->active--;
+    active--;
+    if (o->head != NULL && !o->inRing)
+        ringAdd(o);
+    dispatch();
+    if (o->active == 0 && o->nwait == 0)
+        dropOrigin(o);
+    pthread_mutex_unlock(&gateMutex);
+}
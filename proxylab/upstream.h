@@ -0,0 +1,30 @@
+#ifndef __UPSTREAM_H__
+#define __UPSTREAM_H__
+
+/*
+ * Upstream gate is defined as followed:
+ *     Every connection to an origin needs a slot. An origin ("host:port")
+ *     may hold at most perOrigin slots and all origins together at most
+ *     budget slots. A request which can not get one waits in the FIFO
+ *     queue of its origin.
+ *
+ *     Origins which have waiters and are below their own cap sit in a
+ *     ring. When a slot of the global budget frees up, the ring hands it
+ *     to the origin at its head and moves that origin to the tail, so
+ *     the budget goes round robin over origins rather than to whichever
+ *     has the most waiters, and a slow origin which holds all of its own
+ *     slots only delays its own requests.
+ *
+ *     The time spent waiting is recorded in the upstream_queue histogram.
+ */
+
+#define DEFAULT_ORIGIN_CONNS 32
+#define DEFAULT_UPSTREAM_CONNS 256
+
+typedef struct _upstreamOrigin UpstreamOrigin;
+
+void upstreamInit(int, int);
+UpstreamOrigin *upstreamAcquire(char*, char*);
+void upstreamRelease(UpstreamOrigin*);
+
+#endif /* __UPSTREAM_H__ */
@@ -0,0 +1,154 @@
+/* liburing is not used, the rings are set up by hand */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+static int setup(unsigned entries, struct io_uring_params *p, unsigned flags) {
+    memset(p, 0, sizeof(*p));
+    p->flags = flags;
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+/*
+ * uringInit - set up a ring of entries submission entries. The ring is
+ *     only submitted to by the calling thread, which lets the kernel
+ *     skip some work where it supports that. Returns -1 on failure.
+ */
+
+int uringInit(Uring *r, unsigned entries) {
+    struct io_uring_params p;
+    size_t sqSize, cqSize, ringSize;
+    char *ring;
+
+    if ((r->fd = setup(entries, &p, IORING_SETUP_SINGLE_ISSUER
+            | IORING_SETUP_COOP_TASKRUN)) < 0
+            && (r->fd = setup(entries, &p, 0)) < 0)
+        return -1;
+
+    /* one mapping for both rings, every kernel with the features we use */
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        return -1;
+    }
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ringSize = sqSize > cqSize ? sqSize : cqSize;
+
+    ring = mmap(NULL, ringSize, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (ring == MAP_FAILED) {
+        close(r->fd);
+        return -1;
+    }
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd,
+        IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        munmap(ring, ringSize);
+        close(r->fd);
+        return -1;
+    }
+
+    r->sqHead = (unsigned *)(ring + p.sq_off.head);
+    r->sqTail = (unsigned *)(ring + p.sq_off.tail);
+    r->sqArray = (unsigned *)(ring + p.sq_off.array);
+    r->sqMask = *(unsigned *)(ring + p.sq_off.ring_mask);
+    r->sqEntries = p.sq_entries;
+    r->sqLocalTail = r->sqSubmitted = *r->sqTail;
+    r->cqHead = (unsigned *)(ring + p.cq_off.head);
+    r->cqTail = (unsigned *)(ring + p.cq_off.tail);
+    r->cqMask = *(unsigned *)(ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(ring + p.cq_off.cqes);
+    return 0;
+}
+
+/*
+ * uringSupported - true if this kernel lets us set up a ring at all,
+ *     it may be compiled out or disabled by policy.
+ */
+
+int uringSupported() {
+    struct io_uring_params p;
+    int fd;
+
+    if ((fd = setup(2, &p, 0)) < 0)
+        return 0;
+    close(fd);
+    return (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+}
+
+/*
+ * uringSqe - the next free submission entry, cleared. When the queue is
+ *     full what is in it is submitted first.
+ */
+
+struct io_uring_sqe *uringSqe(Uring *r) {
+    struct io_uring_sqe *sqe;
+    unsigned idx;
+
+    while (r->sqLocalTail - __atomic_load_n(r->sqHead, __ATOMIC_ACQUIRE)
+            >= r->sqEntries)
+        uringSubmit(r, 0);
+
+    idx = r->sqLocalTail & r->sqMask;
+    sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sqArray[idx] = idx;
+    r->sqLocalTail++;
+    return sqe;
+}
+
+/*
+ * uringSubmit - hand every filled entry to the kernel and wait until at
+ *     least wait completions are there. Returns -1 with errno set if
+ *     io_uring_enter failed, EINTR included.
+ */
+
+int uringSubmit(Uring *r, unsigned wait) {
+    unsigned n;
+    int ret;
+
+    __atomic_store_n(r->sqTail, r->sqLocalTail, __ATOMIC_RELEASE);
+    n = r->sqLocalTail - r->sqSubmitted;
+    if (n == 0 && wait == 0)
+        return 0;
+
+    ret = syscall(__NR_io_uring_enter, r->fd, n, wait,
+        wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (ret < 0)
+        return -1;
+    r->sqSubmitted += ret;
+    return ret;
+}
+
+/*
+ * uringCqe - the oldest completion not seen yet, or NULL.
+ */
+
+struct io_uring_cqe *uringCqe(Uring *r) {
+    unsigned head = *r->cqHead;
+
+    if (head == __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & r->cqMask];
+}
+
+void uringCqeSeen(Uring *r) {
+    __atomic_store_n(r->cqHead, *r->cqHead + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * uringRegisterBuffers - pin the buffers for READ_FIXED and WRITE_FIXED.
+ *     An operation may use any address inside a registered buffer.
+ */
+
+int uringRegisterBuffers(Uring *r, struct iovec *iov, unsigned n) {
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS,
+        iov, n);
+}
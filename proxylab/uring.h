@@ -0,0 +1,48 @@
+#ifndef __URING_H__
+#define __URING_H__
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+/*
+ * Uring is defined as followed:
+ *     A minimal io_uring over the raw system calls. Submission entries
+ *     are filled with uringSqe and only handed to the kernel by
+ *     uringSubmit, all of them in one io_uring_enter which can wait for
+ *     completions in the same call. Completions are read straight from
+ *     the shared ring with uringCqe and uringCqeSeen.
+ *
+ *     A ring belongs to the thread which created it.
+ */
+
+/* I/O backend of the accept loops, the tunnel pump and the coroutine loop */
+enum {
+    IO_EPOLL,
+    IO_URING
+};
+
+typedef struct _uring {
+    int fd;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqArray;
+    unsigned sqMask;
+    unsigned sqEntries;
+    unsigned sqLocalTail;       /* entries filled so far */
+    unsigned sqSubmitted;       /* of which the kernel took these */
+    struct io_uring_sqe *sqes;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned cqMask;
+    struct io_uring_cqe *cqes;
+} Uring;
+
+int uringSupported();
+int uringInit(Uring*, unsigned);
+struct io_uring_sqe *uringSqe(Uring*);
+int uringSubmit(Uring*, unsigned);
+struct io_uring_cqe *uringCqe(Uring*);
+void uringCqeSeen(Uring*);
+int uringRegisterBuffers(Uring*, struct iovec*, unsigned);
+
+#endif /* __URING_H__ */
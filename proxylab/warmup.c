@@ -0,0 +1,249 @@
+#include "csapp.h"
+#include "stats.h"
+#include "warmup.h"
+
+typedef struct _warmEntry {
+    char *host;
+    char *port;
+    char *path;
+    long count;             /* times requested in the list */
+    long first;             /* position of the first occurrence */
+} WarmEntry;
+
+static WarmEntry *entries = NULL;
+static long nentries = 0;
+static long nextEntry = 0;
+static WarmFetch fetchFn;
+static int fetchers;
+
+/* progress, exported by dumpWarmup */
+static long warmCached = 0;
+static long warmFailed = 0;
+static int warmDone = 0;
+static unsigned long warmStartUs, warmEndUs;
+static unsigned long hitsAtEnd, missesAtEnd;
+
+/*
+ * logfmtValue - copy the value of " key=" in a log line into buf.
+ *     Returns 0 if the key is missing.
+ */
+
+static int logfmtValue(char *line, char *key, char *buf, size_t size) {
+    char pattern[32], *pos;
+    size_t len;
+
+    snprintf(pattern, sizeof(pattern), " %s=", key);
+    if ((pos = strstr(line, pattern)) == NULL)
+        return 0;
+    pos += strlen(pattern);
+    len = strcspn(pos, " \r\n");
+    if (len >= size)
+        return 0;
+    memcpy(buf, pos, len);
+    buf[len] = '\0';
+    return 1;
+}
+
+/*
+ * parseLine - split a URL or an access log line into host, port and
+ *     path. Returns 0 if the line names nothing to fetch.
+ */
+
+static int parseLine(char *line, char *host, char *port, char *path) {
+    char value[MAXLINE], *pos;
+    size_t len;
+
+    line[strcspn(line, "\r\n")] = '\0';
+
+    if (!strncasecmp(line, "http://", 7)) {
+        line += 7;
+        len = strcspn(line, "/");
+        if (len == 0 || len >= MAXLINE)
+            return 0;
+        memcpy(host, line, len);
+        host[len] = '\0';
+        strcpy(path, line[len] ? line + len : "/");
+        if ((pos = strchr(host, ':')) != NULL) {
+            *pos = '\0';
+            strcpy(port, pos + 1);
+        }
+        else
+            strcpy(port, "80");
+        return strlen(host) > 0 && atoi(port) > 0;
+    }
+
+    /* the access log keeps the first 127 bytes of a path only */
+    if (!logfmtValue(line, "method", value, sizeof(value))
+            || strcasecmp(value, "GET")
+            || !logfmtValue(line, "status", value, sizeof(value))
+            || atoi(value) != 200
+            || !logfmtValue(line, "host", host, MAXLINE)
+            || !logfmtValue(line, "port", port, MAXLINE)
+            || !logfmtValue(line, "path", path, MAXLINE)
+            || strlen(path) >= 127)
+        return 0;
+    return strlen(host) > 0 && atoi(port) > 0;
+}
+
+static int sameObject(WarmEntry *x, WarmEntry *y) {
+    return !strcasecmp(x->host, y->host) && !strcmp(x->port, y->port)
+        && !strcmp(x->path, y->path);
+}
+
+static int cmpKey(const void *a, const void *b) {
+    const WarmEntry *x = (const WarmEntry *)a, *y = (const WarmEntry *)b;
+    int c;
+
+    if ((c = strcasecmp(x->host, y->host)) != 0
+            || (c = strcmp(x->port, y->port)) != 0
+            || (c = strcmp(x->path, y->path)) != 0)
+        return c;
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+static int cmpPopular(const void *a, const void *b) {
+    const WarmEntry *x = (const WarmEntry *)a, *y = (const WarmEntry *)b;
+
+    if (x->count != y->count)
+        return (x->count < y->count) - (x->count > y->count);
+    return (x->first > y->first) - (x->first < y->first);
+}
+
+/*
+ * loadList - read the file, merge duplicates and order by popularity.
+ */
+
+static void loadList(char *file) {
+    char line[3 * MAXLINE], host[MAXLINE], port[MAXLINE], path[MAXLINE];
+    long cap = 0, i, j;
+    FILE *fp;
+
+    if ((fp = fopen(file, "r")) == NULL) {
+        fprintf(stderr, "Can not open warm-up list %s\n", file);
+        exit(1);
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (!parseLine(line, host, port, path))
+            continue;
+        if (nentries == cap) {
+            cap = cap ? cap * 2 : 1024;
+            entries = (WarmEntry *)Realloc(entries, cap * sizeof(WarmEntry));
+        }
+        entries[nentries].host = strdup(host);
+        entries[nentries].port = strdup(port);
+        entries[nentries].path = strdup(path);
+        entries[nentries].count = 1;
+        entries[nentries].first = nentries;
+        nentries++;
+    }
+    fclose(fp);
+
+    qsort(entries, nentries, sizeof(WarmEntry), cmpKey);
+    for (i = 0, j = -1; i < nentries; i++) {
+        if (j >= 0 && sameObject(&entries[i], &entries[j])) {
+            entries[j].count++;
+            Free(entries[i].host);
+            Free(entries[i].port);
+            Free(entries[i].path);
+            continue;
+        }
+        entries[++j] = entries[i];
+    }
+    nentries = j + 1;
+    qsort(entries, nentries, sizeof(WarmEntry), cmpPopular);
+}
+
+static void *fetcherThread(void *vargp) {
+    long i;
+
+    while ((i = __atomic_fetch_add(&nextEntry, 1, __ATOMIC_RELAXED))
+            < nentries) {
+        if (fetchFn(entries[i].host, entries[i].port, entries[i].path))
+            __atomic_fetch_add(&warmCached, 1, __ATOMIC_RELAXED);
+        else
+            __atomic_fetch_add(&warmFailed, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+/*
+ * runWarmup - fetch the whole list with the fetcher threads.
+ */
+
+static void *runWarmup(void *vargp) {
+    pthread_t *tids;
+    long i;
+
+    tids = (pthread_t *)Calloc(fetchers, sizeof(pthread_t));
+    for (i = 0; i < fetchers; i++)
+        Pthread_create(&tids[i], NULL, fetcherThread, NULL);
+    for (i = 0; i < fetchers; i++)
+        Pthread_join(tids[i], NULL);
+    Free(tids);
+
+    for (i = 0; i < nentries; i++) {
+        Free(entries[i].host);
+        Free(entries[i].port);
+        Free(entries[i].path);
+    }
+    Free(entries);
+
+    hitsAtEnd = statsRead(STAT_HITS);
+    missesAtEnd = statsRead(STAT_MISSES);
+    warmEndUs = statsNow();
+    __atomic_store_n(&warmDone, 1, __ATOMIC_RELEASE);
+
+    fprintf(stderr, "Warm-up: %ld objects, %ld cached, %ld not cached, "
+        "%.2f s\n", nentries, warmCached, warmFailed,
+        (warmEndUs - warmStartUs) / 1e6);
+    return NULL;
+}
+
+static void dumpWarmup(FILE *fp) {
+    unsigned long hits, misses;
+    int done = __atomic_load_n(&warmDone, __ATOMIC_ACQUIRE);
+
+    fprintf(fp, "# TYPE proxy_warmup_objects gauge\n");
+    fprintf(fp, "proxy_warmup_objects %ld\n", nentries);
+    fprintf(fp, "# TYPE proxy_warmup_cached gauge\n");
+    fprintf(fp, "proxy_warmup_cached %ld\n",
+        __atomic_load_n(&warmCached, __ATOMIC_RELAXED));
+    fprintf(fp, "# TYPE proxy_warmup_not_cached gauge\n");
+    fprintf(fp, "proxy_warmup_not_cached %ld\n",
+        __atomic_load_n(&warmFailed, __ATOMIC_RELAXED));
+    fprintf(fp, "# TYPE proxy_warmup_seconds gauge\n");
+    fprintf(fp, "proxy_warmup_seconds %g\n",
+        ((done ? warmEndUs : statsNow()) - warmStartUs) / 1e6);
+    fprintf(fp, "# TYPE proxy_warmup_done gauge\n");
+    fprintf(fp, "proxy_warmup_done %d\n", done);
+
+    if (!done)
+        return;
+    hits = statsRead(STAT_HITS) - hitsAtEnd;
+    misses = statsRead(STAT_MISSES) - missesAtEnd;
+    fprintf(fp, "# TYPE proxy_hit_ratio_since_warmup gauge\n");
+    fprintf(fp, "proxy_hit_ratio_since_warmup %g\n",
+        hits + misses ? (double)hits / (hits + misses) : 0.0);
+}
+
+/*
+ * warmCache - warm the cache from file with n fetcher threads. Returns
+ *     when it is done, or right away if background is set.
+ */
+
+void warmCache(char *file, int n, WarmFetch fetch, int background) {
+    pthread_t tid;
+
+    fetchFn = fetch;
+    fetchers = n;
+    loadList(file);
+    statsRegisterDump(dumpWarmup);
+
+    warmStartUs = statsNow();
+    if (background) {
+        Pthread_create(&tid, NULL, runWarmup, NULL);
+        pthread_detach(tid);
+    }
+    else
+        runWarmup(NULL);
+}
@@ -0,0 +1,29 @@
+#ifndef __WARMUP_H__
+#define __WARMUP_H__
+
+/*
+ * Warm-up is defined as followed:
+ *     At startup the cache can be filled from a file, one URL per line
+ *     ("http://host[:port]/path"), or from a previous access log, of which
+ *     the GET requests answered with 200 are used. Duplicates are fetched
+ *     once, the most requested objects first.
+ *
+ *     A fixed number of fetcher threads work through the list. The fetch
+ *     itself is done by the proxy (WarmFetch), exactly like a miss, with
+ *     the body going nowhere. Either the proxy waits for the warm-up
+ *     before it accepts connections, or the warm-up runs in the
+ *     background while it serves.
+ *
+ *     The duration, the number of objects fetched and cached, and the hit
+ *     ratio of client requests since the warm-up finished are exported to
+ *     /metrics.
+ */
+
+#define DEFAULT_WARM_FETCHERS 8
+
+/* fetch one object into the cache, returns 1 if it is cached afterwards */
+typedef int (*WarmFetch)(char *host, char *port, char *path);
+
+void warmCache(char*, int, WarmFetch, int);
+
+#endif /* __WARMUP_H__ */